@@ -0,0 +1,81 @@
+#!/bin/bash
+
+# Compare buffered vs O_DIRECT backing file I/O.
+# Reports throughput, page cache held by evfs_data.bin and peak RSS of evfs.
+
+BLUE='\033[0;34m'
+YELLOW='\033[1;33m'
+NC='\033[0m'
+
+SIZE_MB=${SIZE_MB:-8}   # stays under MAX_FILE_SIZE
+RUNS=${RUNS:-3}
+
+cleanup() {
+    fusermount -u mnt 2>/dev/null || umount mnt 2>/dev/null
+    sleep 1
+}
+
+trap cleanup EXIT
+
+cached_kb() {
+    # Page cache pages of the backing file (fincore from util-linux)
+    if command -v fincore > /dev/null; then
+        fincore --bytes --noheadings --output RES evfs_data.bin 2>/dev/null |
+            awk '{ printf "%d", $1 / 1024 }'
+    else
+        echo "n/a"
+    fi
+}
+
+mb_per_s() {
+    # $1 = bytes, $2 = start ns, $3 = end ns
+    awk -v b="$1" -v s="$2" -v e="$3" 'BEGIN { printf "%.1f", b / 1048576 / ((e - s) / 1e9) }'
+}
+
+run_mode() {
+    local mode=$1
+    local flag=""
+    [ "$mode" = "direct" ] && flag="--direct-io"
+
+    rm -f evfs_data.bin
+    ./evfs mnt $flag -f > /dev/null 2>&1 &
+    local pid=$!
+    sleep 2
+    mountpoint -q mnt || { echo "mount failed ($mode)"; exit 1; }
+
+    local bytes=$((SIZE_MB * 1024 * 1024))
+    local wr_total=0 rd_total=0
+    for i in $(seq 1 "$RUNS"); do
+        local t0=$(date +%s%N)
+        dd if=/dev/zero of=mnt/bench$i.dat bs=1M count="$SIZE_MB" conv=fsync status=none
+        local t1=$(date +%s%N)
+        cat mnt/bench$i.dat > /dev/null
+        local t2=$(date +%s%N)
+        wr_total=$(awk -v a="$wr_total" -v b="$(mb_per_s $bytes $t0 $t1)" 'BEGIN { print a + b }')
+        rd_total=$(awk -v a="$rd_total" -v b="$(mb_per_s $bytes $t1 $t2)" 'BEGIN { print a + b }')
+    done
+
+    local cache=$(cached_kb)
+    local rss=$(awk '/VmHWM/ { print $2 }' /proc/$pid/status)
+
+    printf "%-9s write %7.1f MB/s  read %7.1f MB/s  backing cache %8s KiB  peak RSS %6s KiB\n" \
+        "$mode" \
+        "$(awk -v t="$wr_total" -v n="$RUNS" 'BEGIN { print t / n }')" \
+        "$(awk -v t="$rd_total" -v n="$RUNS" 'BEGIN { print t / n }')" \
+        "$cache" "$rss"
+
+    fusermount -u mnt
+    wait "$pid"
+}
+
+echo "========================================"
+echo "  EVFS Buffered vs Direct I/O Benchmark"
+echo "========================================"
+
+echo -e "${YELLOW}Building EVFS...${NC}"
+make > /dev/null || exit 1
+mkdir -p mnt
+
+echo -e "${BLUE}${RUNS} x ${SIZE_MB} MB per mode${NC}"
+run_mode buffered
+run_mode direct
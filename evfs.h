@@ -16,6 +16,17 @@
 #include <sys/types.h>
 #include <unistd.h>
 #include <time.h>
+#include <stdint.h>
+#include "evfs_crypto.h"
+#include "evfs_probes.h"
+
+// renameat2() flags (<linux/fs.h>), for evfs_rename_flags()
+#ifndef RENAME_NOREPLACE
+#define RENAME_NOREPLACE (1 << 0)
+#endif
+#ifndef RENAME_EXCHANGE
+#define RENAME_EXCHANGE (1 << 1)
+#endif
 
 /*
  * ============================================================================
@@ -24,18 +35,167 @@
  */
 
 #define MAX_FILENAME 256
-#define MAX_FILES 100
+#define MAX_FILES 100      // inodes
+#define MAX_DENTRIES 256   // names; hard links share one inode
 #define BLOCK_SIZE 4096
 
+#define BACKING_FILE "evfs_data.bin"
+#define MAX_FILE_SIZE ((off_t)1 << 44) // 16 TiB per file max
+
+// Alignment required for O_DIRECT I/O on the backing file
+#define IO_ALIGN 4096
+
+// Maximum number of backing files data can be striped across
+#define MAX_BACKING_FILES 8
+
+// Read-only snapshots, exposed as SNAPSHOT_DIR/<name>
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_DIR "/.snapshots"
+
+// Metadata image (file table + block maps), next to the backing file
+#define METADATA_FILE "evfs_meta.bin"
+#define METADATA_MAGIC 0x4154454d53465645ULL  // "EVFSMETA"
+#define METADATA_VERSION 13
+
+// Inodes are saved in pages of META_PAGE_INODES, each encrypted on its
+// own and loaded the first time one of its inodes is used. Pages of about
+// --inode-cache inodes (INODE_CACHE_SIZE by default) stay in memory; the
+// least recently used ones beyond that are dropped (see evfs_metadata.c)
+#define META_PAGE_INODES 8
+#define META_PAGES ((MAX_FILES + META_PAGE_INODES - 1) / META_PAGE_INODES)
+#define INODE_PAGE(idx) ((idx) / META_PAGE_INODES)
+#define INODE_CACHE_SIZE 64
+
+// Extended attributes: XATTR_INLINE_SIZE bytes in the file's metadata entry
+// (sealed with the block cipher when saved); what does not fit goes to a
+// stream of data blocks starting at logical block XATTR_LBLK of its map
+#define XATTR_INLINE_SIZE 256
+#define XATTR_LBLK ((blk_t)1 << 40)
+// Decrypted streams stay cached up to this many bytes (--xattr-cache);
+// the least recently used ones are dropped beyond it
+#define XATTR_CACHE_SIZE (8 << 20)
+
+// Symlink targets shorter than this, less the cipher's overhead, live in
+// the inode (sealed with the inline xattrs); longer ones (up to PATH_MAX)
+// are stored in the symlink's data blocks
+#define SYMLINK_INLINE_SIZE 128
+
+// Small regular files keep their contents in the inode, sealed like the
+// inline xattrs, instead of in data blocks: up to --inline-max bytes (at
+// most INLINE_DATA_SIZE less the cipher's overhead). A file that grows
+// past that moves to data blocks
+#define INLINE_DATA_SIZE 1024
+
+// Per-user/group quotas: ids that can have limits, how long a soft limit
+// may be exceeded, and the root directory xattrs that manage them
+#define MAX_QUOTAS 32
+#define QUOTA_GRACE (7 * 24 * 3600)
+#define QUOTA_XATTR_PREFIX "trusted.evfs.quota."
+
+// Volumes: top-level directories whose subtrees are encrypted with their
+// own passphrase-derived key. Volume 0 is everything else (built-in key).
+// A block map id carries its volume, which selects the key, in its top bits
+#define MAX_VOLUMES EVFS_MAX_KEYS
+#define VOLUME_NAME_MAX 64
+#define VOLUME_XATTR_PREFIX "trusted.evfs.volume."
+#define MAP_ID(volume, seq) (((uint64_t)(volume) << EVFS_KEY_SHIFT) | (seq))
+#define MAP_ID_SEQ(id) ((id) & (((uint64_t)1 << EVFS_KEY_SHIFT) - 1))
+
+// Write-ahead log of metadata changes, next to the metadata file. Changes
+// are committed every WAL_COMMIT_MS (or on fsync); the log is folded into
+// the metadata file once it grows past WAL_CHECKPOINT_BYTES, or at most
+// every WAL_CACHE_CHECKPOINT_MS while changed inode pages hold the inode
+// cache over its size (only pages as saved can be dropped)
+#define WAL_SUFFIX ".wal"
+#define WAL_MAGIC 0x314c415753465645ULL  // "EVFSWAL1"
+#define WAL_COMMIT_MS 5000
+#define WAL_CHECKPOINT_BYTES (4 << 20)
+#define WAL_CACHE_CHECKPOINT_MS (30 * 1000)
+// With --lazytime, changes to nothing but an inode's timestamps are logged
+// at the latest this often (and on fsync, unmount, or with other changes)
+#define WAL_LAZYTIME_MS (60 * 1000)
+
+// When reads update atime (--strictatime, --relatime, --noatime). relatime
+// updates it if it is older than mtime or ctime, or than ATIME_RELATIME_SEC
+typedef enum {
+    ATIME_RELATIME = 0,
+    ATIME_STRICT,
+    ATIME_NONE
+} atime_mode_t;
+#define ATIME_RELATIME_SEC (24 * 3600)
+
+// Backing file I/O classes, in priority order (see evfs_iosched.c). Each
+// can be rate limited (--io-rate) and is reported through the root
+// directory xattr IOSCHED_XATTR_PREFIX "<class>"
+typedef enum {
+    IO_CLASS_READ = 0,   // foreground reads
+    IO_CLASS_WRITE,      // foreground writes
+    IO_CLASS_BACKGROUND, // compaction
+    IO_CLASSES
+} io_class_t;
+#define IOSCHED_XATTR_PREFIX "trusted.evfs.iosched."
+
+// Runtime options (parsed in main.c, defined in evfs_metadata.c)
+typedef struct {
+    int direct_io;  // 1 = open backing file with O_DIRECT (bypass page cache)
+    const char *backing_files[MAX_BACKING_FILES];  // empty = evfs_data.bin
+    int backing_count;
+    const char *cipher;  // block cipher engine name, NULL = auto
+    int compact_rate_mb; // background compaction rate limit (MB/s), 0 = off
+    const char *metadata_file;  // NULL = METADATA_FILE
+    off_t capacity;      // bytes the backing files may grow to, 0 = no limit
+    const char *volumes[MAX_VOLUMES];  // "name:keyfile" to unlock at mount
+    int volume_count;
+    int commit_ms;       // interval between background commits (ms)
+    int inline_max;      // largest file kept in its inode (bytes), 0 = none
+    size_t xattr_cache;  // memory for decrypted xattr streams (bytes)
+    int inode_cache;     // inodes kept in memory (in whole pages)
+    atime_mode_t atime;  // when reads update atime
+    int lazytime;        // 1 = log timestamp-only changes lazily
+    long io_rate[IO_CLASSES];  // per-class rate limit (bytes/s), 0 = none
+    const char *record_file;   // workload trace to record (--record), NULL = none
+} evfs_options_t;
+
+// Block numbers (logical within a file, or physical in the storage space)
+typedef uint64_t blk_t;
+#define BLK_MAX UINT64_MAX
+
+// Largest run of blocks a single extent may describe
+#define EXTENT_MAX_LEN 0xFFFFFFFFULL
+
+// One contiguous run: logical blocks [lblk, lblk+len) -> [pblk, pblk+len)
+typedef struct {
+    blk_t lblk;
+    blk_t pblk;
+    blk_t len;
+    uint64_t gen;       // change generation the blocks were last written in
+} extent_t;
+
+// Per-file logical->physical block map (sorted extent array)
+typedef struct {
+    uint64_t id;        // unique per file; part of the per-block crypto tweak
+    extent_t *extents;  // sorted by lblk, non-overlapping
+    int count;
+    int capacity;
+    int cursor;         // last extent hit, for sequential access
+    uint64_t generation; // bumped whenever the map or its blocks change
+    // Online re-encryption: blocks from 'reencrypted' on, and the inode's
+    // inline areas, still use engine old_engine - 1 (0 = all current)
+    uint32_t old_engine;
+    blk_t reencrypted;
+    uint64_t changed;   // change generation the inode, its names or map last changed in
+} block_map_t;
+
 // File types
 typedef enum {
     FTYPE_DIR,
-    FTYPE_FILE
+    FTYPE_FILE,
+    FTYPE_SYMLINK
 } file_type_t;
 
-// Metadata for each file/directory
+// Inode: metadata of a file/directory/symlink, shared by all its names.
+// The file_table index is the inode number and also selects the block map
 typedef struct {
-    char name[MAX_FILENAME];
     file_type_t type;
     mode_t mode;
     uid_t uid;
@@ -45,9 +205,84 @@ typedef struct {
     time_t ctime;  // change time
     off_t size;
     int is_used;   // 1 if this entry is valid, 0 if free
-    int parent_idx; // index of parent directory (-1 for root)
+    uint32_t nlink; // names (files, symlinks); 2 + subdirectories (dirs)
+    uint32_t volume; // volume (and key) the inode belongs to, 0 = none
+    char symlink[SYMLINK_INLINE_SIZE]; // short symlink target
+    unsigned char xattr[XATTR_INLINE_SIZE]; // inline xattrs (evfs_xattr.c)
+    uint32_t inline_data; // 1: contents are in data[], not in data blocks
+    unsigned char data[INLINE_DATA_SIZE];   // inline contents (evfs_storage.c)
 } file_metadata_t;
 
+// Directory entry: one name of an inode. The root has no entry
+typedef struct {
+    char name[MAX_FILENAME];  // full path without the leading '/'
+    int inode;                // index in file_table
+    int is_used;
+    int parent;               // directory holding it; with hash, its name index key
+    uint32_t pad;
+    uint64_t hash;            // keyed hash of the last component, 0 = not filed
+} dentry_t;
+
+// Quota limits of one user or group (sizes in blocks, 0 = no limit)
+typedef enum {
+    QUOTA_USER,
+    QUOTA_GROUP
+} quota_type_t;
+
+typedef struct {
+    uint32_t type;          // quota_type_t
+    uint32_t id;            // uid or gid
+    uint64_t block_soft;
+    uint64_t block_hard;
+    uint64_t inode_soft;
+    uint64_t inode_hard;
+    int64_t block_grace;    // when an exceeded soft limit turns hard, 0 = not exceeded
+    int64_t inode_grace;
+} quota_limit_t;
+
+// What a user or group uses, saved at a clean unmount
+typedef struct {
+    uint32_t type;          // quota_type_t
+    uint32_t id;
+    uint64_t blocks;
+    uint64_t inodes;
+} quota_usage_t;
+
+// A volume; its id is its index in the volume table (1..MAX_VOLUMES-1)
+typedef struct {
+    char name[VOLUME_NAME_MAX];                // top-level directory
+    uint32_t is_used;
+    unsigned char salt[EVFS_SALT_LEN];         // for the key derivation
+    unsigned char key_check[EVFS_CHECKSUM_LEN]; // recognises the passphrase
+} volume_t;
+
+// In-memory form of the metadata file, shared by the mount and evfs-fsck
+typedef struct {
+    char cipher[32];            // engine the blocks were written with
+    uint32_t backing_count;
+    uint64_t next_map_id;
+    blk_t alloc_end;            // first never-allocated physical block
+    file_metadata_t files[MAX_FILES];
+    block_map_t maps[MAX_FILES];
+    dentry_t dentries[MAX_DENTRIES];
+    quota_limit_t quotas[MAX_QUOTAS];
+    int quota_count;
+    volume_t volumes[MAX_VOLUMES];
+    extent_t *bad;              // quarantined physical ranges (lblk unused)
+    int bad_count;
+    uint64_t wal_seq;           // last log record the image includes
+    uint64_t change_gen;        // current change generation (storage_generation())
+    unsigned char sealed[MAX_FILES]; // inline areas still in their saved form
+    unsigned char names_sealed[MAX_DENTRIES]; // names still in their saved form
+    unsigned char absent[META_PAGES]; // inode pages not loaded (files and maps empty)
+    uint32_t clean;             // saved at unmount: the fields below are exact
+    extent_t *free;             // free physical ranges (lblk unused)
+    int free_count;
+    quota_usage_t *usage;       // quota usage per user and group
+    int usage_count;
+    uint64_t inodes_used;
+} metadata_image_t;
+
 /*
  * ============================================================================
  * GLOBAL VARIABLES (declared as extern, defined in evfs_metadata.c)
@@ -55,7 +290,9 @@ typedef struct {
  */
 
 extern file_metadata_t file_table[MAX_FILES];
+extern dentry_t dentry_table[MAX_DENTRIES];
 extern int initialized;
+extern evfs_options_t evfs_options;
 
 /*
  * ============================================================================
@@ -66,15 +303,251 @@ extern int initialized;
 // Initialize the file system
 void init_filesystem(void);
 
-// Find file by path, returns index or -1 if not found
+// Find file by path, returns its inode index or -1 if not found
 int find_file_by_path(const char *path);
 
+// Same lookup in any dentry table (live or a snapshot's copy)
+int find_path_in_table(const dentry_t *dentries, const char *path);
+
+// Index of the dentry naming path, or -1 (also for "/")
+int find_dentry(const dentry_t *dentries, const char *path);
+
+// Name of a dentry within directory dir_path ("/" or "/a/b"), or NULL
+// if it is not a direct child of it
+const char *dentry_child_name(const dentry_t *dentry, const char *dir_path);
+
+// 1 if the directory at dir_path has no entries
+int directory_is_empty(const dentry_t *dentries, const char *dir_path);
+
+// Collect the live dentries below directory inode dir_idx, at any depth,
+// and decrypt their names. Returns how many went into out
+int dentries_below(int dir_idx, int *out);
+
+// List directory dir_idx (at dir_path) of a table pair (live or a
+// snapshot's copy) through a FUSE filler, with each entry's attributes,
+// starting at 'offset' (0, or one the filler was given). Stops quietly
+// once the filler is full; the kernel resumes from there
+#define FILL_READ_ONLY 1     // a snapshot: entries show no write permission
+#define FILL_SNAPSHOT_DIR 2  // also list SNAPSHOT_DIR (the live root)
+int fill_directory(const file_metadata_t *files, const dentry_t *dentries, const char *dir_path,
+                   int dir_idx, int flags, void *buf, fuse_fill_dir_t filler, off_t offset);
+
+// Inode of the directory that would hold path, or -ENOENT / -ENOTDIR
+int parent_directory(const char *path);
+
+// Held across every change of the inode and dentry tables that takes
+// more than one store (create, link, unlink, rename, ...). Commits and
+// snapshots copy the tables under it, so they never see half of one.
+// Lock order: this, then the volume table lock, then storage_lock
+void metadata_lock(void);
+void metadata_unlock(void);
+
+// Add a name for an inode (does not touch nlink). Returns the dentry
+// index, -ENAMETOOLONG or -ENOSPC. The name changers below all expect
+// the caller to hold metadata_lock() on a mounted file system
+int dentry_add(const char *path, int inode);
+
+// Remove dentry d and drop its inode's link; the inode (data, xattrs)
+// is released with its last name
+void dentry_unlink(int d);
+
+// Rename dentry d to path (now in directory inode parent) / clear it,
+// keeping the lookup index in step. Neither touches nlink
+void dentry_set_name(int d, const char *path, int parent);
+void dentry_release(int d);
+
+// Drop one link to an inode without touching any dentry (its name was
+// reused, e.g. by rename over it). Releases the inode with its last link
+void inode_drop_link(int idx);
+
+// Note a read of an inode: updates its atime as the --*atime mode says
+void inode_accessed(int idx);
+
+// Store / read a symlink's target (inline or in its data blocks).
+// read returns the target length
+int symlink_store(int file_idx, const char *target);
+int symlink_read(int file_idx, char *buf, size_t size);
+// 1 if an inode is a symlink whose target is kept in the inode
+int symlink_is_inline(const file_metadata_t *meta);
+
+// Fill a struct stat from a metadata entry
+void metadata_to_stat(const file_metadata_t *meta, struct stat *stbuf);
+
 // Find an empty slot in file_table, returns index or -1 if no space
 int find_free_slot(void);
 
+// Read / atomically replace a metadata file. read returns -ENOENT if it
+// does not exist, -EINVAL if it is damaged (bad magic, size or checksum).
+// read loads every inode page; write copies the pages an image lacks
+// (absent) from the mounted file system's metadata file as they are
+int read_metadata_image(const char *path, metadata_image_t *img);
+int write_metadata_image(const char *path, const metadata_image_t *img);
+void free_metadata_image(metadata_image_t *img);
+
+// Path of the metadata file in use
+const char *metadata_path(void);
+
+// Cipher engine recorded in the metadata file (0), or -ENOENT/-EINVAL
+int stored_cipher(char *name, size_t len);
+
+// Save the mounted file system's metadata (at unmount)
+int save_metadata(void);
+
+// Write an image captured from the live tables as the metadata file,
+// sealing its inline areas and adding the cipher and quarantined ranges
+int save_metadata_image(metadata_image_t *img);
+
+// Seal (1) or unseal (0) an inode's inline areas: its xattrs, an inline
+// file's contents and a short symlink target, with its map's old_engine
+// (0 = the active one). Unsealing zeroes an area that fails to
+// authenticate and returns -EIO
+int inode_seal(file_metadata_t *meta, uint64_t map_id, uint32_t engine, int seal);
+
+// Seal (1) or unseal (0) a dentry's name for the metadata file or log;
+// tweak is its slot in the table. Returns 0 or -EIO
+int dentry_seal(dentry_t *dentry, uint64_t tweak, int seal);
+
+// Decrypt a live dentry's name if it is still sealed: names are loaded
+// sealed and decrypted when a lookup or listing reaches them
+void dentry_load(int d);
+
+// 1 if a live dentry's name is sealed (not reached since the mount)
+int dentry_is_sealed(int d);
+
+// Decrypt every name still sealed in an image, for the offline tools.
+// Returns 0 or -EIO
+int unseal_image_names(metadata_image_t *img);
+
+// Seal the inline areas of a volume's inodes, when its key is removed.
+// Sealed areas are saved as they are
+void seal_volume_inodes(uint32_t volume);
+
+// Decrypt an inode's inline areas if they are still sealed: they are
+// loaded sealed and decrypted on first use (see volume_check()). The
+// caller has checked that the inode's key is present
+void inode_load(int file_idx);
+
+// 1 if an inode's inline areas are sealed (not used since the mount, or
+// their volume is locked)
+int inode_is_sealed(int file_idx);
+
+// Incremental restore (evfs-tool apply): where restore[i] is set, install
+// files[i] as saved (inline areas sealed; is_used = 0 frees it) and drop
+// its names; then add the count dentries (plain) in free slots.
+// -ESTALE if one of those names belongs to an inode not restored
+int restore_metadata(const file_metadata_t *files, const unsigned char *restore,
+                     const dentry_t *dentries, int count);
+
 // Print file table for debugging
 void print_file_table(void);
 
+// Inode cache. Pages are loaded when a lookup, listing or new inode
+// reaches them; load returns 0, or -EIO if the page is damaged. load_all
+// loads them all (offline tools, snapshots, recording a trace)
+int inode_page_load(int page);
+int inode_cache_load_all(void);
+int inode_page_resident(int page);
+
+// Operations hold the cache while they use inodes (see TRACED() in
+// evfs_core.c): pages are only dropped between them
+void inode_cache_enter(void);
+void inode_cache_leave(void);
+
+// Drop the least recently used pages beyond --inode-cache whose inodes
+// are as in the metadata file and as last logged ('logged', by inode).
+// Called after each commit; skipped while an operation runs. Returns how
+// many pages kept the cache over its size because they changed since the
+// last checkpoint
+int inode_cache_trim(const file_metadata_t *logged);
+
+// Digest of 'count' consecutive inodes (from their first) with their
+// block maps, as saved: tells whether a page still matches its saved copy.
+// Returns 0, or -ENOMEM/-EIO
+int inode_digest(const file_metadata_t *files, const unsigned char *sealed,
+                 const block_map_t *maps, int count, unsigned char *sum);
+
+// 1 if the mount found the metadata file as saved at a clean unmount,
+// with no log to replay: it is the last commit as it stands
+int metadata_clean_mount(void);
+
+// Print page loads and drops of the inode cache
+void print_inode_cache_stats(void);
+
+/*
+ * ============================================================================
+ * BLOCK MAP FUNCTIONS (implemented in evfs_blockmap.c)
+ * ============================================================================
+ */
+
+// Initialize / release a file's block map
+void blockmap_init(block_map_t *map, uint64_t id);
+void blockmap_free(block_map_t *map);
+
+// Map a logical block. Returns 1 if mapped (*pblk set, *run = blocks left in
+// the extent), 0 for a hole (*run = blocks until the next mapped block)
+int blockmap_lookup(block_map_t *map, blk_t lblk, blk_t *pblk, blk_t *run);
+
+// Add a mapping for logical blocks that are currently holes, written in
+// change generation gen
+int blockmap_insert(block_map_t *map, blk_t lblk, blk_t pblk, blk_t len, uint64_t gen);
+
+// Drop (and free) all blocks at or beyond keep_blocks
+void blockmap_truncate(block_map_t *map, blk_t keep_blocks);
+
+// Drop (and free) the blocks mapped in [start, end)
+int blockmap_punch(block_map_t *map, blk_t start, blk_t end);
+
+// Point already-mapped logical blocks [lblk, lblk+len) at new physical
+// blocks; the old physical blocks are returned to the allocator. The
+// blocks keep their change generation (same data)
+int blockmap_remap(block_map_t *map, blk_t lblk, blk_t len, blk_t new_pblk);
+
+// Record that mapped blocks [lblk, lblk+len) were written in generation gen
+int blockmap_touch(block_map_t *map, blk_t lblk, blk_t len, uint64_t gen);
+
+// Number of physical blocks mapped
+blk_t blockmap_blocks(const block_map_t *map);
+
+// Physical block allocator
+void block_allocator_init(blk_t first_free);
+int block_alloc(blk_t goal, blk_t want, blk_t *pblk, blk_t *got);
+void block_free(blk_t pblk, blk_t len);
+// Take exactly 'want' contiguous free blocks lying wholly below 'limit'
+int block_alloc_below(blk_t want, blk_t limit, blk_t *pblk);
+void block_allocator_usage(blk_t *end, blk_t *nfree, int *nextents);
+// Never grow the used space past 'limit' blocks (BLK_MAX = no limit)
+void block_allocator_limit(blk_t limit);
+// Reset the allocator to 'end' with everything not covered by 'used'
+// (physical ranges, any order; sorted in place) on the free list
+void block_allocator_rebuild(blk_t end, extent_t *used, int count);
+// Reset the allocator to 'end' with exactly the free ranges given / copy
+// the free list out (*out malloc'd; returns how many, or -ENOMEM)
+void block_allocator_load(blk_t end, const extent_t *free_ranges, int count);
+int block_allocator_export(extent_t **out);
+
+// Add an owner to a range of allocated blocks (snapshot sharing);
+// block_free() then drops owners until the last one really frees them
+int block_ref(blk_t pblk, blk_t len);
+// Returns 1 if pblk has more than one owner; *run = blocks (<= len) from
+// pblk with the same shared/unshared status
+int block_shared(blk_t pblk, blk_t len, blk_t *run);
+// Number of blocks currently shared
+blk_t block_shared_blocks(void);
+
+// Commit tracking for the write-ahead log (off after block_allocator_init()).
+// While on, blocks allocated since the last block_commit_begin() are fresh;
+// freeing any other block is deferred until the next commit has ended,
+// so the last committed state never sees its blocks reused
+void block_allocator_track(int on);
+// Returns 1 if pblk may be referenced by committed state (so must not be
+// overwritten in place); *run = blocks (<= len) with the same status
+int block_durable(blk_t pblk, blk_t len, blk_t *run);
+// A commit captured the current state / that commit is durable (1) or failed (0)
+void block_commit_begin(void);
+void block_commit_end(int committed);
+// Blocks waiting for a commit before they are free
+blk_t block_deferred_blocks(void);
+
 /*
  * ============================================================================
  * STORAGE MODULE FUNCTIONS (implemented in evfs_storage.c)
@@ -84,8 +557,8 @@ void print_file_table(void);
 // Initialize storage system
 int init_storage(void);
 
-// Allocate storage for a file
-int allocate_storage(int file_idx, size_t size);
+// Allocate (preallocate) storage for the first 'size' bytes of a file
+int allocate_storage(int file_idx, off_t size);
 
 // Read data from storage
 int read_block(int file_idx, off_t offset, char *buf, size_t size);
@@ -93,12 +566,429 @@ int read_block(int file_idx, off_t offset, char *buf, size_t size);
 // Write data to storage
 int write_block(int file_idx, off_t offset, const char *buf, size_t size);
 
+// Resize file storage, releasing blocks past the new end
+int truncate_storage(int file_idx, off_t size);
+
 // Delete file storage
 int delete_storage(int file_idx);
 
+// Same, but the blocks are freed by a background thread: O(1) for the
+// caller, and the slot can be reused at once
+int release_storage(int file_idx);
+
 // Cleanup storage system
 void cleanup_storage(void);
 
+// Stop background storage work (compaction) so the maps stay put and
+// flush written data, e.g. before the metadata is saved. cleanup_storage()
+// does this as well
+void quiesce_storage(void);
+
+// Copy the block maps and allocator state into / out of a metadata image.
+// import also rebuilds the free list from what the maps leave unused, or
+// takes the saved one when inode pages are absent. Absent pages' maps
+// stay empty until storage_load_inodes()
+int export_storage(metadata_image_t *img);
+int import_storage(const metadata_image_t *img);
+
+// Inode cache (evfs_metadata.c). load installs the block maps of a page
+// of inodes just put into file_table (taking the extents) as committed
+// and unchanged. unload empties them again, or fails if anything about
+// the inodes changed: -ESTALE if their digest is no longer 'saved', -EBUSY
+// if they differ from 'logged', the last capture or change tracking, or
+// await re-encryption. Caller holds storage_lock_tables()
+void storage_load_inodes(int first, int count, block_map_t *maps);
+int storage_unload_inodes(int first, int count, const file_metadata_t *logged,
+                          const unsigned char *saved);
+
+// Commit support for the write-ahead log. capture copies the inode and
+// name tables, allocator state and the block maps changed since the last
+// capture (changed[i] set for those; changed = NULL takes them all) in
+// one consistent step, and starts a commit (block_commit_begin()).
+// sync makes written data durable; end_commit finishes the commit
+int storage_capture(metadata_image_t *img, unsigned char *changed);
+int storage_sync(void);
+
+// Hold the storage lock for writing around changes that captures must see
+// whole, e.g. an inode's inline areas being sealed or unsealed
+void storage_lock_tables(void);
+void storage_unlock_tables(void);
+void storage_end_commit(int committed);
+
+// Bulk transfer for offline tools. offset must be a multiple of the block
+// payload; whole blocks are written (the end of the last one zeroed) and
+// nothing is fsynced. Returns size, or -EBUSY for blocks a snapshot shares
+int bulk_write_storage(int file_idx, off_t offset, const char *buf, size_t size);
+int bulk_read_storage(int file_idx, off_t offset, char *buf, size_t size);
+
+// Extend the backing files over every allocated block in one go
+int preallocate_backing_files(void);
+
+// File bytes held per block with the active cipher engine
+size_t storage_block_payload(void);
+
+// Largest file kept inline (--inline-max, bounded by what the sealed
+// area holds with the active cipher engine)
+size_t inline_data_capacity(void);
+
+// Encrypt (enc = 1) or decrypt an inline data area for the metadata file,
+// tweaked by the entry's block map id
+int inline_data_seal(unsigned char *area, uint64_t map_id, uint32_t engine, int enc);
+
+// Copy part of an inline file's contents (zeros past the area). Live
+// inodes are read through read_block(), which takes the storage lock
+void inline_data_read(const file_metadata_t *meta, off_t offset, char *buf, size_t size);
+
+// Replace / read a file's xattr stream (the blocks from XATTR_LBLK on)
+int write_xattr_stream(int file_idx, const char *buf, size_t size);
+int read_xattr_stream(int file_idx, char *buf, size_t size);
+int read_snapshot_xattr_stream(block_map_t *map, char *buf, size_t size);
+
+// Read / write raw (still encrypted) physical blocks, for offline tools
+int read_raw_blocks(blk_t pblk, blk_t count, char *buf);
+int write_raw_blocks(blk_t pblk, blk_t count, const char *buf);
+
+// Number of physical blocks the backing files currently hold in full
+blk_t storage_backing_blocks(void);
+
+// Physical blocks mapped by a file (data and xattr stream)
+blk_t storage_file_blocks(int file_idx);
+
+// Give a new inode's (still empty) block map an id in its volume, so its
+// blocks are encrypted with the volume's key
+void storage_assign_volume(int file_idx, uint32_t volume);
+
+// Block map id of a file (its crypto tweak and key)
+uint64_t storage_map_id(int file_idx);
+
+// Engine a file's inline areas are sealed with (its map's old_engine)
+uint32_t storage_map_engine(int file_idx);
+
+// Capacity in blocks and how many are still free: --capacity, else what
+// is allocated plus the free space of the backing file systems
+void storage_capacity(blk_t *total, blk_t *avail);
+
+// Print storage I/O statistics (bytes moved, buffer pool usage)
+void print_storage_stats(void);
+
+// Snapshot every file's block map (and the file and dentry tables, and
+// which inline areas are sealed) without copying data; the blocks become
+// shared until either side changes them
+int snapshot_storage(block_map_t *maps, file_metadata_t *files, dentry_t *dentries,
+                     unsigned char *sealed);
+// Read through a snapshot's block map
+int read_snapshot_block(block_map_t *map, off_t offset, char *buf, size_t size);
+// Drop a snapshot's block references, freeing blocks only it still used
+void release_snapshot_storage(block_map_t *maps);
+
+// Changed-block tracking. Data blocks are tagged with the change
+// generation they were written in; a file's map records the generation
+// its inode, names or blocks last changed in (noticed when the tables are
+// saved or logged). A backup takes everything changed after the
+// generation the previous one ended, then starts a new generation
+uint64_t storage_generation(void);
+void storage_set_generation(uint64_t gen);
+
+// Copy of a file's block map (extents with their generations); the
+// caller frees out->extents
+int storage_copy_map(int file_idx, block_map_t *out);
+
+// Replace a file's block map (incremental restore). Extents of generation
+// <= since must be mapped the same way in the current map, whose blocks
+// they keep; the others already point at their (written) blocks.
+// -ESTALE if the current map does not match
+int storage_install_map(int file_idx, const block_map_t *map, uint64_t since);
+
+// Take the current tables as unchanged (after a restore)
+void storage_track_reset(void);
+
+// Run one compaction pass (relocate up to max_bytes of live data to
+// reclaim dead space / defragment files). Returns bytes moved, or -1
+long compact_storage(long max_bytes);
+
+// Online re-encryption. When the metadata was written with another engine
+// than the active one (of the same block overhead), import_storage() marks
+// every file as still using it; the re-encryption thread then rewrites
+// them a chunk at a time. start / stop the thread (mount only)
+void start_reencryption(void);
+void stop_reencryption(void);
+
+// A volume was unlocked: its files can be re-encrypted now
+void reencrypt_wake(void);
+
+// Files not wholly re-encrypted yet
+int reencrypt_pending(void);
+
+/*
+ * ============================================================================
+ * I/O SCHEDULER (implemented in evfs_iosched.c)
+ * ============================================================================
+ */
+
+// Reset the counters and load the rate limits from evfs_options
+void io_sched_init(void);
+
+// Class of the calling thread's backing I/O: the one set with
+// io_set_thread_class(), else a foreground read or write
+io_class_t io_class_of(int is_write);
+void io_set_thread_class(io_class_t cls);
+
+// Class for a name ("read", "write", "background"), or -1
+int io_class_by_name(const char *name);
+
+// Wait for a slot to issue one backing I/O / give it back
+void io_submit(io_class_t cls);
+void io_complete(io_class_t cls, size_t bytes);
+
+// Charge bytes to the class's rate limit, sleeping while it is in debt.
+// Call without storage locks held
+void io_throttle(io_class_t cls, size_t bytes);
+
+// Print queue depths, waits and throttling per class
+void print_iosched_stats(void);
+
+// IOSCHED_XATTR_PREFIX attributes on the root directory
+int is_iosched_xattr(const char *name);
+int iosched_setxattr(const char *name, const char *value, size_t size);
+int iosched_getxattr(const char *name, char *value, size_t size);
+int iosched_removexattr(const char *name);
+
+/*
+ * ============================================================================
+ * SNAPSHOTS (implemented in evfs_snapshot.c)
+ * ============================================================================
+ */
+
+// Start / stop the snapshot module (stop waits for pending deletions)
+void init_snapshots(void);
+void cleanup_snapshots(void);
+
+// 1 if path is SNAPSHOT_DIR or lies below it
+int is_snapshot_path(const char *path);
+
+// Create / delete a snapshot by name (mkdir / rmdir in SNAPSHOT_DIR)
+int snapshot_create(const char *name);
+int snapshot_delete(const char *name);
+
+// Read-only access to snapshot contents, for paths below SNAPSHOT_DIR
+int snapshot_getattr(const char *path, struct stat *stbuf);
+int snapshot_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset);
+int snapshot_open(const char *path);
+int snapshot_read(const char *path, char *buf, size_t size, off_t offset);
+int snapshot_readlink(const char *path, char *buf, size_t size);
+int snapshot_getxattr(const char *path, const char *name, char *value, size_t size);
+int snapshot_listxattr(const char *path, char *list, size_t size);
+
+/*
+ * ============================================================================
+ * EXTENDED ATTRIBUTES (implemented in evfs_xattr.c)
+ * ============================================================================
+ */
+
+// getxattr/setxattr/listxattr/removexattr semantics on a live entry.
+// Lookups are served from memory; only changes to large values do I/O
+int xattr_get(int file_idx, const char *name, char *value, size_t size);
+int xattr_set(int file_idx, const char *name, const char *value, size_t size, int flags);
+int xattr_list(int file_idx, char *list, size_t size);
+int xattr_remove(int file_idx, const char *name);
+
+// Drop all cached xattr streams (at mount)
+void init_xattrs(void);
+
+// Forget an entry's xattrs when it is deleted
+void xattr_forget(int file_idx);
+
+// Drop an entry's cached xattr stream (its volume was locked, or its
+// inode page was dropped from memory)
+void xattr_uncache(int file_idx);
+
+// Encrypt (enc = 1) or decrypt an inline xattr area for the metadata file,
+// tweaked by the entry's block map id
+int xattr_seal(unsigned char *area, uint64_t map_id, uint32_t engine, int enc);
+
+// The same lookups on a snapshot's copy of an entry; 'stream' holds
+// xattr_stream_size() bytes read through the snapshot's block map
+size_t xattr_stream_size(const file_metadata_t *meta);
+int xattr_get_in(const file_metadata_t *meta, const char *stream, const char *name,
+                 char *value, size_t size);
+int xattr_list_in(const file_metadata_t *meta, const char *stream, char *list, size_t size);
+
+/*
+ * ============================================================================
+ * QUOTAS (implemented in evfs_quota.c)
+ * ============================================================================
+ */
+
+// Reset usage and load the limits saved in the metadata file
+void init_quotas(const quota_limit_t *limits, int count);
+
+// Recount usage from the file table and block maps (at mount, unless
+// the usage saved at a clean unmount was loaded)
+void quota_rebuild(void);
+
+// Charge blocks/inodes to an owner. Increases fail with -EDQUOT past a
+// hard limit, or past a soft limit whose grace period has run out
+int quota_charge(uid_t uid, gid_t gid, int64_t blocks, int inodes);
+
+// The same without enforcement, e.g. for releases
+void quota_account(uid_t uid, gid_t gid, int64_t blocks, int inodes);
+
+// Inodes in use, for statfs
+uint64_t quota_inodes_used(void);
+
+// Copy out the limits to save; returns how many
+int export_quotas(quota_limit_t *limits, int max);
+
+// Copy out usage (*out malloc'd; returns how many entries, or -ENOMEM)
+// and the inode count / load it as saved, instead of quota_rebuild()
+int export_quota_usage(quota_usage_t **out, uint64_t *inodes);
+void import_quota_usage(const quota_usage_t *usage, int count, uint64_t inodes);
+
+// QUOTA_XATTR_PREFIX attributes on the root directory
+int is_quota_xattr(const char *name);
+int quota_setxattr(const char *name, const char *value, size_t size);
+int quota_getxattr(const char *name, char *value, size_t size);
+int quota_removexattr(const char *name);
+
+/*
+ * ============================================================================
+ * WRITE-AHEAD LOG (implemented in evfs_wal.c)
+ * ============================================================================
+ */
+
+// Path of the log (metadata file + WAL_SUFFIX)
+const char *wal_path(void);
+
+// Apply the log records newer than img->wal_seq to a loaded image.
+// Returns the number of records applied (stops at the first torn one)
+int wal_replay(metadata_image_t *img);
+
+// Log sequence number the current state has reached
+uint64_t wal_last_seq(void);
+
+// Start logging on a mounted file system: write a checkpoint (unless
+// the metadata file is current, see metadata_clean_mount()), empty the
+// log and start the background committer. stop commits what is pending
+// and ends logging (before the full save at unmount)
+int wal_start(void);
+void wal_stop(void);
+
+// Commit everything changed so far and wait until it is durable.
+// Callers arriving together share one commit. 0 when not logging
+int wal_sync(void);
+
+/*
+ * ============================================================================
+ * VOLUMES (implemented in evfs_volume.c)
+ * ============================================================================
+ */
+
+// Load / save the volume table (indexed by volume id)
+void init_volumes(const volume_t *volumes);
+void export_volumes(volume_t *volumes);
+
+// Add a volume's key to the keyring, creating the volume (and its
+// directory /name) if it does not exist yet. -EKEYREJECTED for a wrong
+// passphrase
+int volume_unlock(const char *name, const char *passphrase);
+
+// Remove a volume's key; its files cannot be opened until it is unlocked
+int volume_lock(const char *name);
+
+// Unlock the volumes given with --volume=name:keyfile
+void unlock_volumes_from_options(void);
+
+// 0 if an inode's data can be used, -ENOKEY if its volume is locked.
+// A live inode's inline areas are decrypted on the way (inode_load())
+int volume_check(const file_metadata_t *meta);
+
+// 1 if the inode is a volume's top-level directory
+int is_volume_root(int file_idx);
+
+// VOLUME_XATTR_PREFIX attributes on the root directory
+int is_volume_xattr(const char *name);
+int volume_setxattr(const char *name, const char *value, size_t size);
+int volume_getxattr(const char *name, char *value, size_t size);
+int volume_removexattr(const char *name);
+
+/*
+ * ============================================================================
+ * WORKLOAD TRACES (implemented in evfs_trace.c, replayed by evfs-replay)
+ * ============================================================================
+ */
+
+#define TRACE_MAGIC 0x3143525453465645ULL  // "EVFSTRC1"
+#define TRACE_VERSION 1
+
+// Operations in a trace. TRACE_INODE records an inode that existed when
+// recording started (offset: size, size: file_type_t)
+typedef enum {
+    TRACE_INODE = 0,
+    TRACE_GETATTR,
+    TRACE_READDIR,
+    TRACE_CREATE,
+    TRACE_OPEN,
+    TRACE_READ,
+    TRACE_WRITE,
+    TRACE_TRUNCATE,
+    TRACE_UNLINK,
+    TRACE_MKDIR,
+    TRACE_RMDIR,
+    TRACE_RENAME,
+    TRACE_LINK,
+    TRACE_SYMLINK,
+    TRACE_READLINK,
+    TRACE_UTIMENS,
+    TRACE_SETXATTR,
+    TRACE_GETXATTR,
+    TRACE_LISTXATTR,
+    TRACE_REMOVEXATTR,
+    TRACE_STATFS,
+    TRACE_FSYNC,
+    TRACE_OPS
+} trace_op_t;
+
+extern const char *const trace_op_names[TRACE_OPS];
+
+// trace_record_t.flags
+#define TRACE_GONE 0x01  // the inode no longer exists after the operation
+
+// Start of a trace file; records follow
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t record_size;   // sizeof(trace_record_t)
+    int64_t started;        // wall clock time recording began
+    char cipher[32];        // engine of the recorded file system
+} trace_header_t;
+
+// One operation, written when it completes
+typedef struct {
+    uint64_t time_ns;       // start, since recording began
+    uint64_t offset;        // read/write offset, new size for truncate
+    uint32_t size;          // bytes requested; symlink: target length
+    int32_t result;
+    uint32_t latency_us;    // how long it took
+    uint8_t op;             // trace_op_t
+    uint8_t flags;          // TRACE_GONE
+    int16_t inode;          // -1: none (the path did not resolve)
+} trace_record_t;
+
+// An operation being recorded (see TRACED() in evfs_core.c)
+typedef struct {
+    uint64_t start_ns;      // 0: not recording
+    int inode;
+} trace_call_t;
+
+// Record every FUSE operation to path until trace_stop() (--record)
+int trace_start(const char *path);
+void trace_stop(void);
+
+// Around each operation; both do nothing unless recording
+void trace_begin(trace_call_t *call, const char *path);
+void trace_end(const trace_call_t *call, trace_op_t op, const char *path,
+               size_t size, off_t offset, int result);
+
 /*
  * ============================================================================
  * READ/WRITE OPERATIONS (implemented in evfs_readwrite.c)
@@ -125,9 +1015,22 @@ int evfs_mkdir(const char *path, mode_t mode);
 // Remove directory
 int evfs_rmdir(const char *path);
 
-// Rename file/directory
+// Rename file/directory (POSIX: an existing destination is replaced)
 int evfs_rename(const char *from, const char *to);
 
+// rename with renameat2() flags: RENAME_NOREPLACE fails with EEXIST if
+// 'to' exists, RENAME_EXCHANGE atomically swaps two existing names
+int evfs_rename_flags(const char *from, const char *to, unsigned int flags);
+
+// Create a hard link (metadata only: the new name shares the inode)
+int evfs_link(const char *from, const char *to);
+
+// Create a symbolic link at linkpath pointing to target
+int evfs_symlink(const char *target, const char *linkpath);
+
+// Read a symbolic link's target (NUL-terminated, truncated to size)
+int evfs_readlink(const char *path, char *buf, size_t size);
+
 /*
  * ============================================================================
  * FUSE OPERATIONS (implemented in evfs_core.c)
@@ -156,6 +1059,19 @@ void evfs_destroy(void *private_data);
 // Set file timestamps
 int evfs_utimens(const char *path, const struct timespec ts[2]);
 
+// Extended attributes
+int evfs_setxattr(const char *path, const char *name, const char *value,
+                  size_t size, int flags);
+int evfs_getxattr(const char *path, const char *name, char *value, size_t size);
+int evfs_listxattr(const char *path, char *list, size_t size);
+int evfs_removexattr(const char *path, const char *name);
+
+// File system capacity and usage (df), from counters kept up to date
+int evfs_statfs(const char *path, struct statvfs *stbuf);
+
+// Make a file's data and metadata durable (a commit of the whole log)
+int evfs_fsync(const char *path, int datasync, struct fuse_file_info *fi);
+
 /*
  * ============================================================================
  * FUSE OPERATIONS STRUCTURE
@@ -0,0 +1,1017 @@
+#include "evfs.h"
+#include <pthread.h>
+
+/*
+ * ============================================================================
+ * BLOCK MAP MODULE - Logical->physical block mapping and block allocator
+ * ============================================================================
+ *
+ * Each file owns a block_map_t: a sorted array of extents mapping runs of
+ * logical blocks onto runs of physical blocks in the storage address space.
+ * Lookups are a binary search, with a cached cursor so that sequential
+ * access hits the same (or the next) extent without searching at all.
+ *
+ * Every extent also carries the change generation its blocks were last
+ * written in (see storage_generation()); neighbours only merge when it is
+ * the same, so the blocks changed since a backup can be found by map.
+ *
+ * Physical space is handed out by a simple allocator: a sorted list of
+ * free extents plus a bump pointer at the end of the used space.
+ *
+ * Snapshots share blocks with the live file system. Shared ranges are kept
+ * in a second sorted list with their extra reference count; block_free()
+ * on a shared range drops a reference instead of freeing it. Blocks not on
+ * that list have exactly one owner, so the common case costs nothing.
+ */
+
+// Free extents shorter than this are not used for multi-block requests
+#define FRAGMENT_MIN_BLOCKS 16
+
+typedef struct {
+    blk_t pblk;
+    blk_t len;
+} free_extent_t;
+
+static free_extent_t *free_list = NULL;
+static int free_count = 0;
+static int free_capacity = 0;
+static blk_t alloc_end = 0;     // first never-allocated physical block
+static blk_t free_blocks = 0;   // total blocks on the free list
+static blk_t alloc_limit = BLK_MAX; // alloc_end never grows past this
+static pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Physical ranges referenced by more than one block map
+typedef struct {
+    blk_t pblk;
+    blk_t len;
+    uint32_t refs;  // extra owners beyond the first
+} shared_extent_t;
+
+static shared_extent_t *shared_list = NULL;
+static int shared_count = 0;
+static int shared_capacity = 0;
+
+// Commit tracking (see block_allocator_track()). Blocks allocated since
+// the last commit began are fresh: nothing durable references them yet.
+// Durable blocks that are freed wait on the deferred list until a commit
+// no longer references them
+typedef struct {
+    free_extent_t *list;
+    int count;
+    int capacity;
+} range_list_t;
+
+static int tracking = 0;
+static range_list_t fresh_list;       // sorted by pblk, merged
+static range_list_t deferred_list;    // unsorted
+static range_list_t committing_list;  // deferred frees of the running commit
+
+/*
+ * ----------------------------------------------------------------------------
+ * Per-file extent map
+ * ----------------------------------------------------------------------------
+ */
+
+void blockmap_init(block_map_t *map, uint64_t id) {
+    map->id = id;
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->cursor = 0;
+    map->generation = 0;
+    map->old_engine = 0;
+    map->reencrypted = 0;
+}
+
+void blockmap_free(block_map_t *map) {
+    free(map->extents);
+    map->extents = NULL;
+    map->count = 0;
+    map->capacity = 0;
+    map->cursor = 0;
+}
+
+static int extent_contains(const extent_t *ext, blk_t lblk) {
+    return lblk >= ext->lblk && lblk < ext->lblk + ext->len;
+}
+
+/*
+ * Index of the first extent whose end lies beyond lblk
+ * (i.e. the extent containing lblk, or the next one after a hole).
+ */
+static int blockmap_search(const block_map_t *map, blk_t lblk) {
+    int lo = 0, hi = map->count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        const extent_t *ext = &map->extents[mid];
+        if (ext->lblk + ext->len <= lblk) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+int blockmap_lookup(block_map_t *map, blk_t lblk, blk_t *pblk, blk_t *run) {
+    int i = __atomic_load_n(&map->cursor, __ATOMIC_RELAXED);
+
+    // Sequential fast path: cursor extent or the one right after it
+    if (i < map->count && extent_contains(&map->extents[i], lblk)) {
+        // hit
+    } else if (i + 1 < map->count && extent_contains(&map->extents[i + 1], lblk)) {
+        i = i + 1;
+    } else {
+        i = blockmap_search(map, lblk);
+    }
+
+    if (i < map->count && extent_contains(&map->extents[i], lblk)) {
+        const extent_t *ext = &map->extents[i];
+        __atomic_store_n(&map->cursor, i, __ATOMIC_RELAXED);
+        *pblk = ext->pblk + (lblk - ext->lblk);
+        *run = ext->lblk + ext->len - lblk;
+        return 1;
+    }
+
+    // Hole: report its length up to the next extent
+    *pblk = 0;
+    *run = (i < map->count) ? map->extents[i].lblk - lblk : BLK_MAX - lblk;
+    return 0;
+}
+
+// b can be appended to a: contiguous both ways, written in the same generation
+static int extent_mergeable(const extent_t *a, const extent_t *b) {
+    return a->lblk + a->len == b->lblk && a->pblk + a->len == b->pblk &&
+           a->gen == b->gen && a->len + b->len <= EXTENT_MAX_LEN;
+}
+
+// Merge neighbours that became mergeable
+static void merge_extents(block_map_t *map) {
+    int out = 0;
+    for (int i = 0; i < map->count; i++) {
+        if (out > 0 && extent_mergeable(&map->extents[out - 1], &map->extents[i])) {
+            map->extents[out - 1].len += map->extents[i].len;
+            continue;
+        }
+        map->extents[out++] = map->extents[i];
+    }
+    map->count = out;
+    map->cursor = 0;
+}
+
+static int reserve_extents(block_map_t *map, int extra) {
+    if (map->count + extra <= map->capacity) return 0;
+    int new_capacity = map->capacity * 2 + extra;
+    extent_t *grown = realloc(map->extents, new_capacity * sizeof(extent_t));
+    if (!grown) return -ENOMEM;
+    map->extents = grown;
+    map->capacity = new_capacity;
+    return 0;
+}
+
+// Cut the extent containing lblk so that one starts at lblk. Caller has
+// reserved a slot
+static void split_extent(block_map_t *map, blk_t lblk) {
+    int i = blockmap_search(map, lblk);
+    if (i >= map->count || !extent_contains(&map->extents[i], lblk) ||
+        map->extents[i].lblk == lblk) {
+        return;
+    }
+    extent_t *ext = &map->extents[i];
+    blk_t head = lblk - ext->lblk;
+    memmove(ext + 2, ext + 1, (map->count - i - 1) * sizeof(extent_t));
+    ext[1] = (extent_t){ lblk, ext->pblk + head, ext->len - head, ext->gen };
+    ext->len = head;
+    map->count++;
+}
+
+int blockmap_insert(block_map_t *map, blk_t lblk, blk_t pblk, blk_t len, uint64_t gen) {
+    int i = blockmap_search(map, lblk);
+    extent_t add = { lblk, pblk, len, gen };
+    map->generation++;
+
+    // Extend the previous extent when logically and physically contiguous
+    if (i > 0) {
+        extent_t *prev = &map->extents[i - 1];
+        if (extent_mergeable(prev, &add)) {
+            prev->len += len;
+            // ...and absorb the next one if the gap just closed
+            if (i < map->count) {
+                extent_t *next = &map->extents[i];
+                if (extent_mergeable(prev, next)) {
+                    prev->len += next->len;
+                    memmove(next, next + 1, (map->count - i - 1) * sizeof(extent_t));
+                    map->count--;
+                }
+            }
+            return 0;
+        }
+    }
+
+    if (i < map->count) {
+        extent_t *next = &map->extents[i];
+        if (extent_mergeable(&add, next)) {
+            next->lblk = lblk;
+            next->pblk = pblk;
+            next->len += len;
+            return 0;
+        }
+    }
+
+    if (map->count == map->capacity) {
+        int new_capacity = map->capacity ? map->capacity * 2 : 8;
+        extent_t *grown = realloc(map->extents, new_capacity * sizeof(extent_t));
+        if (!grown) return -ENOMEM;
+        map->extents = grown;
+        map->capacity = new_capacity;
+    }
+
+    memmove(&map->extents[i + 1], &map->extents[i], (map->count - i) * sizeof(extent_t));
+    map->extents[i] = add;
+    map->count++;
+    return 0;
+}
+
+void blockmap_truncate(block_map_t *map, blk_t keep_blocks) {
+    map->generation++;
+    while (map->count > 0) {
+        extent_t *last = &map->extents[map->count - 1];
+        if (last->lblk >= keep_blocks) {
+            block_free(last->pblk, last->len);
+            map->count--;
+        } else if (last->lblk + last->len > keep_blocks) {
+            blk_t keep = keep_blocks - last->lblk;
+            block_free(last->pblk + keep, last->len - keep);
+            last->len = keep;
+            break;
+        } else {
+            break;
+        }
+    }
+    if (map->cursor >= map->count) {
+        map->cursor = 0;
+    }
+}
+
+int blockmap_punch(block_map_t *map, blk_t start, blk_t end) {
+    if (start >= end || map->count == 0) return 0;
+
+    // Punching the middle of an extent splits it in two
+    if (map->count == map->capacity) {
+        int new_capacity = map->capacity * 2;
+        extent_t *grown = realloc(map->extents, new_capacity * sizeof(extent_t));
+        if (!grown) return -ENOMEM;
+        map->extents = grown;
+        map->capacity = new_capacity;
+    }
+
+    map->generation++;
+    for (int i = map->count - 1; i >= 0; i--) {
+        extent_t *ext = &map->extents[i];
+        blk_t ext_end = ext->lblk + ext->len;
+        if (ext_end <= start || ext->lblk >= end) continue;
+
+        blk_t cut_start = ext->lblk > start ? ext->lblk : start;
+        blk_t cut_end = ext_end < end ? ext_end : end;
+        block_free(ext->pblk + (cut_start - ext->lblk), cut_end - cut_start);
+
+        if (cut_start > ext->lblk && cut_end < ext_end) {
+            memmove(&map->extents[i + 2], &map->extents[i + 1],
+                    (map->count - i - 1) * sizeof(extent_t));
+            map->extents[i + 1].lblk = cut_end;
+            map->extents[i + 1].pblk = ext->pblk + (cut_end - ext->lblk);
+            map->extents[i + 1].len = ext_end - cut_end;
+            map->extents[i + 1].gen = ext->gen;
+            ext->len = cut_start - ext->lblk;
+            map->count++;
+        } else if (cut_start > ext->lblk) {
+            ext->len = cut_start - ext->lblk;
+        } else if (cut_end < ext_end) {
+            ext->pblk += cut_end - ext->lblk;
+            ext->len = ext_end - cut_end;
+            ext->lblk = cut_end;
+        } else {
+            memmove(ext, ext + 1, (map->count - i - 1) * sizeof(extent_t));
+            map->count--;
+        }
+    }
+    map->cursor = 0;
+    return 0;
+}
+
+int blockmap_remap(block_map_t *map, blk_t lblk, blk_t len, blk_t new_pblk) {
+    blk_t done = 0;
+
+    while (done < len) {
+        int i = blockmap_search(map, lblk + done);
+        if (i >= map->count || !extent_contains(&map->extents[i], lblk + done)) {
+            return -EINVAL;  // range is not fully mapped
+        }
+
+        extent_t *ext = &map->extents[i];
+        blk_t head = lblk + done - ext->lblk;
+        blk_t take = ext->len - head;
+        if (take > len - done) take = len - done;
+        blk_t tail = ext->len - head - take;
+
+        block_free(ext->pblk + head, take);
+
+        // Split the extent into [head][moved][tail]; the data is the same
+        extent_t moved = { ext->lblk + head, new_pblk + done, take, ext->gen };
+        extent_t rest = { ext->lblk + head + take, ext->pblk + head + take, tail, ext->gen };
+        int slots = (head > 0) + 1 + (tail > 0);
+
+        if (map->count + slots - 1 > map->capacity) {
+            int new_capacity = map->capacity * 2 + slots;
+            extent_t *grown = realloc(map->extents, new_capacity * sizeof(extent_t));
+            if (!grown) return -ENOMEM;
+            map->extents = grown;
+            map->capacity = new_capacity;
+            ext = &map->extents[i];
+        }
+
+        memmove(&map->extents[i + slots], &map->extents[i + 1],
+                (map->count - i - 1) * sizeof(extent_t));
+        int j = i;
+        if (head > 0) {
+            ext->len = head;  // leading part stays where it is
+            j++;
+        }
+        map->extents[j++] = moved;
+        if (tail > 0) {
+            map->extents[j] = rest;
+        }
+        map->count += slots - 1;
+        done += take;
+    }
+
+    // Re-merge neighbours that became contiguous
+    merge_extents(map);
+    map->generation++;
+    return 0;
+}
+
+int blockmap_touch(block_map_t *map, blk_t lblk, blk_t len, uint64_t gen) {
+    // Usually the blocks were already written in this generation
+    int i = blockmap_search(map, lblk);
+    while (i < map->count && map->extents[i].lblk < lblk + len && map->extents[i].gen == gen) {
+        i++;
+    }
+    if (i == map->count || map->extents[i].lblk >= lblk + len) {
+        return 0;
+    }
+
+    if (reserve_extents(map, 2) < 0) return -ENOMEM;
+    split_extent(map, lblk);
+    split_extent(map, lblk + len);
+    for (i = blockmap_search(map, lblk); i < map->count && map->extents[i].lblk < lblk + len; i++) {
+        map->extents[i].gen = gen;
+    }
+    merge_extents(map);
+    map->generation++;
+    return 0;
+}
+
+blk_t blockmap_blocks(const block_map_t *map) {
+    blk_t total = 0;
+    for (int i = 0; i < map->count; i++) {
+        total += map->extents[i].len;
+    }
+    return total;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Commit tracking lists
+ * ----------------------------------------------------------------------------
+ */
+
+static void range_list_clear(range_list_t *rl) {
+    free(rl->list);
+    rl->list = NULL;
+    rl->count = 0;
+    rl->capacity = 0;
+}
+
+static int range_list_reserve(range_list_t *rl, int extra) {
+    if (rl->count + extra <= rl->capacity) return 0;
+    int new_capacity = rl->capacity ? rl->capacity * 2 : 64;
+    while (new_capacity < rl->count + extra) new_capacity *= 2;
+    free_extent_t *grown = realloc(rl->list, new_capacity * sizeof(free_extent_t));
+    if (!grown) return -ENOMEM;
+    rl->list = grown;
+    rl->capacity = new_capacity;
+    return 0;
+}
+
+// Index of the first fresh extent ending after pblk
+static int fresh_find(blk_t pblk) {
+    int lo = 0, hi = fresh_list.count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (fresh_list.list[mid].pblk + fresh_list.list[mid].len <= pblk) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+// Remember newly allocated blocks. Caller holds alloc_lock. Blocks that
+// cannot be remembered count as durable, which only costs a copy later
+static void fresh_add(blk_t pblk, blk_t len) {
+    if (!tracking) return;
+    int i = fresh_find(pblk);
+    free_extent_t *list = fresh_list.list;
+    int merge_prev = i > 0 && list[i - 1].pblk + list[i - 1].len == pblk;
+    int merge_next = i < fresh_list.count && pblk + len == list[i].pblk;
+
+    if (merge_prev && merge_next) {
+        list[i - 1].len += len + list[i].len;
+        memmove(&list[i], &list[i + 1], (fresh_list.count - i - 1) * sizeof(free_extent_t));
+        fresh_list.count--;
+    } else if (merge_prev) {
+        list[i - 1].len += len;
+    } else if (merge_next) {
+        list[i].pblk = pblk;
+        list[i].len += len;
+    } else if (range_list_reserve(&fresh_list, 1) == 0) {
+        list = fresh_list.list;
+        memmove(&list[i + 1], &list[i], (fresh_list.count - i) * sizeof(free_extent_t));
+        list[i].pblk = pblk;
+        list[i].len = len;
+        fresh_list.count++;
+    }
+}
+
+static void deferred_add(range_list_t *rl, blk_t pblk, blk_t len) {
+    if (rl->count > 0 && rl->list[rl->count - 1].pblk + rl->list[rl->count - 1].len == pblk) {
+        rl->list[rl->count - 1].len += len;
+    } else if (range_list_reserve(rl, 1) == 0) {
+        rl->list[rl->count].pblk = pblk;
+        rl->list[rl->count].len = len;
+        rl->count++;
+    } else {
+        // Leaking the range is safe; it just stays unused
+        fprintf(stderr, "[BLOCKMAP] Out of memory, leaking %lu blocks\n",
+                (unsigned long)len);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Physical block allocator
+ * ----------------------------------------------------------------------------
+ */
+
+void block_allocator_init(blk_t first_free) {
+    pthread_mutex_lock(&alloc_lock);
+    free(free_list);
+    free_list = NULL;
+    free_count = 0;
+    free_capacity = 0;
+    free_blocks = 0;
+    alloc_end = first_free;
+    free(shared_list);
+    shared_list = NULL;
+    shared_count = 0;
+    shared_capacity = 0;
+    range_list_clear(&fresh_list);
+    range_list_clear(&deferred_list);
+    range_list_clear(&committing_list);
+    tracking = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+void block_allocator_limit(blk_t limit) {
+    pthread_mutex_lock(&alloc_lock);
+    alloc_limit = limit;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+static void free_list_remove(int i) {
+    memmove(&free_list[i], &free_list[i + 1], (free_count - i - 1) * sizeof(free_extent_t));
+    free_count--;
+}
+
+/*
+ * Allocate up to 'want' contiguous blocks, preferring to start at 'goal'
+ * (typically right after the caller's previous physical block, so files
+ * stay contiguous). May return fewer blocks than requested.
+ */
+static int alloc_extent(blk_t goal, blk_t want, blk_t *pblk, blk_t *got) {
+    if (want == 0) return -EINVAL;
+    if (want > EXTENT_MAX_LEN) want = EXTENT_MAX_LEN;
+
+    pthread_mutex_lock(&alloc_lock);
+
+    // 1. Continue right where the goal is, if that space is free
+    int full = alloc_end >= alloc_limit;
+    if (goal == alloc_end && !full) {
+        goto bump;
+    }
+    for (int i = 0; i < free_count; i++) {
+        free_extent_t *fe = &free_list[i];
+        if (fe->pblk == goal) {
+            blk_t take = fe->len < want ? fe->len : want;
+            *pblk = fe->pblk;
+            *got = take;
+            fe->pblk += take;
+            fe->len -= take;
+            if (fe->len == 0) free_list_remove(i);
+            free_blocks -= take;
+            fresh_add(*pblk, take);
+            pthread_mutex_unlock(&alloc_lock);
+            return 0;
+        }
+        if (fe->pblk > goal) break;
+    }
+
+    // 2. First free extent large enough, else the largest one available
+    if (free_count > 0) {
+        int best = 0;
+        for (int i = 0; i < free_count; i++) {
+            if (free_list[i].len >= want) { best = i; break; }
+            if (free_list[i].len > free_list[best].len) best = i;
+        }
+        // Small scraps are not worth fragmenting a large request over,
+        // unless the used space cannot grow any more
+        if (free_list[best].len >= want || free_list[best].len >= FRAGMENT_MIN_BLOCKS || full) {
+            free_extent_t *fe = &free_list[best];
+            blk_t take = fe->len < want ? fe->len : want;
+            *pblk = fe->pblk;
+            *got = take;
+            fe->pblk += take;
+            fe->len -= take;
+            if (fe->len == 0) free_list_remove(best);
+            free_blocks -= take;
+            fresh_add(*pblk, take);
+            pthread_mutex_unlock(&alloc_lock);
+            return 0;
+        }
+    }
+
+bump:
+    // 3. Extend the used space, up to the configured capacity
+    if (full) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -ENOSPC;
+    }
+    if (want > alloc_limit - alloc_end) want = alloc_limit - alloc_end;
+    *pblk = alloc_end;
+    *got = want;
+    alloc_end += want;
+    fresh_add(*pblk, want);
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+int block_alloc(blk_t goal, blk_t want, blk_t *pblk, blk_t *got) {
+    int ret = alloc_extent(goal, want, pblk, got);
+    if (ret == 0) {
+        EVFS_PROBE4(block__alloc, goal, want, *pblk, *got);
+    } else {
+        EVFS_PROBE3(block__alloc__fail, goal, want, ret);
+    }
+    return ret;
+}
+
+int block_alloc_below(blk_t want, blk_t limit, blk_t *pblk) {
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < free_count; i++) {
+        free_extent_t *fe = &free_list[i];
+        if (fe->pblk + want > limit) break;
+        if (fe->len >= want) {
+            *pblk = fe->pblk;
+            fe->pblk += want;
+            fe->len -= want;
+            if (fe->len == 0) free_list_remove(i);
+            free_blocks -= want;
+            fresh_add(*pblk, want);
+            pthread_mutex_unlock(&alloc_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return -ENOSPC;
+}
+
+// Return a range to the free list. Caller holds alloc_lock.
+static void release_blocks(blk_t pblk, blk_t len) {
+    // Freed space at the very end just moves the bump pointer back
+    if (pblk + len == alloc_end) {
+        alloc_end = pblk;
+        // The tail of the free list may now touch the end as well
+        if (free_count > 0) {
+            free_extent_t *last = &free_list[free_count - 1];
+            if (last->pblk + last->len == alloc_end) {
+                alloc_end = last->pblk;
+                free_blocks -= last->len;
+                free_count--;
+            }
+        }
+        return;
+    }
+
+    // Find insertion point (sorted by pblk)
+    int lo = 0, hi = free_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (free_list[mid].pblk < pblk) lo = mid + 1; else hi = mid;
+    }
+    int i = lo;
+
+    int merge_prev = i > 0 && free_list[i - 1].pblk + free_list[i - 1].len == pblk;
+    int merge_next = i < free_count && pblk + len == free_list[i].pblk;
+
+    if (merge_prev && merge_next) {
+        free_list[i - 1].len += len + free_list[i].len;
+        free_list_remove(i);
+    } else if (merge_prev) {
+        free_list[i - 1].len += len;
+    } else if (merge_next) {
+        free_list[i].pblk = pblk;
+        free_list[i].len += len;
+    } else {
+        if (free_count == free_capacity) {
+            int new_capacity = free_capacity ? free_capacity * 2 : 64;
+            free_extent_t *grown = realloc(free_list, new_capacity * sizeof(free_extent_t));
+            if (!grown) {
+                // Leaking the range is safe; it just stays unused
+                fprintf(stderr, "[BLOCKMAP] Out of memory, leaking %lu blocks\n",
+                        (unsigned long)len);
+                return;
+            }
+            free_list = grown;
+            free_capacity = new_capacity;
+        }
+        memmove(&free_list[i + 1], &free_list[i], (free_count - i) * sizeof(free_extent_t));
+        free_list[i].pblk = pblk;
+        free_list[i].len = len;
+        free_count++;
+    }
+    free_blocks += len;
+}
+
+/*
+ * Free a range nothing references any more. With commit tracking on, the
+ * durable parts are only queued, as the last commit may still use them.
+ * Caller holds alloc_lock.
+ */
+static void retire_blocks(blk_t pblk, blk_t len) {
+    if (!tracking) {
+        release_blocks(pblk, len);
+        return;
+    }
+
+    blk_t end = pblk + len;
+    blk_t pos = pblk;
+    int i = fresh_find(pblk);
+    while (pos < end) {
+        free_extent_t *fe = i < fresh_list.count ? &fresh_list.list[i] : NULL;
+        if (!fe || fe->pblk > pos) {
+            blk_t gap_end = (fe && fe->pblk < end) ? fe->pblk : end;
+            deferred_add(&deferred_list, pos, gap_end - pos);
+            pos = gap_end;
+            continue;
+        }
+
+        // Fresh part: nothing durable knows it, free it now
+        blk_t fe_end = fe->pblk + fe->len;
+        blk_t cut_end = fe_end < end ? fe_end : end;
+        if (fe->pblk < pos && cut_end < fe_end) {
+            if (range_list_reserve(&fresh_list, 1) < 0) {
+                deferred_add(&deferred_list, pos, cut_end - pos);
+                pos = cut_end;
+                continue;
+            }
+            free_extent_t *list = fresh_list.list;
+            memmove(&list[i + 1], &list[i], (fresh_list.count - i) * sizeof(free_extent_t));
+            fresh_list.count++;
+            list[i].len = pos - list[i].pblk;
+            list[i + 1].pblk = cut_end;
+            list[i + 1].len = fe_end - cut_end;
+            i++;
+        } else if (fe->pblk < pos) {
+            fe->len = pos - fe->pblk;
+            i++;
+        } else if (cut_end < fe_end) {
+            fe->pblk = cut_end;
+            fe->len = fe_end - cut_end;
+        } else {
+            memmove(fe, fe + 1, (fresh_list.count - i - 1) * sizeof(free_extent_t));
+            fresh_list.count--;
+        }
+        release_blocks(pos, cut_end - pos);
+        pos = cut_end;
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Shared block references
+ * ----------------------------------------------------------------------------
+ */
+
+// Index of the first shared extent ending after pblk
+static int shared_find(blk_t pblk) {
+    int lo = 0, hi = shared_count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (shared_list[mid].pblk + shared_list[mid].len <= pblk) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+static int shared_reserve(int extra) {
+    if (shared_count + extra <= shared_capacity) return 0;
+    int new_capacity = shared_capacity ? shared_capacity * 2 : 64;
+    while (new_capacity < shared_count + extra) new_capacity *= 2;
+    shared_extent_t *grown = realloc(shared_list, new_capacity * sizeof(shared_extent_t));
+    if (!grown) return -ENOMEM;
+    shared_list = grown;
+    shared_capacity = new_capacity;
+    return 0;
+}
+
+// Make sure no shared extent straddles 'at'
+static int shared_split(blk_t at) {
+    int i = shared_find(at);
+    if (i >= shared_count || shared_list[i].pblk >= at) return 0;
+    if (shared_reserve(1) < 0) return -ENOMEM;
+
+    memmove(&shared_list[i + 1], &shared_list[i], (shared_count - i) * sizeof(shared_extent_t));
+    shared_list[i].len = at - shared_list[i].pblk;
+    shared_list[i + 1].pblk = at;
+    shared_list[i + 1].len -= shared_list[i].len;
+    shared_count++;
+    return 0;
+}
+
+// Re-merge touching extents with equal counts in [lo-1, hi]
+static void shared_merge(int lo, int hi) {
+    if (lo < 1) lo = 1;
+    if (hi > shared_count - 1) hi = shared_count - 1;
+    for (int i = hi; i >= lo; i--) {
+        shared_extent_t *prev = &shared_list[i - 1];
+        shared_extent_t *cur = &shared_list[i];
+        if (prev->pblk + prev->len == cur->pblk && prev->refs == cur->refs) {
+            prev->len += cur->len;
+            memmove(cur, cur + 1, (shared_count - i - 1) * sizeof(shared_extent_t));
+            shared_count--;
+        }
+    }
+}
+
+int block_ref(blk_t pblk, blk_t len) {
+    if (len == 0) return 0;
+    blk_t end = pblk + len;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (shared_split(pblk) < 0 || shared_split(end) < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -ENOMEM;
+    }
+
+    // Every gap between existing entries may need a new one
+    int first = shared_find(pblk);
+    int last = first;
+    while (last < shared_count && shared_list[last].pblk < end) last++;
+    if (shared_reserve(last - first + 1) < 0) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -ENOMEM;
+    }
+
+    blk_t pos = pblk;
+    int i = first;
+    while (pos < end) {
+        if (i < shared_count && shared_list[i].pblk == pos) {
+            shared_list[i].refs++;
+            pos += shared_list[i].len;
+        } else {
+            blk_t gap_end = (i < shared_count && shared_list[i].pblk < end) ? shared_list[i].pblk : end;
+            memmove(&shared_list[i + 1], &shared_list[i], (shared_count - i) * sizeof(shared_extent_t));
+            shared_list[i].pblk = pos;
+            shared_list[i].len = gap_end - pos;
+            shared_list[i].refs = 1;
+            shared_count++;
+            pos = gap_end;
+        }
+        i++;
+    }
+    shared_merge(first, i);
+
+    pthread_mutex_unlock(&alloc_lock);
+    return 0;
+}
+
+int block_shared(blk_t pblk, blk_t len, blk_t *run) {
+    pthread_mutex_lock(&alloc_lock);
+    int i = shared_find(pblk);
+    int shared = i < shared_count && shared_list[i].pblk <= pblk;
+    blk_t limit;
+    if (shared) {
+        limit = shared_list[i].pblk + shared_list[i].len - pblk;
+    } else {
+        limit = i < shared_count ? shared_list[i].pblk - pblk : len;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    *run = limit < len ? limit : len;
+    return shared;
+}
+
+void block_free(blk_t pblk, blk_t len) {
+    if (len == 0) return;
+    EVFS_PROBE2(block__free, pblk, len);
+    blk_t end = pblk + len;
+
+    pthread_mutex_lock(&alloc_lock);
+    if (shared_count == 0) {
+        retire_blocks(pblk, len);
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    if (shared_split(pblk) < 0 || shared_split(end) < 0) {
+        // Leaking the range is safe; it just stays unused
+        fprintf(stderr, "[BLOCKMAP] Out of memory, leaking %lu blocks\n",
+                (unsigned long)len);
+        pthread_mutex_unlock(&alloc_lock);
+        return;
+    }
+
+    // Shared parts lose one owner; the rest goes back to the free list
+    int first = shared_find(pblk);
+    int i = first;
+    blk_t pos = pblk;
+    while (pos < end) {
+        if (i < shared_count && shared_list[i].pblk == pos) {
+            pos += shared_list[i].len;
+            if (--shared_list[i].refs == 0) {
+                memmove(&shared_list[i], &shared_list[i + 1],
+                        (shared_count - i - 1) * sizeof(shared_extent_t));
+                shared_count--;
+            } else {
+                i++;
+            }
+        } else {
+            blk_t gap_end = (i < shared_count && shared_list[i].pblk < end) ? shared_list[i].pblk : end;
+            retire_blocks(pos, gap_end - pos);
+            pos = gap_end;
+        }
+    }
+    shared_merge(first, i);
+
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+blk_t block_shared_blocks(void) {
+    blk_t total = 0;
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < shared_count; i++) {
+        total += shared_list[i].len;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    return total;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Commit tracking
+ * ----------------------------------------------------------------------------
+ */
+
+void block_allocator_track(int on) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!on) {
+        for (int i = 0; i < deferred_list.count; i++) {
+            release_blocks(deferred_list.list[i].pblk, deferred_list.list[i].len);
+        }
+        for (int i = 0; i < committing_list.count; i++) {
+            release_blocks(committing_list.list[i].pblk, committing_list.list[i].len);
+        }
+    }
+    range_list_clear(&fresh_list);
+    range_list_clear(&deferred_list);
+    range_list_clear(&committing_list);
+    tracking = on;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+int block_durable(blk_t pblk, blk_t len, blk_t *run) {
+    pthread_mutex_lock(&alloc_lock);
+    if (!tracking) {
+        pthread_mutex_unlock(&alloc_lock);
+        *run = len;
+        return 0;
+    }
+    int i = fresh_find(pblk);
+    int durable = !(i < fresh_list.count && fresh_list.list[i].pblk <= pblk);
+    blk_t limit;
+    if (!durable) {
+        limit = fresh_list.list[i].pblk + fresh_list.list[i].len - pblk;
+    } else {
+        limit = i < fresh_list.count ? fresh_list.list[i].pblk - pblk : len;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+
+    *run = limit < len ? limit : len;
+    return durable;
+}
+
+void block_commit_begin(void) {
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < deferred_list.count; i++) {
+        deferred_add(&committing_list, deferred_list.list[i].pblk, deferred_list.list[i].len);
+    }
+    deferred_list.count = 0;
+    fresh_list.count = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+void block_commit_end(int committed) {
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < committing_list.count; i++) {
+        if (committed) {
+            release_blocks(committing_list.list[i].pblk, committing_list.list[i].len);
+        } else {
+            deferred_add(&deferred_list, committing_list.list[i].pblk, committing_list.list[i].len);
+        }
+    }
+    committing_list.count = 0;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+blk_t block_deferred_blocks(void) {
+    blk_t total = 0;
+    pthread_mutex_lock(&alloc_lock);
+    for (int i = 0; i < deferred_list.count; i++) total += deferred_list.list[i].len;
+    for (int i = 0; i < committing_list.count; i++) total += committing_list.list[i].len;
+    pthread_mutex_unlock(&alloc_lock);
+    return total;
+}
+
+void block_allocator_usage(blk_t *end, blk_t *nfree, int *nextents) {
+    pthread_mutex_lock(&alloc_lock);
+    *end = alloc_end;
+    *nfree = free_blocks;
+    *nextents = free_count;
+    pthread_mutex_unlock(&alloc_lock);
+}
+
+static int extent_cmp_pblk(const void *a, const void *b) {
+    const extent_t *x = a, *y = b;
+    return x->pblk < y->pblk ? -1 : x->pblk > y->pblk;
+}
+
+void block_allocator_rebuild(blk_t end, extent_t *used, int count) {
+    qsort(used, count, sizeof(extent_t), extent_cmp_pblk);
+
+    block_allocator_init(end);
+
+    // Every gap between used ranges goes back on the free list
+    blk_t pos = 0;
+    for (int i = 0; i < count; i++) {
+        if (used[i].pblk > pos) {
+            block_free(pos, used[i].pblk - pos);
+        }
+        if (used[i].pblk + used[i].len > pos) {
+            pos = used[i].pblk + used[i].len;
+        }
+    }
+    if (end > pos) {
+        block_free(pos, end - pos);
+    }
+}
+
+void block_allocator_load(blk_t end, const extent_t *free_ranges, int count) {
+    block_allocator_init(end);
+    for (int i = 0; i < count; i++) {
+        block_free(free_ranges[i].pblk, free_ranges[i].len);
+    }
+}
+
+int block_allocator_export(extent_t **out) {
+    pthread_mutex_lock(&alloc_lock);
+    // Deferred frees are free in the state being saved
+    int count = free_count + deferred_list.count + committing_list.count;
+    extent_t *ranges = calloc(count > 0 ? count : 1, sizeof(extent_t));
+    if (!ranges) {
+        pthread_mutex_unlock(&alloc_lock);
+        return -ENOMEM;
+    }
+    int n = 0;
+    for (int i = 0; i < free_count; i++, n++) {
+        ranges[n].pblk = free_list[i].pblk;
+        ranges[n].len = free_list[i].len;
+    }
+    for (int i = 0; i < deferred_list.count; i++, n++) {
+        ranges[n].pblk = deferred_list.list[i].pblk;
+        ranges[n].len = deferred_list.list[i].len;
+    }
+    for (int i = 0; i < committing_list.count; i++, n++) {
+        ranges[n].pblk = committing_list.list[i].pblk;
+        ranges[n].len = committing_list.list[i].len;
+    }
+    pthread_mutex_unlock(&alloc_lock);
+    *out = ranges;
+    return count;
+}
@@ -12,33 +12,23 @@
 int evfs_getattr(const char *path, struct stat *stbuf) {
     printf("[GETATTR] Called for path: %s\n", path);
     
-    memset(stbuf, 0, sizeof(struct stat));
+    if (is_snapshot_path(path)) {
+        return snapshot_getattr(path, stbuf);
+    }
     
     int idx = find_file_by_path(path);
     if (idx == -1) {
         printf("[GETATTR] Path not found: %s\n", path);
+        memset(stbuf, 0, sizeof(struct stat));
         return -ENOENT;
     }
     
     file_metadata_t *meta = &file_table[idx];
+    metadata_to_stat(meta, stbuf);
     
-    if (meta->type == FTYPE_DIR) {
-        stbuf->st_mode = S_IFDIR | meta->mode;
-        stbuf->st_nlink = 2;
-    } else {
-        stbuf->st_mode = S_IFREG | meta->mode;
-        stbuf->st_nlink = 1;
-        stbuf->st_size = meta->size;
-    }
-    
-    stbuf->st_uid = meta->uid;
-    stbuf->st_gid = meta->gid;
-    stbuf->st_atime = meta->atime;
-    stbuf->st_mtime = meta->mtime;
-    stbuf->st_ctime = meta->ctime;
-    
-    printf("[GETATTR] Success for: %s (type: %s, size: %ld)\n", 
-           path, meta->type == FTYPE_DIR ? "DIR" : "FILE", meta->size);
+    printf("[GETATTR] Success for: %s (type: %s, size: %ld, nlink: %u)\n", 
+           path, meta->type == FTYPE_DIR ? "DIR" : meta->type == FTYPE_SYMLINK ? "LINK" : "FILE",
+           meta->size, meta->nlink);
     
     return 0;
 }
@@ -46,10 +36,13 @@ int evfs_getattr(const char *path, struct stat *stbuf) {
 // Read directory contents
 int evfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
                  off_t offset, struct fuse_file_info *fi) {
-    (void)offset;  // Mark as intentionally unused
     (void)fi;      // Mark as intentionally unused
     
-    printf("[READDIR] Called for path: %s\n", path);
+    printf("[READDIR] Called for path: %s (offset: %ld)\n", path, offset);
+    
+    if (is_snapshot_path(path)) {
+        return snapshot_readdir(path, buf, filler, offset);
+    }
     
     int dir_idx = find_file_by_path(path);
     if (dir_idx == -1) {
@@ -62,34 +55,32 @@ int evfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
         return -ENOTDIR;
     }
     
-    // Add . and ..
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
-    
-    // Add all files in this directory
-    for (int i = 1; i < MAX_FILES; i++) {
-        if (file_table[i].is_used && file_table[i].parent_idx == dir_idx) {
-            printf("[READDIR] Adding entry: %s\n", file_table[i].name);
-            filler(buf, file_table[i].name, NULL, 0);
-        }
-    }
+    // ., .., the snapshot directory (in /) and all names in this directory
+    fill_directory(file_table, dentry_table, path, dir_idx,
+                   dir_idx == 0 ? FILL_SNAPSHOT_DIR : 0, buf, filler, offset);
     
     printf("[READDIR] Success for: %s\n", path);
     return 0;
 }
 
-// Create a new file
-int evfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
-    (void)fi;  // Mark as intentionally unused
-    
-    printf("[CREATE] Called for path: %s\n", path);
-    
+// The part of evfs_create() that runs under metadata_lock()
+static int create_file(const char *path, mode_t mode) {
     // Check if file already exists
     if (find_file_by_path(path) != -1) {
         printf("[CREATE] File already exists: %s\n", path);
         return -EEXIST;
     }
     
+    int parent = parent_directory(path);
+    if (parent < 0) {
+        printf("[CREATE] No parent directory for: %s\n", path);
+        return parent;
+    }
+    int ret = volume_check(&file_table[parent]);
+    if (ret < 0) {
+        return ret;
+    }
+    
     // Find free slot
     int idx = find_free_slot();
     if (idx == -1) {
@@ -97,32 +88,69 @@ int evfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
         return -ENOSPC;
     }
     
-    // Extract filename from path (assuming single-level for now)
-    const char *filename = path + 1; // skip leading '/'
+    // The caller owns the file and is charged for the inode
+    struct fuse_context *ctx = fuse_get_context();
+    ret = quota_charge(ctx->uid, ctx->gid, 0, 1);
+    if (ret < 0) {
+        printf("[CREATE] Inode quota exceeded for: %s\n", path);
+        return ret;
+    }
     
     // Create new file metadata
-    strncpy(file_table[idx].name, filename, MAX_FILENAME - 1);
+    memset(&file_table[idx], 0, sizeof(file_metadata_t));
     file_table[idx].type = FTYPE_FILE;
     file_table[idx].mode = mode;
-    file_table[idx].uid = getuid();
-    file_table[idx].gid = getgid();
+    file_table[idx].uid = ctx->uid;
+    file_table[idx].gid = ctx->gid;
     file_table[idx].atime = time(NULL);
     file_table[idx].mtime = time(NULL);
     file_table[idx].ctime = time(NULL);
     file_table[idx].size = 0;
     file_table[idx].is_used = 1;
-    file_table[idx].parent_idx = 0; // root directory
+    file_table[idx].volume = file_table[parent].volume;
+    
+    // Name it; dentry_add counts the link
+    ret = dentry_add(path, idx);
+    if (ret < 0) {
+        file_table[idx].is_used = 0;
+        quota_account(ctx->uid, ctx->gid, 0, -1);
+        printf("[CREATE] Cannot add name for: %s\n", path);
+        return ret;
+    }
+    storage_assign_volume(idx, file_table[idx].volume);
     
     printf("[CREATE] File created successfully: %s (index: %d)\n", path, idx);
     return 0;
 }
 
-// Open a file
-int evfs_open(const char *path, struct fuse_file_info *fi) {
+// Create a new file
+int evfs_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
     (void)fi;  // Mark as intentionally unused
     
+    printf("[CREATE] Called for path: %s\n", path);
+    
+    if (is_snapshot_path(path)) {
+        return strcmp(path, SNAPSHOT_DIR) == 0 ? -EEXIST : -EROFS;
+    }
+    
+    metadata_lock();
+    int ret = create_file(path, mode);
+    metadata_unlock();
+    return ret;
+}
+
+// Open a file
+int evfs_open(const char *path, struct fuse_file_info *fi) {    
     printf("[OPEN] Called for path: %s\n", path);
     
+    if (is_snapshot_path(path)) {
+        // Snapshots are read-only
+        if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+            return -EROFS;
+        }
+        return snapshot_open(path);
+    }
+    
     int idx = find_file_by_path(path);
     if (idx == -1) {
         printf("[OPEN] File not found: %s\n", path);
@@ -134,6 +162,12 @@ int evfs_open(const char *path, struct fuse_file_info *fi) {
         return -EISDIR;
     }
     
+    int ret = volume_check(&file_table[idx]);
+    if (ret < 0) {
+        printf("[OPEN] Volume of %s is locked\n", path);
+        return ret;
+    }
+    
     printf("[OPEN] Success for: %s\n", path);
     return 0;
 }
@@ -150,7 +184,39 @@ void *evfs_init(struct fuse_conn_info *conn) {
         return NULL;
     }
     
+    // Existing data must be read with the engine it was written with,
+    // or with one of the same block overhead it can be re-encrypted to
+    static char stored[32];
+    if (stored_cipher(stored, sizeof(stored)) == 0) {
+        if (!evfs_options.cipher || strcmp(evfs_options.cipher, "auto") == 0) {
+            evfs_options.cipher = stored;
+        } else if (strcmp(evfs_options.cipher, stored) != 0) {
+            int from = evfs_crypto_engine_id(stored);
+            int to = evfs_crypto_engine_id(evfs_options.cipher);
+            if (from < 0 || to < 0 ||
+                evfs_crypto_engine_overhead(from) != evfs_crypto_engine_overhead(to)) {
+                fprintf(stderr, "[INIT] File system was written with %s, not %s\n",
+                        stored, evfs_options.cipher);
+                return NULL;
+            }
+        }
+    }
+    if (evfs_crypto_select_engine(evfs_options.cipher) != 0) {
+        fprintf(stderr, "[INIT] Failed to select cipher engine\n");
+        return NULL;
+    }
+    
     init_filesystem();
+    unlock_volumes_from_options();
+    if (initialized && wal_start() < 0) {
+        fprintf(stderr, "[INIT] Write-ahead log unavailable; changes are saved at unmount only\n");
+    }
+    if (initialized) {
+        start_reencryption();
+    }
+    if (initialized && evfs_options.record_file) {
+        trace_start(evfs_options.record_file);
+    }
     return NULL;
 }
 // Destroy filesystem
@@ -158,9 +224,23 @@ void evfs_destroy(void *private_data) {
     (void)private_data;
     
     printf("[DESTROY] Cleaning up EVFS...\n");
+    trace_stop();
     
     // Print final file table state
     print_file_table();
+    print_inode_cache_stats();
+    
+    // Finish pending snapshot deletions while storage is still up
+    cleanup_snapshots();
+    
+    // No block may move once the final state is being written
+    stop_reencryption();
+    
+    // Persist file table and block maps for the next mount
+    wal_stop();
+    if (initialized) {
+        save_metadata();
+    }
     
     // Cleanup storage
     cleanup_storage();
@@ -174,6 +254,10 @@ void evfs_destroy(void *private_data) {
 int evfs_utimens(const char *path, const struct timespec ts[2]) {
     printf("[UTIMENS] Called for path: %s\n", path);
     
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
     int idx = find_file_by_path(path);
     if (idx == -1) {
         printf("[UTIMENS] File not found: %s\n", path);
@@ -195,6 +279,249 @@ int evfs_utimens(const char *path, const struct timespec ts[2]) {
     return 0;
 }
 
+// Set an extended attribute
+int evfs_setxattr(const char *path, const char *name, const char *value,
+                  size_t size, int flags) {
+    printf("[SETXATTR] Called for path: %s (%s, %zu bytes)\n", path, name, size);
+    
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
+    int idx = find_file_by_path(path);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    if (idx == 0 && is_quota_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? quota_setxattr(name, value, size) : -EPERM;
+    }
+    if (idx == 0 && is_volume_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? volume_setxattr(name, value, size) : -EPERM;
+    }
+    if (idx == 0 && is_iosched_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? iosched_setxattr(name, value, size) : -EPERM;
+    }
+    int ret = volume_check(&file_table[idx]);
+    return ret < 0 ? ret : xattr_set(idx, name, value, size, flags);
+}
+
+// Get an extended attribute
+int evfs_getxattr(const char *path, const char *name, char *value, size_t size) {
+    if (is_snapshot_path(path)) {
+        return snapshot_getxattr(path, name, value, size);
+    }
+    
+    int idx = find_file_by_path(path);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    if (idx == 0 && is_quota_xattr(name)) {
+        return quota_getxattr(name, value, size);
+    }
+    if (idx == 0 && is_volume_xattr(name)) {
+        return volume_getxattr(name, value, size);
+    }
+    if (idx == 0 && is_iosched_xattr(name)) {
+        return iosched_getxattr(name, value, size);
+    }
+    int ret = volume_check(&file_table[idx]);
+    return ret < 0 ? ret : xattr_get(idx, name, value, size);
+}
+
+// List extended attribute names
+int evfs_listxattr(const char *path, char *list, size_t size) {
+    if (is_snapshot_path(path)) {
+        return snapshot_listxattr(path, list, size);
+    }
+    
+    int idx = find_file_by_path(path);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    int ret = volume_check(&file_table[idx]);
+    return ret < 0 ? ret : xattr_list(idx, list, size);
+}
+
+// Remove an extended attribute
+int evfs_removexattr(const char *path, const char *name) {
+    printf("[REMOVEXATTR] Called for path: %s (%s)\n", path, name);
+    
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
+    int idx = find_file_by_path(path);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    if (idx == 0 && is_quota_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? quota_removexattr(name) : -EPERM;
+    }
+    if (idx == 0 && is_volume_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? volume_removexattr(name) : -EPERM;
+    }
+    if (idx == 0 && is_iosched_xattr(name)) {
+        return fuse_get_context()->uid == 0 ? iosched_removexattr(name) : -EPERM;
+    }
+    int ret = volume_check(&file_table[idx]);
+    return ret < 0 ? ret : xattr_remove(idx, name);
+}
+
+// File system statistics. Everything comes from counters the allocator
+// and the create/unlink paths keep current, so df costs O(1)
+int evfs_statfs(const char *path, struct statvfs *stbuf) {
+    (void)path;
+    blk_t total, avail;
+    storage_capacity(&total, &avail);
+    uint64_t inodes = quota_inodes_used();
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+    stbuf->f_bsize = BLOCK_SIZE;
+    stbuf->f_frsize = BLOCK_SIZE;
+    stbuf->f_blocks = total;
+    stbuf->f_bfree = avail;
+    stbuf->f_bavail = avail;
+    stbuf->f_files = MAX_FILES;
+    stbuf->f_ffree = inodes < MAX_FILES ? MAX_FILES - inodes : 0;
+    stbuf->f_favail = stbuf->f_ffree;
+    stbuf->f_namemax = MAX_FILENAME - 1;
+
+    printf("[STATFS] %lu/%lu blocks free, %lu/%d inodes free\n",
+           (unsigned long)avail, (unsigned long)total,
+           (unsigned long)stbuf->f_ffree, MAX_FILES);
+    return 0;
+}
+
+// All changes reach the disk together, by a commit of the log, so
+// fsync and fdatasync are the same; concurrent callers share a commit
+int evfs_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    (void)datasync;
+    (void)fi;
+    printf("[FSYNC] Called for path: %s\n", path);
+
+    if (is_snapshot_path(path)) {
+        return 0;
+    }
+    if (find_file_by_path(path) == -1) {
+        return -ENOENT;
+    }
+    return wal_sync() < 0 ? -EIO : 0;
+}
+
+/*
+ * ============================================================================
+ * TRACED ENTRY POINTS
+ * ============================================================================
+ *
+ * FUSE calls each operation through one of these, between an op__start
+ * probe (operation name, path, size, offset) and an op__done probe
+ * (operation name, path, result); see evfs_probes.h. With --record the
+ * operation also goes to the workload trace (evfs_trace.c). Inode pages
+ * stay in memory while it runs (inode_cache_enter()).
+ */
+
+#define TRACED(op, path, size, offset, call)                                  \
+    do {                                                                      \
+        trace_call_t tc;                                                      \
+        EVFS_PROBE4(op__start, trace_op_names[op], path, (size_t)(size),      \
+                    (off_t)(offset));                                         \
+        inode_cache_enter();                                                  \
+        trace_begin(&tc, path);                                               \
+        int ret = call;                                                       \
+        trace_end(&tc, op, path, size, offset, ret);                          \
+        inode_cache_leave();                                                  \
+        EVFS_PROBE3(op__done, trace_op_names[op], path, ret);                 \
+        return ret;                                                           \
+    } while (0)
+
+static int traced_getattr(const char *path, struct stat *stbuf) {
+    TRACED(TRACE_GETATTR, path, 0, 0, evfs_getattr(path, stbuf));
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+                          off_t offset, struct fuse_file_info *fi) {
+    TRACED(TRACE_READDIR, path, 0, offset, evfs_readdir(path, buf, filler, offset, fi));
+}
+
+static int traced_create(const char *path, mode_t mode, struct fuse_file_info *fi) {
+    TRACED(TRACE_CREATE, path, 0, 0, evfs_create(path, mode, fi));
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi) {
+    TRACED(TRACE_OPEN, path, 0, 0, evfs_open(path, fi));
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset,
+                       struct fuse_file_info *fi) {
+    TRACED(TRACE_READ, path, size, offset, evfs_read(path, buf, size, offset, fi));
+}
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset,
+                        struct fuse_file_info *fi) {
+    TRACED(TRACE_WRITE, path, size, offset, evfs_write(path, buf, size, offset, fi));
+}
+
+static int traced_truncate(const char *path, off_t size) {
+    TRACED(TRACE_TRUNCATE, path, 0, size, evfs_truncate(path, size));
+}
+
+static int traced_unlink(const char *path) {
+    TRACED(TRACE_UNLINK, path, 0, 0, evfs_unlink(path));
+}
+
+static int traced_mkdir(const char *path, mode_t mode) {
+    TRACED(TRACE_MKDIR, path, 0, 0, evfs_mkdir(path, mode));
+}
+
+static int traced_rmdir(const char *path) {
+    TRACED(TRACE_RMDIR, path, 0, 0, evfs_rmdir(path));
+}
+
+static int traced_rename(const char *from, const char *to) {
+    TRACED(TRACE_RENAME, from, 0, 0, evfs_rename(from, to));
+}
+
+static int traced_link(const char *from, const char *to) {
+    TRACED(TRACE_LINK, to, 0, 0, evfs_link(from, to));
+}
+
+static int traced_symlink(const char *target, const char *linkpath) {
+    TRACED(TRACE_SYMLINK, linkpath, strlen(target), 0, evfs_symlink(target, linkpath));
+}
+
+static int traced_readlink(const char *path, char *buf, size_t size) {
+    TRACED(TRACE_READLINK, path, size, 0, evfs_readlink(path, buf, size));
+}
+
+static int traced_utimens(const char *path, const struct timespec ts[2]) {
+    TRACED(TRACE_UTIMENS, path, 0, 0, evfs_utimens(path, ts));
+}
+
+static int traced_setxattr(const char *path, const char *name, const char *value,
+                           size_t size, int flags) {
+    TRACED(TRACE_SETXATTR, path, size, 0, evfs_setxattr(path, name, value, size, flags));
+}
+
+static int traced_getxattr(const char *path, const char *name, char *value, size_t size) {
+    TRACED(TRACE_GETXATTR, path, size, 0, evfs_getxattr(path, name, value, size));
+}
+
+static int traced_listxattr(const char *path, char *list, size_t size) {
+    TRACED(TRACE_LISTXATTR, path, size, 0, evfs_listxattr(path, list, size));
+}
+
+static int traced_removexattr(const char *path, const char *name) {
+    TRACED(TRACE_REMOVEXATTR, path, 0, 0, evfs_removexattr(path, name));
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf) {
+    TRACED(TRACE_STATFS, path, 0, 0, evfs_statfs(path, stbuf));
+}
+
+static int traced_fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+    TRACED(TRACE_FSYNC, path, 0, 0, evfs_fsync(path, datasync, fi));
+}
+
 /*
  * ============================================================================
  * FUSE OPERATIONS STRUCTURE
@@ -204,16 +531,25 @@ int evfs_utimens(const char *path, const struct timespec ts[2]) {
 struct fuse_operations evfs_oper = {
     .init       = evfs_init,
     .destroy    = evfs_destroy,
-    .getattr    = evfs_getattr,
-    .readdir    = evfs_readdir,
-    .create     = evfs_create,
-    .open       = evfs_open,
-    .read       = evfs_read,
-    .write      = evfs_write,
-    .truncate   = evfs_truncate,
-    .unlink     = evfs_unlink,
-    .mkdir      = evfs_mkdir,
-    .rmdir      = evfs_rmdir,
-    .rename     = evfs_rename,
-    .utimens    = evfs_utimens,
+    .getattr    = traced_getattr,
+    .readdir    = traced_readdir,
+    .create     = traced_create,
+    .open       = traced_open,
+    .read       = traced_read,
+    .write      = traced_write,
+    .truncate   = traced_truncate,
+    .unlink     = traced_unlink,
+    .mkdir      = traced_mkdir,
+    .rmdir      = traced_rmdir,
+    .rename     = traced_rename,
+    .link       = traced_link,
+    .symlink    = traced_symlink,
+    .readlink   = traced_readlink,
+    .utimens    = traced_utimens,
+    .setxattr   = traced_setxattr,
+    .getxattr   = traced_getxattr,
+    .listxattr  = traced_listxattr,
+    .removexattr = traced_removexattr,
+    .statfs     = traced_statfs,
+    .fsync      = traced_fsync,
 };
\ No newline at end of file
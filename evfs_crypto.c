@@ -1,13 +1,153 @@
 #include "evfs_crypto.h"
+#include "evfs_probes.h"
 #include <openssl/evp.h>
+#include <openssl/hmac.h>
 #include <openssl/rand.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#elif defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
 
-// AES-256 requires 32-byte key
-static unsigned char aes_key[32];
+/*
+ * Keyring: storage key material per key id. Id 0 is the built-in key set
+ * up by evfs_crypto_init(); the others belong to volumes and are derived
+ * from their passphrases. A block's key id is the top bits of its file_id.
+ */
+typedef struct {
+    // AES-256 requires 32-byte key
+    unsigned char aes_key[32];
+    // 512-bit key material for the block engines (XTS needs two AES-256 keys)
+    unsigned char master_key[64];
+    // CBC-ESSIV salt key, SHA-256(aes_key): IVs must not come from the data key
+    unsigned char essiv_key[32];
+    int present;
+} keyring_entry_t;
+
+static keyring_entry_t keyring[EVFS_MAX_KEYS];
+// Readers: every crypto call; writers: adding/removing keys
+static pthread_rwlock_t keyring_lock = PTHREAD_RWLOCK_INITIALIZER;
 // AES block size is 16 bytes
 static unsigned char aes_iv[16];
+// Bumped on every (re)key so per-thread contexts know to re-key
+static int key_generation = 0;
+// Keys for metadata names (sealing, lookup index), derived from key 0
+static unsigned char name_key[64];
+static unsigned char index_key[32];
+
+// PBKDF2-HMAC-SHA512 rounds for volume passphrases
+#define KDF_ITERATIONS 100000
+
+/*
+ * ============================================================================
+ * BLOCK CIPHER ENGINES
+ * ============================================================================
+ *
+ * Storage blocks are encrypted by one of several engines. All of them are
+ * keyed once per thread and then only re-IV'd per block. Length-preserving
+ * engines (XTS, CBC-ESSIV) use the whole block for data; AEAD engines
+ * (GCM, ChaCha20-Poly1305) reserve a trailer for nonce and tag:
+ *
+ *   [ ciphertext (size - 28) | nonce (12) | tag (16) ]
+ */
+
+#define AEAD_NONCE_LEN 12
+#define AEAD_TAG_LEN 16
+#define AEAD_OVERHEAD (AEAD_NONCE_LEN + AEAD_TAG_LEN)
+
+// Micro-benchmark duration per engine at startup
+#define BENCH_NSEC (20 * 1000 * 1000L)
+
+// Vectored calls prepare IVs/nonces for up to this many blocks at once
+#define VEC_BATCH 64
+
+// Engine ids are recorded in the metadata (data not re-encrypted yet): append only
+enum { ENGINE_AES_XTS, ENGINE_AES_CBC, ENGINE_AES_GCM, ENGINE_CHACHA20, NUM_ENGINES };
+
+typedef struct cipher_engine cipher_engine_t;
+
+// How an engine turns the (file_id, block_no) tweak into its IV
+typedef enum {
+    IV_TWEAK,   // tweak used as-is (XTS)
+    IV_ESSIV,   // IV = AES-ECB(SHA-256(key), tweak), derived for a whole batch at once
+    IV_NONCE    // random nonce stored in the block trailer; tweak is AAD
+} iv_mode_t;
+
+// Per-thread OpenSSL contexts, one enc/dec pair per engine and key
+typedef struct {
+    int generation;
+    EVP_CIPHER_CTX *enc[NUM_ENGINES][EVFS_MAX_KEYS];
+    EVP_CIPHER_CTX *dec[NUM_ENGINES][EVFS_MAX_KEYS];
+    EVP_CIPHER_CTX *essiv[EVFS_MAX_KEYS];  // AES-ECB used to derive CBC IVs
+} thread_ctx_t;
+
+// Encrypt/decrypt one block from src to dst (may alias) with a prepared IV
+typedef int (*engine_crypt_fn)(const cipher_engine_t *eng, EVP_CIPHER_CTX *ctx,
+                               const char *src, char *dst, size_t size,
+                               const unsigned char *tweak, const unsigned char *iv, int enc);
+
+// Which part of a keyring entry an engine is keyed with
+typedef enum {
+    KEY_MASTER,
+    KEY_AES
+} key_kind_t;
+
+struct cipher_engine {
+    const char *name;
+    const EVP_CIPHER *(*cipher)(void);
+    key_kind_t key;
+    size_t overhead;  // bytes per block not available for data
+    iv_mode_t iv_mode;
+    engine_crypt_fn crypt;
+};
+
+static int derive_name_keys(const keyring_entry_t *k);
+static int stream_crypt(const cipher_engine_t *, EVP_CIPHER_CTX *, const char *, char *,
+                        size_t, const unsigned char *, const unsigned char *, int);
+static int aead_crypt(const cipher_engine_t *, EVP_CIPHER_CTX *, const char *, char *,
+                      size_t, const unsigned char *, const unsigned char *, int);
+static void detect_cpu_features(void);
+
+static cipher_engine_t engines[NUM_ENGINES] = {
+    [ENGINE_AES_XTS]  = { "aes-256-xts", EVP_aes_256_xts, KEY_MASTER, 0,
+                          IV_TWEAK, stream_crypt },
+    [ENGINE_AES_CBC]  = { "aes-256-cbc-essiv", EVP_aes_256_cbc, KEY_AES, 0,
+                          IV_ESSIV, stream_crypt },
+    [ENGINE_AES_GCM]  = { "aes-256-gcm", EVP_aes_256_gcm, KEY_MASTER, AEAD_OVERHEAD,
+                          IV_NONCE, aead_crypt },
+    [ENGINE_CHACHA20] = { "chacha20-poly1305", EVP_chacha20_poly1305, KEY_MASTER,
+                          AEAD_OVERHEAD, IV_NONCE, aead_crypt },
+};
+
+// CPU features relevant to the engines
+typedef struct {
+    int aes;        // AES-NI / ARMv8 AES
+    int pclmul;     // carry-less multiply (GHASH)
+    int avx2;
+    int vaes;       // vector AES (AVX2/AVX-512 wide)
+    int vpclmul;
+} cpu_features_t;
+
+typedef struct {
+    unsigned long blocks_encrypted;
+    unsigned long blocks_decrypted;
+    unsigned long auth_failures;
+} crypto_stats_t;
+
+static int active_engine = ENGINE_AES_CBC;
+static int auto_selected = 0;
+static double engine_gbps[NUM_ENGINES];  // 0 = not benchmarked
+static cpu_features_t cpu;
+static crypto_stats_t cstats;
+
+static pthread_key_t tctx_key;
+static pthread_once_t tctx_once = PTHREAD_ONCE_INIT;
 
 int evfs_crypto_init(void) {
     printf("[CRYPTO] Initializing AES-256 encryption...\n");
@@ -33,12 +173,28 @@ int evfs_crypto_init(void) {
         return -1;
     }
     
+    keyring_entry_t *k = &keyring[0];
     unsigned int len;
-    if (EVP_DigestFinal_ex(mdctx, aes_key, &len) != 1) {
+    if (EVP_DigestFinal_ex(mdctx, k->aes_key, &len) != 1) {
         EVP_MD_CTX_free(mdctx);
         return -1;
     }
     EVP_MD_CTX_free(mdctx);
+
+    // Block engines get 512 bits of key material
+    if (EVP_Digest(passphrase, strlen(passphrase), k->master_key, &len,
+                   EVP_sha512(), NULL) != 1) {
+        return -1;
+    }
+    if (evfs_checksum(k->aes_key, sizeof(k->aes_key), k->essiv_key) != 0) {
+        return -1;
+    }
+    k->present = 1;
+    key_generation++;
+    if (derive_name_keys(k) != 0) {
+        return -1;
+    }
+    detect_cpu_features();
     
     // Use a fixed IV for simplicity (NOT recommended for production)
     // In production, generate random IV per encryption and store it
@@ -52,12 +208,94 @@ void evfs_crypto_cleanup(void) {
     printf("[CRYPTO] Cleaning up crypto module...\n");
     
     // Zero out sensitive key material
-    memset(aes_key, 0, sizeof(aes_key));
+    pthread_rwlock_wrlock(&keyring_lock);
+    memset(keyring, 0, sizeof(keyring));
     memset(aes_iv, 0, sizeof(aes_iv));
+    memset(name_key, 0, sizeof(name_key));
+    memset(index_key, 0, sizeof(index_key));
+    key_generation++;
+    pthread_rwlock_unlock(&keyring_lock);
     
     printf("[CRYPTO] Crypto cleanup complete\n");
 }
 
+/*
+ * ============================================================================
+ * KEYRING
+ * ============================================================================
+ */
+
+// Check value identifying a key without revealing it
+static int key_check(const keyring_entry_t *k, unsigned char *check) {
+    static const char label[] = "evfs volume key check";
+    unsigned char in[sizeof(label) + sizeof(k->master_key)];
+    memcpy(in, label, sizeof(label));
+    memcpy(in + sizeof(label), k->master_key, sizeof(k->master_key));
+    int ret = evfs_checksum(in, sizeof(in), check);
+    memset(in, 0, sizeof(in));
+    return ret;
+}
+
+int evfs_crypto_add_key(uint32_t key_id, const char *passphrase, const unsigned char *salt,
+                        unsigned char *check, int verify) {
+    if (key_id == 0 || key_id >= EVFS_MAX_KEYS || !passphrase) return -1;
+
+    // One PBKDF2 run yields both the 512-bit and the 256-bit key
+    unsigned char out[64 + 32];
+    if (PKCS5_PBKDF2_HMAC(passphrase, strlen(passphrase), salt, EVFS_SALT_LEN,
+                          KDF_ITERATIONS, EVP_sha512(), sizeof(out), out) != 1) {
+        return -1;
+    }
+    keyring_entry_t k;
+    memcpy(k.master_key, out, sizeof(k.master_key));
+    memcpy(k.aes_key, out + sizeof(k.master_key), sizeof(k.aes_key));
+    k.present = 1;
+    memset(out, 0, sizeof(out));
+
+    unsigned char sum[EVFS_CHECKSUM_LEN];
+    int ret = evfs_checksum(k.aes_key, sizeof(k.aes_key), k.essiv_key);
+    if (ret == 0) ret = key_check(&k, sum);
+    if (ret == 0 && verify && memcmp(sum, check, EVFS_CHECKSUM_LEN) != 0) {
+        ret = -2;
+    }
+    if (ret == 0) {
+        if (!verify) memcpy(check, sum, EVFS_CHECKSUM_LEN);
+        pthread_rwlock_wrlock(&keyring_lock);
+        keyring[key_id] = k;
+        key_generation++;
+        pthread_rwlock_unlock(&keyring_lock);
+        printf("[CRYPTO] Key %u added to the keyring\n", key_id);
+    }
+    memset(&k, 0, sizeof(k));
+    return ret;
+}
+
+void evfs_crypto_remove_key(uint32_t key_id) {
+    if (key_id == 0 || key_id >= EVFS_MAX_KEYS) return;
+    pthread_rwlock_wrlock(&keyring_lock);
+    memset(&keyring[key_id], 0, sizeof(keyring_entry_t));
+    key_generation++;
+    pthread_rwlock_unlock(&keyring_lock);
+    printf("[CRYPTO] Key %u removed from the keyring\n", key_id);
+}
+
+int evfs_crypto_has_key(uint32_t key_id) {
+    if (key_id >= EVFS_MAX_KEYS) return 0;
+    pthread_rwlock_rdlock(&keyring_lock);
+    int present = keyring[key_id].present;
+    pthread_rwlock_unlock(&keyring_lock);
+    return present;
+}
+
+int evfs_crypto_random(void *buf, size_t len) {
+    return RAND_bytes(buf, len) == 1 ? 0 : -1;
+}
+
+int evfs_checksum(const void *data, size_t size, unsigned char *out) {
+    unsigned int len = EVFS_CHECKSUM_LEN;
+    return EVP_Digest(data, size, out, &len, EVP_sha256(), NULL) == 1 ? 0 : -1;
+}
+
 int evfs_encrypt_buffer(char *buf, size_t size) {
     if (!buf || size == 0) return -1;
     
@@ -85,7 +323,7 @@ int evfs_encrypt_buffer(char *buf, size_t size) {
     }
     
     // Initialize encryption with AES-256-CBC
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, aes_key, aes_iv) != 1) {
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, keyring[0].aes_key, aes_iv) != 1) {
         fprintf(stderr, "[CRYPTO] Encryption init failed\n");
         EVP_CIPHER_CTX_free(ctx);
         return -1;
@@ -134,7 +372,7 @@ int evfs_decrypt_buffer(char *buf, size_t size) {
     }
     
     // Initialize decryption with AES-256-CBC
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, aes_key, aes_iv) != 1) {
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, keyring[0].aes_key, aes_iv) != 1) {
         fprintf(stderr, "[CRYPTO] Decryption init failed\n");
         EVP_CIPHER_CTX_free(ctx);
         return -1;
@@ -165,3 +403,494 @@ int evfs_decrypt_buffer(char *buf, size_t size) {
     printf("[CRYPTO] Decrypted %zu bytes\n", decrypt_size);
     return 0;
 }
+
+/*
+ * Per-thread context management
+ */
+static void thread_ctx_free(void *arg) {
+    thread_ctx_t *t = arg;
+    for (int k = 0; k < EVFS_MAX_KEYS; k++) {
+        for (int i = 0; i < NUM_ENGINES; i++) {
+            EVP_CIPHER_CTX_free(t->enc[i][k]);
+            EVP_CIPHER_CTX_free(t->dec[i][k]);
+        }
+        EVP_CIPHER_CTX_free(t->essiv[k]);
+    }
+    free(t);
+}
+
+static void tctx_key_create(void) {
+    pthread_key_create(&tctx_key, thread_ctx_free);
+}
+
+static thread_ctx_t *get_thread_ctx(void) {
+    pthread_once(&tctx_once, tctx_key_create);
+
+    thread_ctx_t *t = pthread_getspecific(tctx_key);
+    if (t && t->generation != key_generation) {
+        // Key changed since these contexts were set up
+        thread_ctx_free(t);
+        pthread_setspecific(tctx_key, NULL);
+        t = NULL;
+    }
+    if (!t) {
+        t = calloc(1, sizeof(*t));
+        if (!t) return NULL;
+        t->generation = key_generation;
+        pthread_setspecific(tctx_key, t);
+    }
+    return t;
+}
+
+// Key material of keyring entry 'key' an engine uses. Caller holds keyring_lock
+static const unsigned char *engine_key(const cipher_engine_t *eng, uint32_t key) {
+    return eng->key == KEY_AES ? keyring[key].aes_key : keyring[key].master_key;
+}
+
+// Keyed context for (engine, key, direction), created on first use
+static EVP_CIPHER_CTX *engine_ctx(thread_ctx_t *t, int id, uint32_t key, int enc) {
+    EVP_CIPHER_CTX **slot = enc ? &t->enc[id][key] : &t->dec[id][key];
+    if (*slot) return *slot;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (!ctx) return NULL;
+    if (EVP_CipherInit_ex(ctx, engines[id].cipher(), NULL, engine_key(&engines[id], key),
+                          NULL, enc) != 1) {
+        EVP_CIPHER_CTX_free(ctx);
+        return NULL;
+    }
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    *slot = ctx;
+    return ctx;
+}
+
+/*
+ * Length-preserving engines: AES-256-XTS (the standard disk cipher, IV =
+ * tweak) and AES-256-CBC with ESSIV IVs. Only the IV changes per block.
+ */
+static int stream_crypt(const cipher_engine_t *eng, EVP_CIPHER_CTX *ctx,
+                        const char *src, char *dst, size_t size,
+                        const unsigned char *tweak, const unsigned char *iv, int enc) {
+    (void)eng;
+    (void)tweak;
+    int len, final_len = 0;
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, iv, enc) != 1 ||
+        EVP_CipherUpdate(ctx, (unsigned char *)dst, &len,
+                         (const unsigned char *)src, size) != 1) {
+        return -1;
+    }
+    // XTS is one-shot; CBC needs the (empty, unpadded) final
+    if (eng->iv_mode == IV_ESSIV &&
+        EVP_CipherFinal_ex(ctx, (unsigned char *)dst + len, &final_len) != 1) {
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * AEAD engines (AES-256-GCM, ChaCha20-Poly1305). A fresh random nonce is
+ * used for every write, the tweak is bound in as AAD, and nonce + tag
+ * live in the block trailer. Decryption fails if the block was altered.
+ */
+static int aead_crypt(const cipher_engine_t *eng, EVP_CIPHER_CTX *ctx,
+                      const char *src, char *dst, size_t size,
+                      const unsigned char *tweak, const unsigned char *iv, int enc) {
+    if (size <= eng->overhead) return -1;
+
+    size_t data_len = size - eng->overhead;
+    unsigned char tag[AEAD_TAG_LEN];
+    unsigned char nonce[AEAD_NONCE_LEN];
+
+    if (enc) {
+        memcpy(nonce, iv, AEAD_NONCE_LEN);
+    } else {
+        // Read trailer before an in-place decrypt can touch it
+        memcpy(nonce, src + data_len, AEAD_NONCE_LEN);
+        memcpy(tag, src + data_len + AEAD_NONCE_LEN, AEAD_TAG_LEN);
+    }
+
+    int len, final_len;
+    if (EVP_CipherInit_ex(ctx, NULL, NULL, NULL, nonce, enc) != 1 ||
+        EVP_CipherUpdate(ctx, NULL, &len, tweak, 16) != 1 ||
+        EVP_CipherUpdate(ctx, (unsigned char *)dst, &len,
+                         (const unsigned char *)src, data_len) != 1) {
+        return -1;
+    }
+
+    if (enc) {
+        if (EVP_CipherFinal_ex(ctx, (unsigned char *)dst + len, &final_len) != 1 ||
+            EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_GET_TAG, AEAD_TAG_LEN, tag) != 1) {
+            return -1;
+        }
+        memcpy(dst + data_len, nonce, AEAD_NONCE_LEN);
+        memcpy(dst + data_len + AEAD_NONCE_LEN, tag, AEAD_TAG_LEN);
+        return 0;
+    }
+
+    if (EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_AEAD_SET_TAG, AEAD_TAG_LEN, tag) != 1) {
+        return -1;
+    }
+    if (EVP_CipherFinal_ex(ctx, (unsigned char *)dst + len, &final_len) != 1) {
+        __atomic_fetch_add(&cstats.auth_failures, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    memset(dst + data_len, 0, eng->overhead);
+    return 0;
+}
+
+static void make_tweak(unsigned char tweak[16], uint64_t file_id, uint64_t block_no) {
+    for (int i = 0; i < 8; i++) {
+        tweak[i] = (unsigned char)(file_id >> (8 * i));
+        tweak[8 + i] = (unsigned char)(block_no >> (8 * i));
+    }
+}
+
+/*
+ * Run a vector of blocks, all under keyring entry 'key' (held by the caller
+ * with keyring_lock), through engine 'id'. Per-call costs (thread
+ * context lookup, keyed context fetch, IV/nonce generation, counters) are
+ * paid once per batch of VEC_BATCH blocks instead of once per block:
+ * ESSIV IVs for the whole batch come from a single ECB pass (which AES-NI
+ * pipelines across blocks) and AEAD nonces from a single RAND_bytes call.
+ */
+static int engine_crypt_vec(int id, uint32_t key, const evfs_crypto_vec_t *vec, int count,
+                            int enc) {
+    const cipher_engine_t *eng = &engines[id];
+
+    thread_ctx_t *t = get_thread_ctx();
+    if (!t) return -1;
+    EVP_CIPHER_CTX *ctx = engine_ctx(t, id, key, enc);
+    if (!ctx) return -1;
+
+    unsigned char tweaks[VEC_BATCH * 16];
+    unsigned char ivs[VEC_BATCH * 16];
+
+    for (int base = 0; base < count; base += VEC_BATCH) {
+        int n = count - base < VEC_BATCH ? count - base : VEC_BATCH;
+
+        for (int i = 0; i < n; i++) {
+            const evfs_crypto_vec_t *v = &vec[base + i];
+            if (!v->src || !v->dst || v->len == 0 || v->len % 16 != 0) return -1;
+            make_tweak(tweaks + i * 16, v->file_id, v->block_no);
+        }
+
+        const unsigned char *iv_base = ivs;
+        int iv_stride = 16;
+        switch (eng->iv_mode) {
+        case IV_TWEAK:
+            iv_base = tweaks;
+            break;
+        case IV_ESSIV: {
+            if (!t->essiv[key]) {
+                t->essiv[key] = EVP_CIPHER_CTX_new();
+                if (!t->essiv[key] ||
+                    EVP_EncryptInit_ex(t->essiv[key], EVP_aes_256_ecb(), NULL,
+                                       keyring[key].essiv_key, NULL) != 1) {
+                    return -1;
+                }
+                EVP_CIPHER_CTX_set_padding(t->essiv[key], 0);
+            }
+            int len;
+            if (EVP_EncryptUpdate(t->essiv[key], ivs, &len, tweaks, n * 16) != 1) return -1;
+            break;
+        }
+        case IV_NONCE:
+            iv_stride = AEAD_NONCE_LEN;
+            if (enc && RAND_bytes(ivs, n * AEAD_NONCE_LEN) != 1) return -1;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            const evfs_crypto_vec_t *v = &vec[base + i];
+            if (eng->crypt(eng, ctx, v->src, v->dst, v->len, tweaks + i * 16,
+                           iv_base + i * iv_stride, enc) != 0) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+static int crypt_vec(const evfs_crypto_vec_t *vec, int count, int enc) {
+    if (!vec || count <= 0) return -1;
+    EVFS_PROBE4(crypt__start, enc, count, vec[0].file_id, vec[0].block_no);
+
+    // Each run of blocks under the same key and engine is one engine call
+    pthread_rwlock_rdlock(&keyring_lock);
+    for (int start = 0, end; start < count; start = end) {
+        uint32_t key = EVFS_KEY_ID(vec[start].file_id);
+        uint32_t engine = vec[start].engine;
+        for (end = start + 1; end < count && EVFS_KEY_ID(vec[end].file_id) == key &&
+                              vec[end].engine == engine; end++) {
+        }
+        int id = engine ? (int)engine - 1 : active_engine;
+        if (id >= NUM_ENGINES) {
+            pthread_rwlock_unlock(&keyring_lock);
+            EVFS_PROBE3(crypt__done, enc, count, -1);
+            fprintf(stderr, "[CRYPTO] Unknown engine %u (file %lu)\n", engine,
+                    (unsigned long)vec[start].file_id);
+            return -1;
+        }
+        if (key >= EVFS_MAX_KEYS || !keyring[key].present) {
+            pthread_rwlock_unlock(&keyring_lock);
+            EVFS_PROBE3(crypt__done, enc, count, -1);
+            fprintf(stderr, "[CRYPTO] Key %u is not loaded (file %lu)\n", key,
+                    (unsigned long)vec[start].file_id);
+            return -1;
+        }
+        if (engine_crypt_vec(id, key, vec + start, end - start, enc) != 0) {
+            pthread_rwlock_unlock(&keyring_lock);
+            EVFS_PROBE3(crypt__done, enc, count, -1);
+            fprintf(stderr, "[CRYPTO] Block %s failed (%s, %d blocks from file %lu block %lu)\n",
+                    enc ? "encryption" : "decryption", engines[id].name, end - start,
+                    (unsigned long)vec[start].file_id, (unsigned long)vec[start].block_no);
+            return -1;
+        }
+    }
+    pthread_rwlock_unlock(&keyring_lock);
+    if (enc) {
+        __atomic_fetch_add(&cstats.blocks_encrypted, count, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_add(&cstats.blocks_decrypted, count, __ATOMIC_RELAXED);
+    }
+    EVFS_PROBE3(crypt__done, enc, count, 0);
+    return 0;
+}
+
+int evfs_encrypt_blocks(const evfs_crypto_vec_t *vec, int count) {
+    return crypt_vec(vec, count, 1);
+}
+
+int evfs_decrypt_blocks(const evfs_crypto_vec_t *vec, int count) {
+    return crypt_vec(vec, count, 0);
+}
+
+int evfs_encrypt_block(char *buf, size_t size, uint64_t file_id, uint64_t block_no) {
+    evfs_crypto_vec_t v = { buf, buf, size, file_id, block_no, 0 };
+    return crypt_vec(&v, 1, 1);
+}
+
+int evfs_decrypt_block(char *buf, size_t size, uint64_t file_id, uint64_t block_no) {
+    evfs_crypto_vec_t v = { buf, buf, size, file_id, block_no, 0 };
+    return crypt_vec(&v, 1, 0);
+}
+
+/*
+ * ============================================================================
+ * METADATA NAMES
+ * ============================================================================
+ *
+ * Names are sealed with AES-256-XTS under a key derived from key 0, not
+ * with the block engine, so the metadata file can be read before the
+ * engine it records is selected. XTS keeps the length: the name fields
+ * keep their size, and the metadata file's checksum covers integrity. The
+ * lookup index hashes names with HMAC-SHA256 under a second derived key,
+ * so its keys say nothing about names and names cannot be chosen to
+ * collide.
+ */
+
+static int derive_name_keys(const keyring_entry_t *k) {
+    static const char seal_label[] = "evfs name seal key";
+    static const char index_label[] = "evfs name index key";
+    unsigned char in[sizeof(index_label) + sizeof(k->master_key)];
+    unsigned int len;
+    int ret = 0;
+
+    memcpy(in, seal_label, sizeof(seal_label));
+    memcpy(in + sizeof(seal_label), k->master_key, sizeof(k->master_key));
+    if (EVP_Digest(in, sizeof(seal_label) + sizeof(k->master_key), name_key, &len,
+                   EVP_sha512(), NULL) != 1) {
+        ret = -1;
+    }
+    memcpy(in, index_label, sizeof(index_label));
+    memcpy(in + sizeof(index_label), k->master_key, sizeof(k->master_key));
+    if (ret == 0 && evfs_checksum(in, sizeof(in), index_key) != 0) {
+        ret = -1;
+    }
+    memset(in, 0, sizeof(in));
+    return ret;
+}
+
+int evfs_crypto_seal_name(void *buf, size_t size, uint64_t tweak, int enc) {
+    if (size < 16) return -1;
+
+    unsigned char iv[16] = { 0 };
+    for (int i = 0; i < 8; i++) iv[i] = (unsigned char)(tweak >> (8 * i));
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    int len, ret = -1;
+    if (ctx && EVP_CipherInit_ex(ctx, EVP_aes_256_xts(), NULL, name_key, iv, enc) == 1 &&
+        EVP_CipherUpdate(ctx, buf, &len, buf, size) == 1) {
+        ret = 0;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return ret;
+}
+
+int evfs_crypto_name_hash(const void *data, size_t size, unsigned char *out) {
+    unsigned int len = EVFS_CHECKSUM_LEN;
+    return HMAC(EVP_sha256(), index_key, sizeof(index_key), data, size, out, &len) ? 0 : -1;
+}
+
+/*
+ * ============================================================================
+ * ENGINE SELECTION
+ * ============================================================================
+ */
+
+static void detect_cpu_features(void) {
+    memset(&cpu, 0, sizeof(cpu));
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        cpu.aes = (ecx >> 25) & 1;
+        cpu.pclmul = (ecx >> 1) & 1;
+    }
+    if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) {
+        cpu.avx2 = (ebx >> 5) & 1;
+        cpu.vaes = (ecx >> 9) & 1;
+        cpu.vpclmul = (ecx >> 10) & 1;
+    }
+#elif defined(__aarch64__)
+    unsigned long hwcap = getauxval(AT_HWCAP);
+    cpu.aes = (hwcap & HWCAP_AES) != 0;
+    cpu.pclmul = (hwcap & HWCAP_PMULL) != 0;
+#endif
+}
+
+static long elapsed_nsec(const struct timespec *a, const struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) * 1000000000L + (b->tv_nsec - a->tv_nsec);
+}
+
+// Encrypt 4 KiB blocks for BENCH_NSEC, 'batch' blocks per call;
+// returns blocks per second
+static double benchmark_blocks(int id, int batch, long nsec) {
+    char *buf = calloc(batch, 4096);
+    evfs_crypto_vec_t *vec = calloc(batch, sizeof(*vec));
+    if (!buf || !vec) {
+        free(buf);
+        free(vec);
+        return 0;
+    }
+    for (int i = 0; i < batch; i++) {
+        vec[i].src = vec[i].dst = buf + i * 4096;
+        vec[i].len = 4096;
+        vec[i].file_id = 1;
+    }
+
+    struct timespec start, now;
+    unsigned long blocks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+        for (int i = 0; i < batch; i++) vec[i].block_no = blocks + i;
+        pthread_rwlock_rdlock(&keyring_lock);
+        int ret = engine_crypt_vec(id, 0, vec, batch, 1);
+        pthread_rwlock_unlock(&keyring_lock);
+        if (ret != 0) {
+            blocks = 0;
+            break;
+        }
+        blocks += batch;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (elapsed_nsec(&start, &now) < nsec);
+    free(buf);
+    free(vec);
+
+    return blocks ? blocks / (elapsed_nsec(&start, &now) / 1e9) : 0;
+}
+
+// Startup benchmark; returns GB/s for batched 4 KiB blocks
+static double benchmark_engine(int id) {
+    return benchmark_blocks(id, VEC_BATCH, BENCH_NSEC) * 4096 / 1e9;
+}
+
+void evfs_crypto_benchmark(long msec) {
+    printf("%-18s %14s %14s %8s\n", "engine", "per-block/s", "vectored/s", "speedup");
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        double single = benchmark_blocks(i, 1, msec * 1000000L);
+        double batched = benchmark_blocks(i, VEC_BATCH, msec * 1000000L);
+        printf("%-18s %14.0f %14.0f %7.2fx\n", engines[i].name, single, batched,
+               single > 0 ? batched / single : 0);
+    }
+}
+
+int evfs_crypto_select_engine(const char *name) {
+    if (name && strcmp(name, "auto") != 0) {
+        for (int i = 0; i < NUM_ENGINES; i++) {
+            if (strcmp(engines[i].name, name) == 0) {
+                active_engine = i;
+                auto_selected = 0;
+                engine_gbps[i] = benchmark_engine(i);
+                printf("[CRYPTO] Using engine %s (%.2f GB/s)\n", name, engine_gbps[i]);
+                return 0;
+            }
+        }
+        fprintf(stderr, "[CRYPTO] Unknown cipher engine: %s\n", name);
+        return -1;
+    }
+
+    // Auto: benchmark everything. With hardware AES prefer XTS (no per-block
+    // overhead); without it take whatever is measurably fastest.
+    int best = ENGINE_AES_XTS;
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        engine_gbps[i] = benchmark_engine(i);
+        printf("[CRYPTO] Benchmark %-18s %.2f GB/s\n", engines[i].name, engine_gbps[i]);
+        if (!cpu.aes && engine_gbps[i] > engine_gbps[best]) {
+            best = i;
+        }
+    }
+    if (engine_gbps[best] == 0) {
+        fprintf(stderr, "[CRYPTO] No working cipher engine\n");
+        return -1;
+    }
+
+    active_engine = best;
+    auto_selected = 1;
+    printf("[CRYPTO] Auto-selected engine %s (%.2f GB/s, AES-NI %s)\n",
+           engines[best].name, engine_gbps[best], cpu.aes ? "yes" : "no");
+    return 0;
+}
+
+const char *evfs_crypto_engine_name(void) {
+    return engines[active_engine].name;
+}
+
+size_t evfs_crypto_block_overhead(void) {
+    return engines[active_engine].overhead;
+}
+
+int evfs_crypto_engine_id(const char *name) {
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        if (name && strcmp(engines[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+const char *evfs_crypto_engine_by_id(int id) {
+    return id >= 0 && id < NUM_ENGINES ? engines[id].name : "unknown";
+}
+
+size_t evfs_crypto_engine_overhead(int id) {
+    return id >= 0 && id < NUM_ENGINES ? engines[id].overhead : 0;
+}
+
+void evfs_crypto_print_stats(void) {
+    printf("\n=========== CRYPTO STATS ===========\n");
+    printf("Engine:        %s (%s)\n", engines[active_engine].name,
+           auto_selected ? "auto" : "configured");
+    printf("Throughput:    %.2f GB/s (startup benchmark)\n", engine_gbps[active_engine]);
+    printf("CPU features: %s%s%s%s%s\n",
+           cpu.aes ? " aes" : "", cpu.pclmul ? " pclmul" : "", cpu.avx2 ? " avx2" : "",
+           cpu.vaes ? " vaes" : "", cpu.vpclmul ? " vpclmulqdq" : "");
+    for (int i = 0; i < NUM_ENGINES; i++) {
+        if (i != active_engine && engine_gbps[i] > 0) {
+            printf("  %-18s %.2f GB/s\n", engines[i].name, engine_gbps[i]);
+        }
+    }
+    printf("Blocks:        %lu encrypted, %lu decrypted\n",
+           cstats.blocks_encrypted, cstats.blocks_decrypted);
+    if (engines[active_engine].overhead > 0) {
+        printf("Auth failures: %lu\n", cstats.auth_failures);
+    }
+    printf("====================================\n\n");
+}
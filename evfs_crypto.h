@@ -2,6 +2,7 @@
 #define EVFS_CRYPTO_H
 
 #include <stddef.h>
+#include <stdint.h>
 
 // Initialize the crypto module (call once at startup)
 int evfs_crypto_init(void);
@@ -17,4 +18,99 @@ int evfs_encrypt_buffer(char *buf, size_t size);
 // Returns 0 on success, -1 on error
 int evfs_decrypt_buffer(char *buf, size_t size);
 
+// SHA-256 of a buffer (metadata integrity). out must hold
+// EVFS_CHECKSUM_LEN bytes. Returns 0 on success, -1 on error
+#define EVFS_CHECKSUM_LEN 32
+int evfs_checksum(const void *data, size_t size, unsigned char *out);
+
+// Select the cipher engine used for storage blocks: "aes-256-xts",
+// "aes-256-cbc-essiv", "aes-256-gcm", "chacha20-poly1305", or NULL/"auto"
+// to probe CPU features and pick via a startup micro-benchmark.
+// Call after evfs_crypto_init(). Returns 0 on success, -1 on error
+int evfs_crypto_select_engine(const char *name);
+
+// Name of the active engine
+const char *evfs_crypto_engine_name(void);
+
+// Engine id (stable, for recording which engine data still uses) for a
+// name, or -1. Data can be re-encrypted in place between engines whose
+// evfs_crypto_engine_overhead() is the same
+int evfs_crypto_engine_id(const char *name);
+const char *evfs_crypto_engine_by_id(int id);
+size_t evfs_crypto_engine_overhead(int id);
+
+// Bytes at the end of each block reserved by the engine (nonce + tag for
+// AEAD engines, 0 for length-preserving ones)
+size_t evfs_crypto_block_overhead(void);
+
+// Print engine choice, measured throughput and block counters
+void evfs_crypto_print_stats(void);
+
+// Encrypt one storage block in-place (size must be a multiple of 16).
+// The tweak (file_id, block_no) makes every logical block of every file
+// encrypt independently so it can be read back on its own.
+// Returns 0 on success, -1 on error
+int evfs_encrypt_block(char *buf, size_t size, uint64_t file_id, uint64_t block_no);
+
+// Decrypt one storage block in-place (counterpart of evfs_encrypt_block)
+// Returns 0 on success, -1 on error (including failed authentication)
+int evfs_decrypt_block(char *buf, size_t size, uint64_t file_id, uint64_t block_no);
+
+// One entry of a vectored (scatter/gather) crypto request
+typedef struct {
+    const char *src;    // input block (may equal dst for in-place)
+    char *dst;          // output block
+    size_t len;         // block size, multiple of 16
+    uint64_t file_id;   // tweak, as for evfs_encrypt_block()
+    uint64_t block_no;
+    uint32_t engine;    // 0 = the active engine, else 1 + the engine id of
+                        // data not re-encrypted yet
+} evfs_crypto_vec_t;
+
+// Encrypt/decrypt many independent blocks in one call. Per-call setup is
+// amortised over the whole vector and IVs are derived for a batch at once.
+// Returns 0 on success, -1 if any block failed
+int evfs_encrypt_blocks(const evfs_crypto_vec_t *vec, int count);
+int evfs_decrypt_blocks(const evfs_crypto_vec_t *vec, int count);
+
+// Keyring. Blocks are encrypted with the key whose id is the top bits of
+// their file_id, so several volumes can share one backing store with
+// their own keys. Key 0 is the built-in key set up by evfs_crypto_init()
+#define EVFS_MAX_KEYS 16
+#define EVFS_KEY_SHIFT 48
+#define EVFS_KEY_ID(file_id) ((uint32_t)((file_id) >> EVFS_KEY_SHIFT))
+#define EVFS_SALT_LEN 16
+
+// Derive key 'key_id' (1..EVFS_MAX_KEYS-1) from a passphrase and salt
+// (PBKDF2-HMAC-SHA512) and add it to the keyring. Without verify, 'check'
+// receives EVFS_CHECKSUM_LEN bytes identifying the key; with verify, the
+// key is only added if it matches 'check'. Returns 0, -1 on error, -2 for
+// a wrong passphrase
+int evfs_crypto_add_key(uint32_t key_id, const char *passphrase, const unsigned char *salt,
+                        unsigned char *check, int verify);
+
+// Forget a key; its blocks cannot be read or written until it is added again
+void evfs_crypto_remove_key(uint32_t key_id);
+
+// 1 if the key is in the keyring
+int evfs_crypto_has_key(uint32_t key_id);
+
+// Seal (enc = 1) or unseal a name or an inode page in place for the
+// metadata file or log, with the built-in key whatever the block engine
+// (size >= 16, length kept); 'tweak' makes equal names in different slots
+// (or pages) differ. Returns 0
+// on success, -1 on error
+int evfs_crypto_seal_name(void *buf, size_t size, uint64_t tweak, int enc);
+
+// Keyed hash (HMAC-SHA256) of a name, for the lookup index. out must
+// hold EVFS_CHECKSUM_LEN bytes. Returns 0 on success, -1 on error
+int evfs_crypto_name_hash(const void *data, size_t size, unsigned char *out);
+
+// Fill buf with random bytes (salts). Returns 0 on success, -1 on error
+int evfs_crypto_random(void *buf, size_t len);
+
+// Print blocks/s of per-block vs vectored calls for every engine,
+// running each measurement for msec milliseconds
+void evfs_crypto_benchmark(long msec);
+
 #endif // EVFS_CRYPTO_H
\ No newline at end of file
@@ -0,0 +1,1040 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <pthread.h>
+#include <stdarg.h>
+#include <limits.h>
+
+/*
+ * ============================================================================
+ * EVFS-FSCK - Offline consistency check and scrub
+ * ============================================================================
+ *
+ * Checks an unmounted file system in four passes:
+ *   1. metadata file: checksum and header (falls back to an intact
+ *      evfs_meta.bin.tmp left by an interrupted save), then the commits
+ *      of the write-ahead log it does not include yet
+ *   2. inodes, names and block maps: types, dangling or duplicate names,
+ *      missing parents, unnamed inodes, link counts, unsorted/overlapping
+ *      extents, blocks past end of file
+ *   3. physical space: cross-linked blocks, blocks beyond the backing
+ *      files, leaked (unreferenced) space, and after a clean unmount the
+ *      free list and inode count saved for the next mount
+ *   4. scrub: every mapped block is read and decrypted. Reads are large,
+ *      sorted by physical position and spread over one thread per core, so
+ *      the pass runs at disk bandwidth. AEAD engines detect corruption;
+ *      length-preserving ones (XTS, CBC-ESSIV) only detect unreadable blocks.
+ *      Blocks of volumes (which have their own passphrase) are not scrubbed.
+ *
+ * Without -y nothing is changed. With -y damaged blocks are unmapped (they
+ * read as zeros) and quarantined so they are never allocated again, bad
+ * entries are dropped, and the repaired metadata replaces the old one
+ * atomically; the previous version is kept as <metadata>.bak.
+ *
+ * Usage: ./evfs-fsck [-y|-n] [-j threads] [--backing=F1,F2,...] [--meta=FILE]
+ *                    [--direct-io]
+ *
+ * Exit status (as fsck(8)): 0 clean, 1 errors corrected,
+ * 4 errors left uncorrected, 8 operational error.
+ */
+
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+// Blocks read and decrypted per scrub request (1 MiB)
+#define SCRUB_CHUNK_BLOCKS 256
+#define SCRUB_MAX_THREADS 64
+
+typedef struct {
+    int file_idx;
+    blk_t lblk;
+    blk_t pblk;
+    blk_t count;
+} scrub_item_t;
+
+typedef struct {
+    int file_idx;
+    blk_t lblk;
+    blk_t pblk;
+} bad_block_t;
+
+// One mapped physical range and its owner, for the cross-link check
+typedef struct {
+    blk_t pblk;
+    blk_t len;
+    int file_idx;
+} owned_range_t;
+
+static metadata_image_t img;
+static int repair = 0;
+static long problems = 0;       // inconsistencies found
+static long unfixed = 0;        // ... that were not (or cannot be) repaired
+static int changed = 0;         // image modified, must be written back
+static blk_t payload;           // usable bytes per block for this engine
+
+static scrub_item_t *items;
+static int item_count;
+static int next_item = 0;
+static bad_block_t *bad_blocks;
+static int bad_count = 0, bad_capacity = 0;
+static pthread_mutex_t bad_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long scrubbed_blocks = 0;
+
+static void problem(int fixable, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void problem(int fixable, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    printf("[FSCK] ");
+    vprintf(fmt, ap);
+    va_end(ap);
+
+    problems++;
+    if (repair && fixable) {
+        printf(" (fixed)\n");
+        changed = 1;
+    } else {
+        printf("\n");
+        unfixed++;
+    }
+}
+
+// First dentry naming an inode, or -1
+static int first_dentry(int idx) {
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (img.dentries[d].is_used && img.dentries[d].inode == idx) return d;
+    }
+    return -1;
+}
+
+// A name of an inode, for messages
+static const char *file_name(int idx) {
+    if (idx == 0) return "/";
+    int d = first_dentry(idx);
+    return d == -1 ? "(unnamed)" : img.dentries[d].name;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Extent list surgery on the image (no allocator involved: fsck rebuilds
+ * nothing in memory; write_back() drops the free space saved at unmount,
+ * so the next mount recomputes it from the maps)
+ * ----------------------------------------------------------------------------
+ */
+
+// Remove physical blocks [pblk, pblk+len) from a map. Returns blocks removed
+static blk_t cut_physical(block_map_t *map, blk_t pblk, blk_t len) {
+    extent_t *out = malloc((map->count + 1) * sizeof(extent_t));
+    if (!out) return 0;
+
+    blk_t removed = 0;
+    int n = 0;
+    for (int e = 0; e < map->count; e++) {
+        extent_t ext = map->extents[e];
+        blk_t lo = ext.pblk > pblk ? ext.pblk : pblk;
+        blk_t hi = ext.pblk + ext.len < pblk + len ? ext.pblk + ext.len : pblk + len;
+        if (lo >= hi) {
+            out[n++] = ext;
+            continue;
+        }
+        if (lo > ext.pblk) {
+            out[n++] = (extent_t){ ext.lblk, ext.pblk, lo - ext.pblk, ext.gen };
+        }
+        if (hi < ext.pblk + ext.len) {
+            blk_t skip = hi - ext.pblk;
+            out[n++] = (extent_t){ ext.lblk + skip, hi, ext.len - skip, ext.gen };
+        }
+        removed += hi - lo;
+    }
+
+    free(map->extents);
+    map->extents = out;
+    map->count = n;
+    map->capacity = map->count + 1;
+    return removed;
+}
+
+// Drop logical blocks at or beyond keep. Returns blocks removed
+// Unmap logical blocks [keep, end); an extent spanning both ends keeps
+// only its head
+static blk_t cut_logical(block_map_t *map, blk_t keep, blk_t end) {
+    blk_t removed = 0;
+    int n = 0;
+    for (int e = 0; e < map->count; e++) {
+        extent_t *ext = &map->extents[e];
+        blk_t ext_end = ext->lblk + ext->len;
+        if (ext_end <= keep || ext->lblk >= end) {
+            map->extents[n++] = *ext;
+            continue;
+        }
+        if (ext->lblk < keep) {
+            removed += ext->len - (keep - ext->lblk);
+            ext->len = keep - ext->lblk;
+        } else if (ext_end > end) {
+            removed += end - ext->lblk;
+            ext->pblk += end - ext->lblk;
+            ext->len = ext_end - end;
+            ext->lblk = end;
+        } else {
+            removed += ext->len;
+            continue;
+        }
+        map->extents[n++] = *ext;
+    }
+    map->count = n;
+    return removed;
+}
+
+static void drop_file(int idx) {
+    memset(&img.files[idx], 0, sizeof(file_metadata_t));
+    blockmap_free(&img.maps[idx]);
+}
+
+static void drop_dentry(int d) {
+    memset(&img.dentries[d], 0, sizeof(dentry_t));
+}
+
+static int quarantine(blk_t pblk, blk_t len) {
+    extent_t *grown = realloc(img.bad, (img.bad_count + 1) * sizeof(extent_t));
+    if (!grown) return -ENOMEM;
+    img.bad = grown;
+    img.bad[img.bad_count++] = (extent_t){ 0, pblk, len, 0 };
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Pass 1: metadata file
+ * ----------------------------------------------------------------------------
+ */
+
+// Apply the write-ahead log, as a mount would, then decrypt every name:
+// the checks below read them all
+static int replay_log(void) {
+    int ret = wal_replay(&img);
+    if (ret < 0) {
+        problem(0, "Cannot replay %s: %s", wal_path(), strerror(-ret));
+        return -1;
+    }
+    if (ret > 0) {
+        printf("[FSCK] Checking the metadata with %d logged commit(s) applied\n", ret);
+        img.clean = 0;  // the mount works out free space again, too
+    }
+    if (unseal_image_names(&img) < 0) {
+        problem(0, "Cannot decrypt the names in %s", metadata_path());
+        return -1;
+    }
+    return 0;
+}
+
+static int load_image(void) {
+    const char *path = metadata_path();
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    printf("[FSCK] Pass 1: metadata file %s\n", path);
+
+    int ret = read_metadata_image(path, &img);
+    if (ret == -ENOENT) {
+        fprintf(stderr, "[FSCK] %s not found\n", path);
+        return -1;
+    }
+
+    if (ret == 0) {
+        if (access(tmp_path, F_OK) == 0) {
+            problem(1, "Stale %s from an interrupted save", tmp_path);
+            if (repair) unlink(tmp_path);
+        }
+        return replay_log();
+    }
+
+    // The save writes and syncs the temporary file before renaming it, so
+    // an intact one is the newest complete version
+    if (read_metadata_image(tmp_path, &img) == 0) {
+        problem(1, "%s is damaged, using intact %s", path, tmp_path);
+        if (repair && rename(tmp_path, path) != 0) {
+            perror("[FSCK] rename");
+            return -1;
+        }
+        return replay_log();
+    }
+
+    problem(0, "%s is damaged (bad checksum or truncated) and no intact copy exists", path);
+    return -1;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Pass 2: file table and block maps
+ * ----------------------------------------------------------------------------
+ */
+
+static int extent_cmp_lblk(const void *a, const void *b) {
+    const extent_t *x = a, *y = b;
+    return x->lblk < y->lblk ? -1 : x->lblk > y->lblk;
+}
+
+static void check_map(int idx) {
+    file_metadata_t *meta = &img.files[idx];
+    block_map_t *map = &img.maps[idx];
+
+    // Only regular files keep contents in the inode, and no more than
+    // the sealed area holds
+    if (meta->inline_data && meta->type != FTYPE_FILE) {
+        problem(1, "'%s' is not a file but has inline contents", file_name(idx));
+        meta->inline_data = 0;
+        memset(meta->data, 0, INLINE_DATA_SIZE);
+    }
+    off_t inline_max = INLINE_DATA_SIZE - evfs_crypto_block_overhead();
+    if (meta->inline_data && meta->size > inline_max) {
+        problem(1, "Inline file '%s' claims %ld bytes; cut to %ld",
+                file_name(idx), (long)meta->size, (long)inline_max);
+        meta->size = inline_max;
+    }
+
+    // Directories may only have an xattr stream
+    if (meta->type == FTYPE_DIR) {
+        blk_t removed = cut_logical(map, 0, XATTR_LBLK);
+        if (removed > 0) {
+            problem(1, "Directory '%s' has %lu data blocks", file_name(idx), (unsigned long)removed);
+        }
+        return;
+    }
+
+    // Extents must be non-empty, sorted and non-overlapping
+    int bad = 0;
+    for (int e = 0; e < map->count; e++) {
+        if (map->extents[e].len == 0 ||
+            (e > 0 && map->extents[e].lblk < map->extents[e - 1].lblk + map->extents[e - 1].len)) {
+            bad = 1;
+        }
+    }
+    if (bad) {
+        problem(1, "File '%s' has an unsorted or overlapping block map", file_name(idx));
+        qsort(map->extents, map->count, sizeof(extent_t), extent_cmp_lblk);
+        int n = 0;
+        for (int e = 0; e < map->count; e++) {
+            extent_t ext = map->extents[e];
+            if (n > 0) {
+                blk_t prev_end = map->extents[n - 1].lblk + map->extents[n - 1].len;
+                if (ext.lblk + ext.len <= prev_end) continue;
+                if (ext.lblk < prev_end) {
+                    blk_t skip = prev_end - ext.lblk;
+                    ext.lblk += skip;
+                    ext.pblk += skip;
+                    ext.len -= skip;
+                }
+            }
+            if (ext.len > 0) map->extents[n++] = ext;
+        }
+        map->count = n;
+    }
+
+    // Blocks past the end of the file (e.g. an interrupted truncate),
+    // short of the xattr stream. Short symlink targets and inline file
+    // contents live in the inode
+    blk_t eof_blocks = (meta->size + payload - 1) / payload;
+    if (symlink_is_inline(meta) || meta->inline_data) {
+        eof_blocks = 0;
+    }
+    blk_t past = cut_logical(map, eof_blocks, XATTR_LBLK);
+    if (past > 0) {
+        problem(1, "File '%s' maps %lu blocks past its end (%ld bytes)",
+                file_name(idx), (unsigned long)past, (long)meta->size);
+    }
+}
+
+// Inode named by "/<dir>" in the image, or -1
+static int lookup(const char *name, size_t len) {
+    if (len == 0) return 0;
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (img.dentries[d].is_used && strlen(img.dentries[d].name) == len &&
+            strncmp(img.dentries[d].name, name, len) == 0) {
+            return img.dentries[d].inode;
+        }
+    }
+    return -1;
+}
+
+// Give an entry a free name in the root directory: its own base name, or
+// "#<inode>" (as in lost+found) if that is taken. A directory takes its
+// descendants along
+static void move_to_root(int d, const char *base) {
+    char old[MAX_FILENAME], name[MAX_FILENAME];
+    int idx = img.dentries[d].inode;
+    strcpy(old, img.dentries[d].name);
+
+    snprintf(name, sizeof(name), "%s", base);
+    if (lookup(name, strlen(name)) != -1) {
+        snprintf(name, sizeof(name), "#%d", idx);
+    }
+    for (int n = 2; lookup(name, strlen(name)) != -1; n++) {
+        snprintf(name, sizeof(name), "#%d.%d", idx, n);
+    }
+
+    if (img.files[idx].type == FTYPE_DIR && old[0] != '\0') {
+        size_t old_len = strlen(old);
+        for (int e = 0; e < MAX_DENTRIES; e++) {
+            char *child = img.dentries[e].name;
+            if (!img.dentries[e].is_used || strncmp(child, old, old_len) != 0 ||
+                child[old_len] != '/') {
+                continue;
+            }
+            char moved[MAX_FILENAME * 2];
+            snprintf(moved, sizeof(moved), "%s%s", name, child + old_len);
+            if (strlen(moved) >= MAX_FILENAME) {
+                drop_dentry(e);  // left without a parent; reconnected below
+            } else {
+                strcpy(child, moved);
+            }
+        }
+    }
+    strcpy(img.dentries[d].name, name);
+    img.dentries[d].hash = 0;  // new parent: filed from the name at mount
+}
+
+static void check_files(void) {
+    printf("[FSCK] Pass 2: inodes, names and block maps\n");
+
+    if (!img.files[0].is_used || img.files[0].type != FTYPE_DIR) {
+        problem(1, "Root directory entry is missing or not a directory");
+        blockmap_free(&img.maps[0]);
+        memset(&img.files[0], 0, sizeof(file_metadata_t));
+        img.files[0].type = FTYPE_DIR;
+        img.files[0].mode = 0755;
+        img.files[0].uid = getuid();
+        img.files[0].gid = getgid();
+        img.files[0].atime = img.files[0].mtime = img.files[0].ctime = time(NULL);
+        img.files[0].size = BLOCK_SIZE;
+        img.files[0].is_used = 1;
+    }
+
+    uint64_t max_id = 0;
+    for (int i = 1; i < MAX_FILES; i++) {
+        file_metadata_t *meta = &img.files[i];
+        if (!meta->is_used) continue;
+
+        if (meta->type != FTYPE_FILE && meta->type != FTYPE_DIR && meta->type != FTYPE_SYMLINK) {
+            problem(1, "Inode %d has an invalid type", i);
+            drop_file(i);
+            continue;
+        }
+        if (meta->size < 0 || meta->size > MAX_FILE_SIZE ||
+            (meta->type == FTYPE_SYMLINK && meta->size >= PATH_MAX)) {
+            problem(0, "File '%s' has an impossible size %ld", file_name(i), (long)meta->size);
+            continue;
+        }
+
+        // The key that encrypts the blocks follows from the map id
+        uint32_t key = EVFS_KEY_ID(img.maps[i].id);
+        if (key != meta->volume || key >= MAX_VOLUMES || (key != 0 && !img.volumes[key].is_used)) {
+            problem(0, "'%s' belongs to volume %u but its blocks to unknown key %u",
+                    file_name(i), meta->volume, key);
+        }
+
+        check_map(i);
+        if (MAP_ID_SEQ(img.maps[i].id) > max_id) max_id = MAP_ID_SEQ(img.maps[i].id);
+        for (int j = 1; j < i; j++) {
+            if (img.files[j].is_used && img.maps[j].id == img.maps[i].id) {
+                // Not repairable: the id is part of every block's crypto tweak
+                problem(0, "'%s' and '%s' share block map id %lu",
+                        file_name(j), file_name(i), (unsigned long)img.maps[i].id);
+            }
+        }
+    }
+
+    if (max_id >= img.next_map_id) {
+        problem(1, "Next map id %lu is below ids in use", (unsigned long)img.next_map_id);
+        img.next_map_id = max_id + 1;
+    }
+
+    // Names: each must point at a live inode, be unique, and a directory
+    // has exactly one
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        dentry_t *dentry = &img.dentries[d];
+        if (!dentry->is_used) continue;
+
+        int idx = dentry->inode;
+        if (dentry->name[0] == '\0' || dentry->name[0] == '/' || idx <= 0 ||
+            !img.files[idx].is_used) {
+            problem(1, "Name '%s' is empty or points at a free inode %d; dropping it",
+                    dentry->name, idx);
+            drop_dentry(d);
+            continue;
+        }
+        for (int e = 0; e < d; e++) {
+            if (!img.dentries[e].is_used) continue;
+            if (strcmp(img.dentries[e].name, dentry->name) == 0) {
+                problem(1, "Name '%s' appears twice; dropping the second", dentry->name);
+                drop_dentry(d);
+                break;
+            }
+            if (img.files[idx].type == FTYPE_DIR && img.dentries[e].inode == idx) {
+                problem(1, "Directory '%s' is also named '%s'; dropping the second",
+                        img.dentries[e].name, dentry->name);
+                drop_dentry(d);
+                break;
+            }
+        }
+    }
+
+    // Every name's parent must be a directory. Moving a directory fixes its
+    // whole subtree, so repeat until nothing changes
+    for (int moved = 1; moved;) {
+        moved = 0;
+        for (int d = 0; d < MAX_DENTRIES; d++) {
+            dentry_t *dentry = &img.dentries[d];
+            if (!dentry->is_used) continue;
+            const char *slash = strrchr(dentry->name, '/');
+            int parent = slash ? lookup(dentry->name, slash - dentry->name) : 0;
+            if (parent >= 0 && img.files[parent].type == FTYPE_DIR) continue;
+
+            char old[MAX_FILENAME];
+            strcpy(old, dentry->name);
+            move_to_root(d, slash + 1);
+            problem(1, "'%s' has no valid parent directory; moved to '/%s'", old, dentry->name);
+            moved = 1;
+        }
+    }
+
+    // Inodes that lost every name are reconnected in the root directory
+    for (int i = 1; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used || first_dentry(i) != -1) continue;
+        int d = 0;
+        while (d < MAX_DENTRIES && img.dentries[d].is_used) d++;
+        if (d == MAX_DENTRIES) {
+            problem(0, "Inode %d has no name and there is no room to reconnect it", i);
+            continue;
+        }
+        img.dentries[d] = (dentry_t){ .inode = i, .is_used = 1 };
+        move_to_root(d, "");
+        problem(1, "Inode %d has no name; reconnected as '/%s'", i, img.dentries[d].name);
+    }
+
+    // Link counts: names for files and symlinks, 2 + subdirectories for
+    // directories
+    uint32_t links[MAX_FILES] = { 0 };
+    links[0] = 2;
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        dentry_t *dentry = &img.dentries[d];
+        if (!dentry->is_used) continue;
+        if (img.files[dentry->inode].type == FTYPE_DIR) {
+            const char *slash = strrchr(dentry->name, '/');
+            int parent = slash ? lookup(dentry->name, slash - dentry->name) : 0;
+            if (parent >= 0) links[parent]++;
+            links[dentry->inode] += 2;
+        } else {
+            links[dentry->inode]++;
+        }
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (img.files[i].is_used && img.files[i].nlink != links[i]) {
+            problem(1, "'%s' has link count %u, should be %u",
+                    file_name(i), img.files[i].nlink, links[i]);
+            img.files[i].nlink = links[i];
+        }
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Pass 3: physical space
+ * ----------------------------------------------------------------------------
+ */
+
+static int owned_cmp(const void *a, const void *b) {
+    const owned_range_t *x = a, *y = b;
+    if (x->pblk != y->pblk) return x->pblk < y->pblk ? -1 : 1;
+    return x->file_idx - y->file_idx;
+}
+
+/*
+ * Find physical blocks owned twice. With cut == 0 they are only reported;
+ * the scrub later decides which owner is right (only the owner whose
+ * tweak was used can decrypt them). With cut != 0 the first owner in
+ * physical order (quarantined ranges first) keeps whatever is left.
+ */
+static void sweep_ranges(int cut, blk_t *used_out, blk_t *max_end_out) {
+    int n = img.bad_count;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (img.files[i].is_used) n += img.maps[i].count;
+    }
+    owned_range_t *ranges = malloc((n > 0 ? n : 1) * sizeof(owned_range_t));
+    if (!ranges) {
+        fprintf(stderr, "[FSCK] Out of memory\n");
+        exit(FSCK_ERROR);
+    }
+    n = 0;
+    for (int b = 0; b < img.bad_count; b++) {
+        ranges[n++] = (owned_range_t){ img.bad[b].pblk, img.bad[b].len, -1 };
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used) continue;
+        for (int e = 0; e < img.maps[i].count; e++) {
+            ranges[n++] = (owned_range_t){ img.maps[i].extents[e].pblk, img.maps[i].extents[e].len, i };
+        }
+    }
+    qsort(ranges, n, sizeof(owned_range_t), owned_cmp);
+
+    blk_t used = 0, covered_end = 0, max_end = 0;
+    int covered_owner = -1;
+    for (int r = 0; r < n; r++) {
+        owned_range_t *cur = &ranges[r];
+        blk_t end = cur->pblk + cur->len;
+        if (cur->pblk < covered_end && cur->file_idx >= 0) {
+            blk_t overlap = (end < covered_end ? end : covered_end) - cur->pblk;
+            const char *other = covered_owner < 0 ? "a quarantined range" : file_name(covered_owner);
+            if (!cut) {
+                problem(1, "%lu blocks of '%s' are also used by '%s'",
+                        (unsigned long)overlap, file_name(cur->file_idx), other);
+            } else {
+                printf("[FSCK] %lu cross-linked blocks left with '%s', removed from '%s'\n",
+                       (unsigned long)overlap, other, file_name(cur->file_idx));
+                cut_physical(&img.maps[cur->file_idx], cur->pblk, overlap);
+            }
+        }
+        if (end > covered_end) {
+            used += end - (cur->pblk > covered_end ? cur->pblk : covered_end);
+            covered_end = end;
+            covered_owner = cur->file_idx;
+        }
+        if (end > max_end) max_end = end;
+    }
+    free(ranges);
+
+    if (used_out) *used_out = used;
+    if (max_end_out) *max_end_out = max_end;
+}
+
+/*
+ * After a clean unmount the next mount takes the saved free list and
+ * inode count as they are. Free ranges must cover exactly the blocks
+ * below the allocator end that nothing else owns; otherwise the mount is
+ * made to work both out again.
+ */
+static void check_saved_usage(blk_t used) {
+    int n = img.free_count + img.bad_count;
+    uint64_t inodes = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used) continue;
+        n += img.maps[i].count;
+        inodes++;
+    }
+    owned_range_t *ranges = malloc((n > 0 ? n : 1) * sizeof(owned_range_t));
+    if (!ranges) {
+        fprintf(stderr, "[FSCK] Out of memory\n");
+        exit(FSCK_ERROR);
+    }
+    n = 0;
+    blk_t free_blocks = 0;
+    for (int f = 0; f < img.free_count; f++) {
+        ranges[n++] = (owned_range_t){ img.free[f].pblk, img.free[f].len, -2 };
+        free_blocks += img.free[f].len;
+    }
+    for (int b = 0; b < img.bad_count; b++) {
+        ranges[n++] = (owned_range_t){ img.bad[b].pblk, img.bad[b].len, -1 };
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used) continue;
+        for (int e = 0; e < img.maps[i].count; e++) {
+            ranges[n++] = (owned_range_t){ img.maps[i].extents[e].pblk, img.maps[i].extents[e].len, i };
+        }
+    }
+    qsort(ranges, n, sizeof(owned_range_t), owned_cmp);
+
+    blk_t covered = 0, covered_end = 0;
+    for (int r = 0; r < n; r++) {
+        blk_t end = ranges[r].pblk + ranges[r].len;
+        if (end > covered_end) {
+            covered += end - (ranges[r].pblk > covered_end ? ranges[r].pblk : covered_end);
+            covered_end = end;
+        }
+    }
+    free(ranges);
+
+    // Free space overlapping anything shows as less covered than counted
+    if (covered_end > img.alloc_end || covered != img.alloc_end || used + free_blocks != covered) {
+        problem(1, "Free space saved at unmount does not match the block maps "
+                "(%lu free, %lu in use, %lu allocated)", (unsigned long)free_blocks,
+                (unsigned long)used, (unsigned long)img.alloc_end);
+        img.clean = 0;
+    }
+    if (img.inodes_used != inodes) {
+        problem(1, "%lu inodes in use, %lu saved at unmount",
+                (unsigned long)inodes, (unsigned long)img.inodes_used);
+        img.clean = 0;
+    }
+}
+
+static void check_space(void) {
+    printf("[FSCK] Pass 3: physical space\n");
+
+    blk_t present = storage_backing_blocks();
+
+    // Blocks past the allocator's end or missing from the backing files
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used) continue;
+        block_map_t *map = &img.maps[i];
+
+        blk_t beyond_end = 0, missing = 0;
+        for (int e = 0; e < map->count; e++) {
+            extent_t *ext = &map->extents[e];
+            blk_t end = ext->pblk + ext->len;
+            if (end > img.alloc_end) {
+                beyond_end += end - (ext->pblk > img.alloc_end ? ext->pblk : img.alloc_end);
+            }
+            if (end > present) {
+                missing += end - (ext->pblk > present ? ext->pblk : present);
+            }
+        }
+        if (beyond_end > 0) {
+            // Metadata is newer than the allocator state: keep the blocks
+            problem(1, "'%s' uses %lu blocks past the allocator end",
+                    file_name(i), (unsigned long)beyond_end);
+            img.alloc_end = BLK_MAX;  // recomputed below
+        }
+        if (missing > 0) {
+            problem(1, "'%s' has %lu blocks beyond the end of the backing files",
+                    file_name(i), (unsigned long)missing);
+            cut_physical(map, present, BLK_MAX - present);
+        }
+    }
+
+    blk_t used, max_end;
+    sweep_ranges(0, &used, &max_end);
+
+    if (img.alloc_end == BLK_MAX) {
+        img.alloc_end = max_end;
+    }
+
+    blk_t leaked = img.alloc_end > used ? img.alloc_end - used : 0;
+    printf("[FSCK] %lu blocks in use, %lu quarantined ranges, %lu unreferenced "
+           "(returned to free space at mount)\n",
+           (unsigned long)used, (unsigned long)img.bad_count, (unsigned long)leaked);
+    if (img.clean) {
+        check_saved_usage(used);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Pass 4: parallel scrub
+ * ----------------------------------------------------------------------------
+ */
+
+static int item_cmp(const void *a, const void *b) {
+    const scrub_item_t *x = a, *y = b;
+    return x->pblk < y->pblk ? -1 : x->pblk > y->pblk;
+}
+
+static void record_bad(int file_idx, blk_t lblk, blk_t pblk) {
+    pthread_mutex_lock(&bad_lock);
+    if (bad_count == bad_capacity) {
+        int new_capacity = bad_capacity ? bad_capacity * 2 : 64;
+        bad_block_t *grown = realloc(bad_blocks, new_capacity * sizeof(bad_block_t));
+        if (!grown) {
+            pthread_mutex_unlock(&bad_lock);
+            return;
+        }
+        bad_blocks = grown;
+        bad_capacity = new_capacity;
+    }
+    bad_blocks[bad_count++] = (bad_block_t){ file_idx, lblk, pblk };
+    pthread_mutex_unlock(&bad_lock);
+}
+
+// A file other than 'not' that maps pblk and decrypted it fine, or -1
+static int verified_owner(int not, blk_t pblk) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (i == not || !img.files[i].is_used) continue;
+        block_map_t *map = &img.maps[i];
+        int owns = 0;
+        for (int e = 0; e < map->count && !owns; e++) {
+            owns = pblk >= map->extents[e].pblk && pblk < map->extents[e].pblk + map->extents[e].len;
+        }
+        if (!owns) continue;
+
+        int damaged = 0;
+        for (int b = 0; b < bad_count && !damaged; b++) {
+            damaged = bad_blocks[b].file_idx == i && bad_blocks[b].pblk == pblk;
+        }
+        if (!damaged) return i;
+    }
+    return -1;
+}
+
+static void *scrub_worker(void *arg) {
+    (void)arg;
+    char *raw = NULL, *plain = malloc(SCRUB_CHUNK_BLOCKS * BLOCK_SIZE);
+    evfs_crypto_vec_t *vec = malloc(SCRUB_CHUNK_BLOCKS * sizeof(evfs_crypto_vec_t));
+    if (posix_memalign((void **)&raw, IO_ALIGN, SCRUB_CHUNK_BLOCKS * BLOCK_SIZE) != 0 ||
+        !plain || !vec) {
+        fprintf(stderr, "[FSCK] Out of memory\n");
+        exit(FSCK_ERROR);
+    }
+
+    for (;;) {
+        int i = __atomic_fetch_add(&next_item, 1, __ATOMIC_RELAXED);
+        if (i >= item_count) break;
+        scrub_item_t *it = &items[i];
+        const block_map_t *map = &img.maps[it->file_idx];
+        uint64_t id = map->id;
+
+        if (read_raw_blocks(it->pblk, it->count, raw) < 0) {
+            for (blk_t b = 0; b < it->count; b++) {
+                record_bad(it->file_idx, it->lblk + b, it->pblk + b);
+            }
+            continue;
+        }
+
+        // Decrypt out of place so failed blocks can be retried one by one
+        for (blk_t b = 0; b < it->count; b++) {
+            vec[b].src = raw + b * BLOCK_SIZE;
+            vec[b].dst = plain + b * BLOCK_SIZE;
+            vec[b].len = BLOCK_SIZE;
+            vec[b].file_id = id;
+            vec[b].block_no = it->lblk + b;
+            vec[b].engine = map->old_engine && it->lblk + b >= map->reencrypted ? map->old_engine : 0;
+        }
+        if (evfs_decrypt_blocks(vec, it->count) != 0) {
+            for (blk_t b = 0; b < it->count; b++) {
+                if (evfs_decrypt_blocks(&vec[b], 1) != 0) {
+                    record_bad(it->file_idx, it->lblk + b, it->pblk + b);
+                }
+            }
+        }
+        __atomic_fetch_add(&scrubbed_blocks, it->count, __ATOMIC_RELAXED);
+    }
+
+    free(raw);
+    free(plain);
+    free(vec);
+    return NULL;
+}
+
+static void scrub(int nthreads) {
+    printf("[FSCK] Pass 4: scrubbing data blocks (%s, %d threads)\n",
+           evfs_crypto_engine_name(), nthreads);
+    if (evfs_crypto_block_overhead() == 0) {
+        printf("[FSCK] Note: %s has no authentication tag; only unreadable blocks "
+               "can be detected\n", evfs_crypto_engine_name());
+    }
+
+    // One item per chunk of an extent, in physical order for streaming reads
+    item_count = 0;
+    blk_t locked = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used) continue;
+        if (!evfs_crypto_has_key(EVFS_KEY_ID(img.maps[i].id))) {
+            locked += blockmap_blocks(&img.maps[i]);
+            continue;
+        }
+        for (int e = 0; e < img.maps[i].count; e++) {
+            item_count += (img.maps[i].extents[e].len + SCRUB_CHUNK_BLOCKS - 1) / SCRUB_CHUNK_BLOCKS;
+        }
+    }
+    items = malloc((item_count > 0 ? item_count : 1) * sizeof(scrub_item_t));
+    if (!items) {
+        fprintf(stderr, "[FSCK] Out of memory\n");
+        exit(FSCK_ERROR);
+    }
+    if (locked > 0) {
+        printf("[FSCK] Note: %lu blocks of volumes are not scrubbed (their keys are not loaded)\n",
+               (unsigned long)locked);
+    }
+    int n = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img.files[i].is_used || !evfs_crypto_has_key(EVFS_KEY_ID(img.maps[i].id))) continue;
+        for (int e = 0; e < img.maps[i].count; e++) {
+            extent_t *ext = &img.maps[i].extents[e];
+            for (blk_t off = 0; off < ext->len; off += SCRUB_CHUNK_BLOCKS) {
+                blk_t count = ext->len - off;
+                if (count > SCRUB_CHUNK_BLOCKS) count = SCRUB_CHUNK_BLOCKS;
+                items[n++] = (scrub_item_t){ i, ext->lblk + off, ext->pblk + off, count };
+            }
+        }
+    }
+    qsort(items, item_count, sizeof(scrub_item_t), item_cmp);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pthread_t threads[SCRUB_MAX_THREADS];
+    for (int t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[t], NULL, scrub_worker, NULL) != 0) {
+            perror("[FSCK] pthread_create");
+            exit(FSCK_ERROR);
+        }
+    }
+    for (int t = 0; t < nthreads; t++) {
+        pthread_join(threads[t], NULL);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    double mb = (double)scrubbed_blocks * BLOCK_SIZE / (1024 * 1024);
+    printf("[FSCK] Scrubbed %lu blocks (%.1f MB) in %.2f s (%.1f MB/s)\n",
+           scrubbed_blocks, mb, secs, secs > 0 ? mb / secs : 0.0);
+
+    // Damaged blocks, reported per file. A block another file decrypts
+    // fine is that file's (a cross-link): it is only unmapped here. Others
+    // are unmapped and quarantined.
+    for (int i = 0; i < MAX_FILES; i++) {
+        blk_t count = 0, linked = 0;
+        for (int b = 0; b < bad_count; b++) {
+            if (bad_blocks[b].file_idx != i) continue;
+            count++;
+            if (verified_owner(i, bad_blocks[b].pblk) >= 0) linked++;
+        }
+        if (count == 0) continue;
+
+        problem(1, "'%s': %lu damaged blocks (%lu belong to another file)%s",
+                file_name(i), (unsigned long)count, (unsigned long)linked,
+                repair ? "; unmapped, they now read as zeros" : "");
+        if (!repair) continue;
+        for (int b = 0; b < bad_count; b++) {
+            if (bad_blocks[b].file_idx != i) continue;
+            int owner = verified_owner(i, bad_blocks[b].pblk);
+            cut_physical(&img.maps[i], bad_blocks[b].pblk, 1);
+            if (owner < 0 && quarantine(bad_blocks[b].pblk, 1) < 0) {
+                fprintf(stderr, "[FSCK] Out of memory\n");
+                exit(FSCK_ERROR);
+            }
+        }
+    }
+
+    // Cross-links the scrub could not settle (e.g. no authentication tag)
+    if (repair) {
+        sweep_ranges(1, NULL, NULL);
+    }
+    free(items);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Main
+ * ----------------------------------------------------------------------------
+ */
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-y|-n] [-j threads] [--backing=F1,F2,...] [--meta=FILE] [--direct-io]\n", prog);
+    fprintf(stderr, "  -y         Repair (default: check only, change nothing)\n");
+    fprintf(stderr, "  -j N       Scrub threads (default: one per core)\n");
+}
+
+static int write_back(void) {
+    const char *path = metadata_path();
+    char bak_path[PATH_MAX];
+    snprintf(bak_path, sizeof(bak_path), "%s.bak", path);
+
+    // Keep the previous version; the new one replaces it atomically
+    unlink(bak_path);
+    if (link(path, bak_path) != 0 && errno != ENOENT) {
+        perror("[FSCK] Failed to keep backup of metadata");
+        return -1;
+    }
+    // Repairs change the maps: the next mount works out free space again
+    img.clean = 0;
+    img.free_count = 0;
+    img.usage_count = 0;
+    int ret = write_metadata_image(path, &img);
+    if (ret < 0) {
+        fprintf(stderr, "[FSCK] Failed to write metadata: %s\n", strerror(-ret));
+        return -1;
+    }
+    printf("[FSCK] Repaired metadata written to %s (previous: %s)\n", path, bak_path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-y") == 0 || strcmp(argv[i], "--repair") == 0) {
+            repair = 1;
+        } else if (strcmp(argv[i], "-n") == 0) {
+            repair = 0;
+        } else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            evfs_options.direct_io = 1;
+        } else if (strncmp(argv[i], "--meta=", 7) == 0) {
+            evfs_options.metadata_file = argv[i] + 7;
+        } else if (strncmp(argv[i], "--backing=", 10) == 0) {
+            for (char *path = strtok(argv[i] + 10, ","); path; path = strtok(NULL, ",")) {
+                if (evfs_options.backing_count == MAX_BACKING_FILES) {
+                    fprintf(stderr, "Too many backing files (max %d)\n", MAX_BACKING_FILES);
+                    return FSCK_ERROR;
+                }
+                evfs_options.backing_files[evfs_options.backing_count++] = path;
+            }
+        } else {
+            usage(argv[0]);
+            return FSCK_ERROR;
+        }
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > SCRUB_MAX_THREADS) nthreads = SCRUB_MAX_THREADS;
+
+    // Never create backing files that are not there
+    for (int i = 0; i < (evfs_options.backing_count ? evfs_options.backing_count : 1); i++) {
+        const char *path = evfs_options.backing_count ? evfs_options.backing_files[i] : BACKING_FILE;
+        if (access(path, R_OK) != 0) {
+            fprintf(stderr, "[FSCK] Backing file %s: %s\n", path, strerror(errno));
+            return FSCK_ERROR;
+        }
+    }
+
+    if (evfs_crypto_init() != 0) {
+        return FSCK_ERROR;
+    }
+    if (load_image() < 0) {
+        evfs_crypto_cleanup();
+        return problems ? FSCK_UNCORRECTED : FSCK_ERROR;
+    }
+    if (evfs_crypto_select_engine(img.cipher) != 0) {
+        fprintf(stderr, "[FSCK] Unknown cipher engine '%s' in metadata\n", img.cipher);
+        evfs_crypto_cleanup();
+        return FSCK_UNCORRECTED;
+    }
+    payload = BLOCK_SIZE - evfs_crypto_block_overhead();
+
+    // Storage is opened only to read blocks; nothing runs in the background
+    evfs_options.compact_rate_mb = 0;
+    if (init_storage() < 0) {
+        evfs_crypto_cleanup();
+        return FSCK_ERROR;
+    }
+    if (storage_backing_blocks() == 0 && img.alloc_end > 0) {
+        printf("[FSCK] Backing files are empty\n");
+    }
+    if ((int)img.backing_count != (evfs_options.backing_count ? evfs_options.backing_count : 1)) {
+        fprintf(stderr, "[FSCK] Metadata was written for %u backing file(s)\n", img.backing_count);
+        cleanup_storage();
+        evfs_crypto_cleanup();
+        return FSCK_ERROR;
+    }
+
+    check_files();
+    check_space();
+    scrub(nthreads);
+
+    int status = FSCK_OK;
+    if (repair && changed && write_back() < 0) {
+        status = FSCK_ERROR;
+    } else if (unfixed > 0) {
+        status = FSCK_UNCORRECTED;
+    } else if (problems > 0) {
+        status = FSCK_FIXED;
+    }
+
+    printf("[FSCK] %ld problem(s) found, %ld left uncorrected%s\n", problems, unfixed,
+           !repair && problems ? " (run with -y to repair)" : "");
+
+    cleanup_storage();
+    free_metadata_image(&img);
+    free(bad_blocks);
+    evfs_crypto_cleanup();
+    return status;
+}
@@ -0,0 +1,335 @@
+#include "evfs.h"
+#include <pthread.h>
+
+/*
+ * ============================================================================
+ * I/O SCHEDULER MODULE - Orders and paces backing file I/O
+ * ============================================================================
+ *
+ * Every transfer to or from the backing files is admitted here first
+ * (io_submit() / io_complete() around it in evfs_storage.c). At most
+ * IO_SCHED_DEPTH transfers are in flight, IO_SCHED_BG_DEPTH of them
+ * background work. A free slot goes to the first waiter of the highest
+ * io_class_t class waiting, so foreground reads overtake writes and both
+ * overtake compaction; a class passed over for IO_STARVE_MS goes first
+ * instead, so nothing waits forever behind a steady stream of reads.
+ *
+ * Each class can also be held to a rate with a token bucket (--io-rate,
+ * or the class's xattr). io_throttle() charges it and sleeps off any
+ * debt; callers use it before taking storage locks, so a paced request
+ * never holds anybody else up. Background work defaults to the
+ * --compact-rate.
+ */
+
+#define IO_SCHED_DEPTH 8      // backing I/Os in flight at once
+#define IO_SCHED_BG_DEPTH 1   // of which background work
+#define IO_STARVE_MS 50       // longest a waiting class is passed over
+#define IO_BURST_MS 100       // tokens a rate-limited class may bank
+
+// Admission waits are also counted in power-of-two microsecond buckets
+// (bucket b: below 2^b us), for the percentiles
+#define WAIT_BUCKETS 32
+
+typedef struct {
+    // Admission: waiters take tickets and leave in ticket order
+    int queued;
+    int inflight;
+    uint64_t next_ticket;
+    uint64_t serving;
+    uint64_t head_since;  // when the first waiter came to the front (ns)
+
+    // Token bucket
+    long rate;            // bytes/s, 0 = unlimited
+    double tokens;
+    uint64_t refilled;    // ns
+
+    // Counters
+    unsigned long ops;
+    unsigned long bytes;
+    unsigned long max_queued;
+    unsigned long promoted;  // slots taken ahead of a higher class
+    uint64_t wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t throttle_ns;
+    unsigned long wait_hist[WAIT_BUCKETS];
+} io_class_state_t;
+
+static const char *class_names[IO_CLASSES] = { "read", "write", "background" };
+
+static io_class_state_t classes[IO_CLASSES];
+static int inflight = 0;
+static pthread_mutex_t sched_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sched_cond = PTHREAD_COND_INITIALIZER;
+
+// Class set by a background thread for all its I/O, -1 = foreground
+static __thread int thread_class = -1;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void io_sched_init(void) {
+    pthread_mutex_lock(&sched_lock);
+    memset(classes, 0, sizeof(classes));
+    inflight = 0;
+    uint64_t now = now_ns();
+    for (int c = 0; c < IO_CLASSES; c++) {
+        classes[c].rate = evfs_options.io_rate[c];
+        classes[c].refilled = now;
+    }
+    if (classes[IO_CLASS_BACKGROUND].rate == 0) {
+        classes[IO_CLASS_BACKGROUND].rate = (long)evfs_options.compact_rate_mb * 1024 * 1024;
+    }
+    for (int c = 0; c < IO_CLASSES; c++) {
+        classes[c].tokens = classes[c].rate * (IO_BURST_MS / 1000.0);
+        if (evfs_options.io_rate[c] > 0) {
+            printf("[IOSCHED] %s I/O limited to %ld bytes/s\n", class_names[c], classes[c].rate);
+        }
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+io_class_t io_class_of(int is_write) {
+    if (thread_class >= 0) return thread_class;
+    return is_write ? IO_CLASS_WRITE : IO_CLASS_READ;
+}
+
+void io_set_thread_class(io_class_t cls) {
+    thread_class = cls;
+}
+
+int io_class_by_name(const char *name) {
+    for (int c = 0; c < IO_CLASSES; c++) {
+        if (strcmp(name, class_names[c]) == 0) return c;
+    }
+    return -1;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Admission
+ * ----------------------------------------------------------------------------
+ */
+
+static int class_limit(int c) {
+    return c == IO_CLASS_BACKGROUND ? IO_SCHED_BG_DEPTH : IO_SCHED_DEPTH;
+}
+
+// Class whose first waiter gets the next free slot, or -1.
+// Caller holds sched_lock
+static int next_class(uint64_t now, int *promoted) {
+    int first = -1, starved = -1;
+    for (int c = 0; c < IO_CLASSES; c++) {
+        io_class_state_t *s = &classes[c];
+        if (s->queued == 0 || s->inflight >= class_limit(c)) continue;
+        if (first < 0) first = c;
+        if (now - s->head_since >= (uint64_t)IO_STARVE_MS * 1000000 &&
+            (starved < 0 || s->head_since < classes[starved].head_since)) {
+            starved = c;
+        }
+    }
+    *promoted = starved >= 0 && starved != first;
+    return *promoted ? starved : first;
+}
+
+void io_submit(io_class_t cls) {
+    io_class_state_t *s = &classes[cls];
+
+    pthread_mutex_lock(&sched_lock);
+    uint64_t arrived = now_ns();
+    uint64_t ticket = s->next_ticket++;
+    if (s->queued++ == 0) s->head_since = arrived;
+    if ((unsigned long)s->queued > s->max_queued) s->max_queued = s->queued;
+
+    int promoted = 0;
+    for (;;) {
+        if (ticket == s->serving && inflight < IO_SCHED_DEPTH &&
+            next_class(now_ns(), &promoted) == (int)cls) {
+            break;
+        }
+        pthread_cond_wait(&sched_cond, &sched_lock);
+    }
+
+    uint64_t now = now_ns();
+    s->serving++;
+    s->queued--;
+    s->head_since = now;
+    s->inflight++;
+    inflight++;
+    if (promoted) s->promoted++;
+
+    uint64_t waited = now - arrived;
+    s->wait_ns += waited;
+    if (waited > s->max_wait_ns) s->max_wait_ns = waited;
+    int b = 0;
+    while (b < WAIT_BUCKETS - 1 && (waited / 1000) >> b) b++;
+    s->wait_hist[b]++;
+
+    // Another waiter may be able to go too
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+void io_complete(io_class_t cls, size_t bytes) {
+    pthread_mutex_lock(&sched_lock);
+    classes[cls].inflight--;
+    classes[cls].ops++;
+    classes[cls].bytes += bytes;
+    inflight--;
+    pthread_cond_broadcast(&sched_cond);
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Rate limits
+ * ----------------------------------------------------------------------------
+ */
+
+void io_throttle(io_class_t cls, size_t bytes) {
+    io_class_state_t *s = &classes[cls];
+
+    pthread_mutex_lock(&sched_lock);
+    if (s->rate <= 0) {
+        pthread_mutex_unlock(&sched_lock);
+        return;
+    }
+    uint64_t now = now_ns();
+    double burst = s->rate * (IO_BURST_MS / 1000.0);
+    s->tokens += (now - s->refilled) / 1e9 * s->rate;
+    if (s->tokens > burst) s->tokens = burst;
+    s->refilled = now;
+
+    // Taking more than is there puts the bucket in debt; whoever took
+    // the last tokens waits until the debt is paid off
+    s->tokens -= bytes;
+    uint64_t delay = s->tokens < 0 ? (uint64_t)(-s->tokens / s->rate * 1e9) : 0;
+    s->throttle_ns += delay;
+    pthread_mutex_unlock(&sched_lock);
+
+    if (delay > 0) {
+        struct timespec ts = { delay / 1000000000, delay % 1000000000 };
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Statistics
+ * ----------------------------------------------------------------------------
+ */
+
+// Upper bound of the admission wait below which pct percent fall (us).
+// Caller holds sched_lock
+static unsigned long wait_percentile(const io_class_state_t *s, int pct) {
+    unsigned long total = 0;
+    for (int b = 0; b < WAIT_BUCKETS; b++) total += s->wait_hist[b];
+    if (total == 0) return 0;
+
+    unsigned long want = (total * pct + 99) / 100, seen = 0;
+    for (int b = 0; b < WAIT_BUCKETS; b++) {
+        seen += s->wait_hist[b];
+        if (seen >= want) return 1UL << b;
+    }
+    return 1UL << (WAIT_BUCKETS - 1);
+}
+
+// "queued inflight ops bytes wait_avg_us wait_p99_us wait_max_us
+// throttled_ms promoted rate" for one class
+static int format_class(int c, char *buf, size_t size) {
+    pthread_mutex_lock(&sched_lock);
+    io_class_state_t *s = &classes[c];
+    unsigned long admitted = s->ops + s->inflight;
+    int len = snprintf(buf, size, "%d %d %lu %lu %lu %lu %lu %lu %lu %ld",
+                       s->queued, s->inflight, s->ops, s->bytes,
+                       admitted ? (unsigned long)(s->wait_ns / admitted / 1000) : 0,
+                       wait_percentile(s, 99),
+                       (unsigned long)(s->max_wait_ns / 1000),
+                       (unsigned long)(s->throttle_ns / 1000000),
+                       s->promoted, s->rate);
+    pthread_mutex_unlock(&sched_lock);
+    return len;
+}
+
+void print_iosched_stats(void) {
+    printf("I/O scheduler: depth %d (%d background), starvation bound %d ms\n",
+           IO_SCHED_DEPTH, IO_SCHED_BG_DEPTH, IO_STARVE_MS);
+    pthread_mutex_lock(&sched_lock);
+    for (int c = 0; c < IO_CLASSES; c++) {
+        io_class_state_t *s = &classes[c];
+        unsigned long admitted = s->ops + s->inflight;
+        printf("  %-11s %lu ops, %lu bytes, wait avg %lu us / p99 %lu us / max %lu us, "
+               "max queued %lu, throttled %lu ms, promoted %lu",
+               class_names[c], s->ops, s->bytes,
+               admitted ? (unsigned long)(s->wait_ns / admitted / 1000) : 0,
+               wait_percentile(s, 99), (unsigned long)(s->max_wait_ns / 1000),
+               s->max_queued, (unsigned long)(s->throttle_ns / 1000000), s->promoted);
+        if (s->rate > 0) {
+            printf(", limit %ld bytes/s", s->rate);
+        }
+        printf("\n");
+    }
+    pthread_mutex_unlock(&sched_lock);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Management through xattrs on the root directory
+ *   IOSCHED_XATTR_PREFIX "<class>"
+ *     get:    the class's counters (see format_class())
+ *     set:    its rate limit in bytes/s, 0 = unlimited
+ *     remove: lifts the rate limit
+ * ----------------------------------------------------------------------------
+ */
+
+int is_iosched_xattr(const char *name) {
+    return strncmp(name, IOSCHED_XATTR_PREFIX, strlen(IOSCHED_XATTR_PREFIX)) == 0;
+}
+
+int iosched_setxattr(const char *name, const char *value, size_t size) {
+    int c = io_class_by_name(name + strlen(IOSCHED_XATTR_PREFIX));
+    char buf[32];
+    if (c < 0 || size == 0 || size >= sizeof(buf)) {
+        return c < 0 ? -ENOTSUP : -EINVAL;
+    }
+    memcpy(buf, value, size);
+    buf[size] = '\0';
+
+    char *end;
+    long rate = strtol(buf, &end, 10);
+    if (end == buf || *end != '\0' || rate < 0) {
+        return -EINVAL;
+    }
+
+    pthread_mutex_lock(&sched_lock);
+    classes[c].rate = rate;
+    classes[c].tokens = rate * (IO_BURST_MS / 1000.0);
+    classes[c].refilled = now_ns();
+    pthread_mutex_unlock(&sched_lock);
+    printf("[IOSCHED] %s I/O limit set to %ld bytes/s\n", class_names[c], rate);
+    return 0;
+}
+
+int iosched_getxattr(const char *name, char *value, size_t size) {
+    int c = io_class_by_name(name + strlen(IOSCHED_XATTR_PREFIX));
+    if (c < 0) {
+        return -ENODATA;
+    }
+
+    char buf[200];
+    int len = format_class(c, buf, sizeof(buf));
+    if (size == 0) {
+        return len;
+    }
+    if ((size_t)len > size) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
+    return len;
+}
+
+int iosched_removexattr(const char *name) {
+    return iosched_setxattr(name, "0", 1);
+}
@@ -1,8 +1,138 @@
 #include "evfs.h"
+#include "evfs_crypto.h"
+#include <libgen.h>
+#include <limits.h>
+#include <pthread.h>
 
-// Global file table
+// Global inode and directory entry tables
 file_metadata_t file_table[MAX_FILES];
+dentry_t dentry_table[MAX_DENTRIES];
 int initialized = 0;
+evfs_options_t evfs_options = {
+    .compact_rate_mb = 16,
+    .commit_ms = WAL_COMMIT_MS,
+    .inline_max = INLINE_DATA_SIZE,
+    .xattr_cache = XATTR_CACHE_SIZE,
+    .inode_cache = INODE_CACHE_SIZE,
+};
+
+// Physical ranges quarantined by evfs-fsck; carried over on every save
+static extent_t *quarantined = NULL;
+static int quarantined_count = 0;
+
+// Inodes whose inline areas are still sealed (as saved): not used since
+// the mount, or their volume's key is not loaded
+static unsigned char inode_sealed[MAX_FILES];
+
+// Dentries whose names are still sealed (as saved): no lookup or listing
+// has reached them since the mount
+static unsigned char dentry_sealed[MAX_DENTRIES];
+
+// Lookup index over dentry_table, keyed by HMAC(parent inode, name) (each
+// dentry's parent and hash): bucket heads and chains hold dentry index + 1
+// (0 ends a chain)
+#define INDEX_BUCKETS 512
+static int index_head[INDEX_BUCKETS];
+static int index_next[MAX_DENTRIES];
+static pthread_rwlock_t index_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Held across each multi-step change of the inode and dentry tables; see
+// metadata_lock()
+static pthread_mutex_t namespace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void index_rebuild(void);
+
+/*
+ * On-disk metadata layout:
+ *   superblock: header (with the page table) | per used dentry: slot +
+ *     dentry | quota limits | volumes | bad ranges | free ranges | quota
+ *     usage | SHA-256
+ *   inode pages holding any inode, each: META_PAGE_INODES records (by
+ *     slot) | the extents of its used slots in slot order, encrypted as
+ *     one piece, its SHA-256 in the page table
+ * Free ranges and quota usage are only saved at a clean unmount (clean);
+ * otherwise mounting reads every page and works them out again.
+ * The file is rewritten whole to a temporary name and renamed over the
+ * old one, so a crash leaves either the previous or the new version.
+ * Changes made since are in the write-ahead log (evfs_wal.c); wal_seq is
+ * the last log record the file already includes.
+ */
+typedef struct {
+    uint64_t offset;        // in the file, 0 = the page holds no inode
+    uint32_t extent_count;
+    uint32_t used;          // bit n: slot n holds an inode
+    unsigned char sum[EVFS_CHECKSUM_LEN];  // of the page as stored
+} metadata_page_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t backing_count;
+    char cipher[32];
+    uint64_t next_map_id;
+    uint64_t alloc_end;
+    uint64_t wal_seq;
+    uint64_t change_gen;
+    uint64_t super_size;    // superblock bytes, checksum included
+    uint64_t inodes_used;
+    uint32_t dentry_count;
+    uint32_t quota_count;
+    uint32_t volume_count;
+    uint32_t bad_count;
+    uint32_t free_count;
+    uint32_t usage_count;
+    uint32_t clean;
+    uint32_t pad;
+    metadata_page_t pages[META_PAGES];
+} metadata_header_t;
+
+// An inode's slot in its page (all zero when unused)
+typedef struct {
+    uint32_t extent_count;
+    uint32_t old_engine;    // re-encryption progress (see block_map_t)
+    uint64_t map_id;
+    uint64_t reencrypted;
+    uint64_t changed;       // change generation (changed-block tracking)
+    file_metadata_t meta;
+} metadata_record_t;
+
+#define PAGE_RECORDS_SIZE (META_PAGE_INODES * sizeof(metadata_record_t))
+// Pages are sealed like names, under tweaks no dentry slot uses
+#define PAGE_TWEAK(page) (((uint64_t)1 << 32) | (uint64_t)(page))
+
+// A name keeps its table slot, the tweak it is sealed with
+typedef struct {
+    uint32_t d;
+    uint32_t pad;
+    dentry_t dentry;
+} metadata_dentry_t;
+
+// Inode cache state (see INODE CACHE below). meta_fd and meta_pages are
+// the metadata file pages are loaded from; page_saved is each page's
+// digest as in that file (valid where page_known is set)
+static int meta_fd = -1;
+static metadata_page_t meta_pages[META_PAGES];
+static unsigned char page_resident[META_PAGES];
+static unsigned char page_known[META_PAGES];
+static unsigned char page_saved[META_PAGES][EVFS_CHECKSUM_LEN];
+static uint64_t page_used[META_PAGES];     // page_clock at the last use
+static uint64_t page_clock = 0;
+static int pages_resident = 0;
+static int clean_mount = 0;
+static unsigned long page_loads = 0, page_drops = 0;
+static pthread_mutex_t page_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_rwlock_t cache_users = PTHREAD_RWLOCK_INITIALIZER;
+
+// Inodes in a page (the last one may be short)
+static int page_slots(int page) {
+    int left = MAX_FILES - page * META_PAGE_INODES;
+    return left < META_PAGE_INODES ? left : META_PAGE_INODES;
+}
+
+static int read_metadata_super(const char *path, metadata_image_t *img,
+                               metadata_page_t *pages, int *fd_out);
+static int read_metadata_pages(int fd, const metadata_page_t *pages, metadata_image_t *img);
+
 // Initialize the file system
 void init_filesystem(void) {
     if (initialized) {
@@ -13,9 +143,12 @@ void init_filesystem(void) {
     printf("[METADATA] Initializing filesystem metadata...\n");
     
     memset(file_table, 0, sizeof(file_table));
+    memset(dentry_table, 0, sizeof(dentry_table));
+    memset(inode_sealed, 0, sizeof(inode_sealed));
+    memset(dentry_sealed, 0, sizeof(dentry_sealed));
+    index_rebuild();
     
     // Create root directory (/)
-    strcpy(file_table[0].name, "/");
     file_table[0].type = FTYPE_DIR;
     file_table[0].mode = 0755;
     file_table[0].uid = getuid();
@@ -25,7 +158,7 @@ void init_filesystem(void) {
     file_table[0].ctime = time(NULL);
     file_table[0].size = BLOCK_SIZE;
     file_table[0].is_used = 1;
-    file_table[0].parent_idx = -1;
+    file_table[0].nlink = 2;
     
     // Initialize storage system
     if (init_storage() < 0) {
@@ -33,6 +166,89 @@ void init_filesystem(void) {
         return;
     }
     
+    // Until a metadata file says otherwise, every (empty) page is loaded
+    memset(page_resident, 1, sizeof(page_resident));
+    memset(page_known, 0, sizeof(page_known));
+    memset(meta_pages, 0, sizeof(meta_pages));
+    pages_resident = META_PAGES;
+    clean_mount = 0;
+
+    // Restore the files (and quota limits, volumes) of the previous mount, if any
+    struct timespec start, loaded;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init_quotas(NULL, 0);
+    init_volumes(NULL);
+    metadata_image_t img;
+    metadata_page_t pages[META_PAGES];
+    int fd = -1;
+    int ret = read_metadata_super(metadata_path(), &img, pages, &fd);
+
+    // After a clean unmount, with no log to replay and the same cipher,
+    // the superblock is all a mount needs: pages are loaded on first use.
+    // Otherwise every page is read, the log applied and the free space
+    // worked out from the block maps
+    struct stat log_st;
+    int log_empty = stat(wal_path(), &log_st) != 0 || log_st.st_size == 0;
+    if (ret == 0 && !(img.clean && log_empty &&
+                      strcmp(img.cipher, evfs_crypto_engine_name()) == 0)) {
+        ret = read_metadata_pages(fd, pages, &img);
+    }
+    if (ret == 0 && wal_replay(&img) < 0) {
+        free_metadata_image(&img);
+        close(fd);
+        fprintf(stderr, "[METADATA] Cannot replay %s\n", wal_path());
+        return;
+    }
+    if (ret == 0) {
+        ret = import_storage(&img);
+        if (ret < 0) {
+            free_metadata_image(&img);
+            close(fd);
+            fprintf(stderr, "[METADATA] Metadata does not match the backing files\n");
+            return;
+        }
+        meta_fd = fd;
+        memcpy(meta_pages, pages, sizeof(meta_pages));
+        for (int p = 0; p < META_PAGES; p++) {
+            page_resident[p] = !img.absent[p];
+            pages_resident -= img.absent[p];
+            clean_mount |= img.absent[p];
+        }
+        memcpy(file_table, img.files, sizeof(file_table));
+        memcpy(dentry_table, img.dentries, sizeof(dentry_table));
+        // Names and inline areas are decrypted when first used, not here
+        memcpy(dentry_sealed, img.names_sealed, sizeof(dentry_sealed));
+        memcpy(inode_sealed, img.sealed, sizeof(inode_sealed));
+        // The root's page stays loaded
+        if (inode_page_load(0) < 0) {
+            free_metadata_image(&img);
+            fprintf(stderr, "[METADATA] %s is damaged; run evfs-fsck\n", metadata_path());
+            return;
+        }
+        index_rebuild();
+        init_quotas(img.quotas, img.quota_count);
+        if (clean_mount) {
+            import_quota_usage(img.usage, img.usage_count, img.inodes_used);
+        }
+        init_volumes(img.volumes);
+        quarantined = img.bad;
+        quarantined_count = img.bad_count;
+        img.bad = NULL;
+        free_metadata_image(&img);
+        clock_gettime(CLOCK_MONOTONIC, &loaded);
+        printf("[METADATA] Loaded metadata from %s in %.1f ms (%s)\n", metadata_path(),
+               (loaded.tv_sec - start.tv_sec) * 1e3 + (loaded.tv_nsec - start.tv_nsec) / 1e6,
+               clean_mount ? "superblock only" : "all inode pages");
+    } else if (ret != -ENOENT) {
+        fprintf(stderr, "[METADATA] %s is damaged; run evfs-fsck\n", metadata_path());
+        return;
+    }
+    if (!clean_mount) {
+        quota_rebuild();
+    }
+    init_xattrs();
+    init_snapshots();
+    
     initialized = 1;
     printf("[INIT] File system initialized with root directory\n");
     print_file_table();
@@ -40,50 +256,1510 @@ void init_filesystem(void) {
 
 // Find file by path
 int find_file_by_path(const char *path) {
+    return find_path_in_table(dentry_table, path);
+}
+
+// Find file by path in a given dentry table
+int find_path_in_table(const dentry_t *dentries, const char *path) {
     if (strcmp(path, "/") == 0) {
         return 0; // root directory
     }
     
-    // Search for the file in file_table
-    for (int i = 1; i < MAX_FILES; i++) {
-        if (file_table[i].is_used) {
-            // Build full path for this file
-            char full_path[MAX_FILENAME * 2];
-            strcpy(full_path, "/");
-            strcat(full_path, file_table[i].name);
-            
-            if (strcmp(full_path, path) == 0) {
-                return i;
+    int d = find_dentry(dentries, path);
+    return d == -1 ? -1 : dentries[d].inode;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Name index
+ * ----------------------------------------------------------------------------
+ *
+ * Each live name is filed under a keyed hash of (parent directory inode,
+ * last component), so resolving a path costs one probe per component
+ * whatever the number of names, and the hash neither reveals names nor
+ * lets them be chosen to collide. Moving a directory renames the full
+ * paths below it but keeps their parents and last components, so only the
+ * moved name itself is refiled.
+ *
+ * The key is saved with the dentry, so the index is rebuilt at mount
+ * without decrypting names; a name is decrypted when a lookup matches its
+ * key or a listing returns it (dentry_load()).
+ */
+
+static const char *last_component(const char *name) {
+    const char *slash = strrchr(name, '/');
+    return slash ? slash + 1 : name;
+}
+
+static uint64_t name_hash(int parent, const char *name, size_t len) {
+    unsigned char in[sizeof(parent) + MAX_FILENAME];
+    unsigned char mac[EVFS_CHECKSUM_LEN];
+    uint64_t hash = 0;
+
+    memcpy(in, &parent, sizeof(parent));
+    memcpy(in + sizeof(parent), name, len);
+    if (evfs_crypto_name_hash(in, sizeof(parent) + len, mac) == 0) {
+        memcpy(&hash, mac, sizeof(hash));
+    }
+    return hash;
+}
+
+// File dentry d under its key. Caller holds index_lock for writing
+static void index_link(int d) {
+    int b = dentry_table[d].hash % INDEX_BUCKETS;
+    index_next[d] = index_head[b];
+    index_head[b] = d + 1;
+}
+
+// Work out dentry d's key from its (plain) name and file it. Caller holds
+// index_lock for writing
+static void index_insert(int d, int parent) {
+    const char *last = last_component(dentry_table[d].name);
+    dentry_table[d].parent = parent;
+    dentry_table[d].hash = name_hash(parent, last, strlen(last));
+    index_link(d);
+}
+
+// Caller holds index_lock for writing
+static void index_remove(int d) {
+    int *link = &index_head[dentry_table[d].hash % INDEX_BUCKETS];
+    while (*link != 0) {
+        if (*link == d + 1) {
+            *link = index_next[d];
+            return;
+        }
+        link = &index_next[*link - 1];
+    }
+}
+
+// Refile every name. Sealed names go in under their saved key; the others
+// are filed from the name, parents before their children
+static void index_rebuild(void) {
+    pthread_rwlock_wrlock(&index_lock);
+    memset(index_head, 0, sizeof(index_head));
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dentry_table[d].is_used && dentry_sealed[d] && dentry_table[d].hash != 0) {
+            index_link(d);
+        }
+    }
+    pthread_rwlock_unlock(&index_lock);
+
+    for (int depth = 0, more = 1; more; depth++) {
+        more = 0;
+        for (int d = 0; d < MAX_DENTRIES; d++) {
+            if (!dentry_table[d].is_used) continue;
+            if (dentry_sealed[d] && dentry_table[d].hash != 0) continue;
+            dentry_load(d);
+            int slashes = 0;
+            for (const char *c = dentry_table[d].name; *c; c++) slashes += *c == '/';
+            if (slashes > depth) more = 1;
+            if (slashes != depth) continue;
+
+            char path[MAX_FILENAME + 1] = "/";
+            strcpy(path + 1, dentry_table[d].name);
+            int parent = parent_directory(path);  // orphans stay unreachable
+            pthread_rwlock_wrlock(&index_lock);
+            index_insert(d, parent);
+            pthread_rwlock_unlock(&index_lock);
+        }
+    }
+}
+
+static int index_lookup(int parent, const char *name, size_t len) {
+    uint64_t hash = name_hash(parent, name, len);
+    int found = -1, sealed;
+
+    // A sealed name with the right key is decrypted, then compared
+    do {
+        sealed = -1;
+        pthread_rwlock_rdlock(&index_lock);
+        for (int e = index_head[hash % INDEX_BUCKETS]; e != 0; e = index_next[e - 1]) {
+            int d = e - 1;
+            if (dentry_table[d].hash != hash || dentry_table[d].parent != parent) continue;
+            if (dentry_sealed[d]) {
+                sealed = d;
+                break;
+            }
+            const char *last = last_component(dentry_table[d].name);
+            if (strlen(last) == len && memcmp(last, name, len) == 0) {
+                found = d;
+                break;
+            }
+        }
+        pthread_rwlock_unlock(&index_lock);
+        if (sealed != -1) dentry_load(sealed);
+    } while (sealed != -1);
+    return found;
+}
+
+static int index_find(const char *path) {
+    int parent = 0, d = -1;
+    const char *name = path + 1;
+
+    for (;;) {
+        size_t len = strcspn(name, "/");
+        if (len == 0 || len >= MAX_FILENAME) return -1;
+        d = index_lookup(parent, name, len);
+        if (d == -1) return -1;
+        // Whatever is found next uses the inode
+        if (inode_page_load(INODE_PAGE(dentry_table[d].inode)) < 0) return -1;
+        if (name[len] == '\0') return d;
+        parent = dentry_table[d].inode;
+        name += len + 1;
+    }
+}
+
+void dentry_set_name(int d, const char *path, int parent) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_remove(d);
+    dentry_sealed[d] = 0;
+    strcpy(dentry_table[d].name, path + 1);
+    index_insert(d, parent);
+    pthread_rwlock_unlock(&index_lock);
+}
+
+void dentry_release(int d) {
+    pthread_rwlock_wrlock(&index_lock);
+    index_remove(d);
+    memset(&dentry_table[d], 0, sizeof(dentry_t));
+    dentry_sealed[d] = 0;
+    pthread_rwlock_unlock(&index_lock);
+}
+
+int find_dentry(const dentry_t *dentries, const char *path) {
+    if (path[0] != '/') {
+        return -1;
+    }
+    if (dentries == dentry_table) {
+        return index_find(path);
+    }
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dentries[d].is_used && strcmp(dentries[d].name, path + 1) == 0) {
+            return d;
+        }
+    }
+    return -1;
+}
+
+const char *dentry_child_name(const dentry_t *dentry, const char *dir_path) {
+    if (!dentry->is_used) {
+        return NULL;
+    }
+    const char *rest = dentry->name;
+    if (strcmp(dir_path, "/") != 0) {
+        size_t len = strlen(dir_path + 1);
+        if (strncmp(rest, dir_path + 1, len) != 0 || rest[len] != '/') {
+            return NULL;
+        }
+        rest += len + 1;
+    }
+    return strchr(rest, '/') ? NULL : rest;
+}
+
+int directory_is_empty(const dentry_t *dentries, const char *dir_path) {
+    // Live names are told apart by their parent, sealed or not
+    int dir_idx = dentries == dentry_table ? find_file_by_path(dir_path) : -1;
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dir_idx != -1 ? dentries[d].is_used && dentries[d].parent == dir_idx
+                          : dentry_child_name(&dentries[d], dir_path) != NULL) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int dentries_below(int dir_idx, int *out) {
+    unsigned char below[MAX_FILES] = { 0 };
+    unsigned char taken[MAX_DENTRIES] = { 0 };
+    int n = 0;
+
+    // By parent, a level per pass
+    below[dir_idx] = 1;
+    for (int more = 1; more; ) {
+        more = 0;
+        for (int d = 0; d < MAX_DENTRIES; d++) {
+            const dentry_t *dentry = &dentry_table[d];
+            if (!dentry->is_used || taken[d] || dentry->parent < 0 || !below[dentry->parent]) {
+                continue;
+            }
+            dentry_load(d);
+            taken[d] = 1;
+            out[n++] = d;
+            if (file_table[dentry->inode].type == FTYPE_DIR) {
+                below[dentry->inode] = more = 1;
+            }
+        }
+    }
+    return n;
+}
+
+/*
+ * Listings use the filler's offset mode: each entry carries the offset of
+ * the next, so when the kernel's buffer is full the next call picks up
+ * where this one stopped instead of starting over. Offsets are positions:
+ * 1 ".", 2 "..", 3 SNAPSHOT_DIR, then DIR_OFF_DENTRIES + dentry index, so
+ * names added or removed in between neither repeat nor shift the others.
+ */
+#define DIR_OFF_DENTRIES 3
+
+int fill_directory(const file_metadata_t *files, const dentry_t *dentries, const char *dir_path,
+                   int dir_idx, int flags, void *buf, fuse_fill_dir_t filler, off_t offset) {
+    struct stat st;
+
+    if (offset < 1) {
+        metadata_to_stat(&files[dir_idx], &st);
+        if (flags & FILL_READ_ONLY) st.st_mode &= ~0222;
+        if (filler(buf, ".", &st, 1)) return 0;
+    }
+    if (offset < 2 && filler(buf, "..", NULL, 2)) {
+        return 0;
+    }
+    if (offset < DIR_OFF_DENTRIES && (flags & FILL_SNAPSHOT_DIR)) {
+        snapshot_getattr(SNAPSHOT_DIR, &st);
+        if (filler(buf, SNAPSHOT_DIR + 1, &st, DIR_OFF_DENTRIES)) return 0;
+    }
+
+    // Attributes come along, saving a getattr per entry. Only the live
+    // names handed to the filler are decrypted
+    int first = offset > DIR_OFF_DENTRIES ? offset - DIR_OFF_DENTRIES : 0;
+    for (int d = first; d < MAX_DENTRIES; d++) {
+        if (dentries == dentry_table) {
+            if (!dentries[d].is_used || dentries[d].parent != dir_idx) continue;
+            dentry_load(d);
+        }
+        const char *child = dentry_child_name(&dentries[d], dir_path);
+        if (!child) continue;
+        metadata_to_stat(&files[dentries[d].inode], &st);
+        if (flags & FILL_READ_ONLY) st.st_mode &= ~0222;
+        if (filler(buf, child, &st, DIR_OFF_DENTRIES + d + 1)) return 0;
+    }
+    return 0;
+}
+
+int parent_directory(const char *path) {
+    char parent[MAX_FILENAME + 1];
+    const char *slash = strrchr(path, '/');
+    if (!slash || slash == path) {
+        return 0; // root directory
+    }
+    if ((size_t)(slash - path) >= sizeof(parent)) {
+        return -ENOENT;
+    }
+    memcpy(parent, path, slash - path);
+    parent[slash - path] = '\0';
+
+    int idx = find_file_by_path(parent);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    return file_table[idx].type == FTYPE_DIR ? idx : -ENOTDIR;
+}
+
+void metadata_lock(void) {
+    pthread_mutex_lock(&namespace_lock);
+}
+
+void metadata_unlock(void) {
+    pthread_mutex_unlock(&namespace_lock);
+}
+
+int dentry_add(const char *path, int inode) {
+    if (strlen(path + 1) >= MAX_FILENAME) {
+        return -ENAMETOOLONG;
+    }
+    int parent = parent_directory(path);
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (!dentry_table[d].is_used) {
+            dentry_table[d].inode = inode;
+            dentry_table[d].is_used = 1;
+            dentry_set_name(d, path, parent);
+
+            // A directory's ".." is a link to its parent
+            if (file_table[inode].type == FTYPE_DIR) {
+                if (parent >= 0) file_table[parent].nlink++;
+            } else {
+                file_table[inode].nlink++;
+            }
+            return d;
+        }
+    }
+    return -ENOSPC;
+}
+
+void inode_drop_link(int idx) {
+    file_metadata_t *meta = &file_table[idx];
+
+    if (meta->type == FTYPE_DIR) {
+        meta->nlink = 0;
+    } else if (meta->nlink > 0) {
+        meta->nlink--;
+    }
+    meta->ctime = time(NULL);
+
+    // Last name gone: release data (in the background), xattrs and the
+    // inode itself
+    if (meta->nlink == 0) {
+        release_storage(idx);
+        xattr_forget(idx);
+        inode_sealed[idx] = 0;
+        quota_account(meta->uid, meta->gid, 0, -1);
+        memset(meta, 0, sizeof(*meta));
+    }
+}
+
+void dentry_unlink(int d) {
+    int idx = dentry_table[d].inode;
+    int parent = dentry_table[d].parent;
+
+    dentry_release(d);
+
+    if (file_table[idx].type == FTYPE_DIR) {
+        if (parent >= 0 && file_table[parent].nlink > 2) file_table[parent].nlink--;
+    }
+    inode_drop_link(idx);
+}
+
+int dentry_seal(dentry_t *dentry, uint64_t tweak, int seal) {
+    if (seal) {
+        size_t len = strnlen(dentry->name, MAX_FILENAME);
+        memset(dentry->name + len, 0, MAX_FILENAME - len);
+    }
+    if (evfs_crypto_seal_name(dentry->name, MAX_FILENAME, tweak, seal) != 0) {
+        return -EIO;
+    }
+    dentry->name[MAX_FILENAME - 1] = '\0';
+    return 0;
+}
+
+void dentry_load(int d) {
+    // A name is decrypted to be used, and its inode with it
+    inode_page_load(INODE_PAGE(dentry_table[d].inode));
+    if (!dentry_sealed[d]) {
+        return;
+    }
+    // Not while the tables are copied (a save, commit or snapshot), nor
+    // while a lookup reads the names
+    storage_lock_tables();
+    pthread_rwlock_wrlock(&index_lock);
+    if (dentry_sealed[d] && dentry_seal(&dentry_table[d], d, 0) != 0) {
+        fprintf(stderr, "[METADATA] Name of dentry %d is damaged\n", d);
+    }
+    dentry_sealed[d] = 0;
+    pthread_rwlock_unlock(&index_lock);
+    storage_unlock_tables();
+}
+
+int dentry_is_sealed(int d) {
+    return d >= 0 && d < MAX_DENTRIES && dentry_sealed[d];
+}
+
+int unseal_image_names(metadata_image_t *img) {
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (!img->names_sealed[d]) continue;
+        if (dentry_seal(&img->dentries[d], d, 0) != 0) {
+            return -EIO;
+        }
+        img->names_sealed[d] = 0;
+    }
+    return 0;
+}
+
+void inode_accessed(int idx) {
+    file_metadata_t *meta = &file_table[idx];
+    time_t now = time(NULL);
+
+    switch (evfs_options.atime) {
+    case ATIME_NONE:
+        return;
+    case ATIME_RELATIME:
+        if (meta->atime > meta->mtime && meta->atime > meta->ctime &&
+            now - meta->atime < ATIME_RELATIME_SEC) {
+            return;
+        }
+        break;
+    case ATIME_STRICT:
+        break;
+    }
+    meta->atime = now;
+}
+
+// Tweak for sealing a short symlink target: a logical block no file data
+// reaches, apart from those of the inline xattrs and contents
+#define SYMLINK_SEAL_LBLK (XATTR_LBLK - 3)
+
+static int symlink_seal(char *area, uint64_t map_id, uint32_t engine, int enc) {
+    evfs_crypto_vec_t v = { area, area, SYMLINK_INLINE_SIZE, map_id, SYMLINK_SEAL_LBLK, engine };
+    return enc ? evfs_encrypt_blocks(&v, 1) : evfs_decrypt_blocks(&v, 1);
+}
+
+int inode_seal(file_metadata_t *meta, uint64_t map_id, uint32_t engine, int seal) {
+    int ret = 0;
+    if (xattr_seal(meta->xattr, map_id, engine, seal) != 0) {
+        if (!seal) memset(meta->xattr, 0, XATTR_INLINE_SIZE);
+        ret = -EIO;
+    }
+    if (meta->inline_data && inline_data_seal(meta->data, map_id, engine, seal) != 0) {
+        if (!seal) memset(meta->data, 0, INLINE_DATA_SIZE);
+        ret = -EIO;
+    }
+    if (symlink_is_inline(meta) && symlink_seal(meta->symlink, map_id, engine, seal) != 0) {
+        if (!seal) memset(meta->symlink, 0, SYMLINK_INLINE_SIZE);
+        ret = -EIO;
+    }
+    return ret;
+}
+
+void seal_volume_inodes(uint32_t volume) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!file_table[i].is_used || file_table[i].volume != volume || inode_sealed[i]) {
+            continue;
+        }
+        uint64_t map_id = storage_map_id(i);
+        uint32_t engine = storage_map_engine(i);
+        storage_lock_tables();
+        if (file_table[i].is_used && !inode_sealed[i]) {
+            if (inode_seal(&file_table[i], map_id, engine, 1) != 0) {
+                fprintf(stderr, "[METADATA] Cannot seal inline data of inode %d\n", i);
             }
+            inode_sealed[i] = 1;
+        }
+        storage_unlock_tables();
+    }
+}
+
+void inode_load(int file_idx) {
+    if (!inode_sealed[file_idx]) {
+        return;
+    }
+    uint64_t map_id = storage_map_id(file_idx);
+    uint32_t engine = storage_map_engine(file_idx);
+    storage_lock_tables();
+    if (file_table[file_idx].is_used && inode_sealed[file_idx] &&
+        inode_seal(&file_table[file_idx], map_id, engine, 0) != 0) {
+        fprintf(stderr, "[METADATA] Inline data of inode %d is damaged; dropped\n", file_idx);
+    }
+    inode_sealed[file_idx] = 0;
+    storage_unlock_tables();
+    EVFS_PROBE1(inode__unseal, file_idx);
+}
+
+int inode_is_sealed(int file_idx) {
+    return file_idx >= 0 && file_idx < MAX_FILES && inode_sealed[file_idx];
+}
+
+int restore_metadata(const file_metadata_t *files, const unsigned char *restore,
+                     const dentry_t *dentries, int count) {
+    // A restored inode's names are replaced whole; any other name must
+    // not be in the way, and all must fit
+    int free_slots = 0;
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (!dentry_table[d].is_used || restore[dentry_table[d].inode]) free_slots++;
+    }
+    if (count > free_slots) {
+        return -ENOSPC;
+    }
+    for (int k = 0; k < count; k++) {
+        char path[MAX_FILENAME + 1];
+        snprintf(path, sizeof(path), "/%s", dentries[k].name);
+        int d = find_dentry(dentry_table, path);
+        if (d != -1 && !restore[dentry_table[d].inode]) {
+            return -ESTALE;
         }
     }
+
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dentry_table[d].is_used && restore[dentry_table[d].inode]) {
+            memset(&dentry_table[d], 0, sizeof(dentry_t));
+            dentry_sealed[d] = 0;
+        }
+    }
+    for (int k = 0, d = 0; k < count; k++, d++) {
+        while (dentry_table[d].is_used) d++;
+        dentry_table[d] = dentries[k];
+        dentry_sealed[d] = 0;
+    }
+
+    storage_lock_tables();
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!restore[i]) continue;
+        file_table[i] = files[i];
+        inode_sealed[i] = files[i].is_used;
+    }
+    storage_unlock_tables();
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (restore[i]) xattr_uncache(i);
+    }
+    index_rebuild();
+    quota_rebuild();
+    return 0;
+}
+
+// Longest target kept in the inode: the area is sealed like the inline
+// xattrs, so the cipher's overhead comes off it
+static size_t symlink_inline_max(void) {
+    return SYMLINK_INLINE_SIZE - 1 - evfs_crypto_block_overhead();
+}
+
+int symlink_is_inline(const file_metadata_t *meta) {
+    return meta->type == FTYPE_SYMLINK && (size_t)meta->size <= symlink_inline_max();
+}
+
+int symlink_store(int file_idx, const char *target) {
+    file_metadata_t *meta = &file_table[file_idx];
+    size_t len = strlen(target);
+
+    if (len <= symlink_inline_max()) {
+        memset(meta->symlink, 0, SYMLINK_INLINE_SIZE);
+        memcpy(meta->symlink, target, len + 1);
+    } else {
+        int ret = write_block(file_idx, 0, target, len);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    meta->size = len;
+    return 0;
+}
+
+int symlink_read(int file_idx, char *buf, size_t size) {
+    file_metadata_t *meta = &file_table[file_idx];
+    size_t len = (size_t)meta->size < size ? (size_t)meta->size : size;
+
+    if (symlink_is_inline(meta)) {
+        memcpy(buf, meta->symlink, len);
+        return len;
+    }
+    return read_block(file_idx, 0, buf, len);
+}
+
+// Fill a struct stat from a metadata entry
+void metadata_to_stat(const file_metadata_t *meta, struct stat *stbuf) {
+    memset(stbuf, 0, sizeof(struct stat));
+
+    if (meta->type == FTYPE_DIR) {
+        stbuf->st_mode = S_IFDIR | meta->mode;
+    } else if (meta->type == FTYPE_SYMLINK) {
+        stbuf->st_mode = S_IFLNK | meta->mode;
+        stbuf->st_size = meta->size;
+    } else {
+        stbuf->st_mode = S_IFREG | meta->mode;
+        stbuf->st_size = meta->size;
+    }
+    stbuf->st_nlink = meta->nlink;
     
-    return -1; // not found
+    stbuf->st_uid = meta->uid;
+    stbuf->st_gid = meta->gid;
+    stbuf->st_atime = meta->atime;
+    stbuf->st_mtime = meta->mtime;
+    stbuf->st_ctime = meta->ctime;
 }
 
-// Find an empty slot in file_table
+// Find an empty slot in file_table: in a loaded page if there is one,
+// else in the first page the page table says has room
 int find_free_slot(void) {
     for (int i = 1; i < MAX_FILES; i++) {
-        if (!file_table[i].is_used) {
+        if (inode_page_resident(INODE_PAGE(i)) && !file_table[i].is_used) {
+            inode_sealed[i] = 0;
             return i;
         }
     }
+    for (int p = 1; p < META_PAGES; p++) {
+        pthread_mutex_lock(&page_lock);
+        int room = !page_resident[p] && meta_pages[p].used != (1u << page_slots(p)) - 1;
+        pthread_mutex_unlock(&page_lock);
+        if (!room || inode_page_load(p) < 0) continue;
+        for (int i = p * META_PAGE_INODES; i < p * META_PAGE_INODES + page_slots(p); i++) {
+            if (!file_table[i].is_used) {
+                inode_sealed[i] = 0;
+                return i;
+            }
+        }
+    }
     return -1;
 }
 
+static const char *type_name(file_type_t type) {
+    return type == FTYPE_DIR ? "DIR" : type == FTYPE_SYMLINK ? "LINK" : "FILE";
+}
+
 // Print file table for debugging
 void print_file_table(void) {
     printf("\n========== FILE TABLE ==========\n");
-    printf("IDX | USED | TYPE | NAME\n");
+    printf("INODE | TYPE | NLINK | NAME\n");
     printf("--------------------------------\n");
-    for (int i = 0; i < MAX_FILES; i++) {
-        if (file_table[i].is_used) {
-            printf("%3d | %4d | %4s | %s\n", 
-                   i, 
-                   file_table[i].is_used,
-                   file_table[i].type == FTYPE_DIR ? "DIR" : "FILE",
-                   file_table[i].name);
+    printf("%5d | %4s | %5u | /\n", 0, type_name(file_table[0].type), file_table[0].nlink);
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dentry_table[d].is_used) {
+            int i = dentry_table[d].inode;
+            int loaded = inode_page_resident(INODE_PAGE(i));
+            printf("%5d | %4s | %5u | %s%s\n",
+                   i,
+                   loaded ? type_name(file_table[i].type) : "-",
+                   loaded ? file_table[i].nlink : 0,
+                   dentry_sealed[d] ? "(sealed)" : "/",
+                   dentry_sealed[d] ? "" : dentry_table[d].name);
         }
     }
     printf("================================\n\n");
-}
\ No newline at end of file
+}
+
+/*
+ * ============================================================================
+ * METADATA PERSISTENCE
+ * ============================================================================
+ */
+
+const char *metadata_path(void) {
+    return evfs_options.metadata_file ? evfs_options.metadata_file : METADATA_FILE;
+}
+
+void free_metadata_image(metadata_image_t *img) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        blockmap_free(&img->maps[i]);
+    }
+    free(img->bad);
+    img->bad = NULL;
+    img->bad_count = 0;
+    free(img->free);
+    img->free = NULL;
+    img->free_count = 0;
+    free(img->usage);
+    img->usage = NULL;
+    img->usage_count = 0;
+}
+
+// Bounds-checked cursor over a loaded file
+static const void *take(const char **pos, const char *end, size_t len) {
+    if ((size_t)(end - *pos) < len) return NULL;
+    const void *p = *pos;
+    *pos += len;
+    return p;
+}
+
+// Whole reads and writes at an offset: 0, -EINVAL for a short file, -EIO
+static int read_at(int fd, void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, (char *)buf + done, size - done, offset + done);
+        if (n < 0) return -EIO;
+        if (n == 0) return -EINVAL;
+        done += n;
+    }
+    return 0;
+}
+
+static int write_at(int fd, const void *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, (const char *)buf + done, size - done, offset + done);
+        if (n < 0) return -errno;
+        done += n;
+    }
+    return 0;
+}
+
+static size_t page_size(const metadata_page_t *pg) {
+    return PAGE_RECORDS_SIZE + (size_t)pg->extent_count * sizeof(extent_t);
+}
+
+/*
+ * Read, check and decrypt one inode page into files and maps (indexed
+ * from the page's first inode; unused slots come back empty, used ones
+ * with their inline areas sealed). Returns 0, -EINVAL if it is damaged,
+ * -ENOMEM or -EIO
+ */
+static int read_page(int fd, const metadata_page_t *pg, int page,
+                     file_metadata_t *files, block_map_t *maps) {
+    int count = page_slots(page);
+    memset(files, 0, count * sizeof(file_metadata_t));
+    for (int s = 0; s < count; s++) {
+        blockmap_init(&maps[s], 0);
+    }
+    if (pg->offset == 0) {
+        return pg->used == 0 && pg->extent_count == 0 ? 0 : -EINVAL;
+    }
+    if ((pg->used >> count) != 0 || pg->extent_count > INT_MAX / sizeof(extent_t)) {
+        return -EINVAL;
+    }
+
+    size_t size = page_size(pg);
+    char *data = malloc(size);
+    if (!data) {
+        return -ENOMEM;
+    }
+    // Checksum first: nothing below trusts a damaged page
+    unsigned char sum[EVFS_CHECKSUM_LEN];
+    int ret = read_at(fd, data, size, pg->offset);
+    if (ret == 0 && (evfs_checksum(data, size, sum) != 0 ||
+                     memcmp(sum, pg->sum, EVFS_CHECKSUM_LEN) != 0 ||
+                     evfs_crypto_seal_name(data, size, PAGE_TWEAK(page), 0) != 0)) {
+        ret = -EINVAL;
+    }
+
+    const metadata_record_t *recs = (const metadata_record_t *)data;
+    const extent_t *ext = (const extent_t *)(data + PAGE_RECORDS_SIZE);
+    uint64_t left = pg->extent_count;
+    for (int s = 0; s < count && ret == 0; s++) {
+        const metadata_record_t *rec = &recs[s];
+        if (!(pg->used & (1u << s))) {
+            if (rec->extent_count != 0) ret = -EINVAL;
+            continue;
+        }
+        if (rec->extent_count > left) {
+            ret = -EINVAL;
+            break;
+        }
+        files[s] = rec->meta;
+        files[s].is_used = 1;
+
+        block_map_t *map = &maps[s];
+        blockmap_init(map, rec->map_id);
+        map->old_engine = rec->old_engine;
+        map->reencrypted = rec->reencrypted;
+        map->changed = rec->changed;
+        if (rec->extent_count > 0) {
+            map->extents = malloc(rec->extent_count * sizeof(extent_t));
+            if (!map->extents) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(map->extents, ext, rec->extent_count * sizeof(extent_t));
+            map->count = map->capacity = rec->extent_count;
+        }
+        ext += rec->extent_count;
+        left -= rec->extent_count;
+    }
+    if (ret == 0 && left != 0) {
+        ret = -EINVAL;
+    }
+
+    memset(data, 0, size);
+    free(data);
+    if (ret < 0) {
+        memset(files, 0, count * sizeof(file_metadata_t));
+        for (int s = 0; s < count; s++) {
+            blockmap_free(&maps[s]);
+        }
+    }
+    return ret;
+}
+
+/*
+ * Read the superblock only: every inode page is left absent. pages (if
+ * given) receives the page table; fd_out (if given) the open file, for
+ * read_metadata_pages() or loading pages later
+ */
+static int read_metadata_super(const char *path, metadata_image_t *img,
+                               metadata_page_t *pages, int *fd_out) {
+    memset(img, 0, sizeof(*img));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return errno == ENOENT ? -ENOENT : -EIO;
+    }
+
+    metadata_header_t head;
+    char *data = NULL;
+    int ret = read_at(fd, &head, sizeof(head), 0);
+    if (ret == 0 && (head.magic != METADATA_MAGIC || head.version != METADATA_VERSION ||
+                     head.super_size < sizeof(head) + EVFS_CHECKSUM_LEN ||
+                     head.super_size > INT_MAX)) {
+        ret = -EINVAL;
+    }
+    if (ret == 0 && !(data = malloc(head.super_size))) {
+        ret = -ENOMEM;
+    }
+    if (ret == 0) {
+        ret = read_at(fd, data, head.super_size, 0);
+    }
+
+    // Checksum first: nothing below trusts a damaged file
+    unsigned char sum[EVFS_CHECKSUM_LEN];
+    if (ret == 0 && (evfs_checksum(data, head.super_size - EVFS_CHECKSUM_LEN, sum) != 0 ||
+                     memcmp(sum, data + head.super_size - EVFS_CHECKSUM_LEN,
+                            EVFS_CHECKSUM_LEN) != 0)) {
+        ret = -EINVAL;
+    }
+    if (ret < 0) {
+        free(data);
+        close(fd);
+        return ret;
+    }
+
+    const char *pos = data;
+    const char *end = data + head.super_size - EVFS_CHECKSUM_LEN;
+    const metadata_header_t *hdr = take(&pos, end, sizeof(*hdr));
+
+    memcpy(img->cipher, hdr->cipher, sizeof(img->cipher));
+    img->cipher[sizeof(img->cipher) - 1] = '\0';
+    img->backing_count = hdr->backing_count;
+    img->next_map_id = hdr->next_map_id;
+    img->alloc_end = hdr->alloc_end;
+    img->wal_seq = hdr->wal_seq;
+    img->change_gen = hdr->change_gen;
+    img->clean = hdr->clean;
+    img->inodes_used = hdr->inodes_used;
+    memset(img->absent, 1, sizeof(img->absent));
+
+    if (hdr->dentry_count > MAX_DENTRIES) {
+        ret = -EINVAL;
+    }
+    // Names stay sealed; see dentry_load() and unseal_image_names()
+    for (uint32_t r = 0; r < hdr->dentry_count && ret == 0; r++) {
+        const metadata_dentry_t *rec = take(&pos, end, sizeof(*rec));
+        if (!rec || rec->d >= MAX_DENTRIES || img->dentries[rec->d].is_used ||
+            rec->dentry.inode < 0 || rec->dentry.inode >= MAX_FILES ||
+            rec->dentry.parent >= MAX_FILES) {
+            ret = -EINVAL;
+            break;
+        }
+        img->dentries[rec->d] = rec->dentry;
+        img->dentries[rec->d].is_used = 1;
+        img->names_sealed[rec->d] = 1;
+    }
+
+    if (ret == 0 && hdr->quota_count > MAX_QUOTAS) {
+        ret = -EINVAL;
+    }
+    if (ret == 0 && hdr->quota_count > 0) {
+        const quota_limit_t *limits = take(&pos, end, hdr->quota_count * sizeof(quota_limit_t));
+        if (!limits) {
+            ret = -EINVAL;
+        } else {
+            memcpy(img->quotas, limits, hdr->quota_count * sizeof(quota_limit_t));
+            img->quota_count = hdr->quota_count;
+        }
+    }
+
+    if (ret == 0 && hdr->volume_count > MAX_VOLUMES) {
+        ret = -EINVAL;
+    }
+    for (uint32_t v = 0; v < hdr->volume_count && ret == 0; v++) {
+        const uint32_t *id = take(&pos, end, sizeof(*id));
+        const volume_t *volume = id ? take(&pos, end, sizeof(*volume)) : NULL;
+        if (!volume || *id == 0 || *id >= MAX_VOLUMES || img->volumes[*id].is_used) {
+            ret = -EINVAL;
+            break;
+        }
+        img->volumes[*id] = *volume;
+        img->volumes[*id].name[VOLUME_NAME_MAX - 1] = '\0';
+        img->volumes[*id].is_used = 1;
+    }
+
+    if (ret == 0 && hdr->bad_count > 0) {
+        const extent_t *bad = take(&pos, end, (size_t)hdr->bad_count * sizeof(extent_t));
+        img->bad = bad ? malloc(hdr->bad_count * sizeof(extent_t)) : NULL;
+        if (!img->bad) {
+            ret = bad ? -ENOMEM : -EINVAL;
+        } else {
+            memcpy(img->bad, bad, hdr->bad_count * sizeof(extent_t));
+            img->bad_count = hdr->bad_count;
+        }
+    }
+    if (ret == 0 && hdr->free_count > 0) {
+        const extent_t *ranges = take(&pos, end, (size_t)hdr->free_count * sizeof(extent_t));
+        img->free = ranges ? malloc(hdr->free_count * sizeof(extent_t)) : NULL;
+        if (!img->free) {
+            ret = ranges ? -ENOMEM : -EINVAL;
+        } else {
+            memcpy(img->free, ranges, hdr->free_count * sizeof(extent_t));
+            img->free_count = hdr->free_count;
+        }
+    }
+    if (ret == 0 && hdr->usage_count > 0) {
+        const quota_usage_t *usage = take(&pos, end, (size_t)hdr->usage_count * sizeof(quota_usage_t));
+        img->usage = usage ? malloc(hdr->usage_count * sizeof(quota_usage_t)) : NULL;
+        if (!img->usage) {
+            ret = usage ? -ENOMEM : -EINVAL;
+        } else {
+            memcpy(img->usage, usage, hdr->usage_count * sizeof(quota_usage_t));
+            img->usage_count = hdr->usage_count;
+        }
+    }
+    if (ret == 0 && pos != end) {
+        ret = -EINVAL;
+    }
+    if (ret == 0 && pages) {
+        memcpy(pages, hdr->pages, sizeof(hdr->pages));
+    }
+
+    free(data);
+    if (ret < 0) {
+        free_metadata_image(img);
+    }
+    if (ret < 0 || !fd_out) {
+        close(fd);
+    } else {
+        *fd_out = fd;
+    }
+    return ret;
+}
+
+// Load every page an image still lacks
+static int read_metadata_pages(int fd, const metadata_page_t *pages, metadata_image_t *img) {
+    for (int p = 0; p < META_PAGES; p++) {
+        if (!img->absent[p]) continue;
+        int first = p * META_PAGE_INODES;
+        int ret = read_page(fd, &pages[p], p, &img->files[first], &img->maps[first]);
+        if (ret < 0) {
+            free_metadata_image(img);
+            return ret;
+        }
+        for (int i = first; i < first + page_slots(p); i++) {
+            img->sealed[i] = img->files[i].is_used;
+        }
+        img->absent[p] = 0;
+    }
+    return 0;
+}
+
+int read_metadata_image(const char *path, metadata_image_t *img) {
+    metadata_page_t pages[META_PAGES];
+    int fd;
+    int ret = read_metadata_super(path, img, pages, &fd);
+    if (ret == 0) {
+        ret = read_metadata_pages(fd, pages, img);
+        close(fd);
+    }
+    return ret;
+}
+
+// Serialise and seal an image's page p. Returns its size, 0 if it holds
+// no inode, or -errno
+static ssize_t build_page(const metadata_image_t *img, int p, metadata_page_t *pg, char **out) {
+    int first = p * META_PAGE_INODES;
+    memset(pg, 0, sizeof(*pg));
+    for (int s = 0; s < page_slots(p); s++) {
+        if (!img->files[first + s].is_used) continue;
+        pg->used |= 1u << s;
+        pg->extent_count += img->maps[first + s].count;
+    }
+    if (pg->used == 0) {
+        return 0;
+    }
+
+    size_t size = page_size(pg);
+    char *data = calloc(1, size);
+    if (!data) {
+        return -ENOMEM;
+    }
+    metadata_record_t *recs = (metadata_record_t *)data;
+    char *pos = data + PAGE_RECORDS_SIZE;
+    for (int s = 0; s < page_slots(p); s++) {
+        const int i = first + s;
+        if (!img->files[i].is_used) continue;
+        metadata_record_t *rec = &recs[s];
+        rec->extent_count = img->maps[i].count;
+        rec->old_engine = img->maps[i].old_engine;
+        rec->map_id = img->maps[i].id;
+        rec->reencrypted = img->maps[i].reencrypted;
+        rec->changed = img->maps[i].changed;
+        rec->meta = img->files[i];
+        memcpy(pos, img->maps[i].extents, img->maps[i].count * sizeof(extent_t));
+        pos += img->maps[i].count * sizeof(extent_t);
+    }
+    if (evfs_crypto_seal_name(data, size, PAGE_TWEAK(p), 1) != 0 ||
+        evfs_checksum(data, size, pg->sum) != 0) {
+        free(data);
+        return -EIO;
+    }
+    *out = data;
+    return size;
+}
+
+/*
+ * Write an image as a new file at path. Present pages are serialised,
+ * absent ones copied as stored from the mounted file system's metadata
+ * file. pages_out and fd_out (if given) receive the new page table and
+ * the new file, open for loading pages from
+ */
+static int write_image(const char *path, const metadata_image_t *img,
+                       metadata_page_t *pages_out, int *fd_out) {
+    // The superblock goes in one buffer so the checksum covers exactly
+    // what is written
+    size_t size = sizeof(metadata_header_t) + img->quota_count * sizeof(quota_limit_t) +
+                  img->bad_count * sizeof(extent_t) + img->free_count * sizeof(extent_t) +
+                  img->usage_count * sizeof(quota_usage_t) + EVFS_CHECKSUM_LEN;
+    uint32_t dentry_count = 0;
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (img->dentries[d].is_used) {
+            size += sizeof(metadata_dentry_t);
+            dentry_count++;
+        }
+    }
+    uint32_t volume_count = 0;
+    for (int v = 1; v < MAX_VOLUMES; v++) {
+        if (img->volumes[v].is_used) {
+            size += sizeof(uint32_t) + sizeof(volume_t);
+            volume_count++;
+        }
+    }
+
+    char *data = calloc(1, size);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    metadata_header_t *hdr = (metadata_header_t *)data;
+    hdr->magic = METADATA_MAGIC;
+    hdr->version = METADATA_VERSION;
+    hdr->backing_count = img->backing_count;
+    snprintf(hdr->cipher, sizeof(hdr->cipher), "%s", img->cipher);
+    hdr->next_map_id = img->next_map_id;
+    hdr->alloc_end = img->alloc_end;
+    hdr->wal_seq = img->wal_seq;
+    hdr->change_gen = img->change_gen;
+    hdr->super_size = size;
+    hdr->inodes_used = img->inodes_used;
+    hdr->dentry_count = dentry_count;
+    hdr->quota_count = img->quota_count;
+    hdr->volume_count = volume_count;
+    hdr->bad_count = img->bad_count;
+    hdr->free_count = img->free_count;
+    hdr->usage_count = img->usage_count;
+    hdr->clean = img->clean;
+
+    char *pos = data + sizeof(*hdr);
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (!img->dentries[d].is_used) continue;
+        metadata_dentry_t *rec = (metadata_dentry_t *)pos;
+        rec->d = d;
+        rec->pad = 0;
+        rec->dentry = img->dentries[d];
+        if (!img->names_sealed[d] && dentry_seal(&rec->dentry, d, 1) != 0) {
+            free(data);
+            return -EIO;
+        }
+        pos += sizeof(*rec);
+    }
+    memcpy(pos, img->quotas, img->quota_count * sizeof(quota_limit_t));
+    pos += img->quota_count * sizeof(quota_limit_t);
+    for (uint32_t v = 1; v < MAX_VOLUMES; v++) {
+        if (!img->volumes[v].is_used) continue;
+        memcpy(pos, &v, sizeof(v));
+        pos += sizeof(v);
+        memcpy(pos, &img->volumes[v], sizeof(volume_t));
+        pos += sizeof(volume_t);
+    }
+    if (img->bad_count > 0) {
+        memcpy(pos, img->bad, img->bad_count * sizeof(extent_t));
+        pos += img->bad_count * sizeof(extent_t);
+    }
+    if (img->free_count > 0) {
+        memcpy(pos, img->free, img->free_count * sizeof(extent_t));
+        pos += img->free_count * sizeof(extent_t);
+    }
+    if (img->usage_count > 0) {
+        memcpy(pos, img->usage, img->usage_count * sizeof(quota_usage_t));
+        pos += img->usage_count * sizeof(quota_usage_t);
+    }
+
+    // Write aside, make it durable, then atomically replace the old file
+    char tmp_path[PATH_MAX];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        free(data);
+        return -errno;
+    }
+
+    // Pages follow the superblock
+    int ret = 0;
+    off_t offset = size;
+    pthread_mutex_lock(&page_lock);
+    for (int p = 0; p < META_PAGES && ret == 0; p++) {
+        metadata_page_t *pg = &hdr->pages[p];
+        char *page = NULL;
+        ssize_t n;
+        if (!img->absent[p]) {
+            n = build_page(img, p, pg, &page);
+        } else if (meta_pages[p].offset == 0) {
+            n = 0;
+        } else if (meta_fd < 0) {
+            n = -EIO;
+        } else {
+            *pg = meta_pages[p];
+            n = page_size(pg);
+            page = malloc(n);
+            if (!page) {
+                n = -ENOMEM;
+            } else if ((ret = read_at(meta_fd, page, n, pg->offset)) < 0) {
+                n = ret;
+            }
+        }
+        if (n > 0) {
+            pg->offset = offset;
+            ret = write_at(fd, page, n, offset);
+            offset += n;
+        } else if (n < 0) {
+            ret = n;
+        }
+        free(page);
+    }
+    pthread_mutex_unlock(&page_lock);
+
+    if (ret == 0 && evfs_checksum(data, pos - data, (unsigned char *)pos) != 0) {
+        ret = -EIO;
+    }
+    if (ret == 0) ret = write_at(fd, data, size, 0);
+    if (ret == 0 && fsync(fd) != 0) ret = -errno;
+    if (ret == 0 && pages_out) {
+        memcpy(pages_out, hdr->pages, sizeof(hdr->pages));
+    }
+    free(data);
+
+    if (ret == 0 && rename(tmp_path, path) != 0) ret = -errno;
+    if (ret < 0) {
+        close(fd);
+        unlink(tmp_path);
+        return ret;
+    }
+    if (fd_out) {
+        *fd_out = fd;
+    } else {
+        close(fd);
+    }
+
+    // Persist the rename itself
+    char dir_buf[PATH_MAX];
+    snprintf(dir_buf, sizeof(dir_buf), "%s", path);
+    int dir_fd = open(dirname(dir_buf), O_RDONLY);
+    if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+    }
+    return 0;
+}
+
+int write_metadata_image(const char *path, const metadata_image_t *img) {
+    return write_image(path, img, NULL, NULL);
+}
+
+int stored_cipher(char *name, size_t len) {
+    metadata_image_t img;
+    int ret = read_metadata_super(metadata_path(), &img, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+    snprintf(name, len, "%s", img.cipher);
+    free_metadata_image(&img);
+    return 0;
+}
+
+int save_metadata_image(metadata_image_t *img) {
+    // What each page holds as saved, for inode_cache_trim() to compare with
+    unsigned char sums[META_PAGES][EVFS_CHECKSUM_LEN];
+    unsigned char summed[META_PAGES] = { 0 };
+    for (int p = 0; p < META_PAGES; p++) {
+        if (img->absent[p]) continue;
+        int first = p * META_PAGE_INODES;
+        summed[p] = inode_digest(&img->files[first], &img->sealed[first], &img->maps[first],
+                                 page_slots(p), sums[p]) == 0;
+    }
+
+    int ret = 0;
+    for (int i = 0; i < MAX_FILES && ret == 0; i++) {
+        if (img->files[i].is_used && !img->sealed[i] &&
+            inode_seal(&img->files[i], img->maps[i].id, img->maps[i].old_engine, 1) != 0) {
+            ret = -EIO;
+        }
+    }
+    snprintf(img->cipher, sizeof(img->cipher), "%s", evfs_crypto_engine_name());
+    img->bad = quarantined;
+    img->bad_count = quarantined_count;
+    metadata_page_t pages[META_PAGES];
+    int fd = -1;
+    if (ret == 0) {
+        ret = write_image(metadata_path(), img, pages, &fd);
+    }
+    img->bad = NULL;
+    img->bad_count = 0;
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Pages are loaded from the new file from now on
+    pthread_mutex_lock(&page_lock);
+    if (meta_fd >= 0) {
+        close(meta_fd);
+    }
+    meta_fd = fd;
+    memcpy(meta_pages, pages, sizeof(meta_pages));
+    for (int p = 0; p < META_PAGES; p++) {
+        if (img->absent[p]) continue;
+        memcpy(page_saved[p], sums[p], EVFS_CHECKSUM_LEN);
+        page_known[p] = summed[p];
+    }
+    pthread_mutex_unlock(&page_lock);
+    return 0;
+}
+
+int save_metadata(void) {
+    metadata_image_t img;
+    memset(&img, 0, sizeof(img));
+
+    // Block maps must not move underneath the saved copy
+    quiesce_storage();
+
+    int ret = export_storage(&img);
+    if (ret == 0) {
+        memcpy(img.files, file_table, sizeof(file_table));
+        memcpy(img.dentries, dentry_table, sizeof(dentry_table));
+        memcpy(img.sealed, inode_sealed, sizeof(img.sealed));
+        memcpy(img.names_sealed, dentry_sealed, sizeof(img.names_sealed));
+        img.quota_count = export_quotas(img.quotas, MAX_QUOTAS);
+        export_volumes(img.volumes);
+        img.wal_seq = wal_last_seq();
+        // Nothing left for a mount to work out: the next one can start
+        // from the superblock alone
+        img.clean = reencrypt_pending() == 0;
+        if (img.clean) {
+            img.free_count = block_allocator_export(&img.free);
+            img.usage_count = export_quota_usage(&img.usage, &img.inodes_used);
+            if (img.free_count < 0 || img.usage_count < 0) ret = -ENOMEM;
+        }
+    }
+    if (ret == 0) {
+        ret = save_metadata_image(&img);
+    }
+    free_metadata_image(&img);
+
+    if (ret < 0) {
+        fprintf(stderr, "[METADATA] Failed to save metadata: %s\n", strerror(-ret));
+        return ret;
+    }
+    // Every log record is in the saved file now
+    unlink(wal_path());
+    printf("[METADATA] Saved metadata to %s\n", metadata_path());
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * INODE CACHE
+ * ============================================================================
+ *
+ * The metadata file keeps inodes in pages of META_PAGE_INODES, each sealed
+ * and checksummed on its own, behind a superblock with the names, quota
+ * limits and volumes and, after a clean unmount, the free list and quota
+ * usage. Such a mount reads the superblock only; a page is read the first
+ * time a lookup, listing or new inode reaches one of its inodes. Until
+ * then its slots are empty in file_table and its block maps hold nothing,
+ * while the saved free list keeps its blocks allocated.
+ *
+ * After each commit the least recently used pages are dropped while more
+ * than --inode-cache inodes are loaded, but only pages whose inodes have
+ * not changed at all: as in the metadata file (page_saved), as last logged
+ * and as change tracking last saw them, so loading them again gives the
+ * same state and the log has nothing to say about them meanwhile. Inodes
+ * decrypted on first use compare as the file decrypts. Pages changed
+ * since the last checkpoint stay until the next one. Page 0 (the
+ * root) always stays; nothing is dropped while an operation runs or a
+ * re-encryption is under way.
+ */
+
+int inode_page_resident(int page) {
+    return __atomic_load_n(&page_resident[page], __ATOMIC_ACQUIRE);
+}
+
+// Caller holds page_lock
+static int load_page(int p) {
+    int first = p * META_PAGE_INODES, count = page_slots(p);
+    file_metadata_t *files = calloc(META_PAGE_INODES, sizeof(file_metadata_t));
+    block_map_t maps[META_PAGE_INODES];
+    unsigned char sealed[META_PAGE_INODES];
+    if (!files) {
+        return -ENOMEM;
+    }
+    int ret = meta_fd >= 0 ? read_page(meta_fd, &meta_pages[p], p, files, maps) : -EIO;
+    if (ret < 0) {
+        fprintf(stderr, "[METADATA] Cannot load inode page %d of %s: %s\n",
+                p, metadata_path(), strerror(-ret));
+        free(files);
+        return ret;
+    }
+    for (int s = 0; s < count; s++) {
+        sealed[s] = files[s].is_used;
+    }
+    page_known[p] = inode_digest(files, sealed, maps, count, page_saved[p]) == 0;
+
+    // Not while the tables are copied (a save, commit or snapshot)
+    storage_lock_tables();
+    memcpy(&file_table[first], files, count * sizeof(file_metadata_t));
+    memcpy(&inode_sealed[first], sealed, count);
+    storage_load_inodes(first, count, maps);
+    __atomic_store_n(&page_resident[p], 1, __ATOMIC_RELEASE);
+    pages_resident++;
+    page_loads++;
+    storage_unlock_tables();
+    free(files);
+    return 0;
+}
+
+/*
+ * Digest of page p as the file holds it, with the inodes decrypted since
+ * it was loaded (inode_load()) decrypted here too: a page whose files
+ * were only read is as saved. Caller holds page_lock
+ */
+static int loaded_digest(int p, unsigned char *sum) {
+    int first = p * META_PAGE_INODES, count = page_slots(p);
+    file_metadata_t *files = calloc(META_PAGE_INODES, sizeof(file_metadata_t));
+    block_map_t maps[META_PAGE_INODES];
+    unsigned char sealed[META_PAGE_INODES];
+    if (!files) {
+        return -ENOMEM;
+    }
+    int ret = meta_fd >= 0 ? read_page(meta_fd, &meta_pages[p], p, files, maps) : -EIO;
+    if (ret < 0) {
+        free(files);
+        return ret;
+    }
+    for (int s = 0; s < count && ret == 0; s++) {
+        sealed[s] = files[s].is_used && inode_sealed[first + s];
+        if (files[s].is_used && !sealed[s] &&
+            inode_seal(&files[s], maps[s].id, maps[s].old_engine, 0) != 0) {
+            ret = -EIO;
+        }
+    }
+    if (ret == 0) {
+        ret = inode_digest(files, sealed, maps, count, sum);
+    }
+    for (int s = 0; s < count; s++) {
+        blockmap_free(&maps[s]);
+    }
+    memset(files, 0, META_PAGE_INODES * sizeof(file_metadata_t));
+    free(files);
+    return ret;
+}
+
+int inode_page_load(int page) {
+    uint64_t now = __atomic_add_fetch(&page_clock, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&page_used[page], now, __ATOMIC_RELAXED);
+    if (inode_page_resident(page)) {
+        return 0;
+    }
+    pthread_mutex_lock(&page_lock);
+    int ret = page_resident[page] ? 0 : load_page(page);
+    pthread_mutex_unlock(&page_lock);
+    return ret;
+}
+
+int inode_cache_load_all(void) {
+    int ret = 0;
+    for (int p = 0; p < META_PAGES; p++) {
+        if (inode_page_load(p) < 0) ret = -EIO;
+    }
+    return ret;
+}
+
+void inode_cache_enter(void) {
+    pthread_rwlock_rdlock(&cache_users);
+}
+
+void inode_cache_leave(void) {
+    pthread_rwlock_unlock(&cache_users);
+}
+
+int inode_cache_trim(const file_metadata_t *logged) {
+    int bound = (evfs_options.inode_cache + META_PAGE_INODES - 1) / META_PAGE_INODES;
+    if (bound < 1) bound = 1;
+    if (__atomic_load_n(&pages_resident, __ATOMIC_RELAXED) <= bound || reencrypt_pending()) {
+        return 0;
+    }
+    // An operation may hold an inode index; try again after the next commit
+    if (pthread_rwlock_trywrlock(&cache_users) != 0) {
+        return 0;
+    }
+
+    unsigned char tried[META_PAGES] = { 0 };
+    int dropped[META_PAGES];
+    int ndropped = 0, stale = 0;
+    pthread_mutex_lock(&page_lock);
+    storage_lock_tables();
+    while (pages_resident > bound) {
+        int victim = -1;
+        for (int p = 1; p < META_PAGES; p++) {
+            if (page_resident[p] && !tried[p] &&
+                (victim == -1 || __atomic_load_n(&page_used[p], __ATOMIC_RELAXED) <
+                                 __atomic_load_n(&page_used[victim], __ATOMIC_RELAXED))) {
+                victim = p;
+            }
+        }
+        if (victim == -1) break;
+        tried[victim] = 1;
+
+        // Changed since the last checkpoint, or busy for now
+        int first = victim * META_PAGE_INODES, count = page_slots(victim);
+        int ret = page_known[victim] ?
+            storage_unload_inodes(first, count, logged + first, page_saved[victim]) : -ESTALE;
+        unsigned char sum[EVFS_CHECKSUM_LEN];
+        if (ret == -ESTALE && page_known[victim] && loaded_digest(victim, sum) == 0) {
+            // Its files may only have been read
+            memcpy(page_saved[victim], sum, EVFS_CHECKSUM_LEN);
+            ret = storage_unload_inodes(first, count, logged + first, page_saved[victim]);
+        }
+        if (ret < 0) {
+            stale += ret == -ESTALE;
+            continue;
+        }
+        memset(&file_table[first], 0, count * sizeof(file_metadata_t));
+        memset(&inode_sealed[first], 0, count);
+        __atomic_store_n(&page_resident[victim], 0, __ATOMIC_RELEASE);
+        pages_resident--;
+        page_drops++;
+        dropped[ndropped++] = victim;
+    }
+    int over = pages_resident > bound;
+    storage_unlock_tables();
+    pthread_mutex_unlock(&page_lock);
+
+    for (int k = 0; k < ndropped; k++) {
+        for (int i = dropped[k] * META_PAGE_INODES;
+             i < dropped[k] * META_PAGE_INODES + page_slots(dropped[k]); i++) {
+            xattr_uncache(i);
+        }
+    }
+    pthread_rwlock_unlock(&cache_users);
+    return over ? stale : 0;
+}
+
+int inode_digest(const file_metadata_t *files, const unsigned char *sealed,
+                 const block_map_t *maps, int count, unsigned char *sum) {
+    // Each slot as its record, the sealed flags, then the extents; the
+    // generation (which a reload changes) is left out
+    size_t size = count * (sizeof(metadata_record_t) + 1);
+    for (int s = 0; s < count; s++) {
+        if (files[s].is_used) size += maps[s].count * sizeof(extent_t);
+    }
+    char *data = calloc(1, size);
+    if (!data) {
+        return -ENOMEM;
+    }
+    metadata_record_t *recs = (metadata_record_t *)data;
+    char *flags = data + count * sizeof(metadata_record_t);
+    char *pos = flags + count;
+    for (int s = 0; s < count; s++) {
+        if (!files[s].is_used) continue;
+        recs[s].extent_count = maps[s].count;
+        recs[s].old_engine = maps[s].old_engine;
+        recs[s].map_id = maps[s].id;
+        recs[s].reencrypted = maps[s].reencrypted;
+        recs[s].changed = maps[s].changed;
+        memcpy(&recs[s].meta, &files[s], sizeof(file_metadata_t));
+        flags[s] = sealed[s];
+        memcpy(pos, maps[s].extents, maps[s].count * sizeof(extent_t));
+        pos += maps[s].count * sizeof(extent_t);
+    }
+    int ret = evfs_checksum(data, size, sum) != 0 ? -EIO : 0;
+    free(data);
+    return ret;
+}
+
+int metadata_clean_mount(void) {
+    return clean_mount;
+}
+
+void print_inode_cache_stats(void) {
+    printf("[METADATA] Inode cache: %d of %d page(s) loaded, %lu load(s), %lu drop(s)\n",
+           pages_resident, META_PAGES, page_loads, page_drops);
+}
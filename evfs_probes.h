@@ -0,0 +1,38 @@
+#ifndef EVFS_PROBES_H
+#define EVFS_PROBES_H
+
+/*
+ * ============================================================================
+ * STATIC TRACEPOINTS - USDT probes, provider "evfs"
+ * ============================================================================
+ *
+ * Built on <sys/sdt.h> (systemtap-sdt-dev): each probe is a single nop in
+ * the code plus an ELF note naming it and its arguments, so it costs
+ * nothing until a tracer (bpftrace, perf, systemtap) attaches. Without the
+ * header, or with -DEVFS_NO_PROBES, the probes compile to nothing.
+ *
+ * EVFS.md lists the probes and their arguments; evfs_latency.bt and
+ * evfs_events.bt use them.
+ */
+
+#if !defined(EVFS_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define EVFS_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef EVFS_HAVE_PROBES
+#define EVFS_PROBE1(name, a)             DTRACE_PROBE1(evfs, name, a)
+#define EVFS_PROBE2(name, a, b)          DTRACE_PROBE2(evfs, name, a, b)
+#define EVFS_PROBE3(name, a, b, c)       DTRACE_PROBE3(evfs, name, a, b, c)
+#define EVFS_PROBE4(name, a, b, c, d)    DTRACE_PROBE4(evfs, name, a, b, c, d)
+#else
+#define EVFS_PROBE1(name, a)             do { (void)(a); } while (0)
+#define EVFS_PROBE2(name, a, b)          do { (void)(a); (void)(b); } while (0)
+#define EVFS_PROBE3(name, a, b, c)       do { (void)(a); (void)(b); (void)(c); } while (0)
+#define EVFS_PROBE4(name, a, b, c, d) \
+    do { (void)(a); (void)(b); (void)(c); (void)(d); } while (0)
+#endif
+
+#endif // EVFS_PROBES_H
@@ -0,0 +1,360 @@
+#include "evfs.h"
+#include <pthread.h>
+#include <inttypes.h>
+
+/*
+ * ============================================================================
+ * QUOTA MODULE - Per-user/group usage and limits
+ * ============================================================================
+ *
+ * Usage (physical blocks mapped, inodes) is kept per uid and per gid and
+ * changed incrementally: the storage layer charges blocks as it maps and
+ * unmaps them, the create/unlink paths charge inodes. Nothing here ever
+ * scans the file table, except once at mount (quota_rebuild()); after a
+ * clean unmount the usage saved with the superblock is taken instead.
+ *
+ * Limits are set per id; 0 means none. Going over a hard limit fails with
+ * EDQUOT. A soft limit may be exceeded for QUOTA_GRACE seconds, after
+ * which it is enforced like a hard one until usage drops back under it.
+ * Blocks shared with snapshots are charged to the live file only while it
+ * maps them; what only snapshots keep is charged to nobody.
+ */
+
+// Every owner of a live inode needs a user and a group entry, plus the
+// ids that have limits but currently own nothing
+#define QUOTA_SLOTS (2 * MAX_FILES + MAX_QUOTAS)
+
+typedef struct {
+    quota_limit_t limit;  // type, id, limits and grace deadlines
+    uint64_t blocks;
+    uint64_t inodes;
+    int is_used;
+} quota_entry_t;
+
+static quota_entry_t quotas[QUOTA_SLOTS];
+static uint64_t inodes_used = 0;
+static pthread_mutex_t quota_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int has_limits(const quota_limit_t *limit) {
+    return limit->block_soft || limit->block_hard || limit->inode_soft || limit->inode_hard;
+}
+
+// Find (or with create, add) the entry for an id. Caller holds quota_lock
+static quota_entry_t *lookup(quota_type_t type, uint32_t id, int create) {
+    quota_entry_t *free_slot = NULL;
+    for (int i = 0; i < QUOTA_SLOTS; i++) {
+        quota_entry_t *q = &quotas[i];
+        if (!q->is_used) {
+            if (!free_slot) free_slot = q;
+        } else if (q->limit.type == (uint32_t)type && q->limit.id == id) {
+            return q;
+        }
+    }
+    if (!create || !free_slot) {
+        return NULL;
+    }
+    memset(free_slot, 0, sizeof(*free_slot));
+    free_slot->limit.type = type;
+    free_slot->limit.id = id;
+    free_slot->is_used = 1;
+    return free_slot;
+}
+
+// Entries that own nothing and limit nothing are dropped
+static void maybe_release(quota_entry_t *q) {
+    if (q->blocks == 0 && q->inodes == 0 && !has_limits(&q->limit)) {
+        q->is_used = 0;
+    }
+}
+
+// 1 if adding 'add' to 'used' is refused
+static int over_limit(uint64_t used, uint64_t add, uint64_t soft, uint64_t hard,
+                      int64_t grace, time_t now) {
+    if (hard && used + add > hard) return 1;
+    if (soft && used + add > soft && grace && now >= grace) return 1;
+    return 0;
+}
+
+// Start the grace period when usage goes over the soft limit, end it
+// when usage is back under
+static void update_grace(uint64_t used, uint64_t soft, int64_t *grace, time_t now) {
+    if (!soft || used <= soft) {
+        *grace = 0;
+    } else if (*grace == 0) {
+        *grace = now + QUOTA_GRACE;
+    }
+}
+
+static void apply(quota_entry_t *q, int64_t blocks, int inodes, time_t now) {
+    q->blocks = (blocks < 0 && (uint64_t)-blocks > q->blocks) ? 0 : q->blocks + blocks;
+    q->inodes = (inodes < 0 && (uint64_t)-inodes > q->inodes) ? 0 : q->inodes + inodes;
+    update_grace(q->blocks, q->limit.block_soft, &q->limit.block_grace, now);
+    update_grace(q->inodes, q->limit.inode_soft, &q->limit.inode_grace, now);
+    maybe_release(q);
+}
+
+static int refused(const quota_entry_t *q, int64_t blocks, int inodes, time_t now) {
+    if (blocks > 0 && over_limit(q->blocks, blocks, q->limit.block_soft, q->limit.block_hard,
+                                 q->limit.block_grace, now)) {
+        return 1;
+    }
+    if (inodes > 0 && over_limit(q->inodes, inodes, q->limit.inode_soft, q->limit.inode_hard,
+                                 q->limit.inode_grace, now)) {
+        return 1;
+    }
+    return 0;
+}
+
+static void account_locked(uid_t uid, gid_t gid, int64_t blocks, int inodes, time_t now) {
+    quota_entry_t *user = lookup(QUOTA_USER, uid, 1);
+    quota_entry_t *group = lookup(QUOTA_GROUP, gid, 1);
+    if (user) apply(user, blocks, inodes, now);
+    if (group) apply(group, blocks, inodes, now);
+    if (inodes < 0 && (uint64_t)-inodes > inodes_used) {
+        inodes_used = 0;
+    } else {
+        inodes_used += inodes;
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Charging
+ * ----------------------------------------------------------------------------
+ */
+
+int quota_charge(uid_t uid, gid_t gid, int64_t blocks, int inodes) {
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&quota_lock);
+    quota_entry_t *user = lookup(QUOTA_USER, uid, 0);
+    quota_entry_t *group = lookup(QUOTA_GROUP, gid, 0);
+    if ((user && refused(user, blocks, inodes, now)) ||
+        (group && refused(group, blocks, inodes, now))) {
+        pthread_mutex_unlock(&quota_lock);
+        printf("[QUOTA] uid %u / gid %u over quota (%" PRId64 " blocks, %d inodes refused)\n",
+               (unsigned)uid, (unsigned)gid, blocks, inodes);
+        return -EDQUOT;
+    }
+    account_locked(uid, gid, blocks, inodes, now);
+    pthread_mutex_unlock(&quota_lock);
+    return 0;
+}
+
+void quota_account(uid_t uid, gid_t gid, int64_t blocks, int inodes) {
+    if (blocks == 0 && inodes == 0) return;
+    pthread_mutex_lock(&quota_lock);
+    account_locked(uid, gid, blocks, inodes, time(NULL));
+    pthread_mutex_unlock(&quota_lock);
+}
+
+uint64_t quota_inodes_used(void) {
+    pthread_mutex_lock(&quota_lock);
+    uint64_t n = inodes_used;
+    pthread_mutex_unlock(&quota_lock);
+    return n;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Limits and persistence
+ * ----------------------------------------------------------------------------
+ */
+
+void init_quotas(const quota_limit_t *limits, int count) {
+    pthread_mutex_lock(&quota_lock);
+    memset(quotas, 0, sizeof(quotas));
+    inodes_used = 0;
+    for (int i = 0; i < count && i < MAX_QUOTAS; i++) {
+        if (!has_limits(&limits[i])) continue;
+        quota_entry_t *q = lookup(limits[i].type, limits[i].id, 1);
+        if (q) q->limit = limits[i];
+    }
+    pthread_mutex_unlock(&quota_lock);
+}
+
+void quota_rebuild(void) {
+    int files = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!file_table[i].is_used) continue;
+        quota_account(file_table[i].uid, file_table[i].gid, storage_file_blocks(i), 1);
+        files++;
+    }
+    printf("[QUOTA] Usage rebuilt from %d inodes\n", files);
+}
+
+int export_quotas(quota_limit_t *limits, int max) {
+    int count = 0;
+    pthread_mutex_lock(&quota_lock);
+    for (int i = 0; i < QUOTA_SLOTS && count < max; i++) {
+        if (quotas[i].is_used && has_limits(&quotas[i].limit)) {
+            limits[count++] = quotas[i].limit;
+        }
+    }
+    pthread_mutex_unlock(&quota_lock);
+    return count;
+}
+
+int export_quota_usage(quota_usage_t **out, uint64_t *inodes) {
+    pthread_mutex_lock(&quota_lock);
+    int count = 0;
+    for (int i = 0; i < QUOTA_SLOTS; i++) {
+        count += quotas[i].is_used && (quotas[i].blocks || quotas[i].inodes);
+    }
+    quota_usage_t *usage = malloc((count > 0 ? count : 1) * sizeof(quota_usage_t));
+    if (!usage) {
+        pthread_mutex_unlock(&quota_lock);
+        return -ENOMEM;
+    }
+    count = 0;
+    for (int i = 0; i < QUOTA_SLOTS; i++) {
+        const quota_entry_t *q = &quotas[i];
+        if (!q->is_used || (!q->blocks && !q->inodes)) continue;
+        usage[count++] = (quota_usage_t){ q->limit.type, q->limit.id, q->blocks, q->inodes };
+    }
+    *inodes = inodes_used;
+    pthread_mutex_unlock(&quota_lock);
+    *out = usage;
+    return count;
+}
+
+void import_quota_usage(const quota_usage_t *usage, int count, uint64_t inodes) {
+    pthread_mutex_lock(&quota_lock);
+    for (int i = 0; i < count; i++) {
+        quota_entry_t *q = lookup(usage[i].type, usage[i].id, 1);
+        if (!q) continue;
+        q->blocks = usage[i].blocks;
+        q->inodes = usage[i].inodes;
+    }
+    inodes_used = inodes;
+    pthread_mutex_unlock(&quota_lock);
+    printf("[QUOTA] Usage of %d ids loaded with the superblock\n", count);
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Management through xattrs on the root directory
+ * ----------------------------------------------------------------------------
+ *
+ * QUOTA_XATTR_PREFIX "user.<uid>" / "group.<gid>":
+ *   set:    "<block soft> <block hard> <inode soft> <inode hard>"
+ *           (bytes, rounded up to blocks; 0 = no limit)
+ *   get:    the same four values, then bytes and inodes in use
+ *   remove: drop all limits of the id
+ */
+
+int is_quota_xattr(const char *name) {
+    return strncmp(name, QUOTA_XATTR_PREFIX, strlen(QUOTA_XATTR_PREFIX)) == 0;
+}
+
+static int parse_quota_name(const char *name, quota_type_t *type, uint32_t *id) {
+    const char *rest = name + strlen(QUOTA_XATTR_PREFIX);
+    if (strncmp(rest, "user.", 5) == 0) {
+        *type = QUOTA_USER;
+        rest += 5;
+    } else if (strncmp(rest, "group.", 6) == 0) {
+        *type = QUOTA_GROUP;
+        rest += 6;
+    } else {
+        return -1;
+    }
+    char *end;
+    errno = 0;
+    unsigned long v = strtoul(rest, &end, 10);
+    if (*rest == '\0' || *end != '\0' || errno != 0 || v > UINT32_MAX) {
+        return -1;
+    }
+    *id = v;
+    return 0;
+}
+
+int quota_setxattr(const char *name, const char *value, size_t size) {
+    quota_type_t type;
+    uint32_t id;
+    if (parse_quota_name(name, &type, &id) < 0) {
+        return -EINVAL;
+    }
+
+    char buf[128];
+    unsigned long long bsoft, bhard, isoft, ihard;
+    if (size >= sizeof(buf)) {
+        return -EINVAL;
+    }
+    memcpy(buf, value, size);
+    buf[size] = '\0';
+    if (sscanf(buf, "%llu %llu %llu %llu", &bsoft, &bhard, &isoft, &ihard) != 4) {
+        return -EINVAL;
+    }
+
+    quota_limit_t limit = {
+        .type = type,
+        .id = id,
+        .block_soft = (bsoft + BLOCK_SIZE - 1) / BLOCK_SIZE,
+        .block_hard = (bhard + BLOCK_SIZE - 1) / BLOCK_SIZE,
+        .inode_soft = isoft,
+        .inode_hard = ihard,
+    };
+
+    pthread_mutex_lock(&quota_lock);
+    quota_entry_t *q = lookup(type, id, 0);
+    if (!q && has_limits(&limit)) {
+        int limited = 0;
+        for (int i = 0; i < QUOTA_SLOTS; i++) {
+            if (quotas[i].is_used && has_limits(&quotas[i].limit)) limited++;
+        }
+        q = limited < MAX_QUOTAS ? lookup(type, id, 1) : NULL;
+        if (!q) {
+            pthread_mutex_unlock(&quota_lock);
+            return -ENOSPC;
+        }
+    }
+    if (q) {
+        time_t now = time(NULL);
+        q->limit = limit;
+        update_grace(q->blocks, limit.block_soft, &q->limit.block_grace, now);
+        update_grace(q->inodes, limit.inode_soft, &q->limit.inode_grace, now);
+        maybe_release(q);
+    }
+    pthread_mutex_unlock(&quota_lock);
+
+    printf("[QUOTA] %s %u: blocks %llu/%llu, inodes %llu/%llu (soft/hard)\n",
+           type == QUOTA_USER ? "user" : "group", (unsigned)id,
+           (unsigned long long)limit.block_soft, (unsigned long long)limit.block_hard,
+           isoft, ihard);
+    return 0;
+}
+
+int quota_getxattr(const char *name, char *value, size_t size) {
+    quota_type_t type;
+    uint32_t id;
+    if (parse_quota_name(name, &type, &id) < 0) {
+        return -ENODATA;
+    }
+
+    quota_entry_t snap = {0};
+    pthread_mutex_lock(&quota_lock);
+    quota_entry_t *q = lookup(type, id, 0);
+    if (q) snap = *q;
+    pthread_mutex_unlock(&quota_lock);
+
+    char buf[160];
+    int len = snprintf(buf, sizeof(buf), "%llu %llu %llu %llu %llu %llu",
+                       (unsigned long long)snap.limit.block_soft * BLOCK_SIZE,
+                       (unsigned long long)snap.limit.block_hard * BLOCK_SIZE,
+                       (unsigned long long)snap.limit.inode_soft,
+                       (unsigned long long)snap.limit.inode_hard,
+                       (unsigned long long)snap.blocks * BLOCK_SIZE,
+                       (unsigned long long)snap.inodes);
+    if (size == 0) {
+        return len;
+    }
+    if ((size_t)len > size) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
+    return len;
+}
+
+int quota_removexattr(const char *name) {
+    return quota_setxattr(name, "0 0 0 0", 7);
+}
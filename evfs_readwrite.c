@@ -1,4 +1,5 @@
 #include "evfs.h"
+#include <limits.h>
 
 /*
  * ============================================================================
@@ -16,6 +17,10 @@ int evfs_read(const char *path, char *buf, size_t size, off_t offset,
     printf("[READ] Called for path: %s (size: %zu, offset: %ld)\n", 
            path, size, offset);
     
+    if (is_snapshot_path(path)) {
+        return snapshot_read(path, buf, size, offset);
+    }
+    
     // Find the file
     int idx = find_file_by_path(path);
     if (idx == -1) {
@@ -29,6 +34,11 @@ int evfs_read(const char *path, char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
     
+    int ret = volume_check(&file_table[idx]);
+    if (ret < 0) {
+        return ret;
+    }
+    
     // Check bounds
     if (offset >= file_table[idx].size) {
         printf("[READ] Offset beyond file size\n");
@@ -48,8 +58,8 @@ int evfs_read(const char *path, char *buf, size_t size, off_t offset,
         return -EIO;
     }
     
-    // Update access time
-    file_table[idx].atime = time(NULL);
+    // Only in memory; the next commit logs it (see inode_accessed())
+    inode_accessed(idx);
     
     printf("[READ] Successfully read %d bytes from %s\n", bytes_read, path);
     return bytes_read;
@@ -60,11 +70,13 @@ int evfs_read(const char *path, char *buf, size_t size, off_t offset,
  */
 int evfs_write(const char *path, const char *buf, size_t size, off_t offset,
                struct fuse_file_info *fi) {
-    (void)fi; // Unused parameter
-    
     printf("[WRITE] Called for path: %s (size: %zu, offset: %ld)\n", 
            path, size, offset);
     
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
     // Find the file
     int idx = find_file_by_path(path);
     if (idx == -1) {
@@ -78,11 +90,17 @@ int evfs_write(const char *path, const char *buf, size_t size, off_t offset,
         return -EISDIR;
     }
     
+    int ret = volume_check(&file_table[idx]);
+    if (ret < 0) {
+        return ret;
+    }
+    
     // Write to storage
     int bytes_written = write_block(idx, offset, buf, size);
     if (bytes_written < 0) {
         printf("[WRITE] Failed to write to storage\n");
-        return -EIO;
+        return (bytes_written == -EFBIG || bytes_written == -ENOSPC ||
+                bytes_written == -EDQUOT) ? bytes_written : -EIO;
     }
     
     // Update file size if necessary
@@ -97,6 +115,11 @@ int evfs_write(const char *path, const char *buf, size_t size, off_t offset,
     file_table[idx].mtime = now;
     file_table[idx].ctime = now;
     
+    // O_SYNC / O_DSYNC: durable before returning (O_SYNC includes O_DSYNC)
+    if (fi && (fi->flags & O_DSYNC) && wal_sync() < 0) {
+        return -EIO;
+    }
+    
     printf("[WRITE] Successfully wrote %d bytes to %s\n", bytes_written, path);
     return bytes_written;
 }
@@ -107,6 +130,10 @@ int evfs_write(const char *path, const char *buf, size_t size, off_t offset,
 int evfs_truncate(const char *path, off_t size) {
     printf("[TRUNCATE] Called for path: %s (size: %ld)\n", path, size);
     
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
     // Find the file
     int idx = find_file_by_path(path);
     if (idx == -1) {
@@ -120,18 +147,21 @@ int evfs_truncate(const char *path, off_t size) {
         return -EISDIR;
     }
     
-    // If growing the file, we might need to write zeros
+    int ret = volume_check(&file_table[idx]);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    // Growing leaves a hole (reads as zeros); shrinking releases blocks
     if (size > file_table[idx].size) {
         printf("[TRUNCATE] Growing file from %ld to %ld\n", 
                file_table[idx].size, size);
-        
-        // Write zeros to extend the file
-        size_t zero_size = size - file_table[idx].size;
-        char *zero_buf = calloc(1, zero_size);
-        if (zero_buf) {
-            write_block(idx, file_table[idx].size, zero_buf, zero_size);
-            free(zero_buf);
-        }
+    }
+    ret = truncate_storage(idx, size);
+    if (ret < 0) {
+        printf("[TRUNCATE] Failed to resize storage\n");
+        return (ret == -EFBIG || ret == -ENOSPC || ret == -EDQUOT ||
+                ret == -ENOMEM) ? ret : -EIO;
     }
     
     // Update file size
@@ -147,47 +177,67 @@ int evfs_truncate(const char *path, off_t size) {
 }
 
 /*
- * Delete a file (unlink)
+ * The part of evfs_unlink() that runs under metadata_lock()
  */
-int evfs_unlink(const char *path) {
-    printf("[UNLINK] Called for path: %s\n", path);
-    
-    // Find the file
-    int idx = find_file_by_path(path);
-    if (idx == -1) {
+static int unlink_name(const char *path) {
+    // Find the name
+    int d = find_dentry(dentry_table, path);
+    if (d == -1) {
         printf("[UNLINK] File not found: %s\n", path);
         return -ENOENT;
     }
     
-    // Check if it's a file
-    if (file_table[idx].type != FTYPE_FILE) {
+    // Check if it's a file or symlink
+    int idx = dentry_table[d].inode;
+    if (file_table[idx].type == FTYPE_DIR) {
         printf("[UNLINK] Not a file: %s\n", path);
         return -EISDIR;
     }
     
-    // Delete storage
-    delete_storage(idx);
-    
-    // Mark entry as unused
-    file_table[idx].is_used = 0;
-    memset(file_table[idx].name, 0, MAX_FILENAME);
+    // Drop the name; storage goes with the last one
+    dentry_unlink(d);
     
-    printf("[UNLINK] File deleted successfully: %s\n", path);
+    printf("[UNLINK] Name removed: %s (inode %d, %u links left)\n",
+           path, idx, file_table[idx].nlink);
     return 0;
 }
 
 /*
- * Create a directory
+ * Delete a file (unlink)
  */
-int evfs_mkdir(const char *path, mode_t mode) {
-    printf("[MKDIR] Called for path: %s\n", path);
+int evfs_unlink(const char *path) {
+    printf("[UNLINK] Called for path: %s\n", path);
     
+    if (is_snapshot_path(path)) {
+        return -EROFS;
+    }
+    
+    metadata_lock();
+    int ret = unlink_name(path);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * The part of evfs_mkdir() that runs under metadata_lock()
+ */
+static int make_directory(const char *path, mode_t mode) {
     // Check if directory already exists
     if (find_file_by_path(path) != -1) {
         printf("[MKDIR] Directory already exists: %s\n", path);
         return -EEXIST;
     }
     
+    int parent = parent_directory(path);
+    if (parent < 0) {
+        printf("[MKDIR] No parent directory for: %s\n", path);
+        return parent;
+    }
+    int ret = volume_check(&file_table[parent]);
+    if (ret < 0) {
+        return ret;
+    }
+    
     // Find free slot
     int idx = find_free_slot();
     if (idx == -1) {
@@ -195,88 +245,484 @@ int evfs_mkdir(const char *path, mode_t mode) {
         return -ENOSPC;
     }
     
-    // Extract directory name from path
-    const char *dirname = path + 1; // skip leading '/'
+    struct fuse_context *ctx = fuse_get_context();
+    ret = quota_charge(ctx->uid, ctx->gid, 0, 1);
+    if (ret < 0) {
+        printf("[MKDIR] Inode quota exceeded for: %s\n", path);
+        return ret;
+    }
     
     // Create new directory metadata
-    strncpy(file_table[idx].name, dirname, MAX_FILENAME - 1);
+    memset(&file_table[idx], 0, sizeof(file_metadata_t));
     file_table[idx].type = FTYPE_DIR;
     file_table[idx].mode = mode | 0755; // Ensure execute permission for directories
-    file_table[idx].uid = getuid();
-    file_table[idx].gid = getgid();
+    file_table[idx].uid = ctx->uid;
+    file_table[idx].gid = ctx->gid;
     file_table[idx].atime = time(NULL);
     file_table[idx].mtime = time(NULL);
     file_table[idx].ctime = time(NULL);
     file_table[idx].size = BLOCK_SIZE; // Standard directory size
     file_table[idx].is_used = 1;
-    file_table[idx].parent_idx = 0; // root directory (for now)
+    file_table[idx].nlink = 2; // its name and its own "."
+    file_table[idx].volume = file_table[parent].volume;
+    
+    ret = dentry_add(path, idx);
+    if (ret < 0) {
+        file_table[idx].is_used = 0;
+        quota_account(ctx->uid, ctx->gid, 0, -1);
+        printf("[MKDIR] Cannot add name for: %s\n", path);
+        return ret;
+    }
+    storage_assign_volume(idx, file_table[idx].volume);
     
     printf("[MKDIR] Directory created successfully: %s (index: %d)\n", path, idx);
     return 0;
 }
 
 /*
- * Remove a directory
+ * Create a directory
  */
-int evfs_rmdir(const char *path) {
-    printf("[RMDIR] Called for path: %s\n", path);
+int evfs_mkdir(const char *path, mode_t mode) {
+    printf("[MKDIR] Called for path: %s\n", path);
+    
+    // mkdir /.snapshots/<name> takes a snapshot
+    if (is_snapshot_path(path)) {
+        if (strncmp(path, SNAPSHOT_DIR "/", strlen(SNAPSHOT_DIR) + 1) != 0) {
+            return -EEXIST;
+        }
+        return snapshot_create(path + strlen(SNAPSHOT_DIR) + 1);
+    }
+    
+    metadata_lock();
+    int ret = make_directory(path, mode);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * The part of evfs_rmdir() that runs under metadata_lock()
+ */
+static int remove_directory(const char *path) {
+    if (strcmp(path, "/") == 0) {
+        return -EBUSY;
+    }
     
     // Find the directory
-    int idx = find_file_by_path(path);
-    if (idx == -1) {
+    int d = find_dentry(dentry_table, path);
+    if (d == -1) {
         printf("[RMDIR] Directory not found: %s\n", path);
         return -ENOENT;
     }
     
     // Check if it's a directory
-    if (file_table[idx].type != FTYPE_DIR) {
+    if (file_table[dentry_table[d].inode].type != FTYPE_DIR) {
         printf("[RMDIR] Not a directory: %s\n", path);
         return -ENOTDIR;
     }
     
+    // A volume's directory lives as long as the volume
+    if (is_volume_root(dentry_table[d].inode)) {
+        return -EBUSY;
+    }
+    
     // Check if directory is empty
-    for (int i = 1; i < MAX_FILES; i++) {
-        if (file_table[i].is_used && file_table[i].parent_idx == idx) {
-            printf("[RMDIR] Directory not empty: %s\n", path);
-            return -ENOTEMPTY;
-        }
+    if (!directory_is_empty(dentry_table, path)) {
+        printf("[RMDIR] Directory not empty: %s\n", path);
+        return -ENOTEMPTY;
     }
     
-    // Mark entry as unused
-    file_table[idx].is_used = 0;
-    memset(file_table[idx].name, 0, MAX_FILENAME);
+    // A directory has no data, but may have an xattr stream
+    dentry_unlink(d);
     
     printf("[RMDIR] Directory removed successfully: %s\n", path);
     return 0;
 }
 
+/*
+ * Remove a directory
+ */
+int evfs_rmdir(const char *path) {
+    printf("[RMDIR] Called for path: %s\n", path);
+    
+    // rmdir /.snapshots/<name> deletes a snapshot
+    if (is_snapshot_path(path)) {
+        if (strncmp(path, SNAPSHOT_DIR "/", strlen(SNAPSHOT_DIR) + 1) != 0) {
+            return -EBUSY;
+        }
+        return snapshot_delete(path + strlen(SNAPSHOT_DIR) + 1);
+    }
+    
+    metadata_lock();
+    int ret = remove_directory(path);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * Move collected dentries from below 'from' to below 'to'. With check set
+ * nothing changes; returns -ENAMETOOLONG if a new name would not fit
+ */
+static int rebase(const int *ds, int n, const char *from, const char *to, int check) {
+    size_t from_len = strlen(from + 1);
+    size_t to_len = strlen(to + 1);
+    for (int i = 0; i < n; i++) {
+        char *name = dentry_table[ds[i]].name;
+        if (check) {
+            if (strlen(name) - from_len + to_len >= MAX_FILENAME) return -ENAMETOOLONG;
+            continue;
+        }
+        char moved[MAX_FILENAME];
+        snprintf(moved, sizeof(moved), "%s%s", to + 1, name + from_len);
+        strcpy(name, moved);
+    }
+    return 0;
+}
+
+// 1 if path lies below directory dir
+static int is_below(const char *path, const char *dir) {
+    size_t len = strlen(dir);
+    return strncmp(path, dir, len) == 0 && path[len] == '/';
+}
+
 /*
  * Rename a file or directory
  */
 int evfs_rename(const char *from, const char *to) {
-    printf("[RENAME] Called: %s -> %s\n", from, to);
+    return evfs_rename_flags(from, to, 0);
+}
+
+/*
+ * The part of evfs_rename_flags() that runs under metadata_lock()
+ */
+static int rename_names(const char *from, const char *to, unsigned int flags) {
+    if ((flags & ~(RENAME_NOREPLACE | RENAME_EXCHANGE)) ||
+        ((flags & RENAME_NOREPLACE) && (flags & RENAME_EXCHANGE))) {
+        return -EINVAL;
+    }
+    if (strcmp(from, "/") == 0 || strcmp(to, "/") == 0) {
+        return -EBUSY;
+    }
     
-    // Find source file
-    int from_idx = find_file_by_path(from);
-    if (from_idx == -1) {
+    // Find source name
+    int d = find_dentry(dentry_table, from);
+    if (d == -1) {
         printf("[RENAME] Source not found: %s\n", from);
         return -ENOENT;
     }
     
+    int new_parent = parent_directory(to);
+    if (new_parent < 0) {
+        printf("[RENAME] No parent directory for: %s\n", to);
+        return new_parent;
+    }
+    int old_parent = parent_directory(from);
+    if (strlen(to + 1) >= MAX_FILENAME) {
+        return -ENAMETOOLONG;
+    }
+    
+    int from_idx = dentry_table[d].inode;
+    int from_dir = file_table[from_idx].type == FTYPE_DIR;
+    
+    // A directory cannot move below itself
+    if (from_dir && is_below(to, from)) {
+        printf("[RENAME] Cannot move %s into itself\n", from);
+        return -EINVAL;
+    }
+    
     // Check if destination exists
-    int to_idx = find_file_by_path(to);
-    if (to_idx != -1) {
+    int t = find_dentry(dentry_table, to);
+    if (t != -1 && (flags & RENAME_NOREPLACE)) {
         printf("[RENAME] Destination already exists: %s\n", to);
         return -EEXIST;
     }
+    if (t == -1 && (flags & RENAME_EXCHANGE)) {
+        printf("[RENAME] Nothing to exchange with: %s\n", to);
+        return -ENOENT;
+    }
+    
+    // Two names of the same inode: nothing to do (POSIX)
+    int to_idx = t == -1 ? -1 : dentry_table[t].inode;
+    if (to_idx == from_idx) {
+        return 0;
+    }
+    int to_dir = to_idx != -1 && file_table[to_idx].type == FTYPE_DIR;
     
-    // Extract new name
-    const char *new_name = to + 1; // skip leading '/'
+    // Volume directories stay put, and data never changes volume (its key)
+    if (is_volume_root(from_idx) || (to_idx != -1 && is_volume_root(to_idx))) {
+        return -EBUSY;
+    }
+    if (file_table[from_idx].volume != file_table[new_parent].volume ||
+        ((flags & RENAME_EXCHANGE) &&
+         file_table[to_idx].volume != file_table[old_parent].volume)) {
+        printf("[RENAME] %s and %s are in different volumes\n", from, to);
+        return -EXDEV;
+    }
     
-    // Update name
-    strncpy(file_table[from_idx].name, new_name, MAX_FILENAME - 1);
+    int moving[MAX_DENTRIES], swapped[MAX_DENTRIES];
+    int n_moving = from_dir ? dentries_below(from_idx, moving) : 0;
+    int n_swapped = 0;
+    if (rebase(moving, n_moving, from, to, 1) < 0) {
+        return -ENAMETOOLONG;
+    }
+    
+    if (flags & RENAME_EXCHANGE) {
+        if (to_dir && is_below(from, to)) {
+            return -EINVAL;
+        }
+        n_swapped = to_dir ? dentries_below(to_idx, swapped) : 0;
+        if (rebase(swapped, n_swapped, to, from, 1) < 0) {
+            return -ENAMETOOLONG;
+        }
+        
+        // Both names stay; they trade inodes (and subtrees)
+        dentry_table[t].inode = from_idx;
+        dentry_table[d].inode = to_idx;
+        rebase(moving, n_moving, from, to, 0);
+        rebase(swapped, n_swapped, to, from, 0);
+        
+        // A directory trading places with a file changes subdirectory counts
+        if (from_dir != to_dir && old_parent != new_parent) {
+            int gains = from_dir ? new_parent : old_parent;
+            int loses = from_dir ? old_parent : new_parent;
+            file_table[gains].nlink++;
+            file_table[loses].nlink--;
+        }
+        file_table[from_idx].ctime = file_table[to_idx].ctime = time(NULL);
+        printf("[RENAME] Exchanged: %s <-> %s\n", from, to);
+        return 0;
+    }
+    
+    if (t != -1) {
+        if (from_dir && !to_dir) {
+            return -ENOTDIR;
+        }
+        if (!from_dir && to_dir) {
+            return -EISDIR;
+        }
+        if (to_dir && !directory_is_empty(dentry_table, to)) {
+            return -ENOTEMPTY;
+        }
+        
+        // Atomic replace: 'to' points at the new inode in one store
+        dentry_table[t].inode = from_idx;
+        dentry_release(d);
+        if (to_dir) {
+            file_table[new_parent].nlink--;  // the replaced directory's ".."
+        }
+        inode_drop_link(to_idx);
+    } else {
+        dentry_set_name(d, to, new_parent);
+    }
+    rebase(moving, n_moving, from, to, 0);
+    
+    // ".." now points at the new parent
+    if (from_dir) {
+        file_table[old_parent].nlink--;
+        file_table[new_parent].nlink++;
+    }
     file_table[from_idx].ctime = time(NULL);
     
     printf("[RENAME] Renamed successfully: %s -> %s\n", from, to);
     return 0;
+}
+
+/*
+ * Rename with renameat2() flags. An existing destination is replaced by
+ * repointing its dentry at the source inode, so 'to' never disappears;
+ * the replaced inode's blocks are freed in the background. Subtrees of a
+ * moved directory are renamed along with it.
+ */
+int evfs_rename_flags(const char *from, const char *to, unsigned int flags) {
+    printf("[RENAME] Called: %s -> %s (flags: %u)\n", from, to, flags);
+    
+    if (is_snapshot_path(from) || is_snapshot_path(to)) {
+        return -EROFS;
+    }
+    metadata_lock();
+    int ret = rename_names(from, to, flags);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * The part of evfs_link() that runs under metadata_lock()
+ */
+static int link_name(const char *from, const char *to) {
+    int idx = find_file_by_path(from);
+    if (idx == -1) {
+        printf("[LINK] Source not found: %s\n", from);
+        return -ENOENT;
+    }
+    
+    // Directories only ever have one name
+    if (file_table[idx].type == FTYPE_DIR) {
+        printf("[LINK] Cannot link a directory: %s\n", from);
+        return -EPERM;
+    }
+    
+    if (find_file_by_path(to) != -1) {
+        printf("[LINK] Destination already exists: %s\n", to);
+        return -EEXIST;
+    }
+    
+    int parent = parent_directory(to);
+    if (parent < 0) {
+        printf("[LINK] No parent directory for: %s\n", to);
+        return parent;
+    }
+    
+    if (file_table[idx].volume != file_table[parent].volume) {
+        printf("[LINK] %s and %s are in different volumes\n", from, to);
+        return -EXDEV;
+    }
+    
+    if (file_table[idx].nlink >= UINT32_MAX) {
+        return -EMLINK;
+    }
+    
+    int ret = dentry_add(to, idx);
+    if (ret < 0) {
+        printf("[LINK] Cannot add name for: %s\n", to);
+        return ret;
+    }
+    file_table[idx].ctime = time(NULL);
+    
+    printf("[LINK] Linked %s -> inode %d (%u links)\n", to, idx, file_table[idx].nlink);
+    return 0;
+}
+
+/*
+ * Create a hard link: a second name for an existing inode. No data moves
+ */
+int evfs_link(const char *from, const char *to) {
+    printf("[LINK] Called: %s -> %s\n", to, from);
+    
+    if (is_snapshot_path(from) || is_snapshot_path(to)) {
+        return -EROFS;
+    }
+    
+    metadata_lock();
+    int ret = link_name(from, to);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * The part of evfs_symlink() that runs under metadata_lock()
+ */
+static int make_symlink(const char *target, const char *linkpath) {
+    size_t len = strlen(target);
+    if (len == 0) {
+        return -ENOENT;
+    }
+    if (len >= PATH_MAX) {
+        return -ENAMETOOLONG;
+    }
+    
+    if (find_file_by_path(linkpath) != -1) {
+        printf("[SYMLINK] Destination already exists: %s\n", linkpath);
+        return -EEXIST;
+    }
+    
+    int parent = parent_directory(linkpath);
+    if (parent < 0) {
+        printf("[SYMLINK] No parent directory for: %s\n", linkpath);
+        return parent;
+    }
+    int ret = volume_check(&file_table[parent]);
+    if (ret < 0) {
+        return ret;
+    }
+    
+    int idx = find_free_slot();
+    if (idx == -1) {
+        printf("[SYMLINK] No free slots available\n");
+        return -ENOSPC;
+    }
+    
+    struct fuse_context *ctx = fuse_get_context();
+    ret = quota_charge(ctx->uid, ctx->gid, 0, 1);
+    if (ret < 0) {
+        printf("[SYMLINK] Inode quota exceeded for: %s\n", linkpath);
+        return ret;
+    }
+    
+    memset(&file_table[idx], 0, sizeof(file_metadata_t));
+    file_table[idx].type = FTYPE_SYMLINK;
+    file_table[idx].mode = 0777;
+    file_table[idx].uid = ctx->uid;
+    file_table[idx].gid = ctx->gid;
+    file_table[idx].atime = time(NULL);
+    file_table[idx].mtime = time(NULL);
+    file_table[idx].ctime = time(NULL);
+    file_table[idx].is_used = 1;
+    file_table[idx].volume = file_table[parent].volume;
+    storage_assign_volume(idx, file_table[idx].volume);
+    
+    // Short targets stay in the inode; long ones take a data block
+    ret = symlink_store(idx, target);
+    if (ret == 0) {
+        ret = dentry_add(linkpath, idx);
+    }
+    if (ret < 0) {
+        delete_storage(idx);
+        file_table[idx].is_used = 0;
+        quota_account(ctx->uid, ctx->gid, 0, -1);
+        printf("[SYMLINK] Failed to create %s\n", linkpath);
+        return ret == -ENOSPC || ret == -ENAMETOOLONG || ret == -EDQUOT ? ret : -EIO;
+    }
+    
+    printf("[SYMLINK] Created %s (index: %d, %s target)\n", linkpath, idx,
+           symlink_is_inline(&file_table[idx]) ? "inline" : "block");
+    return 0;
+}
+
+/*
+ * Create a symbolic link
+ */
+int evfs_symlink(const char *target, const char *linkpath) {
+    printf("[SYMLINK] Called: %s -> %s\n", linkpath, target);
+    
+    if (is_snapshot_path(linkpath)) {
+        return -EROFS;
+    }
+    
+    metadata_lock();
+    int ret = make_symlink(target, linkpath);
+    metadata_unlock();
+    return ret;
+}
+
+/*
+ * Read a symbolic link's target
+ */
+int evfs_readlink(const char *path, char *buf, size_t size) {
+    printf("[READLINK] Called for path: %s\n", path);
+    
+    if (is_snapshot_path(path)) {
+        return snapshot_readlink(path, buf, size);
+    }
+    
+    int idx = find_file_by_path(path);
+    if (idx == -1) {
+        return -ENOENT;
+    }
+    if (file_table[idx].type != FTYPE_SYMLINK) {
+        return -EINVAL;
+    }
+    int ret = volume_check(&file_table[idx]);
+    if (ret < 0) {
+        return ret;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    
+    // FUSE wants a NUL-terminated, possibly truncated target
+    int len = symlink_read(idx, buf, size - 1);
+    if (len < 0) {
+        return -EIO;
+    }
+    buf[len] = '\0';
+    return 0;
 }
\ No newline at end of file
@@ -0,0 +1,528 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <limits.h>
+
+/*
+ * ============================================================================
+ * EVFS-REPLAY - Run a recorded workload against the storage modules
+ * ============================================================================
+ *
+ * Plays a trace written by evfs --record=FILE (evfs_trace.c) straight into
+ * the metadata, storage, xattr and WAL modules, without FUSE or the kernel
+ * in the way, and reports throughput and latency per operation next to the
+ * latencies that were recorded. Run the same trace before and after a
+ * change (or with another --cipher) to compare them on the same workload.
+ *
+ * A replay builds a scratch file system (replay_data.bin, replay_meta.bin
+ * unless --backing/--meta say otherwise) and refuses to start if those
+ * files exist; they are removed afterwards unless --keep is given.
+ *
+ * The trace holds no names and no data, so:
+ *   - inode N of the recording is inode N here, named /iN in the root
+ *   - inodes that existed when recording started are created first
+ *     (untimed) and filled with a fixed pattern up to their recorded size
+ *   - writes store the same pattern, reads and writes that failed when
+ *     recorded are skipped (they never reached storage)
+ *   - xattr operations use one attribute, REPLAY_XATTR
+ *   - rename, link, open, getattr, ... are replayed as a lookup of the
+ *     inode's name; the tree structure itself is not reproduced
+ *
+ * Operations run one at a time in trace order, at the recorded times
+ * (scaled by --speed) or back to back with --fast.
+ *
+ * Usage: ./evfs-replay TRACE [--fast | --speed=X] [--backing=F1,F2,...]
+ *                      [--meta=FILE] [--cipher=NAME] [--direct-io]
+ *                      [--keep] [--verbose]
+ */
+
+#define REPLAY_DATA_FILE "replay_data.bin"
+#define REPLAY_META_FILE "replay_meta.bin"
+#define REPLAY_XATTR "user.replay"
+#define REPLAY_CHUNK_RECORDS 4096
+#define REPLAY_FILL_CHUNK (1 << 20)     // setup writes
+#define REPLAY_MAX_IO (64 << 20)        // larger requests are skipped
+
+typedef struct {
+    uint64_t count;         // replayed
+    uint64_t skipped;
+    uint64_t errors;        // failed here, succeeded when recorded
+    uint64_t recorded_us;   // sum of recorded latencies (replayed ones)
+    uint64_t *lat_ns;       // latency of each replayed operation
+    size_t lat_capacity;
+} op_stats_t;
+
+static op_stats_t stats[TRACE_OPS];
+static char *write_buf = NULL;  // fixed pattern, the same on every run
+static char *read_buf = NULL;
+static size_t buf_size = 0;
+static uint64_t read_bytes = 0, written_bytes = 0;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Grow both buffers to size bytes; the write pattern depends only on the position
+static int reserve_buffers(size_t size) {
+    if (size <= buf_size) return 0;
+    char *w = realloc(write_buf, size);
+    if (!w) return -ENOMEM;
+    write_buf = w;
+    char *r = realloc(read_buf, size);
+    if (!r) return -ENOMEM;
+    read_buf = r;
+    for (size_t i = buf_size; i < size; i++) {
+        write_buf[i] = (char)((i * 2654435761u) >> 13);
+    }
+    buf_size = size;
+    return 0;
+}
+
+static void inode_name(int ino, char *name, size_t len) {
+    if (ino == 0) {
+        snprintf(name, len, "/");
+    } else if (ino > 0) {
+        snprintf(name, len, "/i%d", ino);
+    } else {
+        snprintf(name, len, "/missing");
+    }
+}
+
+static void drop_inode(int ino) {
+    char name[32];
+    inode_name(ino, name, sizeof(name));
+    int d = find_dentry(dentry_table, name);
+    if (d >= 0) dentry_unlink(d);
+}
+
+// Create inode ino as /iN (for a symlink, len is the target length).
+// Caller holds metadata_lock(): the WAL commits in the background
+static int make_inode(int ino, file_type_t type, size_t len) {
+    if (ino <= 0 || ino >= MAX_FILES) return -EINVAL;
+    // The trace missed its removal (e.g. the last name went by rename)
+    if (file_table[ino].is_used) drop_inode(ino);
+
+    file_metadata_t *meta = &file_table[ino];
+    memset(meta, 0, sizeof(*meta));
+    meta->type = type;
+    meta->mode = type == FTYPE_DIR ? 0755 : type == FTYPE_SYMLINK ? 0777 : 0644;
+    meta->uid = getuid();
+    meta->gid = getgid();
+    meta->atime = meta->mtime = meta->ctime = time(NULL);
+    meta->size = type == FTYPE_DIR ? BLOCK_SIZE : 0;
+    meta->nlink = type == FTYPE_DIR ? 2 : 0;
+    meta->is_used = 1;
+    quota_account(meta->uid, meta->gid, 0, 1);
+    storage_assign_volume(ino, 0);
+
+    int ret = 0;
+    if (type == FTYPE_SYMLINK) {
+        char target[PATH_MAX];
+        if (len == 0) len = 1;
+        if (len >= sizeof(target)) len = sizeof(target) - 1;
+        memset(target, 't', len);
+        target[len] = '\0';
+        ret = symlink_store(ino, target);
+    }
+    if (ret == 0) {
+        char name[32];
+        inode_name(ino, name, sizeof(name));
+        ret = dentry_add(name, ino);
+    }
+    if (ret < 0) {
+        delete_storage(ino);
+        quota_account(meta->uid, meta->gid, 0, -1);
+        memset(meta, 0, sizeof(*meta));
+        return ret;
+    }
+    return 0;
+}
+
+// Give a file its recorded size, written with the pattern
+static int fill_file(int ino, uint64_t size) {
+    int ret = reserve_buffers(REPLAY_FILL_CHUNK);
+    for (uint64_t off = 0; ret == 0 && off < size; off += REPLAY_FILL_CHUNK) {
+        size_t len = size - off < REPLAY_FILL_CHUNK ? size - off : REPLAY_FILL_CHUNK;
+        ret = write_block(ino, off, write_buf, len);
+        if (ret >= 0) ret = 0;
+    }
+    if (ret == 0) file_table[ino].size = size;
+    return ret;
+}
+
+// What getattr, open, ... cost: resolve the name
+static int lookup(int ino) {
+    char name[32];
+    inode_name(ino, name, sizeof(name));
+    int idx = find_file_by_path(name);
+    return idx < 0 ? -ENOENT : volume_check(&file_table[idx]);
+}
+
+// Replay one operation. Sets *skipped for one that cannot be replayed
+static int replay_one(const trace_record_t *rec, int *skipped) {
+    int ino = rec->inode < MAX_FILES ? rec->inode : -1;
+    file_metadata_t *meta = ino >= 0 && file_table[ino].is_used ? &file_table[ino] : NULL;
+    int ret;
+
+    *skipped = 0;
+    switch (rec->op) {
+    case TRACE_CREATE:
+    case TRACE_MKDIR:
+    case TRACE_SYMLINK:
+        if (rec->result < 0 || ino <= 0) return lookup(ino);
+        metadata_lock();
+        ret = make_inode(ino, rec->op == TRACE_MKDIR ? FTYPE_DIR :
+                         rec->op == TRACE_SYMLINK ? FTYPE_SYMLINK : FTYPE_FILE, rec->size);
+        metadata_unlock();
+        return ret;
+
+    case TRACE_UNLINK:
+    case TRACE_RMDIR:
+        // Only the last name takes the inode (and its storage) with it
+        if (rec->result == 0 && (rec->flags & TRACE_GONE) && meta) {
+            metadata_lock();
+            drop_inode(ino);
+            metadata_unlock();
+            return 0;
+        }
+        return lookup(ino);
+
+    case TRACE_READ:
+    case TRACE_WRITE:
+    case TRACE_TRUNCATE:
+        if (rec->result < 0 || !meta || meta->type != FTYPE_FILE || rec->size > REPLAY_MAX_IO ||
+            reserve_buffers(rec->size) < 0) {
+            *skipped = 1;
+            return 0;
+        }
+        if (rec->op == TRACE_READ) {
+            if ((off_t)rec->offset >= meta->size) return 0;
+            size_t size = rec->size;
+            if ((off_t)(rec->offset + size) > meta->size) size = meta->size - rec->offset;
+            ret = read_block(ino, rec->offset, read_buf, size);
+            if (ret > 0) read_bytes += ret;
+            return ret;
+        }
+        if (rec->op == TRACE_WRITE) {
+            ret = write_block(ino, rec->offset, write_buf, rec->size);
+            if (ret < 0) return ret;
+            written_bytes += ret;
+            if ((off_t)(rec->offset + ret) > meta->size) meta->size = rec->offset + ret;
+        } else {
+            ret = truncate_storage(ino, rec->offset);
+            if (ret < 0) return ret;
+            meta->size = rec->offset;
+        }
+        meta->mtime = meta->ctime = time(NULL);
+        return ret;
+
+    case TRACE_FSYNC:
+        return wal_sync() < 0 ? -EIO : 0;
+
+    case TRACE_SETXATTR:
+    case TRACE_GETXATTR:
+    case TRACE_LISTXATTR:
+    case TRACE_REMOVEXATTR:
+        if (!meta) return lookup(ino);
+        if (rec->size > REPLAY_MAX_IO || reserve_buffers(rec->size) < 0) {
+            *skipped = 1;
+            return 0;
+        }
+        if (rec->op == TRACE_SETXATTR) {
+            return xattr_set(ino, REPLAY_XATTR, write_buf, rec->size, 0);
+        }
+        if (rec->op == TRACE_GETXATTR) {
+            return xattr_get(ino, REPLAY_XATTR, rec->size ? read_buf : NULL, rec->size);
+        }
+        if (rec->op == TRACE_LISTXATTR) {
+            return xattr_list(ino, rec->size ? read_buf : NULL, rec->size);
+        }
+        return xattr_remove(ino, REPLAY_XATTR);
+
+    default:
+        return lookup(ino);
+    }
+}
+
+// Untimed: the inodes that existed when recording started
+static int setup_inode(const trace_record_t *rec) {
+    int ino = rec->inode;
+    if (ino == 0) return 0;  // the root is always there
+    if (ino < 0 || ino >= MAX_FILES || rec->size > FTYPE_SYMLINK) return -EINVAL;
+
+    file_type_t type = rec->size;
+    metadata_lock();
+    int ret = make_inode(ino, type, type == FTYPE_SYMLINK ? rec->offset : 0);
+    metadata_unlock();
+    if (ret == 0 && type == FTYPE_FILE) ret = fill_file(ino, rec->offset);
+    return ret;
+}
+
+static int add_latency(op_stats_t *st, uint64_t ns) {
+    if (st->count == st->lat_capacity) {
+        size_t capacity = st->lat_capacity ? st->lat_capacity * 2 : 1024;
+        uint64_t *lat = realloc(st->lat_ns, capacity * sizeof(uint64_t));
+        if (!lat) return -ENOMEM;
+        st->lat_ns = lat;
+        st->lat_capacity = capacity;
+    }
+    st->lat_ns[st->count++] = ns;
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void report(uint64_t elapsed_ns, uint64_t max_lag_ns, int paced) {
+    uint64_t total = 0, skipped = 0, errors = 0;
+    for (int op = 0; op < TRACE_OPS; op++) {
+        total += stats[op].count;
+        skipped += stats[op].skipped;
+        errors += stats[op].errors;
+    }
+    double secs = elapsed_ns / 1e9;
+    if (secs <= 0) secs = 1e-9;
+
+    printf("[REPLAY] %lu operations in %.3f s (%.0f ops/s), %lu skipped, %lu failed\n",
+           (unsigned long)total, secs, total / secs, (unsigned long)skipped,
+           (unsigned long)errors);
+    printf("[REPLAY] Read %.1f MB (%.1f MB/s), wrote %.1f MB (%.1f MB/s)\n",
+           read_bytes / 1e6, read_bytes / 1e6 / secs,
+           written_bytes / 1e6, written_bytes / 1e6 / secs);
+    if (paced) {
+        printf("[REPLAY] Fell behind the recorded timing by up to %.3f ms\n", max_lag_ns / 1e6);
+    }
+
+    printf("\n%-12s %9s %10s %10s %10s %10s %14s\n", "OPERATION", "COUNT",
+           "AVG us", "P50 us", "P99 us", "MAX us", "RECORDED us");
+    for (int op = 1; op < TRACE_OPS; op++) {
+        op_stats_t *st = &stats[op];
+        if (st->count == 0) continue;
+        qsort(st->lat_ns, st->count, sizeof(uint64_t), compare_u64);
+        uint64_t sum = 0;
+        for (uint64_t i = 0; i < st->count; i++) sum += st->lat_ns[i];
+        printf("%-12s %9lu %10.1f %10.1f %10.1f %10.1f %14.1f\n", trace_op_names[op],
+               (unsigned long)st->count, sum / 1e3 / st->count,
+               st->lat_ns[st->count / 2] / 1e3,
+               st->lat_ns[(st->count * 99) / 100] / 1e3,
+               st->lat_ns[st->count - 1] / 1e3,
+               (double)st->recorded_us / st->count);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s TRACE [options]\n", prog);
+    fprintf(stderr, "  --fast            Run operations back to back (default: recorded timing)\n");
+    fprintf(stderr, "  --speed=X         Run X times faster than recorded\n");
+    fprintf(stderr, "  --backing=F1,...  Scratch backing files (default: %s)\n", REPLAY_DATA_FILE);
+    fprintf(stderr, "  --meta=FILE       Scratch metadata file (default: %s)\n", REPLAY_META_FILE);
+    fprintf(stderr, "  --cipher=NAME     Cipher engine (default: the recorded one)\n");
+    fprintf(stderr, "  --direct-io       Bypass the page cache for the backing files\n");
+    fprintf(stderr, "  --keep            Keep the scratch file system\n");
+    fprintf(stderr, "  --verbose         Show the storage modules' messages\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *trace_path = NULL;
+    double speed = 1.0;  // 0: as fast as possible
+    int keep = 0, verbose = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fast") == 0) {
+            speed = 0;
+        } else if (strncmp(argv[i], "--speed=", 8) == 0) {
+            speed = atof(argv[i] + 8);
+            if (speed <= 0) {
+                fprintf(stderr, "--speed must be positive\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--keep") == 0) {
+            keep = 1;
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = 1;
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            evfs_options.direct_io = 1;
+        } else if (strncmp(argv[i], "--meta=", 7) == 0) {
+            evfs_options.metadata_file = argv[i] + 7;
+        } else if (strncmp(argv[i], "--cipher=", 9) == 0) {
+            evfs_options.cipher = argv[i] + 9;
+        } else if (strncmp(argv[i], "--backing=", 10) == 0) {
+            for (char *path = strtok(argv[i] + 10, ","); path; path = strtok(NULL, ",")) {
+                if (evfs_options.backing_count == MAX_BACKING_FILES) {
+                    fprintf(stderr, "Too many backing files (max %d)\n", MAX_BACKING_FILES);
+                    return 1;
+                }
+                evfs_options.backing_files[evfs_options.backing_count++] = path;
+            }
+        } else if (argv[i][0] != '-' && !trace_path) {
+            trace_path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (!trace_path) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *trace = fopen(trace_path, "rb");
+    if (!trace) {
+        fprintf(stderr, "[REPLAY] Cannot open %s: %s\n", trace_path, strerror(errno));
+        return 1;
+    }
+    trace_header_t hdr;
+    if (fread(&hdr, sizeof(hdr), 1, trace) != 1 || hdr.magic != TRACE_MAGIC) {
+        fprintf(stderr, "[REPLAY] %s is not an evfs trace\n", trace_path);
+        fclose(trace);
+        return 1;
+    }
+    if (hdr.version != TRACE_VERSION || hdr.record_size != sizeof(trace_record_t)) {
+        fprintf(stderr, "[REPLAY] %s: unsupported trace version %u\n", trace_path, hdr.version);
+        fclose(trace);
+        return 1;
+    }
+    hdr.cipher[sizeof(hdr.cipher) - 1] = '\0';
+
+    // A replay starts from an empty file system and never touches a real one
+    if (evfs_options.backing_count == 0) {
+        evfs_options.backing_files[evfs_options.backing_count++] = REPLAY_DATA_FILE;
+    }
+    if (!evfs_options.metadata_file) {
+        evfs_options.metadata_file = REPLAY_META_FILE;
+    }
+    for (int i = 0; i <= evfs_options.backing_count; i++) {
+        const char *path = i < evfs_options.backing_count ?
+                           evfs_options.backing_files[i] : evfs_options.metadata_file;
+        if (access(path, F_OK) == 0) {
+            fprintf(stderr, "[REPLAY] %s exists; a replay needs a scratch file system\n", path);
+            fclose(trace);
+            return 1;
+        }
+    }
+    if (!evfs_options.cipher) {
+        evfs_options.cipher = hdr.cipher;
+    }
+
+    // The modules' messages go where a daemonized mount's go
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    if (!verbose) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            close(null_fd);
+        }
+    }
+
+    if (evfs_crypto_init() != 0 || evfs_crypto_select_engine(evfs_options.cipher) != 0) {
+        fprintf(stderr, "[REPLAY] Cannot use cipher engine %s\n", evfs_options.cipher);
+        fclose(trace);
+        return 1;
+    }
+    // Inodes are addressed by their recorded slots: keep them all loaded
+    evfs_options.inode_cache = MAX_FILES;
+    init_filesystem();
+    if (!initialized || inode_cache_load_all() < 0) {
+        fprintf(stderr, "[REPLAY] Cannot create the scratch file system\n");
+        evfs_crypto_cleanup();
+        fclose(trace);
+        return 1;
+    }
+    if (wal_start() < 0) {
+        fprintf(stderr, "[REPLAY] Write-ahead log unavailable\n");
+    }
+
+    trace_record_t *recs = malloc(REPLAY_CHUNK_RECORDS * sizeof(trace_record_t));
+    uint64_t start = 0, end = 0, max_lag = 0, setup_count = 0;
+    int failed = !recs;
+    size_t n;
+    while (!failed && (n = fread(recs, sizeof(trace_record_t), REPLAY_CHUNK_RECORDS, trace)) > 0) {
+        for (size_t r = 0; r < n && !failed; r++) {
+            const trace_record_t *rec = &recs[r];
+            if (rec->op >= TRACE_OPS) {
+                fprintf(stderr, "[REPLAY] Unknown operation %u in the trace\n", rec->op);
+                failed = 1;
+                break;
+            }
+            if (rec->op == TRACE_INODE) {
+                int ret = setup_inode(rec);
+                if (ret < 0) {
+                    fprintf(stderr, "[REPLAY] Cannot create inode %d: %s\n",
+                            rec->inode, strerror(-ret));
+                    failed = 1;
+                }
+                setup_count++;
+                continue;
+            }
+            if (start == 0) start = now_ns();
+
+            if (speed > 0) {
+                uint64_t due = start + (uint64_t)(rec->time_ns / speed);
+                uint64_t now = now_ns();
+                if (now < due) {
+                    struct timespec ts = { due / 1000000000ULL, due % 1000000000ULL };
+                    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+                } else if (now - due > max_lag) {
+                    max_lag = now - due;
+                }
+            }
+
+            op_stats_t *st = &stats[rec->op];
+            int skipped;
+            uint64_t t0 = now_ns();
+            int ret = replay_one(rec, &skipped);
+            uint64_t t1 = now_ns();
+            end = t1;
+            if (skipped) {
+                st->skipped++;
+                continue;
+            }
+            if (ret < 0 && rec->result >= 0) st->errors++;
+            st->recorded_us += rec->latency_us;
+            if (add_latency(st, t1 - t0) < 0) failed = 1;
+        }
+    }
+    if (ferror(trace)) {
+        fprintf(stderr, "[REPLAY] Cannot read %s\n", trace_path);
+        failed = 1;
+    }
+    fclose(trace);
+    free(recs);
+
+    wal_stop();
+    if (keep && save_metadata() < 0) failed = 1;
+    cleanup_storage();
+    evfs_crypto_cleanup();
+
+    fflush(stdout);
+    if (saved_stdout >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if (!failed) {
+        printf("[REPLAY] %s: %lu inodes set up, cipher %s, %s\n", trace_path,
+               (unsigned long)setup_count, evfs_options.cipher,
+               speed > 0 ? "recorded timing" : "as fast as possible");
+        if (speed > 0 && speed != 1.0) printf("[REPLAY] Speed %gx\n", speed);
+        report(end - start, max_lag, speed > 0);
+    }
+
+    if (!keep) {
+        for (int i = 0; i < evfs_options.backing_count; i++) {
+            unlink(evfs_options.backing_files[i]);
+        }
+        char wal_path[PATH_MAX];
+        snprintf(wal_path, sizeof(wal_path), "%s.wal", evfs_options.metadata_file);
+        unlink(wal_path);
+        unlink(evfs_options.metadata_file);
+    }
+
+    for (int op = 0; op < TRACE_OPS; op++) free(stats[op].lat_ns);
+    free(write_buf);
+    free(read_buf);
+    return failed ? 1 : 0;
+}
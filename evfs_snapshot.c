@@ -0,0 +1,441 @@
+#include "evfs.h"
+#include <pthread.h>
+
+/*
+ * ============================================================================
+ * SNAPSHOT MODULE - Read-only point-in-time copies of the whole file system
+ * ============================================================================
+ *
+ * mkdir /.snapshots/<name> copies the inode and dentry tables and the block maps; the
+ * data blocks themselves become shared (reference counted by the block
+ * allocator), and the live file system copies a block only when it next
+ * writes to it. Snapshot contents are readable below /.snapshots/<name>/.
+ *
+ * rmdir /.snapshots/<name> removes the snapshot from the namespace at once;
+ * a background thread then drops its block references, freeing the blocks
+ * no one else uses.
+ */
+
+typedef struct snapshot {
+    char name[MAX_FILENAME];
+    time_t created;
+    file_metadata_t files[MAX_FILES];
+    block_map_t maps[MAX_FILES];
+    dentry_t dentries[MAX_DENTRIES];
+    unsigned char sealed[MAX_FILES];  // inline areas copied while sealed
+    struct snapshot *next;  // deletion queue link
+} snapshot_t;
+
+static snapshot_t *snapshots[MAX_SNAPSHOTS];
+static pthread_rwlock_t snapshot_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Deleted snapshots waiting for their blocks to be released
+static snapshot_t *dying = NULL;
+static pthread_t reaper_thread;
+static int reaper_running = 0;
+static pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reaper_cond = PTHREAD_COND_INITIALIZER;
+
+static void release_snapshot(snapshot_t *snap) {
+    release_snapshot_storage(snap->maps);
+    printf("[SNAPSHOT] Released snapshot '%s'\n", snap->name);
+    free(snap);
+}
+
+static void *reaper_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&reaper_lock);
+    for (;;) {
+        while (reaper_running && !dying) {
+            pthread_cond_wait(&reaper_cond, &reaper_lock);
+        }
+        snapshot_t *batch = dying;
+        dying = NULL;
+        int running = reaper_running;
+        pthread_mutex_unlock(&reaper_lock);
+
+        while (batch) {
+            snapshot_t *next = batch->next;
+            release_snapshot(batch);
+            batch = next;
+        }
+
+        pthread_mutex_lock(&reaper_lock);
+        if (!running && !dying) break;
+    }
+    pthread_mutex_unlock(&reaper_lock);
+    return NULL;
+}
+
+void init_snapshots(void) {
+    reaper_running = 1;
+    if (pthread_create(&reaper_thread, NULL, reaper_main, NULL) != 0) {
+        perror("[SNAPSHOT] Failed to start reaper");
+        reaper_running = 0;
+    }
+}
+
+void cleanup_snapshots(void) {
+    // Let the reaper finish queued deletions, then drop the rest
+    pthread_mutex_lock(&reaper_lock);
+    int was_running = reaper_running;
+    reaper_running = 0;
+    pthread_cond_signal(&reaper_cond);
+    pthread_mutex_unlock(&reaper_lock);
+    if (was_running) {
+        pthread_join(reaper_thread, NULL);
+    }
+
+    pthread_rwlock_wrlock(&snapshot_lock);
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i]) {
+            release_snapshot(snapshots[i]);
+            snapshots[i] = NULL;
+        }
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+}
+
+int is_snapshot_path(const char *path) {
+    size_t len = strlen(SNAPSHOT_DIR);
+    return strncmp(path, SNAPSHOT_DIR, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+/*
+ * Split "/.snapshots/<name>/<inner>" into the snapshot name and the path
+ * inside it ("/" for the snapshot root). Returns 0 for SNAPSHOT_DIR itself.
+ */
+static int split_snapshot_path(const char *path, char *name, const char **inner) {
+    const char *p = path + strlen(SNAPSHOT_DIR);
+    if (*p == '\0' || strcmp(p, "/") == 0) {
+        return 0;
+    }
+
+    p++;  // skip '/'
+    const char *slash = strchr(p, '/');
+    size_t len = slash ? (size_t)(slash - p) : strlen(p);
+    if (len >= MAX_FILENAME) {
+        return -ENAMETOOLONG;
+    }
+    memcpy(name, p, len);
+    name[len] = '\0';
+    *inner = slash ? slash : "/";
+    return 1;
+}
+
+// Find a snapshot by name. Caller holds snapshot_lock.
+static int find_snapshot(const char *name) {
+    for (int i = 0; i < MAX_SNAPSHOTS; i++) {
+        if (snapshots[i] && strcmp(snapshots[i]->name, name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/*
+ * Resolve a path below SNAPSHOT_DIR to a snapshot and an inode in its file
+ * table. Caller holds snapshot_lock. Returns 0, or -ENOENT.
+ */
+static int resolve(const char *path, snapshot_t **snap, int *idx) {
+    char name[MAX_FILENAME];
+    const char *inner;
+    if (split_snapshot_path(path, name, &inner) <= 0) {
+        return -ENOENT;
+    }
+
+    int s = find_snapshot(name);
+    if (s == -1) {
+        return -ENOENT;
+    }
+
+    *snap = snapshots[s];
+    *idx = find_path_in_table(snapshots[s]->dentries, inner);
+    return *idx == -1 ? -ENOENT : 0;
+}
+
+// resolve() for access to an entry's contents, which needs its volume's key
+static int resolve_contents(const char *path, snapshot_t **snap, int *idx) {
+    int ret = resolve(path, snap, idx);
+    return ret < 0 ? ret : volume_check(&(*snap)->files[*idx]);
+}
+
+int snapshot_create(const char *name) {
+    if (name[0] == '\0' || strchr(name, '/') || strcmp(name, ".") == 0 ||
+        strcmp(name, "..") == 0) {
+        return -EINVAL;
+    }
+    if (strlen(name) >= MAX_FILENAME) {
+        return -ENAMETOOLONG;
+    }
+
+    snapshot_t *snap = calloc(1, sizeof(snapshot_t));
+    if (!snap) {
+        return -ENOMEM;
+    }
+    // A snapshot holds every inode (the operation keeps them loaded)
+    if (inode_cache_load_all() < 0) {
+        free(snap);
+        return -EIO;
+    }
+
+    pthread_rwlock_wrlock(&snapshot_lock);
+
+    if (find_snapshot(name) != -1) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        free(snap);
+        printf("[SNAPSHOT] Snapshot already exists: %s\n", name);
+        return -EEXIST;
+    }
+
+    int slot = -1;
+    for (int i = 0; i < MAX_SNAPSHOTS && slot == -1; i++) {
+        if (!snapshots[i]) slot = i;
+    }
+    if (slot == -1) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        free(snap);
+        printf("[SNAPSHOT] No free snapshot slots\n");
+        return -ENOSPC;
+    }
+
+    // Shares every block with the live file system; no data is copied
+    if (snapshot_storage(snap->maps, snap->files, snap->dentries, snap->sealed) < 0) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        free(snap);
+        return -ENOMEM;
+    }
+    strcpy(snap->name, name);
+    snap->created = time(NULL);
+    snapshots[slot] = snap;
+
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    printf("[SNAPSHOT] Created snapshot '%s'\n", name);
+    return 0;
+}
+
+int snapshot_delete(const char *name) {
+    pthread_rwlock_wrlock(&snapshot_lock);
+    int s = find_snapshot(name);
+    if (s == -1) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        return -ENOENT;
+    }
+    snapshot_t *snap = snapshots[s];
+    snapshots[s] = NULL;
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    // Blocks are released in the background
+    pthread_mutex_lock(&reaper_lock);
+    if (reaper_running) {
+        snap->next = dying;
+        dying = snap;
+        pthread_cond_signal(&reaper_cond);
+        snap = NULL;
+    }
+    pthread_mutex_unlock(&reaper_lock);
+
+    if (snap) {
+        release_snapshot(snap);
+    }
+
+    printf("[SNAPSHOT] Deleted snapshot '%s'\n", name);
+    return 0;
+}
+
+int snapshot_getattr(const char *path, struct stat *stbuf) {
+    char name[MAX_FILENAME];
+    const char *inner;
+    if (split_snapshot_path(path, name, &inner) == 0) {
+        // The snapshot directory itself
+        metadata_to_stat(&file_table[0], stbuf);
+        stbuf->st_mode = S_IFDIR | 0755;
+        return 0;
+    }
+
+    pthread_rwlock_rdlock(&snapshot_lock);
+    snapshot_t *snap;
+    int idx;
+    int ret = resolve(path, &snap, &idx);
+    if (ret == 0) {
+        metadata_to_stat(&snap->files[idx], stbuf);
+        stbuf->st_mode &= ~0222;  // read-only
+    } else {
+        memset(stbuf, 0, sizeof(struct stat));
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+    return ret;
+}
+
+int snapshot_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset) {
+    char name[MAX_FILENAME];
+    const char *inner = "/";
+    int ret = 0;
+
+    pthread_rwlock_rdlock(&snapshot_lock);
+
+    if (split_snapshot_path(path, name, &inner) == 0) {
+        // Offsets as in fill_directory(): 1 ".", 2 "..", then 3 + slot
+        struct stat st;
+        snapshot_getattr(SNAPSHOT_DIR, &st);
+        if ((offset < 1 && filler(buf, ".", &st, 1)) ||
+            (offset < 2 && filler(buf, "..", NULL, 2))) {
+            pthread_rwlock_unlock(&snapshot_lock);
+            return 0;
+        }
+        for (int i = offset > 3 ? offset - 3 : 0; i < MAX_SNAPSHOTS; i++) {
+            if (!snapshots[i]) continue;
+            metadata_to_stat(&snapshots[i]->files[0], &st);
+            st.st_mode &= ~0222;
+            if (filler(buf, snapshots[i]->name, &st, 3 + i + 1)) break;
+        }
+    } else {
+        snapshot_t *snap;
+        int dir_idx;
+        ret = resolve(path, &snap, &dir_idx);
+        if (ret == 0 && snap->files[dir_idx].type != FTYPE_DIR) {
+            ret = -ENOTDIR;
+        }
+        if (ret == 0) {
+            fill_directory(snap->files, snap->dentries, inner, dir_idx, FILL_READ_ONLY,
+                           buf, filler, offset);
+        }
+    }
+
+    pthread_rwlock_unlock(&snapshot_lock);
+    return ret;
+}
+
+int snapshot_open(const char *path) {
+    pthread_rwlock_rdlock(&snapshot_lock);
+    snapshot_t *snap;
+    int idx;
+    int ret = resolve_contents(path, &snap, &idx);
+    if (ret == 0 && snap->files[idx].type != FTYPE_FILE) {
+        ret = -EISDIR;
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+    return ret;
+}
+
+/*
+ * Run an xattr lookup on a snapshot entry. The stream is read through the
+ * snapshot's map on every call; snapshots are not expected to be hot.
+ */
+// A snapshot's copy of an inode, unsealed into *copy if it was taken from
+// a locked volume (whose key resolve_contents() found loaded again now)
+static const file_metadata_t *snapshot_inode(snapshot_t *snap, int idx, file_metadata_t *copy) {
+    if (!snap->sealed[idx]) {
+        return &snap->files[idx];
+    }
+    *copy = snap->files[idx];
+    inode_seal(copy, snap->maps[idx].id, snap->maps[idx].old_engine, 0);  // a damaged area reads as zeros
+    return copy;
+}
+
+static int snapshot_xattr(const char *path, const char *name, char *buf, size_t size) {
+    char snap_name[MAX_FILENAME];
+    const char *inner;
+    if (split_snapshot_path(path, snap_name, &inner) == 0) {
+        return name ? -ENODATA : 0;  // the snapshot directory has none
+    }
+
+    pthread_rwlock_rdlock(&snapshot_lock);
+
+    snapshot_t *snap;
+    int idx;
+    int ret = resolve_contents(path, &snap, &idx);
+    if (ret < 0) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        return ret;
+    }
+
+    file_metadata_t unsealed;
+    const file_metadata_t *meta = snapshot_inode(snap, idx, &unsealed);
+    size_t len = xattr_stream_size(meta);
+    char *stream = len > 0 ? malloc(len) : NULL;
+    if (len > 0 && !stream) {
+        ret = -ENOMEM;
+    } else if (len > 0 && read_snapshot_xattr_stream(&snap->maps[idx], stream, len) < 0) {
+        ret = -EIO;
+    } else {
+        ret = name ? xattr_get_in(meta, stream, name, buf, size)
+                   : xattr_list_in(meta, stream, buf, size);
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    free(stream);
+    return ret;
+}
+
+int snapshot_getxattr(const char *path, const char *name, char *value, size_t size) {
+    return snapshot_xattr(path, name, value, size);
+}
+
+int snapshot_listxattr(const char *path, char *list, size_t size) {
+    return snapshot_xattr(path, NULL, list, size);
+}
+
+int snapshot_readlink(const char *path, char *buf, size_t size) {
+    pthread_rwlock_rdlock(&snapshot_lock);
+
+    snapshot_t *snap;
+    int idx;
+    int ret = resolve_contents(path, &snap, &idx);
+    if (ret == 0 && snap->files[idx].type != FTYPE_SYMLINK) {
+        ret = -EINVAL;
+    }
+    if (ret == 0 && size > 0) {
+        // Same layout as symlink_read(), through the snapshot's map
+        file_metadata_t unsealed;
+        const file_metadata_t *meta = snapshot_inode(snap, idx, &unsealed);
+        size_t len = (size_t)meta->size < size - 1 ? (size_t)meta->size : size - 1;
+        if (symlink_is_inline(meta)) {
+            memcpy(buf, meta->symlink, len);
+        } else if (read_snapshot_block(&snap->maps[idx], 0, buf, len) < 0) {
+            ret = -EIO;
+        }
+        buf[len] = '\0';
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+    return ret;
+}
+
+int snapshot_read(const char *path, char *buf, size_t size, off_t offset) {
+    // Held for the whole read so a concurrent rmdir waits for us
+    pthread_rwlock_rdlock(&snapshot_lock);
+
+    snapshot_t *snap;
+    int idx;
+    int ret = resolve_contents(path, &snap, &idx);
+    if (ret == 0 && snap->files[idx].type != FTYPE_FILE) {
+        ret = -EISDIR;
+    }
+    if (ret < 0) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        return ret;
+    }
+
+    off_t file_size = snap->files[idx].size;
+    if (offset >= file_size) {
+        pthread_rwlock_unlock(&snapshot_lock);
+        return 0;  // EOF
+    }
+    if (offset + (off_t)size > file_size) {
+        size = file_size - offset;
+    }
+
+    if (snap->files[idx].inline_data) {
+        file_metadata_t unsealed;
+        const file_metadata_t *meta = snapshot_inode(snap, idx, &unsealed);
+        inline_data_read(meta, offset, buf, size);
+        ret = size;
+    } else {
+        ret = read_snapshot_block(&snap->maps[idx], offset, buf, size);
+    }
+    pthread_rwlock_unlock(&snapshot_lock);
+
+    return ret < 0 ? -EIO : ret;
+}
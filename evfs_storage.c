@@ -1,5 +1,9 @@
+#define _GNU_SOURCE  // O_DIRECT
 #include "evfs.h"
 #include "evfs_crypto.h"
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/statvfs.h>
 
 /*
  * ============================================================================
@@ -7,294 +11,3151 @@
  * ============================================================================
  */
 
-#define BACKING_FILE "evfs_data.bin"
-#define MAX_FILE_SIZE (10 * 1024 * 1024) // 10MB per file max
+// Most blocks moved by one backing I/O in read_block()/write_block()
+#define IO_BATCH_BLOCKS 32
 
-// Storage metadata for each file
+// Storage address space is striped across backing files in units of
+// STRIPE_SIZE (must be a multiple of IO_ALIGN)
+#define STRIPE_SIZE (64 * 1024)
+
+// Background compaction tuning
+#define COMPACT_INTERVAL_SEC 5
+#define COMPACT_CHUNK_BLOCKS 64           // blocks copied per storage_lock hold
+#define COMPACT_MAX_DEFRAG_BLOCKS 4096    // largest file relocated in one piece
+#define COMPACT_MAX_SEGMENTS 256          // extents gathered into one relocation
+
+// Aligned buffer pool used for O_DIRECT I/O
+#define IO_POOL_BUFFERS 16
+#define IO_POOL_BUF_SIZE (128 * 1024)  // must be a multiple of IO_ALIGN
+
+// I/O counters, reported by print_storage_stats()
+typedef struct {
+    unsigned long read_ops;
+    unsigned long write_ops;
+    unsigned long bytes_read;
+    unsigned long bytes_written;
+    unsigned long pool_hits;    // aligned buffer taken from the pool
+    unsigned long pool_misses;  // pool exhausted, fell back to posix_memalign
+    unsigned long parallel_ops; // requests fanned out to several backing files
+    unsigned long dev_bytes[MAX_BACKING_FILES];
+} storage_stats_t;
+
+// Contiguous piece of a request that lands on a single backing file
+typedef struct {
+    int dev;
+    char *buf;
+    size_t size;
+    off_t dev_offset;
+} stripe_seg_t;
+
+// A request waiting for the jobs it handed to stripe workers
+typedef struct {
+    int pending;            // jobs not finished yet; under stripe_lock
+    pthread_cond_t done;
+} stripe_wait_t;
+
+// All segments of one request that target the same backing file
+typedef struct stripe_job {
+    int dev;
+    int is_write;
+    stripe_seg_t *segs;
+    int nsegs;
+    int result;  // 0 = ok, -1 = I/O error
+    struct stripe_job *next;    // in its worker's queue
+    stripe_wait_t *wait;
+} stripe_job_t;
+
+// One thread per backing file, started with the storage, runs the jobs
+// queued for that file; a striped request costs a queue push per extra
+// file instead of a thread
 typedef struct {
-    off_t storage_offset;  // Where this file's data starts in backing file
-    size_t allocated_size; // How much space is allocated
-} storage_info_t;
+    pthread_t thread;
+    stripe_job_t *head, *tail;
+    pthread_cond_t work;
+} stripe_worker_t;
 
-static storage_info_t storage_table[MAX_FILES];
-static int backing_fd = -1;
-static off_t next_free_offset = 0;
+// Per-file block maps. Reading or writing a file holds storage_lock
+// shared plus the file's locks below; operations on all the tables at
+// once (commits, snapshots, loading) take it exclusively. Changes of
+// either kind go through fair_wrlock(). The rwlock prefers exclusive
+// holders, so a steady stream of readers cannot hold a commit off
+static block_map_t block_maps[MAX_FILES];
+static uint64_t next_map_id = 1;
+static uint64_t change_gen = 1;     // see CHANGED-BLOCK TRACKING
+static pthread_rwlock_t storage_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
 
 /*
- * Initialize the storage system
+ * Locks of a live file. 'writer' is held by whoever changes the file's
+ * blocks or inline contents, for the whole operation including its
+ * crypto and I/O, so the holder may look the map up without 'map'.
+ * 'map' guards the map and the inline contents themselves: readers share
+ * it while they look blocks up and read them; a writer takes it only to
+ * switch the map over to blocks it has already written, or around an
+ * overwrite in place. Freed blocks can be reused at once, so nothing is
+ * freed while a reader of the file still holds 'map'.
  */
-int init_storage(void) {
-    printf("[STORAGE] Initializing storage system...\n");
-    
-    // Open or create backing file
-    backing_fd = open(BACKING_FILE, O_RDWR | O_CREAT, 0666);
-    if (backing_fd < 0) {
-        perror("[STORAGE] Failed to open backing file");
-        return -1;
-    }
-    
-    // Get file size
-    struct stat st;
-    if (fstat(backing_fd, &st) < 0) {
-        perror("[STORAGE] Failed to stat backing file");
-        close(backing_fd);
-        return -1;
+typedef struct {
+    pthread_mutex_t writer;
+    pthread_rwlock_t map;
+} file_lock_t;
+
+static file_lock_t file_locks[MAX_FILES];
+static int backing_fds[MAX_BACKING_FILES];
+static int backing_count = 0;
+static int direct_io_active = 0;
+static stripe_worker_t stripe_workers[MAX_BACKING_FILES];
+static int stripe_worker_count = 0;     // 0: requests run one file at a time
+static int stripe_workers_running = 0;
+static pthread_mutex_t stripe_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// File bytes held per 4 KiB block (less than BLOCK_SIZE when the cipher
+// engine keeps a nonce/tag trailer in each block)
+static size_t block_payload = BLOCK_SIZE;
+
+static char *io_pool[IO_POOL_BUFFERS];
+static char *io_pool_free[IO_POOL_BUFFERS];
+static int io_pool_nfree = 0;
+static pthread_mutex_t io_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static storage_stats_t stats;
+
+// Compaction progress counters
+typedef struct {
+    unsigned long passes;
+    unsigned long relocations;      // completed copy-then-switch moves
+    unsigned long aborted;          // moves dropped because the file changed
+    unsigned long bytes_moved;
+    unsigned long bytes_reclaimed;  // backing file space given back to the OS
+} compact_stats_t;
+
+// One piece of a relocation: logical run [lblk, lblk+len) at src_pblk
+typedef struct {
+    blk_t lblk;
+    blk_t src_pblk;
+    blk_t len;
+} move_seg_t;
+
+/*
+ * Writers of all volumes share the storage. Left to the locks, whichever
+ * thread grabs them next wins, so a volume with many busy writers could
+ * starve the others; instead writers queue here per volume and are let
+ * in round-robin across the volumes waiting, at most FAIR_SLOTS at once.
+ * Everything that changes the storage comes through here, operations on
+ * all the tables too: those go first, let no writer in while they wait,
+ * and run alone once the writers inside have left.
+ */
+#define FAIR_SLOTS 8
+
+static int fair_waiting[MAX_VOLUMES];
+static int fair_busy = 0;       // writers let in, -1 while held exclusively
+static int fair_exclusive = 0;  // exclusive holders, waiting or not
+static uint32_t fair_next = 0;  // volume whose turn comes first
+static pthread_mutex_t fair_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fair_cond = PTHREAD_COND_INITIALIZER;
+
+static compact_stats_t compact_stats;
+static pthread_t compact_thread;
+static int compact_running = 0;
+static pthread_mutex_t compact_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compact_cond = PTHREAD_COND_INITIALIZER;
+static int defrag_cursor = 0;
+
+static void start_compactor(void);
+static void stop_compactor(void);
+static void start_releaser(void);
+static void stop_releaser(void);
+static void drain_releases(void);
+static void track_clear(void);
+static void track_changes(unsigned char *marked);
+static off_t device_bytes_for(blk_t end, int d);
+static int write_map_locked(block_map_t *map, off_t offset, const char *buf, size_t size);
+
+#define STAT_ADD(field, n) __atomic_fetch_add(&stats.field, (n), __ATOMIC_RELAXED)
+
+#define ALIGN_DOWN(x) ((x) & ~((off_t)IO_ALIGN - 1))
+#define ALIGN_UP(x)   ALIGN_DOWN((x) + IO_ALIGN - 1)
+
+/*
+ * Aligned buffer pool
+ */
+static int io_pool_init(void) {
+    for (int i = 0; i < IO_POOL_BUFFERS; i++) {
+        if (posix_memalign((void **)&io_pool[i], IO_ALIGN, IO_POOL_BUF_SIZE) != 0) {
+            fprintf(stderr, "[STORAGE] Failed to allocate aligned I/O buffer\n");
+            return -1;
+        }
+        io_pool_free[io_pool_nfree++] = io_pool[i];
     }
-    
-    // If file is empty, initialize it
-    if (st.st_size == 0) {
-        printf("[STORAGE] Creating new backing file\n");
-        next_free_offset = 0;
-    } else {
-        printf("[STORAGE] Using existing backing file (size: %ld bytes)\n", st.st_size);
-        next_free_offset = st.st_size;
+    printf("[STORAGE] Aligned buffer pool: %d x %d KiB\n",
+           IO_POOL_BUFFERS, IO_POOL_BUF_SIZE / 1024);
+    return 0;
+}
+
+static void io_pool_destroy(void) {
+    for (int i = 0; i < IO_POOL_BUFFERS; i++) {
+        free(io_pool[i]);
+        io_pool[i] = NULL;
     }
-    
-    // Initialize storage table
-    for (int i = 0; i < MAX_FILES; i++) {
-        storage_table[i].storage_offset = -1;
-        storage_table[i].allocated_size = 0;
+    io_pool_nfree = 0;
+}
+
+static int io_pool_owns(const char *buf) {
+    for (int i = 0; i < IO_POOL_BUFFERS; i++) {
+        if (io_pool[i] == buf) return 1;
     }
-    
-    printf("[STORAGE] Storage system initialized successfully\n");
     return 0;
 }
 
+static char *io_buf_get(void) {
+    char *buf = NULL;
+
+    pthread_mutex_lock(&io_pool_lock);
+    if (io_pool_nfree > 0) {
+        buf = io_pool_free[--io_pool_nfree];
+    }
+    pthread_mutex_unlock(&io_pool_lock);
+
+    if (buf) {
+        STAT_ADD(pool_hits, 1);
+        return buf;
+    }
+
+    // Pool exhausted (many concurrent requests) - use a one-off buffer
+    STAT_ADD(pool_misses, 1);
+    if (posix_memalign((void **)&buf, IO_ALIGN, IO_POOL_BUF_SIZE) != 0) {
+        return NULL;
+    }
+    return buf;
+}
+
+static void io_buf_put(char *buf) {
+    if (!io_pool_owns(buf)) {
+        free(buf);
+        return;
+    }
+    pthread_mutex_lock(&io_pool_lock);
+    io_pool_free[io_pool_nfree++] = buf;
+    pthread_mutex_unlock(&io_pool_lock);
+}
+
 /*
- * Allocate storage space for a file
+ * Plain positional I/O that retries on short transfers.
+ * Returns bytes transferred (short only at EOF for reads), or -1.
  */
-int allocate_storage(int file_idx, size_t size) {
-    if (file_idx < 0 || file_idx >= MAX_FILES) {
-        printf("[STORAGE] Invalid file index: %d\n", file_idx);
-        return -1;
+static ssize_t pread_full(int fd, char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        if (n == 0) break;  // EOF
+        done += n;
     }
-    
-    if (size > MAX_FILE_SIZE) {
-        printf("[STORAGE] Requested size too large: %zu\n", size);
-        return -EFBIG;
+    return done;
+}
+
+static ssize_t pwrite_full(int fd, const char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
     }
-    
-    // Round up to block size
-    size_t alloc_size = ((size + BLOCK_SIZE - 1) / BLOCK_SIZE) * BLOCK_SIZE;
-    if (alloc_size == 0) alloc_size = BLOCK_SIZE;
-    
-    printf("[STORAGE] Allocating %zu bytes for file %d at offset %ld\n", 
-           alloc_size, file_idx, next_free_offset);
-    
-    storage_table[file_idx].storage_offset = next_free_offset;
-    storage_table[file_idx].allocated_size = alloc_size;
-    next_free_offset += alloc_size;
-    
-    return 0;
+    return done;
 }
 
 /*
- * Read data from storage
+ * O_DIRECT read: every transfer is widened to IO_ALIGN boundaries and
+ * goes through an aligned pool buffer. Bytes past EOF read as zeros.
  */
+static ssize_t direct_pread(int fd, char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        off_t cur = offset + done;
+        off_t astart = ALIGN_DOWN(cur);
+        size_t skip = cur - astart;
+        size_t chunk = size - done;
+        if (chunk > IO_POOL_BUF_SIZE - skip) chunk = IO_POOL_BUF_SIZE - skip;
+        size_t alen = ALIGN_UP(cur + (off_t)chunk) - astart;
+
+        char *pb = io_buf_get();
+        if (!pb) return -1;
+
+        ssize_t n = pread_full(fd, pb, alen, astart);
+        if (n < 0) {
+            io_buf_put(pb);
+            return -1;
+        }
+        if ((size_t)n < alen) memset(pb + n, 0, alen - n);
+
+        memcpy(buf + done, pb + skip, chunk);
+        io_buf_put(pb);
+        done += chunk;
+
+        if ((size_t)n < skip + chunk) break;  // reached EOF
+    }
+    return done;
+}
+
 /*
- * Read data from storage
+ * O_DIRECT write: partial head/tail blocks are read-modify-written so
+ * that only whole, aligned blocks ever reach the device.
  */
+static ssize_t direct_pwrite(int fd, const char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+
+    while (done < size) {
+        off_t cur = offset + done;
+        off_t astart = ALIGN_DOWN(cur);
+        size_t skip = cur - astart;
+        size_t chunk = size - done;
+        if (chunk > IO_POOL_BUF_SIZE - skip) chunk = IO_POOL_BUF_SIZE - skip;
+        off_t aend = ALIGN_UP(cur + (off_t)chunk);
+        size_t alen = aend - astart;
+
+        char *pb = io_buf_get();
+        if (!pb) return -1;
+
+        // Fill the partially covered head and tail blocks from disk
+        if (skip != 0) {
+            ssize_t n = pread_full(fd, pb, IO_ALIGN, astart);
+            if (n < 0) { io_buf_put(pb); return -1; }
+            memset(pb + n, 0, IO_ALIGN - n);
+        }
+        if ((cur + (off_t)chunk) % IO_ALIGN != 0 &&
+            (skip == 0 || alen > IO_ALIGN)) {
+            char *tail = pb + alen - IO_ALIGN;
+            ssize_t n = pread_full(fd, tail, IO_ALIGN, aend - IO_ALIGN);
+            if (n < 0) { io_buf_put(pb); return -1; }
+            memset(tail + n, 0, IO_ALIGN - n);
+        }
+
+        memcpy(pb + skip, buf + done, chunk);
+        ssize_t n = pwrite_full(fd, pb, alen, astart);
+        io_buf_put(pb);
+        if (n < 0) return -1;
+
+        done += chunk;
+    }
+    return done;
+}
+
 /*
- * Read data from storage
+ * Run every segment of a job against its backing file.
+ * Reads past the end of a backing file return zeros (unwritten stripe).
  */
-int read_block(int file_idx, off_t offset, char *buf, size_t size) {
-    if (file_idx < 0 || file_idx >= MAX_FILES) {
-        printf("[STORAGE] Invalid file index: %d\n", file_idx);
-        return -1;
+static void stripe_job_run(stripe_job_t *job) {
+    int fd = backing_fds[job->dev];
+
+    job->result = 0;
+    for (int i = 0; i < job->nsegs; i++) {
+        stripe_seg_t *seg = &job->segs[i];
+        ssize_t n;
+
+        if (job->is_write) {
+            n = direct_io_active ? direct_pwrite(fd, seg->buf, seg->size, seg->dev_offset)
+                                 : pwrite_full(fd, seg->buf, seg->size, seg->dev_offset);
+        } else {
+            n = direct_io_active ? direct_pread(fd, seg->buf, seg->size, seg->dev_offset)
+                                 : pread_full(fd, seg->buf, seg->size, seg->dev_offset);
+            if (n >= 0 && (size_t)n < seg->size) {
+                memset(seg->buf + n, 0, seg->size - n);
+            }
+        }
+        if (n < 0) {
+            job->result = -1;
+            return;
+        }
+        STAT_ADD(dev_bytes[job->dev], seg->size);
     }
+}
 
-    if (storage_table[file_idx].storage_offset < 0) {
-        printf("[STORAGE] No storage allocated for file %d\n", file_idx);
-        // Return zeros for unallocated storage
-        memset(buf, 0, size);
-        return size;
+static void *stripe_worker_main(void *arg) {
+    stripe_worker_t *w = arg;
+
+    pthread_mutex_lock(&stripe_lock);
+    for (;;) {
+        while (!w->head && stripe_workers_running) {
+            pthread_cond_wait(&w->work, &stripe_lock);
+        }
+        if (!w->head) break;  // stopping, queue drained
+        stripe_job_t *job = w->head;
+        w->head = job->next;
+        if (!w->head) w->tail = NULL;
+        pthread_mutex_unlock(&stripe_lock);
+
+        stripe_job_run(job);
+
+        pthread_mutex_lock(&stripe_lock);
+        if (--job->wait->pending == 0) {
+            pthread_cond_signal(&job->wait->done);
+        }
     }
+    pthread_mutex_unlock(&stripe_lock);
+    return NULL;
+}
 
-    off_t read_offset = storage_table[file_idx].storage_offset + offset;
+static void stop_stripe_workers(void) {
+    pthread_mutex_lock(&stripe_lock);
+    stripe_workers_running = 0;
+    for (int d = 0; d < stripe_worker_count; d++) {
+        pthread_cond_signal(&stripe_workers[d].work);
+    }
+    pthread_mutex_unlock(&stripe_lock);
 
-    // Calculate padded size (must match what was written)
-    size_t padded_size = size;
-    if (size % 16 != 0) {
-        padded_size = ((size / 16) + 1) * 16;
+    for (int d = 0; d < stripe_worker_count; d++) {
+        pthread_join(stripe_workers[d].thread, NULL);
+        pthread_cond_destroy(&stripe_workers[d].work);
     }
+    stripe_worker_count = 0;
+}
 
-    printf("[STORAGE] Reading %zu bytes (padded: %zu) from file %d at offset %ld (physical: %ld)\n",
-           size, padded_size, file_idx, offset, read_offset);
+static void start_stripe_workers(void) {
+    if (backing_count < 2) return;
 
-    // Allocate temporary buffer for padded read
-    char *temp_buf = malloc(padded_size);
-    if (!temp_buf) {
-        perror("[STORAGE] Failed to allocate read buffer");
-        return -1;
+    stripe_workers_running = 1;
+    for (int d = 0; d < backing_count; d++) {
+        stripe_worker_t *w = &stripe_workers[d];
+        w->head = w->tail = NULL;
+        pthread_cond_init(&w->work, NULL);
+        if (pthread_create(&w->thread, NULL, stripe_worker_main, w) != 0) {
+            pthread_cond_destroy(&w->work);
+            perror("[STORAGE] Failed to start stripe workers; striped requests run serially");
+            stop_stripe_workers();
+            return;
+        }
+        stripe_worker_count++;
     }
+}
 
-    // Seek to position
-    if (lseek(backing_fd, read_offset, SEEK_SET) < 0) {
-        perror("[STORAGE] Failed to seek");
-        free(temp_buf);
-        return -1;
+/*
+ * Split a storage-address-space transfer into per-file stripe segments
+ * and issue them on all the backing files involved at once: the calling
+ * thread runs one file's job, the stripe workers the others.
+ * Returns size on success, -1 on error.
+ */
+static ssize_t striped_io(int is_write, char *buf, size_t size, off_t offset) {
+    if (size == 0) return 0;
+
+    // Single backing file: the address space maps 1:1 onto it
+    if (backing_count == 1) {
+        stripe_seg_t seg = { 0, buf, size, offset };
+        stripe_job_t job = { 0, is_write, &seg, 1, 0, NULL, NULL };
+        stripe_job_run(&job);
+        return job.result < 0 ? -1 : (ssize_t)size;
     }
 
-    // Read the padded size (what was actually written to disk)
-    ssize_t bytes_read = read(backing_fd, temp_buf, padded_size);
-    if (bytes_read < 0) {
-        perror("[STORAGE] Failed to read");
-        free(temp_buf);
-        return -1;
+    int max_segs = (int)((size + (offset % STRIPE_SIZE)) / STRIPE_SIZE) + 2;
+    stripe_seg_t *segs = malloc(sizeof(stripe_seg_t) * max_segs * backing_count);
+    if (!segs) return -1;
+
+    // Bucket segments per device, preserving ascending device offsets
+    int nsegs[MAX_BACKING_FILES] = { 0 };
+    size_t done = 0;
+    while (done < size) {
+        off_t cur = offset + done;
+        off_t stripe = cur / STRIPE_SIZE;
+        size_t in_stripe = cur % STRIPE_SIZE;
+        size_t len = STRIPE_SIZE - in_stripe;
+        if (len > size - done) len = size - done;
+
+        int dev = stripe % backing_count;
+        stripe_seg_t *seg = &segs[dev * max_segs + nsegs[dev]++];
+        seg->dev = dev;
+        seg->buf = buf + done;
+        seg->size = len;
+        seg->dev_offset = (stripe / backing_count) * STRIPE_SIZE + in_stripe;
+        done += len;
     }
 
-    // Only decrypt if we actually read some data
-    if (bytes_read > 0) {
-        // Decrypt data (works on padded data)
-        if (evfs_decrypt_buffer(temp_buf, padded_size) != 0) {
-            fprintf(stderr, "[STORAGE] Decryption failed\n");
-            free(temp_buf);
-            return -1;
+    stripe_job_t jobs[MAX_BACKING_FILES];
+    stripe_wait_t wait = { 0, PTHREAD_COND_INITIALIZER };
+    int njobs = 0;
+    for (int dev = 0; dev < backing_count; dev++) {
+        if (nsegs[dev] == 0) continue;
+        jobs[njobs].dev = dev;
+        jobs[njobs].is_write = is_write;
+        jobs[njobs].segs = &segs[dev * max_segs];
+        jobs[njobs].nsegs = nsegs[dev];
+        jobs[njobs].result = 0;
+        jobs[njobs].next = NULL;
+        jobs[njobs].wait = &wait;
+        njobs++;
+    }
+
+    // Queue all but the last job to their files' workers; the calling
+    // thread runs that one (and the rest, if there are no workers)
+    if (njobs > 1) STAT_ADD(parallel_ops, 1);
+    pthread_mutex_lock(&stripe_lock);
+    int handed = stripe_worker_count > 0 ? njobs - 1 : 0;
+    for (int j = 0; j < handed; j++) {
+        stripe_worker_t *w = &stripe_workers[jobs[j].dev];
+        if (w->tail) {
+            w->tail->next = &jobs[j];
+        } else {
+            w->head = &jobs[j];
         }
+        w->tail = &jobs[j];
+        pthread_cond_signal(&w->work);
+    }
+    wait.pending = handed;
+    pthread_mutex_unlock(&stripe_lock);
 
-        // Copy only the requested size to output buffer
-        memcpy(buf, temp_buf, size);
-        printf("[STORAGE] Successfully read %zu bytes (decrypted from %zu padded)\n", 
-               size, padded_size);
+    for (int j = handed; j < njobs; j++) {
+        stripe_job_run(&jobs[j]);
     }
 
-    free(temp_buf);
-    return size;  // Return the original requested size
+    pthread_mutex_lock(&stripe_lock);
+    while (wait.pending > 0) {
+        pthread_cond_wait(&wait.done, &stripe_lock);
+    }
+    pthread_mutex_unlock(&stripe_lock);
+    pthread_cond_destroy(&wait.done);
+
+    int failed = 0;
+    for (int j = 0; j < njobs; j++) {
+        if (jobs[j].result < 0) failed = 1;
+    }
+
+    free(segs);
+    return failed ? -1 : (ssize_t)size;
 }
 
 /*
- * Write data to storage
+ * Backing file I/O entry points used by the rest of this module; each
+ * transfer waits for its turn with the I/O scheduler (evfs_iosched.c)
+ * between the io__queue and io__start probes
  */
-int write_block(int file_idx, off_t offset, const char *buf, size_t size) {
-    if (file_idx < 0 || file_idx >= MAX_FILES) {
-        printf("[STORAGE] Invalid file index: %d\n", file_idx);
-        return -1;
+static ssize_t backing_read(char *buf, size_t size, off_t offset) {
+    io_class_t cls = io_class_of(0);
+    EVFS_PROBE4(io__queue, 0, cls, offset, size);
+    io_submit(cls);
+    EVFS_PROBE4(io__start, 0, cls, offset, size);
+    ssize_t n = striped_io(0, buf, size, offset);
+    io_complete(cls, n > 0 ? n : 0);
+    EVFS_PROBE4(io__done, 0, cls, offset, n);
+    if (n > 0) {
+        STAT_ADD(read_ops, 1);
+        STAT_ADD(bytes_read, n);
+    }
+    return n;
+}
+
+static ssize_t backing_write(const char *buf, size_t size, off_t offset) {
+    io_class_t cls = io_class_of(1);
+    EVFS_PROBE4(io__queue, 1, cls, offset, size);
+    io_submit(cls);
+    EVFS_PROBE4(io__start, 1, cls, offset, size);
+    ssize_t n = striped_io(1, (char *)buf, size, offset);
+    io_complete(cls, n > 0 ? n : 0);
+    EVFS_PROBE4(io__done, 1, cls, offset, n);
+    if (n > 0) {
+        STAT_ADD(write_ops, 1);
+        STAT_ADD(bytes_written, n);
+    }
+    return n;
+}
+
+/*
+ * Open one backing file, honouring --direct-io.
+ * Sets direct_io_active on the first successful O_DIRECT open.
+ */
+static int open_backing_file(const char *path) {
+    int flags = O_RDWR | O_CREAT;
+    int use_direct = evfs_options.direct_io &&
+                     (backing_count == 0 || direct_io_active);
+    if (use_direct) {
+        flags |= O_DIRECT;
+    }
+
+    int fd = open(path, flags, 0666);
+    if (fd < 0 && use_direct && errno == EINVAL && backing_count == 0) {
+        // e.g. tmpfs does not support O_DIRECT
+        fprintf(stderr, "[STORAGE] O_DIRECT not supported here, using buffered I/O\n");
+        fd = open(path, O_RDWR | O_CREAT, 0666);
+    } else if (fd >= 0 && use_direct) {
+        direct_io_active = 1;
+    }
+    return fd;
+}
+
+static void close_backing_files(void) {
+    for (int i = 0; i < backing_count; i++) {
+        close(backing_fds[i]);
+        backing_fds[i] = -1;
     }
+    backing_count = 0;
+}
+
+/*
+ * Initialize the storage system
+ */
+int init_storage(void) {
+    printf("[STORAGE] Initializing storage system...\n");
+    io_sched_init();
 
-    // Calculate padded size for encryption (must be multiple of 16 for AES)
-    size_t padded_size = size;
-    if (size % 16 != 0) {
-        padded_size = ((size / 16) + 1) * 16;
+    // Open or create backing files
+    int nfiles = evfs_options.backing_count;
+    if (nfiles == 0) {
+        evfs_options.backing_files[0] = BACKING_FILE;
+        nfiles = 1;
     }
 
-    // Check if we need to allocate or expand storage (use padded size)
-    if (storage_table[file_idx].storage_offset < 0) {
-        // First write - allocate storage for padded size
-        if (allocate_storage(file_idx, offset + padded_size) < 0) {
+    off_t max_rows = 0;
+    for (int i = 0; i < nfiles; i++) {
+        const char *path = evfs_options.backing_files[i];
+        int fd = open_backing_file(path);
+        if (fd < 0) {
+            fprintf(stderr, "[STORAGE] Failed to open backing file %s: %s\n",
+                    path, strerror(errno));
+            close_backing_files();
             return -1;
         }
-    } else if (offset + padded_size > (off_t)storage_table[file_idx].allocated_size) {
-        // Need more space - reallocate
-        printf("[STORAGE] Need to expand storage for file %d\n", file_idx);
+        backing_fds[backing_count++] = fd;
 
-        size_t new_size = offset + padded_size;
-        off_t old_offset = storage_table[file_idx].storage_offset;
-        size_t old_size = storage_table[file_idx].allocated_size;
+        // One user at a time: a mount, evfs-fsck or evfs-tool
+        if (flock(fd, LOCK_EX | LOCK_NB) < 0) {
+            fprintf(stderr, "[STORAGE] Backing file %s is in use (mounted?)\n", path);
+            close_backing_files();
+            return -1;
+        }
 
-        // Allocate new space
-        if (allocate_storage(file_idx, new_size) < 0) {
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            perror("[STORAGE] Failed to stat backing file");
+            close_backing_files();
             return -1;
         }
 
-        // Copy existing data to new location
-        if (old_size > 0) {
-            char *temp_buf = malloc(old_size);
-            if (temp_buf) {
-                lseek(backing_fd, old_offset, SEEK_SET);
-                ssize_t rd = read(backing_fd, temp_buf, old_size);
-                if (rd > 0) {
-                    lseek(backing_fd, storage_table[file_idx].storage_offset, SEEK_SET);
-                    write(backing_fd, temp_buf, rd);
-                }
-                free(temp_buf);
-            }
+        if (st.st_size == 0) {
+            printf("[STORAGE] Creating new backing file %s\n", path);
+        } else {
+            printf("[STORAGE] Using existing backing file %s (size: %ld bytes)\n",
+                   path, st.st_size);
         }
+        off_t rows = (st.st_size + STRIPE_SIZE - 1) / STRIPE_SIZE;
+        if (rows > max_rows) max_rows = rows;
     }
 
-    off_t write_offset = storage_table[file_idx].storage_offset + offset;
+    if (direct_io_active) {
+        if (io_pool_init() < 0) {
+            io_pool_destroy();
+            close_backing_files();
+            return -1;
+        }
+        printf("[STORAGE] Direct I/O enabled (page cache bypassed)\n");
+    }
 
-    printf("[STORAGE] Writing %zu bytes (padded: %zu) to file %d at offset %ld (physical: %ld)\n",
-           size, padded_size, file_idx, offset, write_offset);
+    off_t used_bytes;
+    if (backing_count > 1) {
+        printf("[STORAGE] Striping across %d backing files (%d KiB stripes)\n",
+               backing_count, STRIPE_SIZE / 1024);
+        // New allocations start after the last used stripe row
+        used_bytes = max_rows * STRIPE_SIZE * backing_count;
+    } else {
+        struct stat st;
+        fstat(backing_fds[0], &st);
+        used_bytes = st.st_size;
+    }
+    block_allocator_init((used_bytes + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    block_allocator_limit(evfs_options.capacity > 0 ? (blk_t)evfs_options.capacity / BLOCK_SIZE : BLK_MAX);
 
-    // Allocate buffer with extra space for AES padding
-    char *enc_buf = malloc(padded_size);
-    if (!enc_buf) {
-        perror("[STORAGE] Failed to allocate encrypt buffer");
-        return -1;
+    block_payload = BLOCK_SIZE - evfs_crypto_block_overhead();
+    printf("[STORAGE] Cipher engine %s, %zu data bytes per block\n",
+           evfs_crypto_engine_name(), block_payload);
+    
+    // Initialize block maps
+    for (int i = 0; i < MAX_FILES; i++) {
+        blockmap_init(&block_maps[i], next_map_id++);
+        pthread_mutex_init(&file_locks[i].writer, NULL);
+        pthread_rwlock_init(&file_locks[i].map, NULL);
     }
+    change_gen = 1;
+    track_clear();
+    
+    start_stripe_workers();
+    start_compactor();
+    start_releaser();
+
+    printf("[STORAGE] Storage system initialized successfully\n");
+    return 0;
+}
 
-    // Copy data and zero-pad the extra bytes
-    memcpy(enc_buf, buf, size);
-    if (padded_size > size) {
-        memset(enc_buf + size, 0, padded_size - size);
+// Aim right after the previous logical block to keep files contiguous
+static blk_t alloc_goal(block_map_t *map, blk_t lblk) {
+    blk_t prev_pblk, run;
+    if (lblk > 0 && blockmap_lookup(map, lblk - 1, &prev_pblk, &run)) {
+        return prev_pblk + 1;
     }
+    return BLK_MAX;
+}
 
-    // Encrypt the buffer (encryption happens in-place on full padded buffer)
-    if (evfs_encrypt_buffer(enc_buf, size) != 0) {
-        fprintf(stderr, "[STORAGE] Encryption failed\n");
-        free(enc_buf);
-        return -1;
+// Owner of a live block map, charged for the blocks it maps
+static file_metadata_t *map_owner(const block_map_t *map) {
+    return &file_table[map - block_maps];
+}
+
+// Charge the owner for a change in the number of blocks a map holds
+static void charge_blocks(const block_map_t *map, blk_t before) {
+    blk_t after = blockmap_blocks(map);
+    if (after != before) {
+        quota_account(map_owner(map)->uid, map_owner(map)->gid, (int64_t)after - (int64_t)before, 0);
     }
+}
 
-    // Seek to position
-    if (lseek(backing_fd, write_offset, SEEK_SET) < 0) {
-        perror("[STORAGE] Failed to seek");
-        free(enc_buf);
-        return -1;
+// Lock of a live map; a snapshot's map is private and needs none
+static pthread_rwlock_t *map_lock(const block_map_t *map) {
+    if (map < block_maps || map >= block_maps + MAX_FILES) {
+        return NULL;
     }
+    return &file_locks[map - block_maps].map;
+}
 
-    // Write the FULL PADDED SIZE to disk (critical for decryption to work)
-    ssize_t bytes_written = write(backing_fd, enc_buf, padded_size);
-    free(enc_buf);
+static void map_rdlock(const block_map_t *map) {
+    pthread_rwlock_t *lock = map_lock(map);
+    if (lock) pthread_rwlock_rdlock(lock);
+}
 
-    if (bytes_written < 0) {
-        perror("[STORAGE] Failed to write");
-        return -1;
+static void map_wrlock(const block_map_t *map) {
+    pthread_rwlock_t *lock = map_lock(map);
+    if (lock) pthread_rwlock_wrlock(lock);
+}
+
+static void map_unlock(const block_map_t *map) {
+    pthread_rwlock_t *lock = map_lock(map);
+    if (lock) pthread_rwlock_unlock(lock);
+}
+
+// Writer lock of a live map; a detached one is private
+static pthread_mutex_t *map_writer(const block_map_t *map) {
+    if (!map_lock(map)) {
+        return NULL;
     }
+    return &file_locks[map - block_maps].writer;
+}
 
-    if ((size_t)bytes_written != padded_size) {
-        fprintf(stderr, "[STORAGE] Partial write: expected %zu, wrote %zd\n", 
-                padded_size, bytes_written);
-        return -1;
+/*
+ * Wait for this volume's turn, then take storage_lock shared and the
+ * file's writer lock. With no map, take storage_lock exclusively for an
+ * operation on all the tables. A thread let in must leave before it asks
+ * for the exclusive lock, or it waits for itself.
+ */
+static void fair_wrlock(const block_map_t *map) {
+    pthread_mutex_lock(&fair_lock);
+    if (!map) {
+        fair_exclusive++;
+        while (fair_busy != 0) pthread_cond_wait(&fair_cond, &fair_lock);
+        fair_busy = -1;
+        pthread_mutex_unlock(&fair_lock);
+        pthread_rwlock_wrlock(&storage_lock);
+        return;
     }
 
-    // Sync to disk
-    fsync(backing_fd);
+    uint32_t volume = EVFS_KEY_ID(map->id) % MAX_VOLUMES;
+    fair_waiting[volume]++;
+    for (;;) {
+        uint32_t turn = fair_next;
+        while (fair_waiting[turn] == 0) turn = (turn + 1) % MAX_VOLUMES;
+        if (!fair_exclusive && fair_busy < FAIR_SLOTS && turn == volume) break;
+        pthread_cond_wait(&fair_cond, &fair_lock);
+    }
+    fair_waiting[volume]--;
+    fair_busy++;
+    fair_next = (volume + 1) % MAX_VOLUMES;
+    pthread_mutex_unlock(&fair_lock);
 
-    printf("[STORAGE] Successfully wrote %zd bytes encrypted (original: %zu)\n", 
-           bytes_written, size);
-    
-    // Return the original size (not padded) to match caller's expectation
-    return size;
+    pthread_rwlock_rdlock(&storage_lock);
+    if (map_writer(map)) pthread_mutex_lock(map_writer(map));
+}
+
+static void fair_unlock(const block_map_t *map) {
+    if (map && map_writer(map)) pthread_mutex_unlock(map_writer(map));
+    pthread_rwlock_unlock(&storage_lock);
+
+    pthread_mutex_lock(&fair_lock);
+    if (map) {
+        fair_busy--;
+    } else {
+        fair_busy = 0;
+        fair_exclusive--;
+    }
+    pthread_cond_broadcast(&fair_cond);
+    pthread_mutex_unlock(&fair_lock);
 }
 
 /*
- * Delete file storage
+ * Allocate up to 'want' blocks for the hole run starting at lblk and
+ * charge them to the file's owner, without mapping them yet. *got =
+ * blocks allocated; returns 0, -ENOSPC or -EDQUOT.
  */
-int delete_storage(int file_idx) {
-    if (file_idx < 0 || file_idx >= MAX_FILES) {
-        return -1;
+static int claim_blocks(block_map_t *map, blk_t lblk, blk_t want, blk_t *pblk, blk_t *got) {
+    if (block_alloc(alloc_goal(map, lblk), want, pblk, got) < 0) {
+        return -ENOSPC;
+    }
+    file_metadata_t *owner = map_owner(map);
+    int ret = quota_charge(owner->uid, owner->gid, *got, 0);
+    if (ret < 0) {
+        block_free(*pblk, *got);
+        return ret;
     }
-    
-    printf("[STORAGE] Freeing storage for file %d\n", file_idx);
-    
-    // Mark storage as free
-    storage_table[file_idx].storage_offset = -1;
-    storage_table[file_idx].allocated_size = 0;
-    
     return 0;
 }
 
+// Give back blocks from claim_blocks() that were never mapped
+static void unclaim_blocks(block_map_t *map, blk_t pblk, blk_t len) {
+    file_metadata_t *owner = map_owner(map);
+    quota_account(owner->uid, owner->gid, -(int64_t)len, 0);
+    block_free(pblk, len);
+}
+
 /*
- * Cleanup storage system
+ * Map the hole run starting at lblk (at most 'want' blocks) to freshly
+ * allocated physical blocks, charged to the file's owner. Caller holds
+ * the file's writer lock. *got = blocks mapped; returns 0, -ENOSPC or
+ * -EDQUOT.
  */
-void cleanup_storage(void) {
-    printf("[STORAGE] Cleaning up storage system...\n");
-    
-    if (backing_fd >= 0) {
-        fsync(backing_fd);
-        close(backing_fd);
-        backing_fd = -1;
+static int map_new_blocks(block_map_t *map, blk_t lblk, blk_t want, blk_t *pblk, blk_t *got) {
+    int ret = claim_blocks(map, lblk, want, pblk, got);
+    if (ret < 0) {
+        return ret;
+    }
+    map_wrlock(map);
+    ret = blockmap_insert(map, lblk, *pblk, *got, change_gen);
+    map_unlock(map);
+    if (ret < 0) {
+        unclaim_blocks(map, *pblk, *got);
+        return -ENOSPC;
+    }
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * INLINE DATA
+ * ============================================================================
+ *
+ * A regular file of at most inline_data_capacity() bytes keeps its
+ * contents in its inode (file_metadata_t.data) and maps no data blocks:
+ * reading it needs no backing I/O and it costs no block. The contents are
+ * saved and logged with the inode, sealed like the inline xattrs, and
+ * bytes past the end of file are kept zero. A write or truncate beyond the
+ * capacity first moves the contents to block 0 and the file carries on as
+ * a normal one; a file left without data blocks (e.g. truncated to 0) may
+ * become inline again. Like block maps, inline contents are read under
+ * the file's map lock and changed under both its locks, so commits and
+ * snapshots (which exclude all of them) copy them whole.
+ */
+
+// Tweak for sealing inline contents: a logical block no file data reaches
+#define INLINE_SEAL_LBLK (XATTR_LBLK - 2)
+
+// Bytes the sealed area holds with the active cipher engine
+static size_t inline_area_size(void) {
+    return INLINE_DATA_SIZE - evfs_crypto_block_overhead();
+}
+
+size_t inline_data_capacity(void) {
+    if (evfs_options.inline_max <= 0) return 0;
+    size_t max = (size_t)evfs_options.inline_max;
+    return max < inline_area_size() ? max : inline_area_size();
+}
+
+int inline_data_seal(unsigned char *area, uint64_t map_id, uint32_t engine, int enc) {
+    evfs_crypto_vec_t v = { (char *)area, (char *)area, INLINE_DATA_SIZE, map_id,
+                            INLINE_SEAL_LBLK, engine };
+    return enc ? evfs_encrypt_blocks(&v, 1) : evfs_decrypt_blocks(&v, 1);
+}
+
+// Whether a map holds data blocks (an xattr stream does not count)
+static int map_has_data(const block_map_t *map) {
+    return map->count > 0 && map->extents[0].lblk < XATTR_LBLK;
+}
+
+/*
+ * Whether a file's first 'end' bytes can be kept inline. A regular file
+ * without data blocks that is small enough becomes inline on the way.
+ * Caller holds the file's map lock exclusively
+ */
+static int inline_fits(int file_idx, off_t end) {
+    file_metadata_t *meta = &file_table[file_idx];
+    size_t cap = inline_data_capacity();
+    if ((size_t)end > cap) {
+        return 0;
+    }
+    if (!meta->inline_data) {
+        if (meta->type != FTYPE_FILE || (size_t)meta->size > cap ||
+            map_has_data(&block_maps[file_idx])) {
+            return 0;
+        }
+        memset(meta->data, 0, INLINE_DATA_SIZE);  // a hole reads as zeros
+        meta->inline_data = 1;
+    }
+    return 1;
+}
+
+/*
+ * Move an inline file's contents to its data blocks. Caller holds the
+ * file's writer lock
+ */
+static int inline_spill(int file_idx) {
+    file_metadata_t *meta = &file_table[file_idx];
+    if (!meta->inline_data) {
+        return 0;
+    }
+
+    // The zero tail needs no block (the size may not be updated yet)
+    size_t len = inline_area_size();
+    while (len > 0 && meta->data[len - 1] == 0) len--;
+    int ret = len > 0 ? write_map_locked(&block_maps[file_idx], 0, (const char *)meta->data, len) : 0;
+    if (ret < 0) {
+        return ret;
+    }
+    map_wrlock(&block_maps[file_idx]);
+    memset(meta->data, 0, INLINE_DATA_SIZE);
+    meta->inline_data = 0;
+    map_unlock(&block_maps[file_idx]);
+    printf("[STORAGE] File %d outgrew its inode; moved %zu bytes to blocks\n", file_idx, len);
+    return 0;
+}
+
+void inline_data_read(const file_metadata_t *meta, off_t offset, char *buf, size_t size) {
+    size_t len = offset < INLINE_DATA_SIZE ? INLINE_DATA_SIZE - offset : 0;
+    if (len > size) len = size;
+    memcpy(buf, meta->data + offset, len);
+    memset(buf + len, 0, size - len);
+}
+
+/*
+ * Allocate storage space for a file
+ */
+int allocate_storage(int file_idx, off_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        printf("[STORAGE] Invalid file index: %d\n", file_idx);
+        return -1;
+    }
+    
+    if (size > MAX_FILE_SIZE) {
+        printf("[STORAGE] Requested size too large: %ld\n", size);
+        return -EFBIG;
+    }
+    
+    blk_t nblocks = (size + block_payload - 1) / block_payload;
+    block_map_t *map = &block_maps[file_idx];
+
+    printf("[STORAGE] Allocating %lu blocks for file %d\n",
+           (unsigned long)nblocks, file_idx);
+    
+    fair_wrlock(map);
+    map_wrlock(map);
+    int fits = inline_fits(file_idx, size);
+    map_unlock(map);
+    int err = fits ? 0 : inline_spill(file_idx);
+    blk_t lblk = 0;
+    while (!fits && err == 0 && lblk < nblocks) {
+        blk_t pblk, run;
+        if (!blockmap_lookup(map, lblk, &pblk, &run)) {
+            if (run > nblocks - lblk) run = nblocks - lblk;
+            err = map_new_blocks(map, lblk, run, &pblk, &run);
+        }
+        lblk += run;
+    }
+    fair_unlock(map);
+    
+    return err;
+}
+
+// Engine a logical block is (to be) encrypted with: the active one, or
+// the old one where re-encryption has not got to yet (see block_map_t)
+static uint32_t block_engine(const block_map_t *map, blk_t lblk) {
+    return map->old_engine && lblk >= map->reencrypted ? map->old_engine : 0;
+}
+
+/*
+ * Encrypt or decrypt 'count' consecutive logical blocks held back to back
+ * in buf, as one vectored crypto call
+ */
+static int crypt_blocks(block_map_t *map, blk_t lblk, blk_t count, char *buf, int enc) {
+    evfs_crypto_vec_t vec[IO_BATCH_BLOCKS];
+    for (blk_t i = 0; i < count; i++) {
+        vec[i].src = vec[i].dst = buf + i * BLOCK_SIZE;
+        vec[i].len = BLOCK_SIZE;
+        vec[i].file_id = map->id;
+        vec[i].block_no = lblk + i;
+        vec[i].engine = block_engine(map, lblk + i);
+    }
+    return enc ? evfs_encrypt_blocks(vec, count) : evfs_decrypt_blocks(vec, count);
+}
+
+/*
+ * Read and decrypt 'count' (<= IO_BATCH_BLOCKS) physically contiguous
+ * blocks into buf
+ */
+static int read_blocks(block_map_t *map, blk_t lblk, blk_t pblk, blk_t count, char *buf) {
+    if (backing_read(buf, count * BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) < 0) {
+        perror("[STORAGE] Failed to read");
+        return -1;
+    }
+    if (crypt_blocks(map, lblk, count, buf, 0) != 0) {
+        fprintf(stderr, "[STORAGE] Decryption failed\n");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Read data through a block map (a live file's or a snapshot's)
+ */
+static int read_map(block_map_t *map, off_t offset, char *buf, size_t size) {
+    if (size == 0) return 0;
+
+    blk_t first = offset / block_payload;
+    blk_t last = (offset + size - 1) / block_payload;
+
+    char *temp_buf = malloc(IO_BATCH_BLOCKS * BLOCK_SIZE);
+    if (!temp_buf) {
+        perror("[STORAGE] Failed to allocate read buffer");
+        return -1;
+    }
+
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(map);
+
+    size_t done = 0;
+    blk_t lblk = first;
+    while (lblk <= last) {
+        blk_t pblk, run;
+        int mapped = blockmap_lookup(map, lblk, &pblk, &run);
+        blk_t n = last - lblk + 1;
+        if (n > run) n = run;
+        if (mapped && n > IO_BATCH_BLOCKS) n = IO_BATCH_BLOCKS;
+
+        if (mapped && read_blocks(map, lblk, pblk, n, temp_buf) < 0) {
+            map_unlock(map);
+            pthread_rwlock_unlock(&storage_lock);
+            free(temp_buf);
+            return -1;
+        }
+
+        // Copy the requested part of each block's payload
+        for (blk_t i = 0; i < n; i++) {
+            off_t blk_start = (off_t)(lblk + i) * block_payload;
+            size_t skip = offset + done - blk_start;
+            size_t len = block_payload - skip;
+            if (len > size - done) len = size - done;
+
+            if (mapped) {
+                memcpy(buf + done, temp_buf + i * BLOCK_SIZE + skip, len);
+            } else {
+                // Never written: reads as zeros
+                memset(buf + done, 0, len);
+            }
+            done += len;
+        }
+        lblk += n;
+    }
+
+    map_unlock(map);
+    pthread_rwlock_unlock(&storage_lock);
+    free(temp_buf);
+    return size;
+}
+
+/*
+ * Read data from storage
+ */
+int read_block(int file_idx, off_t offset, char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        printf("[STORAGE] Invalid file index: %d\n", file_idx);
+        return -1;
+    }
+
+    printf("[STORAGE] Reading %zu bytes from file %d at offset %ld\n",
+           size, file_idx, offset);
+    EVFS_PROBE3(read__start, file_idx, offset, size);
+    io_throttle(IO_CLASS_READ, size);
+
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(&block_maps[file_idx]);
+    if (file_table[file_idx].inline_data) {
+        inline_data_read(&file_table[file_idx], offset, buf, size);
+        map_unlock(&block_maps[file_idx]);
+        pthread_rwlock_unlock(&storage_lock);
+        printf("[STORAGE] Read %zu bytes from the inode\n", size);
+        EVFS_PROBE4(read__done, file_idx, offset, size, (int)size);
+        return size;
+    }
+    map_unlock(&block_maps[file_idx]);
+    pthread_rwlock_unlock(&storage_lock);
+
+    int ret = read_map(&block_maps[file_idx], offset, buf, size);
+    if (ret >= 0) {
+        printf("[STORAGE] Successfully read %zu bytes\n", size);
+    }
+    EVFS_PROBE4(read__done, file_idx, offset, size, ret);
+    return ret;
+}
+
+/*
+ * Write data through a live block map (a file's data or its xattr stream).
+ * Caller holds the file's writer lock. New blocks and copies are
+ * encrypted and written without the map lock, then switched in under
+ * it; an overwrite in place is written under it, so no reader of the
+ * file sees a half-written block
+ */
+static int write_map_locked(block_map_t *map, off_t offset, const char *buf, size_t size) {
+    blk_t first = offset / block_payload;
+    blk_t last = (offset + size - 1) / block_payload;
+
+    char *enc_buf = malloc(IO_BATCH_BLOCKS * BLOCK_SIZE);
+    if (!enc_buf) {
+        perror("[STORAGE] Failed to allocate encrypt buffer");
+        return -1;
+    }
+
+    map_wrlock(map);
+    map->generation++;  // in-place overwrites invalidate in-flight relocations
+    map_unlock(map);
+
+    int ret = size;
+    size_t done = 0;
+    blk_t lblk = first;
+    while (lblk <= last && ret >= 0) {
+        blk_t pblk, run;
+        int fresh = !blockmap_lookup(map, lblk, &pblk, &run);
+        blk_t n = last - lblk + 1;
+        if (n > run) n = run;
+        if (n > IO_BATCH_BLOCKS) n = IO_BATCH_BLOCKS;
+
+        // Where the new ciphertext goes: in place, unless a snapshot
+        // still references the blocks or the last commit does (the
+        // copy then becomes visible atomically with the next commit)
+        blk_t dst = pblk;
+        int cow = 0;
+
+        if (fresh) {
+            int err = claim_blocks(map, lblk, n, &dst, &n);
+            if (err < 0) {
+                ret = err;
+                break;
+            }
+        } else if (block_shared(pblk, n, &n)) {
+            if (block_alloc(alloc_goal(map, lblk), n, &dst, &n) < 0) {
+                ret = -ENOSPC;
+                break;
+            }
+            cow = 1;
+        } else if (block_durable(pblk, n, &n)) {
+            // When full, overwrite in place rather than fail
+            cow = block_alloc(alloc_goal(map, lblk), n, &dst, &n) == 0;
+        }
+
+        for (blk_t i = 0; i < n; i++) {
+            char *blk = enc_buf + i * BLOCK_SIZE;
+            off_t blk_start = (off_t)(lblk + i) * block_payload;
+            size_t skip = offset + done - blk_start;
+            size_t len = block_payload - skip;
+            if (len > size - done) len = size - done;
+
+            // A partially overwritten block keeps its other bytes
+            if (len < block_payload) {
+                if (fresh) {
+                    memset(blk, 0, BLOCK_SIZE);
+                } else if (read_blocks(map, lblk + i, pblk + i, 1, blk) < 0) {
+                    ret = -1;
+                    break;
+                }
+            }
+
+            memcpy(blk + skip, buf + done, len);
+            done += len;
+        }
+        if (ret >= 0 && crypt_blocks(map, lblk, n, enc_buf, 1) != 0) {
+            fprintf(stderr, "[STORAGE] Encryption failed\n");
+            ret = -1;
+        }
+        if (ret >= 0 && (fresh || cow)) {
+            // No reader sees these blocks until they are mapped
+            if (backing_write(enc_buf, n * BLOCK_SIZE, (off_t)dst * BLOCK_SIZE) < 0) {
+                perror("[STORAGE] Failed to write");
+                ret = -1;
+            } else {
+                map_wrlock(map);
+                int err = fresh ? blockmap_insert(map, lblk, dst, n, change_gen)
+                                : blockmap_remap(map, lblk, n, dst);
+                if (err == 0) {
+                    fresh = cow = 0;  // the map owns them now
+                    err = blockmap_touch(map, lblk, n, change_gen);
+                }
+                map_unlock(map);
+                if (err < 0) ret = -1;
+            }
+        } else if (ret >= 0) {
+            map_wrlock(map);
+            if (backing_write(enc_buf, n * BLOCK_SIZE, (off_t)dst * BLOCK_SIZE) < 0) {
+                perror("[STORAGE] Failed to write");
+                ret = -1;
+            } else if (blockmap_touch(map, lblk, n, change_gen) < 0) {
+                ret = -1;
+            }
+            map_unlock(map);
+        }
+        if (ret < 0) {
+            if (fresh) unclaim_blocks(map, dst, n);
+            if (cow) block_free(dst, n);
+            break;
+        }
+
+        lblk += n;
+    }
+
+    free(enc_buf);
+
+    // Not synced here: the next commit (see evfs_wal.c) makes it durable
+    return ret;
+}
+
+// Write file data: inline while it fits, else through the block map
+static int write_file(int file_idx, off_t offset, const char *buf, size_t size) {
+    block_map_t *map = &block_maps[file_idx];
+    fair_wrlock(map);
+    map_wrlock(map);
+    int ret = inline_fits(file_idx, offset + size);
+    if (ret) {
+        memcpy(file_table[file_idx].data + offset, buf, size);
+    }
+    map_unlock(map);
+    if (ret) {
+        ret = size;
+    } else {
+        ret = inline_spill(file_idx);
+        if (ret == 0) ret = write_map_locked(map, offset, buf, size);
+    }
+    fair_unlock(map);
+    return ret;
+}
+
+/*
+ * Write data to storage
+ */
+int write_block(int file_idx, off_t offset, const char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        printf("[STORAGE] Invalid file index: %d\n", file_idx);
+        return -1;
+    }
+    if (size == 0) return 0;
+
+    if (offset + (off_t)size > MAX_FILE_SIZE) {
+        printf("[STORAGE] Write beyond maximum file size\n");
+        return -EFBIG;
+    }
+
+    printf("[STORAGE] Writing %zu bytes to file %d at offset %ld (blocks %lu-%lu)\n",
+           size, file_idx, offset, (unsigned long)(offset / block_payload),
+           (unsigned long)((offset + size - 1) / block_payload));
+    EVFS_PROBE3(write__start, file_idx, offset, size);
+    io_throttle(IO_CLASS_WRITE, size);
+
+    int ret = write_file(file_idx, offset, buf, size);
+    // Blocks freed since the last commit only become free with the next
+    if (ret == -ENOSPC && block_deferred_blocks() > 0 && wal_sync() == 0) {
+        ret = write_file(file_idx, offset, buf, size);
+    }
+    if (ret >= 0) {
+        printf("[STORAGE] Successfully wrote %zu bytes encrypted\n", size);
+    }
+    EVFS_PROBE4(write__done, file_idx, offset, size, ret);
+    return ret;
+}
+
+/*
+ * Resize file storage. Blocks wholly past the new end are released; the
+ * tail of a partial last block is zeroed so a later extension reads zeros.
+ */
+int truncate_storage(int file_idx, off_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -1;
+    }
+    if (size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    block_map_t *map = &block_maps[file_idx];
+    blk_t keep = (size + block_payload - 1) / block_payload;
+    size_t tail = size % block_payload;
+
+    fair_wrlock(map);
+    map_wrlock(map);
+    if (inline_fits(file_idx, size)) {
+        memset(file_table[file_idx].data + size, 0, INLINE_DATA_SIZE - size);
+        map_unlock(map);
+        fair_unlock(map);
+        printf("[STORAGE] Truncated inline file %d to %ld bytes\n", file_idx, size);
+        return 0;
+    }
+    map_unlock(map);
+    int ret = inline_spill(file_idx);
+    if (ret < 0) {
+        fair_unlock(map);
+        return ret;
+    }
+
+    map_wrlock(map);
+    blk_t before = blockmap_blocks(map);
+    ret = blockmap_punch(map, keep, XATTR_LBLK);  // the xattr stream stays
+    charge_blocks(map, before);
+    map_unlock(map);
+    if (ret < 0) {
+        fair_unlock(map);
+        return ret;
+    }
+
+    blk_t pblk, run;
+    if (tail != 0 && blockmap_lookup(map, keep - 1, &pblk, &run)) {
+        // The zeroed block goes elsewhere if a snapshot shares it, or
+        // (space permitting) if the last commit references it
+        blk_t dst = pblk, got;
+        int cow = block_shared(pblk, 1, &run);
+        if (cow && (ret = block_alloc(alloc_goal(map, keep - 1), 1, &dst, &got)) < 0) {
+            fair_unlock(map);
+            return ret;
+        }
+        if (!cow && block_durable(pblk, 1, &run)) {
+            cow = block_alloc(alloc_goal(map, keep - 1), 1, &dst, &got) == 0;
+        }
+
+        // As in write_map_locked(): only the switch, or a write in
+        // place, happens under the map lock
+        char *blk = malloc(BLOCK_SIZE);
+        if (!blk || read_blocks(map, keep - 1, pblk, 1, blk) < 0) {
+            ret = -1;
+        } else {
+            memset(blk + tail, 0, block_payload - tail);
+            evfs_crypto_vec_t v = { blk, blk, BLOCK_SIZE, map->id, keep - 1,
+                                    block_engine(map, keep - 1) };
+            if (evfs_encrypt_blocks(&v, 1) != 0 ||
+                (cow && backing_write(blk, BLOCK_SIZE, (off_t)dst * BLOCK_SIZE) < 0)) {
+                ret = -1;
+            } else {
+                map_wrlock(map);
+                if ((!cow && backing_write(blk, BLOCK_SIZE, (off_t)dst * BLOCK_SIZE) < 0) ||
+                    (cow && blockmap_remap(map, keep - 1, 1, dst) < 0)) {
+                    ret = -1;
+                } else {
+                    cow = 0;  // the map owns it now
+                    if (blockmap_touch(map, keep - 1, 1, change_gen) < 0) ret = -1;
+                }
+                map_unlock(map);
+            }
+        }
+        if (ret < 0 && cow) block_free(dst, 1);
+        free(blk);
+    }
+    fair_unlock(map);
+
+    printf("[STORAGE] Truncated file %d storage to %lu blocks\n",
+           file_idx, (unsigned long)keep);
+    return ret;
+}
+
+/*
+ * Delete file storage
+ */
+int delete_storage(int file_idx) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -1;
+    }
+    
+    printf("[STORAGE] Freeing storage for file %d\n", file_idx);
+    
+    // Return all blocks to the allocator; a reused slot gets a fresh id
+    block_map_t *map = &block_maps[file_idx];
+    fair_wrlock(map);
+    map_wrlock(map);
+    blk_t before = blockmap_blocks(map);
+    blockmap_truncate(map, 0);
+    charge_blocks(map, before);
+    blockmap_free(map);
+    blockmap_init(map, __atomic_fetch_add(&next_map_id, 1, __ATOMIC_RELAXED));
+    map_unlock(map);
+    fair_unlock(map);
+    
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * BACKGROUND RELEASE
+ * ============================================================================
+ *
+ * Freeing a big file walks all its extents. release_storage() instead
+ * swaps the file's map for an empty one and queues the old map for a
+ * background thread, so unlink and rename-over stay O(1). The slot can be
+ * reused at once: it gets a fresh map id. The queue is drained before the
+ * metadata is saved, so saved allocator state never covers queued blocks.
+ */
+
+typedef struct release_item {
+    block_map_t map;
+    struct release_item *next;
+} release_item_t;
+
+static release_item_t *release_queue = NULL;
+static int releasing = 0;       // items popped but not yet freed
+static pthread_t release_thread;
+static int release_running = 0;
+static pthread_mutex_t release_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t release_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t release_done = PTHREAD_COND_INITIALIZER;
+
+static void release_map(block_map_t *map) {
+    fair_wrlock(map);
+    blockmap_truncate(map, 0);
+    fair_unlock(map);
+    blockmap_free(map);
+}
+
+// Pop one item and free it. Caller holds release_lock (dropped meanwhile)
+static void release_one(void) {
+    release_item_t *item = release_queue;
+    release_queue = item->next;
+    releasing++;
+    pthread_mutex_unlock(&release_lock);
+
+    release_map(&item->map);
+    free(item);
+
+    pthread_mutex_lock(&release_lock);
+    releasing--;
+    pthread_cond_broadcast(&release_done);
+}
+
+static void *release_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&release_lock);
+    for (;;) {
+        while (release_running && !release_queue) {
+            pthread_cond_wait(&release_cond, &release_lock);
+        }
+        if (!release_queue) break;
+        release_one();
+    }
+    pthread_mutex_unlock(&release_lock);
+    return NULL;
+}
+
+static void start_releaser(void) {
+    release_running = 1;
+    if (pthread_create(&release_thread, NULL, release_main, NULL) != 0) {
+        perror("[STORAGE] Failed to start releaser");
+        release_running = 0;
+    }
+}
+
+// Free everything queued, helping the thread, and wait until it is idle
+static void drain_releases(void) {
+    pthread_mutex_lock(&release_lock);
+    while (release_queue || releasing > 0) {
+        if (release_queue) {
+            release_one();
+        } else {
+            pthread_cond_wait(&release_done, &release_lock);
+        }
+    }
+    pthread_mutex_unlock(&release_lock);
+}
+
+static void stop_releaser(void) {
+    pthread_mutex_lock(&release_lock);
+    int was_running = release_running;
+    release_running = 0;
+    pthread_cond_signal(&release_cond);
+    pthread_mutex_unlock(&release_lock);
+    if (was_running) {
+        pthread_join(release_thread, NULL);
+    }
+    drain_releases();
+}
+
+int release_storage(int file_idx) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -1;
+    }
+
+    release_item_t *item = malloc(sizeof(*item));
+    if (!item) {
+        return delete_storage(file_idx);
+    }
+
+    // Detach the map; the slot gets an empty one with a fresh id. The
+    // owner's usage drops now, the free space once the blocks are freed
+    block_map_t *map = &block_maps[file_idx];
+    fair_wrlock(map);
+    map_wrlock(map);
+    item->map = *map;
+    blockmap_init(map, __atomic_fetch_add(&next_map_id, 1, __ATOMIC_RELAXED));
+    charge_blocks(map, blockmap_blocks(&item->map));
+    map_unlock(map);
+    fair_unlock(map);
+
+    pthread_mutex_lock(&release_lock);
+    if (!release_running) {
+        pthread_mutex_unlock(&release_lock);
+        release_map(&item->map);
+        free(item);
+        return 0;
+    }
+    item->next = release_queue;
+    release_queue = item;
+    pthread_cond_signal(&release_cond);
+    pthread_mutex_unlock(&release_lock);
+
+    printf("[STORAGE] Queued storage of file %d for release\n", file_idx);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * XATTR STREAMS
+ * ============================================================================
+ *
+ * Extended attributes too big for a file's inline area live in the same
+ * block map as its data, from logical block XATTR_LBLK on, so snapshots,
+ * compaction and the metadata file handle them like any other blocks.
+ */
+
+static off_t xattr_offset(void) {
+    return (off_t)XATTR_LBLK * block_payload;
+}
+
+int write_xattr_stream(int file_idx, const char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -EINVAL;
+    }
+    block_map_t *map = &block_maps[file_idx];
+
+    fair_wrlock(map);
+    int ret = size > 0 ? write_map_locked(map, xattr_offset(), buf, size) : 0;
+    if (ret >= 0) {
+        // Release whatever the previous, longer stream used
+        map_wrlock(map);
+        blk_t before = blockmap_blocks(map);
+        ret = blockmap_punch(map, XATTR_LBLK + (size + block_payload - 1) / block_payload, BLK_MAX);
+        charge_blocks(map, before);
+        map_unlock(map);
+    }
+    fair_unlock(map);
+    return ret;
+}
+
+int read_xattr_stream(int file_idx, char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -EINVAL;
+    }
+    return read_map(&block_maps[file_idx], xattr_offset(), buf, size) < 0 ? -EIO : 0;
+}
+
+int read_snapshot_xattr_stream(block_map_t *map, char *buf, size_t size) {
+    return read_map(map, xattr_offset(), buf, size) < 0 ? -EIO : 0;
+}
+
+/*
+ * ============================================================================
+ * BULK TRANSFER
+ * ============================================================================
+ *
+ * Used by evfs-tool to stream whole files in and out of an unmounted file
+ * system. A call covers many blocks: the map is updated under the lock,
+ * the crypto runs without it (so callers can use several threads), and
+ * every physically contiguous run reaches the backing files as one I/O.
+ * Nothing is fsynced here; quiesce_storage() flushes before metadata is
+ * saved.
+ */
+
+// Crypto vector for 'count' blocks held back to back in buf. Only the
+// blocks with mapped[i] set are included. Returns the vector length
+static int bulk_vec(const block_map_t *map, blk_t lblk, blk_t count, char *buf,
+                    const char *mapped, evfs_crypto_vec_t *vec) {
+    int n = 0;
+    for (blk_t i = 0; i < count; i++) {
+        if (mapped && !mapped[i]) continue;
+        vec[n].src = vec[n].dst = buf + i * BLOCK_SIZE;
+        vec[n].len = BLOCK_SIZE;
+        vec[n].file_id = map->id;
+        vec[n].block_no = lblk + i;
+        vec[n].engine = block_engine(map, lblk + i);
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Write whole blocks starting at a block boundary; the part of the last
+ * block past the data is zeroed. Holes are allocated contiguously (use
+ * allocate_storage() first to preallocate the whole file). Blocks still
+ * shared with a snapshot are not copied, so this returns -EBUSY for them.
+ */
+int bulk_write_storage(int file_idx, off_t offset, const char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES || offset % block_payload != 0) {
+        return -EINVAL;
+    }
+    if (size == 0) return 0;
+    if (offset + (off_t)size > MAX_FILE_SIZE) {
+        return -EFBIG;
+    }
+
+    block_map_t *map = &block_maps[file_idx];
+    blk_t first = offset / block_payload;
+    blk_t count = (size + block_payload - 1) / block_payload;
+
+    char *enc_buf = NULL;
+    evfs_crypto_vec_t *vec = malloc(count * sizeof(evfs_crypto_vec_t));
+    if (!vec || posix_memalign((void **)&enc_buf, IO_ALIGN, count * BLOCK_SIZE) != 0) {
+        free(vec);
+        return -ENOMEM;
+    }
+
+    // Map the range (a small file goes to its inode instead)
+    int ret = 0;
+    fair_wrlock(map);
+    map_wrlock(map);
+    if (inline_fits(file_idx, offset + size)) {
+        memcpy(file_table[file_idx].data, buf, size);
+        memset(file_table[file_idx].data + size, 0, INLINE_DATA_SIZE - size);
+        map_unlock(map);
+        fair_unlock(map);
+        free(enc_buf);
+        free(vec);
+        return size;
+    }
+    map_unlock(map);
+    ret = inline_spill(file_idx);
+    map_wrlock(map);
+    map->generation++;
+    map_unlock(map);
+    for (blk_t lblk = first; lblk < first + count && ret == 0; ) {
+        blk_t pblk, run;
+        blk_t n = first + count - lblk;
+        if (!blockmap_lookup(map, lblk, &pblk, &run)) {
+            if (n > run) n = run;
+            ret = map_new_blocks(map, lblk, n, &pblk, &n);
+        } else {
+            if (n > run) n = run;
+            if (block_shared(pblk, n, &n)) {
+                ret = -EBUSY;
+            } else {
+                map_wrlock(map);
+                ret = blockmap_touch(map, lblk, n, change_gen);
+                map_unlock(map);
+            }
+        }
+        lblk += n;
+    }
+    fair_unlock(map);
+
+    // Lay the data out at BLOCK_SIZE stride and encrypt it
+    if (ret == 0) {
+        for (blk_t i = 0; i < count; i++) {
+            size_t len = size - i * block_payload;
+            if (len > block_payload) len = block_payload;
+            memcpy(enc_buf + i * BLOCK_SIZE, buf + i * block_payload, len);
+            memset(enc_buf + i * BLOCK_SIZE + len, 0, BLOCK_SIZE - len);
+        }
+        int n = bulk_vec(map, first, count, enc_buf, NULL, vec);
+        if (evfs_encrypt_blocks(vec, n) != 0) {
+            fprintf(stderr, "[STORAGE] Encryption failed\n");
+            ret = -EIO;
+        }
+    }
+
+    // One write per physically contiguous run
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(map);
+    for (blk_t lblk = first; lblk < first + count && ret == 0; ) {
+        blk_t pblk, run;
+        if (!blockmap_lookup(map, lblk, &pblk, &run)) {
+            ret = -EIO;  // unmapped behind our back
+            break;
+        }
+        blk_t n = first + count - lblk;
+        if (n > run) n = run;
+        if (backing_write(enc_buf + (lblk - first) * BLOCK_SIZE, n * BLOCK_SIZE,
+                          (off_t)pblk * BLOCK_SIZE) < 0) {
+            perror("[STORAGE] Failed to write");
+            ret = -EIO;
+        }
+        lblk += n;
+    }
+    map_unlock(map);
+    pthread_rwlock_unlock(&storage_lock);
+
+    free(enc_buf);
+    free(vec);
+    return ret < 0 ? ret : (int)size;
+}
+
+/*
+ * Read starting at a block boundary. Holes read as zeros.
+ */
+int bulk_read_storage(int file_idx, off_t offset, char *buf, size_t size) {
+    if (file_idx < 0 || file_idx >= MAX_FILES || offset % block_payload != 0) {
+        return -EINVAL;
+    }
+    if (size == 0) return 0;
+
+    block_map_t *map = &block_maps[file_idx];
+    blk_t first = offset / block_payload;
+    blk_t count = (size + block_payload - 1) / block_payload;
+
+    char *raw = NULL;
+    char *mapped = calloc(count, 1);
+    evfs_crypto_vec_t *vec = malloc(count * sizeof(evfs_crypto_vec_t));
+    if (!mapped || !vec || posix_memalign((void **)&raw, IO_ALIGN, count * BLOCK_SIZE) != 0) {
+        free(mapped);
+        free(vec);
+        return -ENOMEM;
+    }
+
+    // Ciphertext is tweaked by logical block, so it can be decrypted
+    // after the lock is dropped even if the blocks move meanwhile
+    int ret = 0;
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(map);
+    if (file_table[file_idx].inline_data) {
+        inline_data_read(&file_table[file_idx], offset, buf, size);
+        map_unlock(map);
+        pthread_rwlock_unlock(&storage_lock);
+        free(raw);
+        free(mapped);
+        free(vec);
+        return size;
+    }
+    for (blk_t lblk = first; lblk < first + count && ret == 0; ) {
+        blk_t pblk, run;
+        int is_mapped = blockmap_lookup(map, lblk, &pblk, &run);
+        blk_t n = first + count - lblk;
+        if (n > run) n = run;
+        if (!is_mapped) {
+            memset(raw + (lblk - first) * BLOCK_SIZE, 0, n * BLOCK_SIZE);
+        } else if (backing_read(raw + (lblk - first) * BLOCK_SIZE, n * BLOCK_SIZE,
+                                (off_t)pblk * BLOCK_SIZE) < 0) {
+            perror("[STORAGE] Failed to read");
+            ret = -EIO;
+        } else {
+            memset(mapped + (lblk - first), 1, n);
+        }
+        lblk += n;
+    }
+    map_unlock(map);
+    pthread_rwlock_unlock(&storage_lock);
+
+    if (ret == 0) {
+        int n = bulk_vec(map, first, count, raw, mapped, vec);
+        if (evfs_decrypt_blocks(vec, n) != 0) {
+            fprintf(stderr, "[STORAGE] Decryption failed\n");
+            ret = -EIO;
+        }
+    }
+    if (ret == 0) {
+        for (blk_t i = 0; i < count; i++) {
+            size_t len = size - i * block_payload;
+            if (len > block_payload) len = block_payload;
+            memcpy(buf + i * block_payload, raw + i * BLOCK_SIZE, len);
+        }
+    }
+
+    free(raw);
+    free(mapped);
+    free(vec);
+    return ret < 0 ? ret : (int)size;
+}
+
+int preallocate_backing_files(void) {
+    blk_t end, nfree;
+    int nextents;
+    block_allocator_usage(&end, &nfree, &nextents);
+
+    for (int d = 0; d < backing_count; d++) {
+        off_t want = device_bytes_for(end, d);
+        struct stat st;
+        if (fstat(backing_fds[d], &st) == 0 && st.st_size >= want) continue;
+        int err = posix_fallocate(backing_fds[d], 0, want);
+        if (err != 0 && err != EOPNOTSUPP && err != EINVAL) {
+            fprintf(stderr, "[STORAGE] Failed to preallocate backing file: %s\n", strerror(err));
+            return -err;
+        }
+    }
+    return 0;
+}
+
+size_t storage_block_payload(void) {
+    return block_payload;
+}
+
+/*
+ * ============================================================================
+ * CHANGED-BLOCK TRACKING
+ * ============================================================================
+ *
+ * Every extent carries the change generation its blocks were written in:
+ * new blocks, overwrites (in place or copied), the zeroed tail block of a
+ * truncate and re-encryption tag them with the current one; compaction
+ * moves blocks without changing their data and keeps it. Extents of
+ * different generations are not merged.
+ *
+ * A file's map also records the generation its inode, names or map last
+ * changed in. Rather than hooking every operation, the tables are compared
+ * with how they looked at the last save or commit, each time they are
+ * saved or logged; a dentry that changed marks both the inode it names now
+ * and the one it named before. An inode whose inline areas, or a dentry
+ * whose name, were decrypted since counts as changed too: sealed and plain
+ * forms cannot be compared.
+ *
+ * A backup (evfs-tool backup) takes the files changed after the
+ * generation the previous backup ended and, of those, only the extents
+ * written after it, then starts a new generation.
+ */
+
+static file_metadata_t tracked_files[MAX_FILES];
+static unsigned char tracked_sealed[MAX_FILES];
+static dentry_t tracked_dentries[MAX_DENTRIES];
+static unsigned char tracked_names_sealed[MAX_DENTRIES];
+static uint64_t tracked_id[MAX_FILES];
+static uint64_t tracked_gen[MAX_FILES];
+
+// Caller holds storage_lock exclusively
+static void track_reset_locked(void) {
+    memcpy(tracked_files, file_table, sizeof(tracked_files));
+    memcpy(tracked_dentries, dentry_table, sizeof(tracked_dentries));
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        tracked_names_sealed[d] = dentry_is_sealed(d);
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        tracked_sealed[i] = inode_is_sealed(i);
+        tracked_id[i] = block_maps[i].id;
+        tracked_gen[i] = block_maps[i].generation;
+    }
+}
+
+// A new file system: everything counts as changed at the first save
+static void track_clear(void) {
+    memset(tracked_files, 0, sizeof(tracked_files));
+    memset(tracked_sealed, 0, sizeof(tracked_sealed));
+    memset(tracked_dentries, 0, sizeof(tracked_dentries));
+    memset(tracked_names_sealed, 0, sizeof(tracked_names_sealed));
+    memset(tracked_id, 0, sizeof(tracked_id));
+    memset(tracked_gen, 0, sizeof(tracked_gen));
+}
+
+static void mark_changed(int file_idx, unsigned char *marked) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) return;
+    if (block_maps[file_idx].changed != change_gen && marked) marked[file_idx] = 1;
+    block_maps[file_idx].changed = change_gen;
+}
+
+/*
+ * Mark the files changed since the last call. marked[i] (if given) is set
+ * for files whose mark moved. Caller holds storage_lock exclusively
+ */
+static void track_changes(unsigned char *marked) {
+    if (marked) memset(marked, 0, MAX_FILES);
+    for (int i = 0; i < MAX_FILES; i++) {
+        const block_map_t *map = &block_maps[i];
+        if (map->id != tracked_id[i] || map->generation != tracked_gen[i] ||
+            inode_is_sealed(i) != tracked_sealed[i] ||
+            memcmp(&file_table[i], &tracked_files[i], sizeof(file_metadata_t)) != 0) {
+            mark_changed(i, marked);
+        }
+    }
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        const dentry_t *now = &dentry_table[d], *then = &tracked_dentries[d];
+        if (dentry_is_sealed(d) == tracked_names_sealed[d] &&
+            memcmp(now, then, sizeof(dentry_t)) == 0) {
+            continue;
+        }
+        if (now->is_used) mark_changed(now->inode, marked);
+        if (then->is_used) mark_changed(then->inode, marked);
+    }
+    track_reset_locked();
+}
+
+void storage_track_reset(void) {
+    fair_wrlock(NULL);
+    track_reset_locked();
+    fair_unlock(NULL);
+}
+
+uint64_t storage_generation(void) {
+    pthread_rwlock_rdlock(&storage_lock);
+    uint64_t gen = change_gen;
+    pthread_rwlock_unlock(&storage_lock);
+    return gen;
+}
+
+void storage_set_generation(uint64_t gen) {
+    fair_wrlock(NULL);
+    change_gen = gen;
+    fair_unlock(NULL);
+}
+
+int storage_copy_map(int file_idx, block_map_t *out) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -EINVAL;
+    }
+    pthread_rwlock_rdlock(&storage_lock);
+    const block_map_t *src = &block_maps[file_idx];
+    map_rdlock(src);
+    blockmap_init(out, src->id);
+    out->old_engine = src->old_engine;
+    out->reencrypted = src->reencrypted;
+    out->changed = src->changed;
+    if (src->count > 0) {
+        out->extents = malloc(src->count * sizeof(extent_t));
+        if (!out->extents) {
+            map_unlock(src);
+            pthread_rwlock_unlock(&storage_lock);
+            return -ENOMEM;
+        }
+        memcpy(out->extents, src->extents, src->count * sizeof(extent_t));
+        out->count = out->capacity = src->count;
+    }
+    map_unlock(src);
+    pthread_rwlock_unlock(&storage_lock);
+    return 0;
+}
+
+int storage_install_map(int file_idx, const block_map_t *src, uint64_t since) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return -EINVAL;
+    }
+
+    fair_wrlock(NULL);
+    block_map_t *cur = &block_maps[file_idx];
+    block_map_t built;
+    blockmap_init(&built, src->id);
+
+    // Unchanged extents take their blocks from the current map
+    int ret = 0;
+    for (int e = 0; e < src->count && ret == 0; e++) {
+        const extent_t *ext = &src->extents[e];
+        if (ext->gen > since) {
+            ret = blockmap_insert(&built, ext->lblk, ext->pblk, ext->len, ext->gen);
+            continue;
+        }
+        for (blk_t done = 0; done < ext->len && ret == 0; ) {
+            blk_t pblk, run;
+            if (cur->id != src->id || !blockmap_lookup(cur, ext->lblk + done, &pblk, &run)) {
+                ret = -ESTALE;
+                break;
+            }
+            if (run > ext->len - done) run = ext->len - done;
+            ret = blockmap_insert(&built, ext->lblk + done, pblk, run, ext->gen);
+            done += run;
+        }
+    }
+
+    // Kept blocks get a second owner, so dropping the old map leaves them
+    int refs = 0;
+    for (; ret == 0 && refs < built.count; refs++) {
+        const extent_t *ext = &built.extents[refs];
+        if (ext->gen <= since && block_ref(ext->pblk, ext->len) < 0) ret = -ENOMEM;
+    }
+    if (ret < 0) {
+        for (int e = 0; e < refs - 1; e++) {
+            const extent_t *ext = &built.extents[e];
+            if (ext->gen <= since) block_free(ext->pblk, ext->len);
+        }
+        fair_unlock(NULL);
+        blockmap_free(&built);
+        return ret;
+    }
+
+    blockmap_truncate(cur, 0);
+    blockmap_free(cur);
+    built.generation = cur->generation + 1;
+    built.old_engine = src->old_engine;
+    built.reencrypted = src->reencrypted;
+    built.changed = src->changed;
+    *cur = built;
+    if (MAP_ID_SEQ(src->id) >= next_map_id) next_map_id = MAP_ID_SEQ(src->id) + 1;
+    fair_unlock(NULL);
+    return 0;
+}
+
+/*
+ * ============================================================================
+ * METADATA IMAGE SUPPORT
+ * ============================================================================
+ */
+
+void quiesce_storage(void) {
+    stop_compactor();
+    drain_releases();
+
+    // Saved maps must never point at blocks still in the page cache
+    for (int i = 0; i < backing_count; i++) {
+        fsync(backing_fds[i]);
+    }
+}
+
+int export_storage(metadata_image_t *img) {
+    fair_wrlock(NULL);
+    track_changes(NULL);
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        block_map_t *src = &block_maps[i];
+        blockmap_init(&img->maps[i], src->id);
+        img->maps[i].old_engine = src->old_engine;
+        img->maps[i].reencrypted = src->reencrypted;
+        img->maps[i].changed = src->changed;
+        if (src->count == 0) continue;
+
+        img->maps[i].extents = malloc(src->count * sizeof(extent_t));
+        if (!img->maps[i].extents) {
+            fair_unlock(NULL);
+            return -ENOMEM;
+        }
+        memcpy(img->maps[i].extents, src->extents, src->count * sizeof(extent_t));
+        img->maps[i].count = img->maps[i].capacity = src->count;
+    }
+
+    for (int p = 0; p < META_PAGES; p++) {
+        img->absent[p] = !inode_page_resident(p);
+    }
+
+    blk_t nfree;
+    int nextents;
+    block_allocator_usage(&img->alloc_end, &nfree, &nextents);
+    img->next_map_id = next_map_id;
+    img->backing_count = backing_count;
+    img->change_gen = change_gen;
+
+    fair_unlock(NULL);
+    return 0;
+}
+
+/*
+ * Commits (evfs_wal.c). A capture copies what changed since the previous
+ * one: a map counts as changed when its id or generation differs. After
+ * a failed commit the next capture takes every map again.
+ */
+static uint64_t captured_id[MAX_FILES];
+static uint64_t captured_gen[MAX_FILES];
+static int captured_valid = 0;
+
+int storage_capture(metadata_image_t *img, unsigned char *changed) {
+    // No create, unlink or rename is half done while the tables are copied
+    metadata_lock();
+    fair_wrlock(NULL);
+
+    // A file newly marked changed is logged with its map
+    unsigned char marked[MAX_FILES];
+    track_changes(marked);
+
+    memcpy(img->files, file_table, sizeof(img->files));
+    memcpy(img->dentries, dentry_table, sizeof(img->dentries));
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        img->names_sealed[d] = dentry_is_sealed(d);
+    }
+    for (int p = 0; p < META_PAGES; p++) {
+        img->absent[p] = !inode_page_resident(p);
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        block_map_t *src = &block_maps[i];
+        blockmap_init(&img->maps[i], src->id);
+        img->maps[i].old_engine = src->old_engine;
+        img->maps[i].reencrypted = src->reencrypted;
+        img->maps[i].changed = src->changed;
+        img->sealed[i] = inode_is_sealed(i);
+        int dirty = !changed || !captured_valid || captured_id[i] != src->id ||
+                    captured_gen[i] != src->generation || marked[i];
+        if (changed) changed[i] = dirty;
+        if (!dirty || src->count == 0) continue;
+
+        img->maps[i].extents = malloc(src->count * sizeof(extent_t));
+        if (!img->maps[i].extents) {
+            fair_unlock(NULL);
+            metadata_unlock();
+            return -ENOMEM;
+        }
+        memcpy(img->maps[i].extents, src->extents, src->count * sizeof(extent_t));
+        img->maps[i].count = img->maps[i].capacity = src->count;
+    }
+    for (int i = 0; i < MAX_FILES; i++) {
+        captured_id[i] = block_maps[i].id;
+        captured_gen[i] = block_maps[i].generation;
+    }
+    captured_valid = 1;
+
+    blk_t nfree;
+    int nextents;
+    block_allocator_usage(&img->alloc_end, &nfree, &nextents);
+    img->next_map_id = next_map_id;
+    img->backing_count = backing_count;
+    img->change_gen = change_gen;
+
+    // Blocks freed so far stay reserved until this commit ends
+    block_commit_begin();
+
+    fair_unlock(NULL);
+    metadata_unlock();
+    return 0;
+}
+
+void storage_lock_tables(void) {
+    fair_wrlock(NULL);
+}
+
+void storage_unlock_tables(void) {
+    fair_unlock(NULL);
+}
+
+int storage_sync(void) {
+    int ret = 0;
+    for (int i = 0; i < backing_count; i++) {
+        if (fsync(backing_fds[i]) != 0) ret = -EIO;
+    }
+    return ret;
+}
+
+void storage_end_commit(int committed) {
+    if (!committed) {
+        fair_wrlock(NULL);
+        captured_valid = 0;
+        fair_unlock(NULL);
+    }
+    block_commit_end(committed);
+}
+
+void storage_load_inodes(int first, int count, block_map_t *maps) {
+    for (int k = 0; k < count; k++) {
+        int i = first + k;
+        block_map_t *map = &block_maps[i];
+        uint64_t generation = map->generation + 1;
+        blockmap_free(map);
+        if (file_table[i].is_used) {
+            *map = maps[k];
+        } else {
+            blockmap_free(&maps[k]);
+            blockmap_init(map, __atomic_fetch_add(&next_map_id, 1, __ATOMIC_RELAXED));
+        }
+        // Nothing about them has changed since the last commit
+        map->generation = generation;
+        tracked_files[i] = file_table[i];
+        tracked_sealed[i] = inode_is_sealed(i);
+        tracked_id[i] = captured_id[i] = map->id;
+        tracked_gen[i] = captured_gen[i] = map->generation;
+    }
+}
+
+int storage_unload_inodes(int first, int count, const file_metadata_t *logged,
+                          const unsigned char *saved) {
+    if (!captured_valid) {
+        return -EBUSY;
+    }
+    unsigned char sealed[META_PAGE_INODES];
+    for (int k = 0; k < count; k++) {
+        int i = first + k;
+        const block_map_t *map = &block_maps[i];
+        sealed[k] = inode_is_sealed(i);
+        if (map->id != tracked_id[i] || map->generation != tracked_gen[i] ||
+            map->id != captured_id[i] || map->generation != captured_gen[i] ||
+            sealed[k] != tracked_sealed[i] || map->old_engine != 0 ||
+            (!file_table[i].is_used && map->count != 0) ||
+            memcmp(&file_table[i], &tracked_files[i], sizeof(file_metadata_t)) != 0 ||
+            memcmp(&file_table[i], &logged[k], sizeof(file_metadata_t)) != 0) {
+            return -EBUSY;
+        }
+    }
+    // Nor may a name of theirs have changed unseen
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        const dentry_t *now = &dentry_table[d], *then = &tracked_dentries[d];
+        if (dentry_is_sealed(d) == tracked_names_sealed[d] &&
+            memcmp(now, then, sizeof(dentry_t)) == 0) {
+            continue;
+        }
+        if ((now->is_used && now->inode >= first && now->inode < first + count) ||
+            (then->is_used && then->inode >= first && then->inode < first + count)) {
+            return -EBUSY;
+        }
+    }
+    unsigned char sum[EVFS_CHECKSUM_LEN];
+    if (inode_digest(&file_table[first], sealed, &block_maps[first], count, sum) != 0 ||
+        memcmp(sum, saved, EVFS_CHECKSUM_LEN) != 0) {
+        return -ESTALE;
+    }
+
+    // Their blocks stay allocated: only the maps go
+    for (int k = 0; k < count; k++) {
+        int i = first + k;
+        block_map_t *map = &block_maps[i];
+        uint64_t generation = map->generation + 1;
+        blockmap_free(map);
+        blockmap_init(map, 0);
+        map->generation = generation;
+        map->changed = 0;
+        memset(&tracked_files[i], 0, sizeof(file_metadata_t));
+        tracked_sealed[i] = 0;
+        tracked_id[i] = captured_id[i] = 0;
+        tracked_gen[i] = captured_gen[i] = generation;
+    }
+    return 0;
+}
+
+int import_storage(const metadata_image_t *img) {
+    if ((int)img->backing_count != backing_count) {
+        fprintf(stderr, "[STORAGE] Metadata was written for %u backing file(s), %d given\n",
+                img->backing_count, backing_count);
+        return -EINVAL;
+    }
+
+    // Written with another engine: everything is re-encrypted from it,
+    // unless an earlier re-encryption has not finished
+    uint32_t old_engine = 0;
+    if (strcmp(img->cipher, evfs_crypto_engine_name()) != 0) {
+        int id = evfs_crypto_engine_id(img->cipher);
+        if (id < 0 || evfs_crypto_engine_overhead(id) != evfs_crypto_block_overhead()) {
+            fprintf(stderr, "[STORAGE] Blocks written with %s cannot be re-encrypted to %s\n",
+                    img->cipher, evfs_crypto_engine_name());
+            return -EINVAL;
+        }
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (img->files[i].is_used && img->maps[i].old_engine) {
+                fprintf(stderr, "[STORAGE] Re-encryption from %s to %s has not finished\n",
+                        evfs_crypto_engine_by_id(img->maps[i].old_engine - 1), img->cipher);
+                return -EINVAL;
+            }
+        }
+        old_engine = id + 1;
+        printf("[STORAGE] Re-encrypting from %s to %s\n", img->cipher, evfs_crypto_engine_name());
+    }
+
+    fair_wrlock(NULL);
+
+    // Everything mapped, plus quarantined ranges, stays allocated
+    int nused = img->bad_count;
+    for (int i = 0; i < MAX_FILES; i++) {
+        nused += img->maps[i].count;
+    }
+    extent_t *used = malloc((nused > 0 ? nused : 1) * sizeof(extent_t));
+    if (!used) {
+        fair_unlock(NULL);
+        return -ENOMEM;
+    }
+
+    int n = 0;
+    // The volume bits of an id are not part of the sequence
+    uint64_t max_id = img->next_map_id;
+    for (int i = 0; i < MAX_FILES; i++) {
+        const block_map_t *src = &img->maps[i];
+        if (MAP_ID_SEQ(src->id) >= max_id) max_id = MAP_ID_SEQ(src->id) + 1;
+    }
+    next_map_id = max_id;
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        const block_map_t *src = &img->maps[i];
+        blockmap_free(&block_maps[i]);
+        // Slots without a file get a fresh id, as after delete_storage();
+        // those of absent pages get theirs when loaded
+        if (img->absent[INODE_PAGE(i)]) {
+            blockmap_init(&block_maps[i], 0);
+            continue;
+        }
+        blockmap_init(&block_maps[i], img->files[i].is_used ? src->id : next_map_id++);
+        if (img->files[i].is_used) {
+            block_maps[i].old_engine = old_engine ? old_engine : src->old_engine;
+            block_maps[i].reencrypted = old_engine ? 0 : src->reencrypted;
+            block_maps[i].changed = src->changed;
+        }
+        for (int e = 0; e < src->count; e++) {
+            if (blockmap_insert(&block_maps[i], src->extents[e].lblk, src->extents[e].pblk,
+                                src->extents[e].len, src->extents[e].gen) < 0) {
+                free(used);
+                fair_unlock(NULL);
+                return -ENOMEM;
+            }
+            used[n++] = src->extents[e];
+        }
+    }
+    for (int b = 0; b < img->bad_count; b++) {
+        used[n++] = img->bad[b];
+    }
+
+    // Without every map, the free list comes as saved
+    int partial = 0;
+    for (int p = 0; p < META_PAGES; p++) {
+        partial |= img->absent[p];
+    }
+    if (partial) {
+        block_allocator_load(img->alloc_end, img->free, img->free_count);
+    } else {
+        block_allocator_rebuild(img->alloc_end, used, n);
+    }
+    free(used);
+
+    // What was loaded is the baseline for changed-block tracking
+    change_gen = img->change_gen ? img->change_gen : 1;
+    memcpy(tracked_files, img->files, sizeof(tracked_files));
+    memcpy(tracked_sealed, img->sealed, sizeof(tracked_sealed));
+    memcpy(tracked_dentries, img->dentries, sizeof(tracked_dentries));
+    memcpy(tracked_names_sealed, img->names_sealed, sizeof(tracked_names_sealed));
+    for (int i = 0; i < MAX_FILES; i++) {
+        tracked_id[i] = block_maps[i].id;
+        tracked_gen[i] = block_maps[i].generation;
+    }
+
+    fair_unlock(NULL);
+    return 0;
+}
+
+int read_raw_blocks(blk_t pblk, blk_t count, char *buf) {
+    return backing_read(buf, count * BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) < 0 ? -EIO : 0;
+}
+
+int write_raw_blocks(blk_t pblk, blk_t count, const char *buf) {
+    return backing_write(buf, count * BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) < 0 ? -EIO : 0;
+}
+
+// Bytes device d must hold for blocks [0, end) to be present
+static off_t device_bytes_for(blk_t end, int d) {
+    off_t end_bytes = (off_t)end * BLOCK_SIZE;
+    off_t row = (off_t)STRIPE_SIZE * backing_count;
+    off_t partial = end_bytes % row - (off_t)d * STRIPE_SIZE;
+    if (partial < 0) partial = 0;
+    if (partial > STRIPE_SIZE) partial = STRIPE_SIZE;
+    return (end_bytes / row) * STRIPE_SIZE + partial;
+}
+
+blk_t storage_backing_blocks(void) {
+    off_t sizes[MAX_BACKING_FILES];
+    off_t total = 0;
+    for (int d = 0; d < backing_count; d++) {
+        struct stat st;
+        sizes[d] = fstat(backing_fds[d], &st) == 0 ? st.st_size : 0;
+        total += sizes[d];
+    }
+
+    // Largest end every device covers (need grows with end)
+    blk_t lo = 0, hi = total / BLOCK_SIZE;
+    while (lo < hi) {
+        blk_t mid = lo + (hi - lo + 1) / 2;
+        int covered = 1;
+        for (int d = 0; d < backing_count && covered; d++) {
+            covered = sizes[d] >= device_bytes_for(mid, d);
+        }
+        if (covered) lo = mid; else hi = mid - 1;
+    }
+    return lo;
+}
+
+blk_t storage_file_blocks(int file_idx) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(&block_maps[file_idx]);
+    blk_t n = blockmap_blocks(&block_maps[file_idx]);
+    map_unlock(&block_maps[file_idx]);
+    pthread_rwlock_unlock(&storage_lock);
+    return n;
+}
+
+void storage_assign_volume(int file_idx, uint32_t volume) {
+    if (file_idx < 0 || file_idx >= MAX_FILES || volume >= MAX_VOLUMES) {
+        return;
+    }
+    block_map_t *map = &block_maps[file_idx];
+    fair_wrlock(map);
+    map_wrlock(map);
+    if (map->count == 0 && EVFS_KEY_ID(map->id) != volume) {
+        map->id = MAP_ID(volume, __atomic_fetch_add(&next_map_id, 1, __ATOMIC_RELAXED));
+    }
+    map_unlock(map);
+    fair_unlock(map);
+}
+
+uint64_t storage_map_id(int file_idx) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(&block_maps[file_idx]);
+    uint64_t id = block_maps[file_idx].id;
+    map_unlock(&block_maps[file_idx]);
+    pthread_rwlock_unlock(&storage_lock);
+    return id;
+}
+
+uint32_t storage_map_engine(int file_idx) {
+    if (file_idx < 0 || file_idx >= MAX_FILES) {
+        return 0;
+    }
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(&block_maps[file_idx]);
+    uint32_t engine = block_maps[file_idx].old_engine;
+    map_unlock(&block_maps[file_idx]);
+    pthread_rwlock_unlock(&storage_lock);
+    return engine;
+}
+
+void storage_capacity(blk_t *total, blk_t *avail) {
+    blk_t end, nfree;
+    int nextents;
+    block_allocator_usage(&end, &nfree, &nextents);
+    blk_t used = end - nfree;
+
+    if (evfs_options.capacity > 0) {
+        *total = evfs_options.capacity / BLOCK_SIZE;
+        *avail = *total > used ? *total - used : 0;
+        return;
+    }
+
+    // Room left on the file systems holding the backing files, each
+    // device counted once, on top of the free blocks below the end
+    blk_t host = 0;
+    dev_t seen[MAX_BACKING_FILES];
+    int nseen = 0;
+    for (int d = 0; d < backing_count; d++) {
+        struct stat st;
+        struct statvfs vfs;
+        if (fstat(backing_fds[d], &st) != 0 || fstatvfs(backing_fds[d], &vfs) != 0) continue;
+        int dup = 0;
+        for (int i = 0; i < nseen; i++) dup |= seen[i] == st.st_dev;
+        if (dup) continue;
+        seen[nseen++] = st.st_dev;
+        host += (blk_t)vfs.f_bavail * vfs.f_frsize / BLOCK_SIZE;
+    }
+    *avail = nfree + host;
+    *total = used + *avail;
+}
+
+/*
+ * ============================================================================
+ * SNAPSHOT SUPPORT
+ * ============================================================================
+ *
+ * A snapshot holds its own copy of every block map, pointing at the same
+ * physical blocks with an extra reference each. No data is copied: the live
+ * side copies a block on its next write (see write_block/truncate_storage).
+ */
+
+int snapshot_storage(block_map_t *maps, file_metadata_t *files, dentry_t *dentries,
+                     unsigned char *sealed) {
+    // Point in time: no create, unlink or rename is half done meanwhile
+    metadata_lock();
+    fair_wrlock(NULL);
+
+    // Metadata is taken under the same lock so sizes match the maps
+    memcpy(files, file_table, sizeof(file_table));
+    memcpy(dentries, dentry_table, sizeof(dentry_table));
+    for (int i = 0; i < MAX_FILES; i++) {
+        sealed[i] = inode_is_sealed(i);
+    }
+    // A snapshot looks names up in its own copy, which holds them plain
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (dentry_is_sealed(d) && dentry_seal(&dentries[d], d, 0) != 0) {
+            memset(&dentries[d], 0, sizeof(dentry_t));
+        }
+    }
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        block_map_t *src = &block_maps[i];
+        blockmap_init(&maps[i], src->id);
+        maps[i].old_engine = src->old_engine;
+        maps[i].reencrypted = src->reencrypted;
+        if (src->count == 0) continue;
+
+        maps[i].extents = malloc(src->count * sizeof(extent_t));
+        if (!maps[i].extents) goto fail;
+        memcpy(maps[i].extents, src->extents, src->count * sizeof(extent_t));
+        maps[i].count = maps[i].capacity = src->count;
+
+        for (int e = 0; e < src->count; e++) {
+            if (block_ref(src->extents[e].pblk, src->extents[e].len) < 0) {
+                maps[i].count = e;  // only these got a reference
+                goto fail;
+            }
+        }
+    }
+
+    fair_unlock(NULL);
+    metadata_unlock();
+    return 0;
+
+fail:
+    fair_unlock(NULL);
+    metadata_unlock();
+    for (int i = 0; i < MAX_FILES; i++) {
+        blockmap_truncate(&maps[i], 0);
+        blockmap_free(&maps[i]);
+    }
+    return -ENOMEM;
+}
+
+int read_snapshot_block(block_map_t *map, off_t offset, char *buf, size_t size) {
+    return read_map(map, offset, buf, size);
+}
+
+void release_snapshot_storage(block_map_t *maps) {
+    // Drop the snapshot's references; blocks only it used become free
+    for (int i = 0; i < MAX_FILES; i++) {
+        blockmap_truncate(&maps[i], 0);
+        blockmap_free(&maps[i]);
+    }
+}
+
+/*
+ * ============================================================================
+ * BACKGROUND COMPACTION
+ * ============================================================================
+ *
+ * Deleted files, truncation and RMW-free appends leave dead regions and
+ * scatter files. The compactor relocates live extents:
+ *   - tail reclaim: the highest extent in use moves into a free hole lower
+ *     down, so the used space shrinks and the backing file can be truncated
+ *   - defragmentation: a file split over several extents is copied into
+ *     one contiguous run, in a hole below its current position
+ * Copying happens under the shared storage_lock and the file's map lock,
+ * so foreground reads keep going; only the final map switch takes the
+ * map lock exclusively, as a writer of the file. If the file was written
+ * in the meantime (generation changed) the move is dropped.
+ * Blocks are tweaked by logical position, so ciphertext is copied as-is.
+ */
+
+// Shrink backing files to the allocator's end. Caller holds storage_lock
+// exclusively so nothing is allocated or written past the end meanwhile.
+static void trim_backing_files(void) {
+    blk_t end, nfree;
+    int nextents;
+    block_allocator_usage(&end, &nfree, &nextents);
+
+    for (int d = 0; d < backing_count; d++) {
+        off_t dev_size = device_bytes_for(end, d);
+
+        struct stat st;
+        if (fstat(backing_fds[d], &st) == 0 && st.st_size > dev_size &&
+            ftruncate(backing_fds[d], dev_size) == 0) {
+            compact_stats.bytes_reclaimed += st.st_size - dev_size;
+        }
+    }
+}
+
+// Extents already back-to-back on disk (sparse files keep several extents
+// even when packed, and must not be picked again every pass)
+static int map_contiguous(const block_map_t *map) {
+    for (int e = 1; e < map->count; e++) {
+        if (map->extents[e].pblk != map->extents[e - 1].pblk + map->extents[e - 1].len) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Any block of the file still shared with a snapshot? Relocating those
+// would only duplicate them.
+static int map_shared(const block_map_t *map) {
+    for (int e = 0; e < map->count; e++) {
+        blk_t run;
+        if (block_shared(map->extents[e].pblk, map->extents[e].len, &run) ||
+            run < map->extents[e].len) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Pick the next relocation. Caller holds storage_lock (shared); each map
+ * is looked at under its lock, and relocate() checks it did not change.
+ * On success fills segs/nsegs and reserves the destination at *dest.
+ */
+static int pick_relocation(int *file_idx, uint64_t *id, uint64_t *gen,
+                           move_seg_t *segs, int *nsegs, blk_t *dest) {
+    blk_t end, nfree;
+    int nextents;
+    block_allocator_usage(&end, &nfree, &nextents);
+
+    // Tail reclaim: highest extent in use, if a hole below can take it
+    if (nfree > 0) {
+        int best_file = -1;
+        extent_t best = { 0 };
+        uint64_t best_id = 0, best_gen = 0;
+        for (int f = 0; f < MAX_FILES; f++) {
+            block_map_t *map = &block_maps[f];
+            map_rdlock(map);
+            for (int e = 0; e < map->count; e++) {
+                const extent_t *ext = &map->extents[e];
+                if (ext->pblk + ext->len > best.pblk + best.len) {
+                    best = *ext;
+                    best_file = f;
+                    best_id = map->id;
+                    best_gen = map->generation;
+                }
+            }
+            map_unlock(map);
+        }
+        if (best_file >= 0) {
+            blk_t run;
+            if (!block_shared(best.pblk, best.len, &run) && run == best.len &&
+                block_alloc_below(best.len, best.pblk, dest) == 0) {
+                *file_idx = best_file;
+                *id = best_id;
+                *gen = best_gen;
+                segs[0].lblk = best.lblk;
+                segs[0].src_pblk = best.pblk;
+                segs[0].len = best.len;
+                *nsegs = 1;
+                return 0;
+            }
+        }
+    }
+
+    // Defragmentation: next file spread over several extents
+    for (int n = 0; n < MAX_FILES; n++) {
+        int f = (defrag_cursor + n) % MAX_FILES;
+        block_map_t *map = &block_maps[f];
+        map_rdlock(map);
+        blk_t total = blockmap_blocks(map);
+        if (map->count < 2 || map->count > COMPACT_MAX_SEGMENTS ||
+            map_contiguous(map) || map_shared(map) || total > COMPACT_MAX_DEFRAG_BLOCKS) {
+            map_unlock(map);
+            continue;
+        }
+
+        // Only ever move data downwards so passes converge instead of
+        // undoing each other's work
+        blk_t lowest = BLK_MAX;
+        for (int e = 0; e < map->count; e++) {
+            if (map->extents[e].pblk < lowest) lowest = map->extents[e].pblk;
+        }
+        if (block_alloc_below(total, lowest, dest) != 0) {
+            map_unlock(map);
+            continue;
+        }
+
+        *file_idx = f;
+        *id = map->id;
+        *gen = map->generation;
+        for (int e = 0; e < map->count; e++) {
+            segs[e].lblk = map->extents[e].lblk;
+            segs[e].src_pblk = map->extents[e].pblk;
+            segs[e].len = map->extents[e].len;
+        }
+        *nsegs = map->count;
+        map_unlock(map);
+        defrag_cursor = f + 1;
+        return 0;
+    }
+
+    return -1;
+}
+
+static int map_unchanged(int file_idx, uint64_t id, uint64_t gen) {
+    return block_maps[file_idx].id == id && block_maps[file_idx].generation == gen;
+}
+
+/*
+ * Copy segments to dest, then switch the map over. Returns bytes moved,
+ * 0 if the move was abandoned, -1 on I/O error.
+ */
+static long relocate(int file_idx, uint64_t id, uint64_t gen,
+                     const move_seg_t *segs, int nsegs, blk_t dest) {
+    char *buf = malloc(COMPACT_CHUNK_BLOCKS * BLOCK_SIZE);
+    if (!buf) return -1;
+
+    blk_t total = 0;
+    for (int i = 0; i < nsegs; i++) total += segs[i].len;
+
+    // Copy phase: shared lock per chunk, foreground reads continue
+    blk_t out = 0;
+    for (int i = 0; i < nsegs; i++) {
+        for (blk_t off = 0; off < segs[i].len; off += COMPACT_CHUNK_BLOCKS) {
+            blk_t n = segs[i].len - off;
+            if (n > COMPACT_CHUNK_BLOCKS) n = COMPACT_CHUNK_BLOCKS;
+
+            // Paced by the background rate limit (read and write)
+            io_throttle(IO_CLASS_BACKGROUND, 2 * n * BLOCK_SIZE);
+
+            pthread_rwlock_rdlock(&storage_lock);
+            map_rdlock(&block_maps[file_idx]);
+            int ok = map_unchanged(file_idx, id, gen) &&
+                     backing_read(buf, n * BLOCK_SIZE,
+                                  (off_t)(segs[i].src_pblk + off) * BLOCK_SIZE) >= 0;
+            map_unlock(&block_maps[file_idx]);
+            pthread_rwlock_unlock(&storage_lock);
+
+            if (!ok || backing_write(buf, n * BLOCK_SIZE, (off_t)(dest + out) * BLOCK_SIZE) < 0) {
+                free(buf);
+                block_free(dest, total);
+                compact_stats.aborted++;
+                return 0;
+            }
+            out += n;
+        }
+    }
+    free(buf);
+
+    // New copy must be durable before anything points at it
+    for (int d = 0; d < backing_count; d++) {
+        fsync(backing_fds[d]);
+    }
+
+    // Switch phase: as a writer of the file, only if nothing changed
+    // meanwhile
+    block_map_t *map = &block_maps[file_idx];
+    fair_wrlock(map);
+    map_wrlock(map);
+    if (!map_unchanged(file_idx, id, gen)) {
+        map_unlock(map);
+        fair_unlock(map);
+        block_free(dest, total);
+        compact_stats.aborted++;
+        return 0;
+    }
+
+    blk_t placed = 0;
+    for (int i = 0; i < nsegs; i++) {
+        if (blockmap_remap(map, segs[i].lblk, segs[i].len, dest + placed) < 0) {
+            fprintf(stderr, "[COMPACT] Remap failed for file %d\n", file_idx);
+            map_unlock(map);
+            fair_unlock(map);
+            return -1;
+        }
+        placed += segs[i].len;
+    }
+    map_unlock(map);
+    fair_unlock(map);
+
+    fair_wrlock(NULL);
+    trim_backing_files();
+    fair_unlock(NULL);
+
+    compact_stats.relocations++;
+    compact_stats.bytes_moved += total * BLOCK_SIZE;
+    return total * BLOCK_SIZE;
+}
+
+static long compact_pass(long max_bytes) {
+    move_seg_t *segs = malloc(COMPACT_MAX_SEGMENTS * sizeof(move_seg_t));
+    if (!segs) return -1;
+
+    long moved = 0;
+    int attempts = 0;
+    compact_stats.passes++;
+
+    while (moved < max_bytes && attempts++ < MAX_FILES) {
+        int file_idx, nsegs;
+        uint64_t id, gen;
+        blk_t dest;
+
+        pthread_rwlock_rdlock(&storage_lock);
+        int found = pick_relocation(&file_idx, &id, &gen, segs, &nsegs, &dest) == 0;
+        pthread_rwlock_unlock(&storage_lock);
+        if (!found) break;
+
+        long n = relocate(file_idx, id, gen, segs, nsegs, dest);
+        if (n < 0) {
+            free(segs);
+            return -1;
+        }
+        moved += n;
+    }
+
+    // Pick up any tail freed by ordinary deletes/truncates as well
+    fair_wrlock(NULL);
+    trim_backing_files();
+    fair_unlock(NULL);
+
+    free(segs);
+    return moved;
+}
+
+long compact_storage(long max_bytes) {
+    return compact_pass(max_bytes);
+}
+
+static void *compact_main(void *arg) {
+    (void)arg;
+    long rate_bps = (long)evfs_options.compact_rate_mb * 1024 * 1024;
+    io_set_thread_class(IO_CLASS_BACKGROUND);
+
+    pthread_mutex_lock(&compact_lock);
+    while (compact_running) {
+        struct timespec wake;
+        clock_gettime(CLOCK_REALTIME, &wake);
+        wake.tv_sec += COMPACT_INTERVAL_SEC;
+        pthread_cond_timedwait(&compact_cond, &compact_lock, &wake);
+        if (!compact_running) break;
+        pthread_mutex_unlock(&compact_lock);
+
+        long moved = compact_pass(rate_bps * COMPACT_INTERVAL_SEC);
+        if (moved > 0) {
+            printf("[COMPACT] Relocated %ld bytes (total reclaimed: %lu bytes)\n",
+                   moved, compact_stats.bytes_reclaimed);
+        }
+
+        pthread_mutex_lock(&compact_lock);
+    }
+    pthread_mutex_unlock(&compact_lock);
+    return NULL;
+}
+
+static void start_compactor(void) {
+    if (evfs_options.compact_rate_mb <= 0) return;
+
+    compact_running = 1;
+    if (pthread_create(&compact_thread, NULL, compact_main, NULL) != 0) {
+        perror("[STORAGE] Failed to start compactor");
+        compact_running = 0;
+        return;
+    }
+    printf("[STORAGE] Background compaction enabled (%d MB/s)\n",
+           evfs_options.compact_rate_mb);
+}
+
+static void stop_compactor(void) {
+    pthread_mutex_lock(&compact_lock);
+    if (!compact_running) {
+        pthread_mutex_unlock(&compact_lock);
+        return;
+    }
+    compact_running = 0;
+    pthread_cond_signal(&compact_cond);
+    pthread_mutex_unlock(&compact_lock);
+    pthread_join(compact_thread, NULL);
+}
+
+/*
+ * ============================================================================
+ * ONLINE RE-ENCRYPTION
+ * ============================================================================
+ *
+ * Mounting with another --cipher than the metadata was written with (of
+ * the same block overhead, so the layout stays) re-encrypts the file
+ * system in the background. Each file's map records the engine its data
+ * still uses (old_engine) and how far it has been re-encrypted: blocks
+ * below 'reencrypted' use the active engine, the rest the old one, and
+ * reads and writes pick the engine per block. Both fields are saved with
+ * the map, so a crash or unmount resumes where the last commit left off.
+ *
+ * The thread takes one chunk of a file at a time: it reads the blocks
+ * under the shared lock and the file's map lock, re-encrypts them into freshly allocated blocks,
+ * and only then moves the map over and advances 'reencrypted', as a
+ * writer of the file and only if it did not change meanwhile (as the
+ * compactor does). The old blocks are freed with the next commit, so the
+ * last committed state stays readable. The work is background I/O:
+ * paced by its rate limit and queued behind foreground requests.
+ * Files of a locked volume wait until it is unlocked. When a file is
+ * done its inline areas are sealed with the new engine from then on.
+ */
+
+// Online re-encryption tuning
+#define REENCRYPT_CHUNK_BLOCKS 64  // blocks moved per storage_lock hold
+#define REENCRYPT_RETRY_SEC 5      // wait while only locked volumes are left
+
+typedef struct {
+    unsigned long chunks;
+    unsigned long aborted;   // chunks dropped because the file changed
+    unsigned long files;     // files finished
+    unsigned long bytes;
+} reencrypt_stats_t;
+
+static reencrypt_stats_t reencrypt_stats;
+static pthread_t reencrypt_thread;
+static int reencrypt_running = 0;
+static int reencrypt_cursor = 0;
+static pthread_mutex_t reencrypt_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reencrypt_cond = PTHREAD_COND_INITIALIZER;
+
+int reencrypt_pending(void) {
+    int n = 0;
+    pthread_rwlock_rdlock(&storage_lock);
+    for (int i = 0; i < MAX_FILES; i++) {
+        map_rdlock(&block_maps[i]);
+        if (block_maps[i].old_engine) n++;
+        map_unlock(&block_maps[i]);
+    }
+    pthread_rwlock_unlock(&storage_lock);
+    return n;
+}
+
+/*
+ * Re-encrypt the next chunk of some file. Returns 1 after progress, 0
+ * when nothing is left, -EAGAIN if what is left cannot be done now
+ * (locked volume, file changed, no space), -EIO on a failed transfer.
+ */
+static int reencrypt_step(void) {
+    int file_idx = -1, pending = 0, mapped = 0;
+    uint64_t id = 0, gen = 0;
+    uint32_t old_engine = 0;
+    blk_t start = 0, pblk = 0, n = 0;
+
+    pthread_rwlock_rdlock(&storage_lock);
+    for (int k = 0; k < MAX_FILES && file_idx < 0; k++) {
+        int f = (reencrypt_cursor + k) % MAX_FILES;
+        block_map_t *map = &block_maps[f];
+        map_rdlock(map);
+        if (!map->old_engine || !evfs_crypto_has_key(EVFS_KEY_ID(map->id))) {
+            pending |= map->old_engine != 0;
+            map_unlock(map);
+            continue;
+        }
+        pending = 1;
+
+        // Holes need no work: go straight to the next mapped block
+        blk_t run;
+        start = map->reencrypted;
+        mapped = blockmap_lookup(map, start, &pblk, &run);
+        if (!mapped && run != BLK_MAX - start) {
+            start += run;
+            mapped = blockmap_lookup(map, start, &pblk, &run);
+        }
+        n = run < REENCRYPT_CHUNK_BLOCKS ? run : REENCRYPT_CHUNK_BLOCKS;
+        file_idx = f;
+        id = map->id;
+        gen = map->generation;
+        old_engine = map->old_engine;
+        map_unlock(map);
+    }
+    pthread_rwlock_unlock(&storage_lock);
+    if (file_idx < 0) {
+        return pending ? -EAGAIN : 0;
+    }
+    reencrypt_cursor = file_idx;
+
+    if (!mapped) {
+        // Only the inline areas are left: decrypt them with the old
+        // engine, then the file switches over
+        inode_load(file_idx);
+        block_map_t *map = &block_maps[file_idx];
+        fair_wrlock(map);
+        map_wrlock(map);
+        int done = map_unchanged(file_idx, id, gen) && !inode_is_sealed(file_idx);
+        if (done) {
+            map->old_engine = 0;
+            map->reencrypted = 0;
+            map->generation++;
+            reencrypt_stats.files++;
+        }
+        map_unlock(map);
+        fair_unlock(map);
+        if (done) {
+            printf("[REENCRYPT] File %d now uses %s\n", file_idx, evfs_crypto_engine_name());
+            reencrypt_cursor = file_idx + 1;
+        }
+        return done ? 1 : -EAGAIN;
+    }
+
+    blk_t dest, got;
+    if (block_alloc(pblk, n, &dest, &got) < 0) {
+        return -EAGAIN;
+    }
+    n = got;
+    char *buf = malloc(n * BLOCK_SIZE);
+    evfs_crypto_vec_t *vec = malloc(n * sizeof(evfs_crypto_vec_t));
+    if (!buf || !vec) {
+        free(buf);
+        free(vec);
+        block_free(dest, n);
+        return -EAGAIN;
+    }
+
+    io_throttle(IO_CLASS_BACKGROUND, 2 * n * BLOCK_SIZE);
+
+    pthread_rwlock_rdlock(&storage_lock);
+    map_rdlock(&block_maps[file_idx]);
+    int ret = map_unchanged(file_idx, id, gen) ? 0 : -EAGAIN;
+    if (ret == 0 && backing_read(buf, n * BLOCK_SIZE, (off_t)pblk * BLOCK_SIZE) < 0) {
+        ret = -EIO;
+    }
+    map_unlock(&block_maps[file_idx]);
+    pthread_rwlock_unlock(&storage_lock);
+
+    if (ret == 0) {
+        for (blk_t i = 0; i < n; i++) {
+            vec[i].src = vec[i].dst = buf + i * BLOCK_SIZE;
+            vec[i].len = BLOCK_SIZE;
+            vec[i].file_id = id;
+            vec[i].block_no = start + i;
+            vec[i].engine = old_engine;
+        }
+        if (evfs_decrypt_blocks(vec, n) != 0) {
+            ret = -EIO;
+        } else {
+            for (blk_t i = 0; i < n; i++) vec[i].engine = 0;
+            if (evfs_encrypt_blocks(vec, n) != 0 ||
+                backing_write(buf, n * BLOCK_SIZE, (off_t)dest * BLOCK_SIZE) < 0) {
+                ret = -EIO;
+            }
+        }
+    }
+    free(vec);
+    free(buf);
+
+    // Switch: only if nothing changed while the chunk was copied
+    if (ret == 0) {
+        block_map_t *map = &block_maps[file_idx];
+        fair_wrlock(map);
+        map_wrlock(map);
+        ret = map_unchanged(file_idx, id, gen) ? 0 : -EAGAIN;
+        if (ret == 0) {
+            // New ciphertext: a backup must take the blocks again
+            ret = blockmap_remap(map, start, n, dest);
+            if (ret == 0) ret = blockmap_touch(map, start, n, change_gen);
+            if (ret == 0) map->reencrypted = start + n;
+        }
+        map_unlock(map);
+        fair_unlock(map);
+    }
+    if (ret < 0) {
+        block_free(dest, n);
+        if (ret == -EAGAIN) reencrypt_stats.aborted++;
+        if (ret == -EIO) {
+            fprintf(stderr, "[REENCRYPT] Cannot re-encrypt blocks %lu-%lu of file %d\n",
+                    (unsigned long)start, (unsigned long)(start + n - 1), file_idx);
+        }
+        return ret == -EIO ? -EIO : -EAGAIN;
+    }
+    reencrypt_stats.chunks++;
+    reencrypt_stats.bytes += n * BLOCK_SIZE;
+    return 1;
+}
+
+static void *reencrypt_main(void *arg) {
+    (void)arg;
+    io_set_thread_class(IO_CLASS_BACKGROUND);
+
+    pthread_mutex_lock(&reencrypt_lock);
+    while (reencrypt_running) {
+        pthread_mutex_unlock(&reencrypt_lock);
+        int ret = reencrypt_step();
+        pthread_mutex_lock(&reencrypt_lock);
+        if (ret == 0) {
+            printf("[REENCRYPT] All files use %s (%lu bytes re-encrypted)\n",
+                   evfs_crypto_engine_name(), reencrypt_stats.bytes);
+            break;
+        }
+        if (ret < 0 && reencrypt_running) {
+            // Nothing could be done: wait for a volume to be unlocked
+            // or the file to settle
+            struct timespec wake;
+            clock_gettime(CLOCK_REALTIME, &wake);
+            wake.tv_sec += REENCRYPT_RETRY_SEC;
+            pthread_cond_timedwait(&reencrypt_cond, &reencrypt_lock, &wake);
+        }
+    }
+    pthread_mutex_unlock(&reencrypt_lock);
+    return NULL;
+}
+
+void start_reencryption(void) {
+    int pending = reencrypt_pending();
+    if (pending == 0) return;
+
+    pthread_mutex_lock(&reencrypt_lock);
+    if (!reencrypt_running) {
+        reencrypt_running = 1;
+        if (pthread_create(&reencrypt_thread, NULL, reencrypt_main, NULL) != 0) {
+            perror("[STORAGE] Failed to start re-encryption");
+            reencrypt_running = 0;
+        } else {
+            printf("[STORAGE] Re-encrypting %d file(s) to %s in the background\n", pending,
+                   evfs_crypto_engine_name());
+        }
+    }
+    pthread_mutex_unlock(&reencrypt_lock);
+}
+
+void reencrypt_wake(void) {
+    pthread_mutex_lock(&reencrypt_lock);
+    pthread_cond_signal(&reencrypt_cond);
+    pthread_mutex_unlock(&reencrypt_lock);
+}
+
+void stop_reencryption(void) {
+    pthread_mutex_lock(&reencrypt_lock);
+    if (!reencrypt_running) {
+        pthread_mutex_unlock(&reencrypt_lock);
+        return;
+    }
+    reencrypt_running = 0;
+    pthread_cond_signal(&reencrypt_cond);
+    pthread_mutex_unlock(&reencrypt_lock);
+    pthread_join(reencrypt_thread, NULL);
+}
+
+/*
+ * Print storage I/O statistics
+ */
+void print_storage_stats(void) {
+    evfs_crypto_print_stats();
+
+    printf("\n========== STORAGE STATS ==========\n");
+    printf("Mode:          %s\n", direct_io_active ? "direct (O_DIRECT)" : "buffered");
+    printf("Reads:         %lu ops, %lu bytes\n", stats.read_ops, stats.bytes_read);
+    printf("Writes:        %lu ops, %lu bytes\n", stats.write_ops, stats.bytes_written);
+    if (direct_io_active) {
+        printf("Buffer pool:   %lu hits, %lu misses\n", stats.pool_hits, stats.pool_misses);
+    }
+    blk_t end, nfree;
+    int nfree_extents;
+    block_allocator_usage(&end, &nfree, &nfree_extents);
+    printf("Blocks:        %lu in use, %lu free (%d free extents)\n",
+           (unsigned long)(end - nfree), (unsigned long)nfree, nfree_extents);
+    printf("Shared:        %lu blocks (snapshots)\n",
+           (unsigned long)block_shared_blocks());
+    printf("Compaction:    %lu passes, %lu moves (%lu aborted), %lu bytes moved, "
+           "%lu bytes reclaimed\n",
+           compact_stats.passes, compact_stats.relocations, compact_stats.aborted,
+           compact_stats.bytes_moved, compact_stats.bytes_reclaimed);
+    int pending = reencrypt_pending();
+    if (pending > 0 || reencrypt_stats.chunks > 0) {
+        printf("Re-encryption: %lu chunks (%lu aborted), %lu bytes, %lu files done, "
+               "%d left\n", reencrypt_stats.chunks, reencrypt_stats.aborted,
+               reencrypt_stats.bytes, reencrypt_stats.files, pending);
+    }
+    print_iosched_stats();
+    if (backing_count > 1) {
+        printf("Parallel ops:  %lu\n", stats.parallel_ops);
+        for (int i = 0; i < backing_count; i++) {
+            printf("  [%d] %-20s %lu bytes\n", i, evfs_options.backing_files[i],
+                   stats.dev_bytes[i]);
+        }
+    }
+    printf("===================================\n\n");
+}
+
+/*
+ * Cleanup storage system
+ */
+void cleanup_storage(void) {
+    printf("[STORAGE] Cleaning up storage system...\n");
+
+    stop_reencryption();
+    stop_compactor();
+    stop_releaser();
+    stop_stripe_workers();
+    
+    print_storage_stats();
+
+    for (int i = 0; i < backing_count; i++) {
+        fsync(backing_fds[i]);
+    }
+    close_backing_files();
+
+    for (int i = 0; i < MAX_FILES; i++) {
+        blockmap_free(&block_maps[i]);
+    }
+
+    if (direct_io_active) {
+        io_pool_destroy();
+        direct_io_active = 0;
     }
     
     printf("[STORAGE] Storage system cleaned up\n");
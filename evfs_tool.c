@@ -0,0 +1,1147 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <pthread.h>
+#include <dirent.h>
+#include <limits.h>
+#include <sys/time.h>
+
+/*
+ * ============================================================================
+ * EVFS-TOOL - Offline bulk import/export and incremental backup
+ * ============================================================================
+ *
+ * Moves whole directory trees into or out of an unmounted file system
+ * without going through FUSE. Each file is preallocated as one contiguous
+ * run, then cut into large chunks that a pool of threads encrypts (or
+ * decrypts) in parallel; every chunk reaches the backing files as a few
+ * big sequential writes, and nothing is fsynced until the end.
+ *
+ * An import is all or nothing: the metadata is only saved once every
+ * chunk has been written, so a failed run leaves the file system as it was.
+ * Hard links and symlinks are carried over both ways; a file with several
+ * names is stored (and its data moved) once.
+ *
+ * Usage: ./evfs-tool import SRC_DIR [EVFS_DIR] [options]
+ *        ./evfs-tool export [EVFS_PATH] DEST_DIR [options]
+ *        ./evfs-tool backup SINCE OUT_FILE [options]
+ *        ./evfs-tool apply IN_FILE [options]
+ * Options: -j threads, --backing=F1,F2,..., --meta=FILE, --cipher=NAME,
+ *          --direct-io, --volume=NAME:KEYFILE
+ *
+ * Files in a volume are only imported or exported while it is unlocked
+ * (--volume, as for evfs); export skips those of locked volumes.
+ */
+
+// Blocks per chunk handed to a worker (4 MiB of ciphertext)
+#define TOOL_CHUNK_BLOCKS 1024
+#define TOOL_MAX_THREADS 64
+
+// One chunk of one file
+typedef struct {
+    int file_idx;
+    int fd;         // host file: source for import, destination for export
+    off_t offset;
+    size_t len;
+} tool_job_t;
+
+// A host file whose data is being moved, kept open until the end
+typedef struct {
+    int file_idx;
+    int fd;
+    char path[PATH_MAX];
+} tool_file_t;
+
+static tool_job_t *jobs = NULL;
+static int job_count = 0;
+static int job_capacity = 0;
+static int next_job = 0;
+
+static tool_file_t files[MAX_FILES];
+static int file_count = 0;
+
+// Host files with several names seen during an import: (dev, ino) -> inode
+typedef struct {
+    dev_t dev;
+    ino_t ino;
+    int file_idx;
+} tool_link_t;
+
+static tool_link_t links[MAX_FILES];
+static int link_count = 0;
+
+static int exporting = 0;
+static int failed = 0;
+static size_t chunk_bytes;
+static unsigned long dirs_done = 0;
+static off_t bytes_total = 0;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Host file I/O
+ * ----------------------------------------------------------------------------
+ */
+
+static ssize_t read_full(int fd, char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pread(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        if (n == 0) break;
+        done += n;
+    }
+    return done;
+}
+
+static ssize_t write_full(int fd, const char *buf, size_t size, off_t offset) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(fd, buf + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        done += n;
+    }
+    return done;
+}
+
+// mkdir -p for a host path
+static int make_dirs(const char *path, mode_t mode) {
+    char tmp[PATH_MAX];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p != '/') continue;
+        *p = '\0';
+        if (mkdir(tmp, 0755) < 0 && errno != EEXIST) return -1;
+        *p = '/';
+    }
+    if (mkdir(tmp, mode) < 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Work queue
+ * ----------------------------------------------------------------------------
+ */
+
+static int add_file(int file_idx, int fd, const char *path, off_t size) {
+    if (file_count == MAX_FILES) {
+        return -ENOSPC;
+    }
+    files[file_count].file_idx = file_idx;
+    files[file_count].fd = fd;
+    snprintf(files[file_count].path, PATH_MAX, "%s", path);
+    file_count++;
+
+    // Consecutive chunks of a file are queued together, so the workers
+    // sweep each file front to back
+    for (off_t off = 0; off < size; off += chunk_bytes) {
+        if (job_count == job_capacity) {
+            int cap = job_capacity ? job_capacity * 2 : 256;
+            tool_job_t *grown = realloc(jobs, cap * sizeof(tool_job_t));
+            if (!grown) return -ENOMEM;
+            jobs = grown;
+            job_capacity = cap;
+        }
+        size_t len = size - off < (off_t)chunk_bytes ? (size_t)(size - off) : chunk_bytes;
+        jobs[job_count++] = (tool_job_t){ file_idx, fd, off, len };
+    }
+    bytes_total += size;
+    return 0;
+}
+
+static void *tool_worker(void *arg) {
+    (void)arg;
+    char *buf = malloc(chunk_bytes);
+    if (!buf) {
+        __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    for (;;) {
+        int j = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED);
+        if (j >= job_count || __atomic_load_n(&failed, __ATOMIC_RELAXED)) break;
+        tool_job_t *job = &jobs[j];
+
+        int ret;
+        if (exporting) {
+            ret = bulk_read_storage(job->file_idx, job->offset, buf, job->len);
+            if (ret >= 0 && write_full(job->fd, buf, job->len, job->offset) < 0) {
+                ret = -errno;
+            }
+        } else {
+            ssize_t n = read_full(job->fd, buf, job->len, job->offset);
+            if (n < 0) {
+                ret = -errno;
+            } else if ((size_t)n < job->len) {
+                ret = -EIO;  // source shrank while importing
+            } else {
+                ret = bulk_write_storage(job->file_idx, job->offset, buf, job->len);
+            }
+        }
+        if (ret < 0) {
+            const char *path = "?";
+            for (int f = 0; f < file_count; f++) {
+                if (files[f].fd == job->fd) path = files[f].path;
+            }
+            fprintf(stderr, "[TOOL] %s at offset %ld: %s\n", path, (long)job->offset, strerror(-ret));
+            __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void run_jobs(long nthreads) {
+    pthread_t threads[TOOL_MAX_THREADS];
+    int started = 0;
+    for (long t = 0; t < nthreads; t++) {
+        if (pthread_create(&threads[started], NULL, tool_worker, NULL) == 0) {
+            started++;
+        }
+    }
+    if (started == 0) {
+        tool_worker(NULL);
+    }
+    for (int t = 0; t < started; t++) {
+        pthread_join(threads[t], NULL);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Import
+ * ----------------------------------------------------------------------------
+ */
+
+// Create a file table entry for an EVFS path, taking attributes from st
+static int add_entry(const char *path, file_type_t type, const struct stat *st) {
+    int idx = find_file_by_path(path);
+    if (idx != -1) {
+        // Existing directories are merged into; files are never replaced
+        if (type == FTYPE_DIR && file_table[idx].type == FTYPE_DIR) return idx;
+        fprintf(stderr, "[TOOL] %s already exists\n", path);
+        return -EEXIST;
+    }
+    if (strlen(path + 1) >= MAX_FILENAME) {
+        fprintf(stderr, "[TOOL] Path too long: %s\n", path);
+        return -ENAMETOOLONG;
+    }
+    int parent = parent_directory(path);
+    if (parent < 0) {
+        fprintf(stderr, "[TOOL] No parent directory for %s\n", path);
+        return parent;
+    }
+    if (volume_check(&file_table[parent]) < 0) {
+        fprintf(stderr, "[TOOL] %s is in a locked volume (use --volume)\n", path);
+        return -ENOKEY;
+    }
+    idx = find_free_slot();
+    if (idx == -1) {
+        fprintf(stderr, "[TOOL] No free slots for %s (max %d entries)\n", path, MAX_FILES);
+        return -ENOSPC;
+    }
+
+    int ret = quota_charge(getuid(), getgid(), 0, 1);
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] Inode quota exceeded for %s\n", path);
+        return ret;
+    }
+
+    file_metadata_t *meta = &file_table[idx];
+    memset(meta, 0, sizeof(*meta));
+    meta->type = type;
+    meta->mode = st->st_mode & 07777;
+    meta->uid = getuid();
+    meta->gid = getgid();
+    meta->atime = st->st_atime;
+    meta->mtime = st->st_mtime;
+    meta->ctime = time(NULL);
+    meta->size = type == FTYPE_DIR ? BLOCK_SIZE : 0;
+    meta->is_used = 1;
+    meta->nlink = type == FTYPE_DIR ? 2 : 0; // dentry_add counts the name
+    meta->volume = file_table[parent].volume;
+
+    ret = dentry_add(path, idx);
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] No room for the name %s (max %d names)\n", path, MAX_DENTRIES);
+        meta->is_used = 0;
+        quota_account(meta->uid, meta->gid, 0, -1);
+        return ret;
+    }
+    storage_assign_volume(idx, meta->volume);
+    return idx;
+}
+
+// Another name for an inode imported earlier
+static int add_link(const char *path, int idx) {
+    if (find_file_by_path(path) != -1) {
+        fprintf(stderr, "[TOOL] %s already exists\n", path);
+        return -EEXIST;
+    }
+    int ret = dentry_add(path, idx);
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] No room for the name %s (max %d names)\n", path, MAX_DENTRIES);
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static int import_symlink(const char *src, const char *dst, const struct stat *st) {
+    char target[PATH_MAX];
+    ssize_t len = readlink(src, target, sizeof(target) - 1);
+    if (len < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", src, strerror(errno));
+        return -errno;
+    }
+    target[len] = '\0';
+
+    int idx = add_entry(dst, FTYPE_SYMLINK, st);
+    if (idx < 0) {
+        return idx;
+    }
+    return symlink_store(idx, target);
+}
+
+static int import_file(const char *src, const char *dst, const struct stat *st) {
+    // Further names of a multiply-linked file only add a dentry
+    for (int l = 0; l < link_count; l++) {
+        if (links[l].dev == st->st_dev && links[l].ino == st->st_ino) {
+            return add_link(dst, links[l].file_idx);
+        }
+    }
+
+    int fd = open(src, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", src, strerror(errno));
+        return -errno;
+    }
+
+    int idx = add_entry(dst, FTYPE_FILE, st);
+    int ret = idx;
+    if (idx >= 0) {
+        // One contiguous run up front; the workers only fill it in
+        ret = allocate_storage(idx, st->st_size);
+        if (ret == 0) {
+            file_table[idx].size = st->st_size;
+            ret = add_file(idx, fd, src, st->st_size);
+        }
+    }
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+    if (st->st_nlink > 1 && link_count < MAX_FILES) {
+        links[link_count++] = (tool_link_t){ st->st_dev, st->st_ino, idx };
+    }
+    return 0;
+}
+
+static int import_dir(const char *src, const char *dst) {
+    DIR *dir = opendir(src);
+    if (!dir) {
+        fprintf(stderr, "[TOOL] %s: %s\n", src, strerror(errno));
+        return -errno;
+    }
+
+    int ret = 0;
+    struct dirent *de;
+    while (ret == 0 && (de = readdir(dir)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+
+        char src_path[PATH_MAX], dst_path[PATH_MAX];
+        snprintf(src_path, sizeof(src_path), "%s/%s", src, de->d_name);
+        snprintf(dst_path, sizeof(dst_path), "%s/%s", dst, de->d_name);
+        if (is_snapshot_path(dst_path)) {
+            fprintf(stderr, "[TOOL] Skipping %s (reserved name)\n", src_path);
+            continue;
+        }
+
+        struct stat st;
+        if (lstat(src_path, &st) < 0) {
+            fprintf(stderr, "[TOOL] %s: %s\n", src_path, strerror(errno));
+            ret = -errno;
+        } else if (S_ISDIR(st.st_mode)) {
+            ret = add_entry(dst_path, FTYPE_DIR, &st);
+            if (ret >= 0) {
+                dirs_done++;
+                ret = import_dir(src_path, dst_path);
+            }
+        } else if (S_ISREG(st.st_mode)) {
+            ret = import_file(src_path, dst_path, &st);
+        } else if (S_ISLNK(st.st_mode)) {
+            ret = import_symlink(src_path, dst_path, &st);
+        } else {
+            printf("[TOOL] Skipping %s (not a regular file, directory or symlink)\n", src_path);
+        }
+    }
+
+    closedir(dir);
+    return ret < 0 ? ret : 0;
+}
+
+static int do_import(const char *src, const char *dst) {
+    struct stat st;
+    if (stat(src, &st) < 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "[TOOL] %s is not a directory\n", src);
+        return -ENOTDIR;
+    }
+
+    if (strcmp(dst, "/") != 0) {
+        int ret = add_entry(dst, FTYPE_DIR, &st);
+        if (ret < 0) return ret;
+        dirs_done++;
+    }
+    int ret = import_dir(src, strcmp(dst, "/") == 0 ? "" : dst);
+    if (ret < 0) return ret;
+
+    // Grow the backing files once, instead of on every chunk
+    return preallocate_backing_files();
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Export
+ * ----------------------------------------------------------------------------
+ */
+
+static int export_file(int idx, const char *dst) {
+    file_metadata_t *meta = &file_table[idx];
+    int fd = open(dst, O_WRONLY | O_CREAT | O_TRUNC, meta->mode & 07777);
+    if (fd < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", dst, strerror(errno));
+        return -errno;
+    }
+    // Sized up front so chunks can land in any order
+    if (ftruncate(fd, meta->size) < 0) {
+        int err = errno;
+        close(fd);
+        return -err;
+    }
+    int ret = add_file(idx, fd, dst, meta->size);
+    if (ret < 0) close(fd);
+    return ret;
+}
+
+static int export_symlink(int idx, const char *dst) {
+    char target[PATH_MAX];
+    int len = symlink_read(idx, target, sizeof(target) - 1);
+    if (len < 0) {
+        return len;
+    }
+    target[len] = '\0';
+    unlink(dst);
+    if (symlink(target, dst) < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", dst, strerror(errno));
+        return -errno;
+    }
+    return 0;
+}
+
+// A file or symlink; names of an inode already exported become hard links
+static int export_entry(int idx, const char *dst) {
+    if (volume_check(&file_table[idx]) < 0) {
+        fprintf(stderr, "[TOOL] Skipping %s: its volume is locked (use --volume)\n", dst);
+        return 0;
+    }
+    for (int f = 0; f < file_count; f++) {
+        if (files[f].file_idx == idx) {
+            unlink(dst);
+            if (link(files[f].path, dst) < 0) {
+                fprintf(stderr, "[TOOL] %s: %s\n", dst, strerror(errno));
+                return -errno;
+            }
+            return 0;
+        }
+    }
+    return file_table[idx].type == FTYPE_SYMLINK ? export_symlink(idx, dst) : export_file(idx, dst);
+}
+
+static int do_export(const char *src, const char *dst) {
+    int src_idx = find_file_by_path(src);
+    if (src_idx == -1) {
+        fprintf(stderr, "[TOOL] %s not found\n", src);
+        return -ENOENT;
+    }
+    if (make_dirs(dst, 0755) < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", dst, strerror(errno));
+        return -errno;
+    }
+
+    char path[PATH_MAX];
+    if (file_table[src_idx].type != FTYPE_DIR) {
+        const char *base = strrchr(src, '/') + 1;
+        snprintf(path, sizeof(path), "%s/%s", dst, base);
+        return export_entry(src_idx, path);
+    }
+
+    // Everything named below src: "<src>/<rest>" goes to "<dst>/<rest>"
+    int below[MAX_DENTRIES];
+    int count = dentries_below(src_idx, below);
+    size_t prefix = src_idx == 0 ? 0 : strlen(src);
+    for (int pass = 0; pass < 2; pass++) {
+        // Directories first, so files always have somewhere to go
+        for (int k = 0; k < count; k++) {
+            const char *name = dentry_table[below[k]].name;
+            int i = dentry_table[below[k]].inode;
+            file_metadata_t *meta = &file_table[i];
+            snprintf(path, sizeof(path), "%s/%s", dst, name + prefix);
+
+            int ret = 0;
+            if (pass == 0 && meta->type == FTYPE_DIR) {
+                if (make_dirs(path, meta->mode & 07777) < 0) {
+                    fprintf(stderr, "[TOOL] %s: %s\n", path, strerror(errno));
+                    ret = -errno;
+                }
+                dirs_done++;
+            } else if (pass == 1 && meta->type != FTYPE_DIR) {
+                char *slash = strrchr(path, '/');
+                *slash = '\0';
+                ret = make_dirs(path, 0755) < 0 ? -errno : 0;
+                *slash = '/';
+                if (ret == 0) ret = export_entry(i, path);
+            }
+            if (ret < 0) return ret;
+        }
+    }
+    return 0;
+}
+
+// Give exported files the times recorded in EVFS, once all data is in
+static void finish_export(void) {
+    for (int f = 0; f < file_count; f++) {
+        file_metadata_t *meta = &file_table[files[f].file_idx];
+        struct timespec ts[2] = { { meta->atime, 0 }, { meta->mtime, 0 } };
+        futimens(files[f].fd, ts);
+    }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Incremental backup
+ * ----------------------------------------------------------------------------
+ *
+ * "backup SINCE OUT" writes everything that changed after change
+ * generation SINCE (0: everything) as a stream of frames, each with its
+ * own SHA-256: a header (volume table, quota limits, which inodes exist),
+ * per changed file its inode and whole extent list followed by the blocks
+ * of the extents written after SINCE, the names of those files, and an end
+ * frame. Blocks and inline areas stay encrypted, so no volume needs to be
+ * unlocked. The generation the backup covers is then closed; pass it as
+ * SINCE next time.
+ *
+ * "apply IN" replays a stream onto a replica that holds exactly what the
+ * previous backup described (a new file system for a full one): changed
+ * files get the sent blocks in fresh space plus the blocks they kept from
+ * before, deleted inodes are dropped, and nothing is saved unless the
+ * whole stream checked out.
+ */
+
+#define BACKUP_MAGIC 0x4B55424B53465645ULL  // "EVFSBKUK"
+#define BACKUP_VERSION 3
+
+enum { FRAME_HEADER = 1, FRAME_FILE, FRAME_DATA, FRAME_NAMES, FRAME_END };
+
+typedef struct {
+    uint32_t type;
+    uint32_t pad;
+    uint64_t size;          // payload bytes; the SHA-256 of frame + payload follows
+} backup_frame_t;
+
+typedef struct {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t quota_count;
+    char cipher[32];
+    uint64_t since;
+    uint64_t gen;           // last generation the backup includes
+    unsigned char used[MAX_FILES];
+    volume_t volumes[MAX_VOLUMES];
+    quota_limit_t quotas[MAX_QUOTAS];
+} backup_header_t;
+
+// Followed by extent_count extents (pblk unused)
+typedef struct {
+    uint32_t idx;
+    uint32_t extent_count;
+    uint64_t map_id;
+    uint32_t old_engine;
+    uint32_t pad;
+    uint64_t reencrypted;
+    uint64_t changed;
+    file_metadata_t meta;   // inline areas sealed
+} backup_file_t;
+
+typedef struct {
+    uint32_t d;             // slot at the source: the seal's tweak
+    uint32_t pad;
+    dentry_t dentry;        // sealed
+} backup_name_t;
+
+typedef struct {
+    uint64_t files;
+    uint64_t blocks;
+} backup_end_t;
+
+static char *frame_buf = NULL;  // frame + largest payload + checksum
+static size_t frame_capacity = 0;
+
+static int frame_reserve(size_t payload) {
+    size_t need = sizeof(backup_frame_t) + payload + EVFS_CHECKSUM_LEN;
+    if (need <= frame_capacity) return 0;
+    char *grown = NULL;
+    if (posix_memalign((void **)&grown, IO_ALIGN, need) != 0) return -ENOMEM;
+    free(frame_buf);
+    frame_buf = grown;
+    frame_capacity = need;
+    return 0;
+}
+
+// Payload area of the frame buffer (for raw blocks, aligned for direct I/O)
+static char *frame_payload(void) {
+    return frame_buf + sizeof(backup_frame_t);
+}
+
+// Write the frame whose payload is already in place
+static int put_frame(int fd, off_t *pos, uint32_t type, size_t size) {
+    backup_frame_t *f = (backup_frame_t *)frame_buf;
+    f->type = type;
+    f->pad = 0;
+    f->size = size;
+    size_t len = sizeof(*f) + size;
+    if (evfs_checksum(frame_buf, len, (unsigned char *)frame_buf + len) != 0 ||
+        write_full(fd, frame_buf, len + EVFS_CHECKSUM_LEN, *pos) < 0) {
+        return -EIO;
+    }
+    *pos += len + EVFS_CHECKSUM_LEN;
+    return 0;
+}
+
+// Read the next frame into frame_buf; its payload is at frame_payload()
+static int get_frame(int fd, off_t *pos, uint32_t *type, size_t *size) {
+    backup_frame_t f;
+    if (read_full(fd, (char *)&f, sizeof(f), *pos) != sizeof(f) ||
+        f.size > (uint64_t)TOOL_CHUNK_BLOCKS * BLOCK_SIZE + sizeof(backup_header_t) +
+                 MAX_DENTRIES * sizeof(backup_name_t) ||
+        frame_reserve(f.size) < 0) {
+        return -EINVAL;
+    }
+    size_t len = sizeof(f) + f.size;
+    unsigned char sum[EVFS_CHECKSUM_LEN];
+    memcpy(frame_buf, &f, sizeof(f));
+    if (read_full(fd, frame_buf + sizeof(f), f.size + EVFS_CHECKSUM_LEN, *pos + sizeof(f)) !=
+            (ssize_t)(f.size + EVFS_CHECKSUM_LEN) ||
+        evfs_checksum(frame_buf, len, sum) != 0 ||
+        memcmp(sum, frame_buf + len, EVFS_CHECKSUM_LEN) != 0) {
+        return -EINVAL;
+    }
+    *pos += len + EVFS_CHECKSUM_LEN;
+    *type = f.type;
+    *size = f.size;
+    return 0;
+}
+
+static int do_backup(uint64_t since, const char *out) {
+    uint64_t gen = storage_generation();
+    if (since >= gen) {
+        fprintf(stderr, "[TOOL] Generation %lu has not ended (current: %lu)\n",
+                (unsigned long)since, (unsigned long)gen);
+        return -EINVAL;
+    }
+    int fd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", out, strerror(errno));
+        return -errno;
+    }
+    int ret = frame_reserve(sizeof(backup_header_t) + TOOL_CHUNK_BLOCKS * BLOCK_SIZE +
+                            MAX_DENTRIES * sizeof(backup_name_t));
+    off_t pos = 0;
+
+    backup_header_t *hdr = (backup_header_t *)frame_payload();
+    if (ret == 0) {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = BACKUP_MAGIC;
+        hdr->version = BACKUP_VERSION;
+        snprintf(hdr->cipher, sizeof(hdr->cipher), "%s", evfs_crypto_engine_name());
+        hdr->since = since;
+        hdr->gen = gen;
+        for (int i = 0; i < MAX_FILES; i++) hdr->used[i] = file_table[i].is_used != 0;
+        export_volumes(hdr->volumes);
+        hdr->quota_count = export_quotas(hdr->quotas, MAX_QUOTAS);
+        ret = put_frame(fd, &pos, FRAME_HEADER, sizeof(*hdr));
+    }
+
+    unsigned char sent[MAX_FILES] = { 0 };
+    backup_end_t end = { 0, 0 };
+    for (int i = 0; i < MAX_FILES && ret == 0; i++) {
+        block_map_t map;
+        if (!file_table[i].is_used || storage_copy_map(i, &map) < 0) continue;
+        if (since > 0 && map.changed <= since) {
+            blockmap_free(&map);
+            continue;
+        }
+
+        backup_file_t *rec = (backup_file_t *)frame_payload();
+        rec->idx = i;
+        rec->extent_count = map.count;
+        rec->map_id = map.id;
+        rec->old_engine = map.old_engine;
+        rec->pad = 0;
+        rec->reencrypted = map.reencrypted;
+        rec->changed = map.changed;
+        rec->meta = file_table[i];
+        if (!inode_is_sealed(i) && inode_seal(&rec->meta, map.id, map.old_engine, 1) != 0) {
+            ret = -EIO;
+        }
+        extent_t *ext = (extent_t *)(rec + 1);
+        for (int e = 0; e < map.count; e++) {
+            ext[e] = map.extents[e];
+            ext[e].pblk = 0;
+        }
+        if (ret == 0) {
+            ret = put_frame(fd, &pos, FRAME_FILE, sizeof(*rec) + map.count * sizeof(extent_t));
+        }
+
+        // Then the blocks written since, still encrypted
+        for (int e = 0; e < map.count && ret == 0; e++) {
+            const extent_t *x = &map.extents[e];
+            if (x->gen <= since) continue;
+            for (blk_t off = 0; off < x->len && ret == 0; off += TOOL_CHUNK_BLOCKS) {
+                blk_t n = x->len - off < TOOL_CHUNK_BLOCKS ? x->len - off : TOOL_CHUNK_BLOCKS;
+                ret = read_raw_blocks(x->pblk + off, n, frame_payload());
+                if (ret == 0) ret = put_frame(fd, &pos, FRAME_DATA, n * BLOCK_SIZE);
+                end.blocks += n;
+            }
+        }
+        blockmap_free(&map);
+        sent[i] = 1;
+        end.files++;
+    }
+
+    // Every name of the files sent (a restored file's names are replaced)
+    if (ret == 0) {
+        backup_name_t *names = (backup_name_t *)frame_payload();
+        int n = 0;
+        for (int d = 0; d < MAX_DENTRIES && ret == 0; d++) {
+            if (!dentry_table[d].is_used || !sent[dentry_table[d].inode]) continue;
+            names[n].d = d;
+            names[n].pad = 0;
+            names[n].dentry = dentry_table[d];
+            if (!dentry_is_sealed(d) && dentry_seal(&names[n].dentry, d, 1) != 0) ret = -EIO;
+            n++;
+        }
+        if (ret == 0) ret = put_frame(fd, &pos, FRAME_NAMES, n * sizeof(backup_name_t));
+    }
+    if (ret == 0) {
+        memcpy(frame_payload(), &end, sizeof(end));
+        ret = put_frame(fd, &pos, FRAME_END, sizeof(end));
+    }
+    if (ret == 0 && fsync(fd) < 0) ret = -errno;
+    close(fd);
+
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] Backup to %s failed: %s\n", out, strerror(-ret));
+        unlink(out);
+        return ret;
+    }
+
+    // Later changes belong to the next backup
+    storage_set_generation(gen + 1);
+    printf("[TOOL] Backup of generation %lu (changes after %lu): %lu files, %lu blocks, "
+           "%ld bytes written\n", (unsigned long)gen, (unsigned long)since,
+           (unsigned long)end.files, (unsigned long)end.blocks, (long)pos);
+    printf("[TOOL] Pass %lu as SINCE for the next incremental backup\n", (unsigned long)gen);
+    return 0;
+}
+
+// Receive one changed file: its blocks go to fresh space, then its map
+// is replaced. *files / *restore collect the inode
+static int apply_file(int fd, off_t *pos, uint64_t since, size_t size,
+                      file_metadata_t *files, unsigned char *restore, uint64_t *blocks) {
+    const backup_file_t *rec = (const backup_file_t *)frame_payload();
+    if (size < sizeof(*rec) || rec->idx >= MAX_FILES ||
+        size != sizeof(*rec) + (size_t)rec->extent_count * sizeof(extent_t)) {
+        return -EINVAL;
+    }
+    int idx = rec->idx;
+    block_map_t map;
+    blockmap_init(&map, rec->map_id);
+    map.old_engine = rec->old_engine;
+    map.reencrypted = rec->reencrypted;
+    map.changed = rec->changed;
+    files[idx] = rec->meta;
+    restore[idx] = 1;
+
+    // The frame buffer is reused for the data: keep the extents
+    int count = rec->extent_count;
+    extent_t *ext = malloc((count > 0 ? count : 1) * sizeof(extent_t));
+    if (!ext) return -ENOMEM;
+    memcpy(ext, rec + 1, count * sizeof(extent_t));
+
+    int ret = 0;
+    blk_t goal = 0;
+    for (int e = 0; e < count && ret == 0; e++) {
+        if (ext[e].gen <= since) {
+            ret = blockmap_insert(&map, ext[e].lblk, 0, ext[e].len, ext[e].gen);
+            continue;
+        }
+        for (blk_t done = 0; done < ext[e].len && ret == 0; ) {
+            uint32_t type;
+            size_t n;
+            ret = get_frame(fd, pos, &type, &n);
+            if (ret == 0 && (type != FRAME_DATA || n == 0 || n % BLOCK_SIZE != 0 ||
+                             done + n / BLOCK_SIZE > ext[e].len)) {
+                ret = -EINVAL;
+            }
+            // Store the chunk wherever free space allows
+            for (blk_t off = 0; ret == 0 && off < n / BLOCK_SIZE; ) {
+                blk_t pblk, got;
+                if (block_alloc(goal, n / BLOCK_SIZE - off, &pblk, &got) < 0) {
+                    ret = -ENOSPC;
+                    break;
+                }
+                ret = write_raw_blocks(pblk, got, frame_payload() + off * BLOCK_SIZE);
+                if (ret == 0) {
+                    ret = blockmap_insert(&map, ext[e].lblk + done + off, pblk, got, ext[e].gen);
+                }
+                if (ret < 0) block_free(pblk, got);
+                goal = pblk + got;
+                off += got;
+            }
+            done += n / BLOCK_SIZE;
+            *blocks += n / BLOCK_SIZE;
+        }
+    }
+    free(ext);
+
+    // Extents written before since take their blocks from the replica
+    if (ret == 0) ret = storage_install_map(idx, &map, since);
+    if (ret < 0) {
+        // Blocks stored so far are simply never referenced
+        fprintf(stderr, "[TOOL] Cannot restore inode %d: %s\n", idx, strerror(-ret));
+    }
+    blockmap_free(&map);
+    return ret;
+}
+
+static int do_apply(const char *in) {
+    int fd = open(in, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", in, strerror(errno));
+        return -errno;
+    }
+
+    off_t pos = 0;
+    uint32_t type;
+    size_t size;
+    int ret = get_frame(fd, &pos, &type, &size);
+    backup_header_t hdr;
+    if (ret == 0 && (type != FRAME_HEADER || size != sizeof(hdr))) ret = -EINVAL;
+    if (ret == 0) {
+        memcpy(&hdr, frame_payload(), sizeof(hdr));
+        if (hdr.magic != BACKUP_MAGIC || hdr.version != BACKUP_VERSION ||
+            hdr.quota_count > MAX_QUOTAS) {
+            ret = -EINVAL;
+        }
+    }
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] %s is not an EVFS backup\n", in);
+        close(fd);
+        return ret;
+    }
+
+    // The replica must be exactly where the previous backup left it
+    hdr.cipher[sizeof(hdr.cipher) - 1] = '\0';
+    if (strcmp(hdr.cipher, evfs_crypto_engine_name()) != 0) {
+        fprintf(stderr, "[TOOL] Backup was written with %s, the file system uses %s\n",
+                hdr.cipher, evfs_crypto_engine_name());
+        ret = -EINVAL;
+    } else if (storage_generation() != hdr.since + 1) {
+        fprintf(stderr, "[TOOL] Backup holds the changes after generation %lu; this file "
+                "system is at %lu\n", (unsigned long)hdr.since,
+                (unsigned long)storage_generation() - 1);
+        ret = -ESTALE;
+    }
+    for (int i = 0; i < MAX_FILES && ret == 0; i++) {
+        block_map_t map;
+        if (!file_table[i].is_used || storage_copy_map(i, &map) < 0) continue;
+        if (map.changed > hdr.since) {
+            fprintf(stderr, "[TOOL] This file system was changed after its last restore\n");
+            ret = -ESTALE;
+        }
+        blockmap_free(&map);
+    }
+    if (ret < 0) {
+        close(fd);
+        return ret;
+    }
+
+    // Freed blocks stay untouched until the new metadata is saved, so a
+    // failed run leaves the replica as it was
+    block_allocator_track(1);
+
+    static file_metadata_t files[MAX_FILES];
+    static dentry_t names[MAX_DENTRIES];
+    unsigned char restore[MAX_FILES] = { 0 };
+    int name_count = 0;
+    uint64_t nfiles = 0, blocks = 0;
+    memset(files, 0, sizeof(files));
+    int done = 0;
+    while (ret == 0 && !done) {
+        ret = get_frame(fd, &pos, &type, &size);
+        if (ret < 0) break;
+        switch (type) {
+        case FRAME_FILE:
+            ret = apply_file(fd, &pos, hdr.since, size, files, restore, &blocks);
+            nfiles++;
+            break;
+        case FRAME_NAMES: {
+            const backup_name_t *n = (const backup_name_t *)frame_payload();
+            if (size % sizeof(*n) != 0) {
+                ret = -EINVAL;
+                break;
+            }
+            for (size_t k = 0; k < size / sizeof(*n) && ret == 0; k++) {
+                if (name_count == MAX_DENTRIES || n[k].dentry.inode < 0 ||
+                    n[k].dentry.inode >= MAX_FILES || !restore[n[k].dentry.inode]) {
+                    ret = -EINVAL;
+                    break;
+                }
+                // Slots are not kept across saves; the names go in free ones
+                names[name_count] = n[k].dentry;
+                if (dentry_seal(&names[name_count++], n[k].d, 0) != 0) ret = -EIO;
+            }
+            break;
+        }
+        case FRAME_END: {
+            const backup_end_t *end = (const backup_end_t *)frame_payload();
+            if (size != sizeof(*end) || end->files != nfiles || end->blocks != blocks) {
+                ret = -EINVAL;
+            }
+            done = 1;
+            break;
+        }
+        default:
+            ret = -EINVAL;
+        }
+    }
+    close(fd);
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] %s: %s\n", in,
+                ret == -EINVAL ? "damaged or truncated backup" : strerror(-ret));
+        return ret;
+    }
+
+    // Inodes deleted since go too
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (file_table[i].is_used && !hdr.used[i] && !restore[i]) {
+            delete_storage(i);
+            restore[i] = 1;
+        }
+    }
+    init_volumes(hdr.volumes);
+    init_quotas(hdr.quotas, hdr.quota_count);
+    ret = restore_metadata(files, restore, names, name_count);
+    if (ret < 0) {
+        fprintf(stderr, "[TOOL] Names do not match this file system\n");
+        return ret;
+    }
+
+    // The replica now stands where the source did after the backup
+    storage_set_generation(hdr.gen + 1);
+    storage_track_reset();
+    printf("[TOOL] Applied generation %lu (changes after %lu): %lu files, %lu blocks\n",
+           (unsigned long)hdr.gen, (unsigned long)hdr.since, (unsigned long)nfiles,
+           (unsigned long)blocks);
+    return 0;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Main
+ * ----------------------------------------------------------------------------
+ */
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s import SRC_DIR [EVFS_DIR] [options]\n", prog);
+    fprintf(stderr, "       %s export [EVFS_PATH] DEST_DIR [options]\n", prog);
+    fprintf(stderr, "       %s backup SINCE OUT_FILE [options]\n", prog);
+    fprintf(stderr, "       %s apply IN_FILE [options]\n", prog);
+    fprintf(stderr, "  -j N              Crypto/I/O threads (default: one per core)\n");
+    fprintf(stderr, "  --backing=F1,...  Backing files (as for evfs)\n");
+    fprintf(stderr, "  --meta=FILE       Metadata file (as for evfs)\n");
+    fprintf(stderr, "  --cipher=NAME     Cipher engine for a new file system\n");
+    fprintf(stderr, "  --direct-io       Bypass the page cache for the backing files\n");
+    fprintf(stderr, "  --volume=NAME:KEYFILE  Unlock a volume (as for evfs)\n");
+}
+
+// Open the file system the way a mount would, minus FUSE
+static int open_filesystem(void) {
+    if (evfs_crypto_init() != 0) {
+        return -1;
+    }
+
+    // Existing data must be read with the engine it was written with
+    static char stored[32];
+    if (stored_cipher(stored, sizeof(stored)) == 0) {
+        if (!evfs_options.cipher || strcmp(evfs_options.cipher, "auto") == 0) {
+            evfs_options.cipher = stored;
+        } else if (strcmp(evfs_options.cipher, stored) != 0) {
+            fprintf(stderr, "[TOOL] File system was written with %s, not %s\n",
+                    stored, evfs_options.cipher);
+            evfs_crypto_cleanup();
+            return -1;
+        }
+    }
+    if (evfs_crypto_select_engine(evfs_options.cipher) != 0) {
+        fprintf(stderr, "[TOOL] Failed to select cipher engine\n");
+        evfs_crypto_cleanup();
+        return -1;
+    }
+
+    // No background relocation while chunks are in flight
+    evfs_options.compact_rate_mb = 0;
+    init_filesystem();
+    // The tools walk the whole inode table
+    if (!initialized || inode_cache_load_all() < 0) {
+        evfs_crypto_cleanup();
+        return -1;
+    }
+    unlock_volumes_from_options();
+    return 0;
+}
+
+static void close_filesystem(int save) {
+    cleanup_snapshots();
+    if (save) {
+        if (save_metadata() < 0) failed = 1;
+    }
+    cleanup_storage();
+    evfs_crypto_cleanup();
+}
+
+// Turn an EVFS path argument into "/a/b" form (no trailing slash)
+static void normalize_path(const char *in, char *out, size_t len) {
+    snprintf(out, len, "%s%s", in[0] == '/' ? "" : "/", in);
+    size_t n = strlen(out);
+    while (n > 1 && out[n - 1] == '/') out[--n] = '\0';
+}
+
+int main(int argc, char *argv[]) {
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *args[3];
+    int nargs = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            nthreads = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--direct-io") == 0) {
+            evfs_options.direct_io = 1;
+        } else if (strncmp(argv[i], "--meta=", 7) == 0) {
+            evfs_options.metadata_file = argv[i] + 7;
+        } else if (strncmp(argv[i], "--cipher=", 9) == 0) {
+            evfs_options.cipher = argv[i] + 9;
+        } else if (strncmp(argv[i], "--volume=", 9) == 0) {
+            if (evfs_options.volume_count == MAX_VOLUMES) {
+                fprintf(stderr, "Too many volumes (max %d)\n", MAX_VOLUMES);
+                return 1;
+            }
+            evfs_options.volumes[evfs_options.volume_count++] = argv[i] + 9;
+        } else if (strncmp(argv[i], "--backing=", 10) == 0) {
+            for (char *path = strtok(argv[i] + 10, ","); path; path = strtok(NULL, ",")) {
+                if (evfs_options.backing_count == MAX_BACKING_FILES) {
+                    fprintf(stderr, "Too many backing files (max %d)\n", MAX_BACKING_FILES);
+                    return 1;
+                }
+                evfs_options.backing_files[evfs_options.backing_count++] = path;
+            }
+        } else if (argv[i][0] != '-' && nargs < 3) {
+            args[nargs++] = argv[i];
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (nargs >= 2 && (strcmp(args[0], "backup") == 0 || strcmp(args[0], "apply") == 0)) {
+        int backup = strcmp(args[0], "backup") == 0;
+        char *end;
+        uint64_t since = backup ? strtoull(args[1], &end, 10) : 0;
+        if (backup && (nargs != 3 || *end != '\0')) {
+            usage(argv[0]);
+            return 1;
+        }
+        if (open_filesystem() < 0) {
+            return 1;
+        }
+        int ret = backup ? do_backup(since, args[2]) : do_apply(args[1]);
+        // Nothing applied is kept unless the whole backup was
+        close_filesystem(ret == 0);
+        free(frame_buf);
+        if (failed) ret = -EIO;
+        if (ret < 0 && !backup) {
+            fprintf(stderr, "[TOOL] Apply failed; the file system is unchanged\n");
+        }
+        return ret < 0 ? 1 : 0;
+    }
+    if (nargs < 2 || (strcmp(args[0], "import") != 0 && strcmp(args[0], "export") != 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > TOOL_MAX_THREADS) nthreads = TOOL_MAX_THREADS;
+
+    exporting = strcmp(args[0], "export") == 0;
+    const char *host = exporting ? args[nargs - 1] : args[1];
+    char evfs_path[PATH_MAX];
+    normalize_path(nargs == 3 ? (exporting ? args[1] : args[2]) : "/", evfs_path, sizeof(evfs_path));
+    if (is_snapshot_path(evfs_path)) {
+        fprintf(stderr, "[TOOL] Snapshots only exist while mounted\n");
+        return 1;
+    }
+
+    if (open_filesystem() < 0) {
+        return 1;
+    }
+    chunk_bytes = TOOL_CHUNK_BLOCKS * storage_block_payload();
+
+    double start = now_sec();
+    int ret = exporting ? do_export(evfs_path, host) : do_import(host, evfs_path);
+    if (ret < 0) {
+        failed = 1;
+    } else {
+        run_jobs(nthreads);
+        if (exporting && !failed) finish_export();
+    }
+    double elapsed = now_sec() - start;
+
+    for (int f = 0; f < file_count; f++) {
+        if (exporting && !failed && fsync(files[f].fd) < 0) {
+            fprintf(stderr, "[TOOL] %s: %s\n", files[f].path, strerror(errno));
+            failed = 1;
+        }
+        close(files[f].fd);
+    }
+
+    // An import only becomes visible if every chunk made it
+    close_filesystem(!exporting && !failed);
+
+    if (failed) {
+        fprintf(stderr, "[TOOL] %s failed%s\n", exporting ? "Export" : "Import",
+                exporting ? "" : "; the file system is unchanged");
+        free(jobs);
+        return 1;
+    }
+
+    double mb = bytes_total / (1024.0 * 1024.0);
+    printf("[TOOL] %s %d files, %lu directories, %.1f MB in %.2f s (%.1f MB/s, %ld threads)\n",
+           exporting ? "Exported" : "Imported", file_count, dirs_done, mb, elapsed,
+           elapsed > 0 ? mb / elapsed : 0.0, nthreads);
+    free(jobs);
+    return 0;
+}
@@ -0,0 +1,167 @@
+#include "evfs.h"
+#include <pthread.h>
+
+/*
+ * ============================================================================
+ * TRACE MODULE - Recording the workload of a mount
+ * ============================================================================
+ *
+ * With --record=FILE every FUSE operation is appended to FILE as one
+ * fixed-size trace_record_t: operation, inode, offset, size, result, start
+ * time and latency. Data and names are not recorded. The trace starts with
+ * a TRACE_INODE record per inode that already exists, so a replay can set
+ * up the same files first (evfs-replay, evfs_replay.c).
+ *
+ * Records are collected in memory and written TRACE_BUFFER_RECORDS at a
+ * time. When not recording, an operation costs one flag test.
+ */
+
+#define TRACE_BUFFER_RECORDS 2048  // 64 KiB
+
+const char *const trace_op_names[TRACE_OPS] = {
+    "inode", "getattr", "readdir", "create", "open", "read", "write",
+    "truncate", "unlink", "mkdir", "rmdir", "rename", "link", "symlink",
+    "readlink", "utimens", "setxattr", "getxattr", "listxattr",
+    "removexattr", "statfs", "fsync",
+};
+
+static int recording = 0;
+static int trace_fd = -1;
+static uint64_t trace_epoch;  // CLOCK_MONOTONIC ns when recording began
+static trace_record_t trace_buf[TRACE_BUFFER_RECORDS];
+static int trace_fill = 0;
+static uint64_t trace_count = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Write out the buffered records. Caller holds trace_lock
+static int flush_records(void) {
+    size_t len = trace_fill * sizeof(trace_record_t);
+    const char *p = (const char *)trace_buf;
+    while (len > 0) {
+        ssize_t n = write(trace_fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    trace_fill = 0;
+    return 0;
+}
+
+// Caller holds trace_lock
+static void add_record(const trace_record_t *rec) {
+    if (trace_fd < 0) return;
+    trace_buf[trace_fill++] = *rec;
+    trace_count++;
+    if (trace_fill == TRACE_BUFFER_RECORDS && flush_records() < 0) {
+        // Keep the mount going; the trace just ends here
+        fprintf(stderr, "[TRACE] Cannot write the trace: %s; recording stopped\n",
+                strerror(errno));
+        __atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+        close(trace_fd);
+        trace_fd = -1;
+    }
+}
+
+int trace_start(const char *path) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "[TRACE] Cannot create %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+    trace_header_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.record_size = sizeof(trace_record_t);
+    hdr.started = time(NULL);
+    snprintf(hdr.cipher, sizeof(hdr.cipher), "%s", evfs_crypto_engine_name());
+    if (write(fd, &hdr, sizeof(hdr)) != (ssize_t)sizeof(hdr)) {
+        fprintf(stderr, "[TRACE] Cannot write %s\n", path);
+        close(fd);
+        return -EIO;
+    }
+
+    // Every inode, loaded or not, and none dropped while they are listed
+    inode_cache_enter();
+    inode_cache_load_all();
+    pthread_mutex_lock(&trace_lock);
+    trace_fd = fd;
+    trace_fill = 0;
+    trace_count = 0;
+    trace_epoch = now_ns();
+
+    // What a replay has to create before the first operation
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!file_table[i].is_used) continue;
+        trace_record_t rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.op = TRACE_INODE;
+        rec.inode = i;
+        rec.offset = file_table[i].size;
+        rec.size = file_table[i].type;
+        add_record(&rec);
+    }
+    __atomic_store_n(&recording, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&trace_lock);
+    inode_cache_leave();
+
+    printf("[TRACE] Recording operations to %s\n", path);
+    return 0;
+}
+
+void trace_stop(void) {
+    pthread_mutex_lock(&trace_lock);
+    __atomic_store_n(&recording, 0, __ATOMIC_RELAXED);
+    if (trace_fd >= 0) {
+        if (flush_records() < 0 || fsync(trace_fd) < 0) {
+            fprintf(stderr, "[TRACE] Cannot write the trace: %s\n", strerror(errno));
+        }
+        close(trace_fd);
+        trace_fd = -1;
+        printf("[TRACE] Recorded %lu operations\n", (unsigned long)trace_count);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_begin(trace_call_t *call, const char *path) {
+    if (!__atomic_load_n(&recording, __ATOMIC_RELAXED)) {
+        call->start_ns = 0;
+        return;
+    }
+    // Resolved now: unlink and rename make the path useless afterwards
+    call->inode = find_file_by_path(path);
+    call->start_ns = now_ns();
+}
+
+void trace_end(const trace_call_t *call, trace_op_t op, const char *path,
+               size_t size, off_t offset, int result) {
+    if (call->start_ns == 0) return;
+    uint64_t end = now_ns();
+
+    trace_record_t rec;
+    memset(&rec, 0, sizeof(rec));
+    rec.op = op;
+    rec.size = size;
+    rec.offset = offset;
+    rec.result = result;
+    rec.latency_us = (end - call->start_ns) / 1000;
+    // New names (create, mkdir, link, ...) only resolve afterwards
+    rec.inode = call->inode >= 0 ? call->inode : find_file_by_path(path);
+    if (rec.inode >= 0 && !file_table[rec.inode].is_used) {
+        rec.flags |= TRACE_GONE;
+    }
+
+    pthread_mutex_lock(&trace_lock);
+    rec.time_ns = call->start_ns - trace_epoch;
+    add_record(&rec);
+    pthread_mutex_unlock(&trace_lock);
+}
@@ -0,0 +1,286 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <pthread.h>
+
+/*
+ * ============================================================================
+ * VOLUME MODULE - Per-tenant keys in one backing store
+ * ============================================================================
+ *
+ * A volume is a top-level directory whose subtree is encrypted with its
+ * own key, derived from the volume's passphrase. Every inode records its
+ * volume (inherited from its parent directory) and its block map id
+ * carries the volume in its top bits, which is what picks the key for
+ * each block; blocks, the allocator, snapshots and compaction stay shared.
+ *
+ * Unlocking a volume adds its key to the keyring (creating the volume the
+ * first time); locking removes it again. While a volume is locked its
+ * names stay visible but contents, symlink targets and xattrs cannot be
+ * used (ENOKEY). Only a check value of the key is stored, never the key.
+ *
+ * Volumes are managed through xattrs on the root directory:
+ *   VOLUME_XATTR_PREFIX "<name>"
+ *     set:    the passphrase; unlocks (creates) the volume
+ *     get:    "<id> locked" or "<id> unlocked"
+ *     remove: locks the volume
+ */
+
+static volume_t volumes[MAX_VOLUMES];
+static pthread_mutex_t volume_table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void init_volumes(const volume_t *saved) {
+    pthread_mutex_lock(&volume_table_lock);
+    for (uint32_t v = 1; v < MAX_VOLUMES; v++) {
+        evfs_crypto_remove_key(v);
+    }
+    memset(volumes, 0, sizeof(volumes));
+    if (saved) {
+        memcpy(volumes, saved, sizeof(volumes));
+    }
+    pthread_mutex_unlock(&volume_table_lock);
+}
+
+void export_volumes(volume_t *out) {
+    pthread_mutex_lock(&volume_table_lock);
+    memcpy(out, volumes, sizeof(volumes));
+    pthread_mutex_unlock(&volume_table_lock);
+}
+
+// Volume id for a name, or 0. Caller holds volume_table_lock
+static uint32_t find_volume(const char *name) {
+    for (uint32_t v = 1; v < MAX_VOLUMES; v++) {
+        if (volumes[v].is_used && strcmp(volumes[v].name, name) == 0) {
+            return v;
+        }
+    }
+    return 0;
+}
+
+static int valid_name(const char *name) {
+    return name[0] != '\0' && !strchr(name, '/') && strcmp(name, ".") != 0 &&
+           strcmp(name, "..") != 0 && strcmp(name, SNAPSHOT_DIR + 1) != 0 &&
+           strlen(name) < VOLUME_NAME_MAX;
+}
+
+// Create the volume's top-level directory. Caller holds metadata_lock()
+// and volume_table_lock
+static int create_volume_root(const char *name, uint32_t volume) {
+    char path[VOLUME_NAME_MAX + 1];
+    snprintf(path, sizeof(path), "/%s", name);
+    if (find_file_by_path(path) != -1) {
+        return -EEXIST;  // existing data cannot be re-keyed in place
+    }
+
+    int idx = find_free_slot();
+    if (idx == -1) {
+        return -ENOSPC;
+    }
+    int ret = quota_charge(file_table[0].uid, file_table[0].gid, 0, 1);
+    if (ret < 0) {
+        return ret;
+    }
+
+    time_t now = time(NULL);
+    memset(&file_table[idx], 0, sizeof(file_metadata_t));
+    file_table[idx].type = FTYPE_DIR;
+    file_table[idx].mode = 0700;
+    file_table[idx].uid = file_table[0].uid;
+    file_table[idx].gid = file_table[0].gid;
+    file_table[idx].atime = file_table[idx].mtime = file_table[idx].ctime = now;
+    file_table[idx].size = BLOCK_SIZE;
+    file_table[idx].is_used = 1;
+    file_table[idx].nlink = 2;
+    file_table[idx].volume = volume;
+
+    ret = dentry_add(path, idx);
+    if (ret < 0) {
+        file_table[idx].is_used = 0;
+        quota_account(file_table[0].uid, file_table[0].gid, 0, -1);
+        return ret;
+    }
+    storage_assign_volume(idx, volume);
+    return 0;
+}
+
+int volume_unlock(const char *name, const char *passphrase) {
+    if (!valid_name(name)) {
+        return -EINVAL;
+    }
+
+    // A new volume gets a directory: the metadata lock comes first
+    metadata_lock();
+    pthread_mutex_lock(&volume_table_lock);
+    uint32_t v = find_volume(name);
+    if (v != 0) {
+        metadata_unlock();
+        if (evfs_crypto_has_key(v)) {
+            pthread_mutex_unlock(&volume_table_lock);
+            return 0;
+        }
+        int ret = evfs_crypto_add_key(v, passphrase, volumes[v].salt, volumes[v].key_check, 1);
+        pthread_mutex_unlock(&volume_table_lock);
+        if (ret < 0) {
+            printf("[VOLUME] Cannot unlock '%s': %s\n", name,
+                   ret == -2 ? "wrong passphrase" : "key derivation failed");
+            return ret == -2 ? -EKEYREJECTED : -EIO;
+        }
+        printf("[VOLUME] Unlocked volume '%s' (id %u)\n", name, v);
+        reencrypt_wake();
+        return 0;
+    }
+
+    // New volume: fresh salt, key and top-level directory
+    for (v = 1; v < MAX_VOLUMES && volumes[v].is_used; v++);
+    if (v == MAX_VOLUMES) {
+        pthread_mutex_unlock(&volume_table_lock);
+        metadata_unlock();
+        return -ENOSPC;
+    }
+    volume_t *vol = &volumes[v];
+    memset(vol, 0, sizeof(*vol));
+    int ret = evfs_crypto_random(vol->salt, sizeof(vol->salt)) == 0 ? 0 : -EIO;
+    if (ret == 0 && evfs_crypto_add_key(v, passphrase, vol->salt, vol->key_check, 0) != 0) {
+        ret = -EIO;
+    }
+    if (ret == 0) {
+        ret = create_volume_root(name, v);
+        if (ret < 0) evfs_crypto_remove_key(v);
+    }
+    if (ret == 0) {
+        strcpy(vol->name, name);
+        vol->is_used = 1;
+    }
+    pthread_mutex_unlock(&volume_table_lock);
+    metadata_unlock();
+
+    if (ret < 0) {
+        printf("[VOLUME] Cannot create volume '%s': %s\n", name, strerror(-ret));
+        return ret;
+    }
+    printf("[VOLUME] Created volume '%s' (id %u)\n", name, v);
+    return 0;
+}
+
+int volume_lock(const char *name) {
+    pthread_mutex_lock(&volume_table_lock);
+    uint32_t v = find_volume(name);
+    int locked = v != 0 && !evfs_crypto_has_key(v);
+    pthread_mutex_unlock(&volume_table_lock);
+    if (v == 0) {
+        return -ENODATA;
+    }
+    if (locked) {
+        return 0;
+    }
+
+    // Nothing decrypted with the key may outlive it
+    seal_volume_inodes(v);
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (file_table[i].is_used && file_table[i].volume == v) {
+            xattr_uncache(i);
+        }
+    }
+    evfs_crypto_remove_key(v);
+    printf("[VOLUME] Locked volume '%s' (id %u)\n", name, v);
+    return 0;
+}
+
+void unlock_volumes_from_options(void) {
+    for (int i = 0; i < evfs_options.volume_count; i++) {
+        const char *spec = evfs_options.volumes[i];
+        const char *colon = strchr(spec, ':');
+        char name[VOLUME_NAME_MAX];
+        if (!colon || (size_t)(colon - spec) >= sizeof(name)) {
+            fprintf(stderr, "[VOLUME] Bad --volume '%s' (expected NAME:KEYFILE)\n", spec);
+            continue;
+        }
+        memcpy(name, spec, colon - spec);
+        name[colon - spec] = '\0';
+
+        // The passphrase is the key file's first line
+        char passphrase[256];
+        FILE *f = fopen(colon + 1, "r");
+        if (!f || !fgets(passphrase, sizeof(passphrase), f)) {
+            fprintf(stderr, "[VOLUME] Cannot read key file %s\n", colon + 1);
+            if (f) fclose(f);
+            continue;
+        }
+        fclose(f);
+        passphrase[strcspn(passphrase, "\r\n")] = '\0';
+
+        volume_unlock(name, passphrase);
+        memset(passphrase, 0, sizeof(passphrase));
+    }
+}
+
+int volume_check(const file_metadata_t *meta) {
+    if (meta->volume != 0 && !evfs_crypto_has_key(meta->volume)) {
+        return -ENOKEY;
+    }
+    // A live inode is about to be used; a snapshot's copy is unsealed
+    // by the snapshot module
+    if (meta >= file_table && meta < file_table + MAX_FILES) {
+        inode_load(meta - file_table);
+    }
+    return 0;
+}
+
+int is_volume_root(int file_idx) {
+    if (file_idx <= 0 || file_idx >= MAX_FILES || file_table[file_idx].volume == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&volume_table_lock);
+    uint32_t v = file_table[file_idx].volume;
+    char path[VOLUME_NAME_MAX + 1];
+    snprintf(path, sizeof(path), "/%s", volumes[v % MAX_VOLUMES].name);
+    pthread_mutex_unlock(&volume_table_lock);
+    return find_file_by_path(path) == file_idx;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Management through xattrs on the root directory
+ * ----------------------------------------------------------------------------
+ */
+
+int is_volume_xattr(const char *name) {
+    return strncmp(name, VOLUME_XATTR_PREFIX, strlen(VOLUME_XATTR_PREFIX)) == 0;
+}
+
+int volume_setxattr(const char *name, const char *value, size_t size) {
+    char passphrase[256];
+    if (size == 0 || size >= sizeof(passphrase)) {
+        return -EINVAL;
+    }
+    memcpy(passphrase, value, size);
+    passphrase[size] = '\0';
+
+    int ret = volume_unlock(name + strlen(VOLUME_XATTR_PREFIX), passphrase);
+    memset(passphrase, 0, sizeof(passphrase));
+    return ret;
+}
+
+int volume_getxattr(const char *name, char *value, size_t size) {
+    pthread_mutex_lock(&volume_table_lock);
+    uint32_t v = find_volume(name + strlen(VOLUME_XATTR_PREFIX));
+    pthread_mutex_unlock(&volume_table_lock);
+    if (v == 0) {
+        return -ENODATA;
+    }
+
+    char buf[32];
+    int len = snprintf(buf, sizeof(buf), "%u %s", v,
+                       evfs_crypto_has_key(v) ? "unlocked" : "locked");
+    if (size == 0) {
+        return len;
+    }
+    if ((size_t)len > size) {
+        return -ERANGE;
+    }
+    memcpy(value, buf, len);
+    return len;
+}
+
+int volume_removexattr(const char *name) {
+    return volume_lock(name + strlen(VOLUME_XATTR_PREFIX));
+}
@@ -0,0 +1,678 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <pthread.h>
+#include <limits.h>
+
+/*
+ * ============================================================================
+ * WRITE-AHEAD LOG - Atomic, grouped commits of metadata changes
+ * ============================================================================
+ *
+ * The metadata file is only rewritten at unmount and at checkpoints. In
+ * between, what changed (inodes, names, block maps, quota limits, volumes)
+ * is appended to the log as one record per commit, and the log is fsynced
+ * once per record. Mounting replays the records newer than the metadata
+ * file and stops at the first torn one, so a crash loses at most the
+ * commit in progress and never leaves half of one.
+ *
+ * Block contents are not logged. Blocks the last commit references are
+ * never overwritten in place (write_map() writes a copy, which the next
+ * commit switches to) and never reused before the next commit has ended
+ * (block_allocator_track()), so after a crash every map points at exactly
+ * the data of its commit. One commit costs one fsync per backing file
+ * (for the data it references) plus one of the log.
+ *
+ * A background thread commits every evfs_options.commit_ms. wal_sync()
+ * (fsync, O_SYNC writes) asks for a commit and waits for it; everyone
+ * waiting at that moment shares the one commit.
+ *
+ * With --lazytime an inode whose only change is to its timestamps (reads
+ * updating atime, utimens) is left out of background commits; it stays
+ * different from what was logged, so a later commit picks it up: one that
+ * logs the inode for another reason, one serving wal_sync(), the last one
+ * before unmount, or the first after WAL_LAZYTIME_MS.
+ */
+
+typedef struct {
+    uint64_t magic;
+    uint64_t seq;
+    uint64_t size;          // whole record, checksum included
+    uint64_t next_map_id;
+    uint64_t alloc_end;
+    uint32_t inode_count;
+    uint32_t dentry_count;
+    uint32_t quota_count;   // WAL_UNCHANGED: quota limits did not change
+    uint32_t volume_count;  // 0, or MAX_VOLUMES when the table changed
+} wal_header_t;
+
+#define WAL_UNCHANGED UINT32_MAX
+
+// An inode and, unless extent_count is WAL_UNCHANGED, its whole block map
+typedef struct {
+    uint32_t idx;
+    uint32_t extent_count;
+    uint64_t map_id;
+    uint32_t old_engine;    // re-encryption progress (see block_map_t)
+    uint32_t pad;
+    uint64_t reencrypted;
+    uint64_t changed;       // change generation (changed-block tracking)
+    file_metadata_t meta;   // inline areas sealed, as in the metadata file
+} wal_inode_t;
+
+typedef struct {
+    uint32_t d;
+    uint32_t pad;
+    dentry_t dentry;        // is_used = 0: the name was removed
+} wal_dentry_t;
+
+// What the last commit wrote, to find what changed since
+static file_metadata_t logged_files[MAX_FILES];
+static dentry_t logged_dentries[MAX_DENTRIES];
+static quota_limit_t logged_quotas[MAX_QUOTAS];
+static int logged_quota_count = 0;
+static volume_t logged_volumes[MAX_VOLUMES];
+
+static int wal_fd = -1;
+static off_t wal_size = 0;
+static uint64_t wal_seq = 0;        // last record written or replayed
+static unsigned long commit_count = 0;
+static unsigned long checkpoint_count = 0;
+static unsigned long deferred_count = 0;   // timestamp-only inodes left out
+static struct timespec times_logged;      // last commit that logged them all
+static struct timespec last_checkpoint;
+static int checkpoint_due = 0;      // changed pages keep the inode cache too full
+static pthread_mutex_t commit_lock = PTHREAD_MUTEX_INITIALIZER;  // one commit at a time
+
+static pthread_t committer;
+static int wal_running = 0;
+static uint64_t sync_requested = 0; // tickets handed out by wal_sync()
+static uint64_t sync_done = 0;      // tickets the last finished commit covers
+static int sync_result = 0;
+static pthread_mutex_t wal_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wal_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wal_done = PTHREAD_COND_INITIALIZER;
+
+const char *wal_path(void) {
+    static char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s%s", metadata_path(), WAL_SUFFIX);
+    return path;
+}
+
+uint64_t wal_last_seq(void) {
+    return wal_seq;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Replay
+ * ----------------------------------------------------------------------------
+ */
+
+// Bounds-checked cursor over a record
+static const void *take(const char **pos, const char *end, size_t len) {
+    if ((size_t)(end - *pos) < len) return NULL;
+    const void *p = *pos;
+    *pos += len;
+    return p;
+}
+
+// Check that a record's entries are well formed before touching the image
+static int record_valid(const wal_header_t *hdr, const char *pos, const char *end) {
+    for (uint32_t r = 0; r < hdr->inode_count; r++) {
+        const wal_inode_t *ino = take(&pos, end, sizeof(*ino));
+        if (!ino || ino->idx >= MAX_FILES) return 0;
+        if (ino->extent_count != WAL_UNCHANGED &&
+            !take(&pos, end, (size_t)ino->extent_count * sizeof(extent_t))) {
+            return 0;
+        }
+    }
+    for (uint32_t r = 0; r < hdr->dentry_count; r++) {
+        const wal_dentry_t *ent = take(&pos, end, sizeof(*ent));
+        if (!ent || ent->d >= MAX_DENTRIES ||
+            (ent->dentry.is_used && (ent->dentry.inode < 0 || ent->dentry.inode >= MAX_FILES ||
+                                     ent->dentry.parent >= MAX_FILES))) {
+            return 0;
+        }
+    }
+    if (hdr->quota_count != WAL_UNCHANGED &&
+        (hdr->quota_count > MAX_QUOTAS ||
+         !take(&pos, end, hdr->quota_count * sizeof(quota_limit_t)))) {
+        return 0;
+    }
+    if (hdr->volume_count != 0 &&
+        (hdr->volume_count != MAX_VOLUMES ||
+         !take(&pos, end, MAX_VOLUMES * sizeof(volume_t)))) {
+        return 0;
+    }
+    return pos == end;
+}
+
+static int apply_record(metadata_image_t *img, const wal_header_t *hdr,
+                        const char *pos, const char *end) {
+    for (uint32_t r = 0; r < hdr->inode_count; r++) {
+        const wal_inode_t *ino = take(&pos, end, sizeof(*ino));
+        img->files[ino->idx] = ino->meta;
+        img->sealed[ino->idx] = ino->meta.is_used;  // logged sealed
+
+        block_map_t *map = &img->maps[ino->idx];
+        if (ino->extent_count == WAL_UNCHANGED) {
+            map->id = ino->map_id;
+            map->old_engine = ino->old_engine;
+            map->reencrypted = ino->reencrypted;
+            map->changed = ino->changed;
+            continue;
+        }
+        const extent_t *ext = take(&pos, end, (size_t)ino->extent_count * sizeof(extent_t));
+        blockmap_free(map);
+        blockmap_init(map, ino->map_id);
+        map->old_engine = ino->old_engine;
+        map->reencrypted = ino->reencrypted;
+        map->changed = ino->changed;
+        // A slot without an inode owns no blocks (its map may have been
+        // captured a moment before the inode was)
+        if (ino->extent_count == 0 || !ino->meta.is_used) continue;
+        map->extents = malloc(ino->extent_count * sizeof(extent_t));
+        if (!map->extents) return -ENOMEM;
+        memcpy(map->extents, ext, ino->extent_count * sizeof(extent_t));
+        map->count = map->capacity = ino->extent_count;
+    }
+    for (uint32_t r = 0; r < hdr->dentry_count; r++) {
+        const wal_dentry_t *ent = take(&pos, end, sizeof(*ent));
+        img->dentries[ent->d] = ent->dentry;
+        img->names_sealed[ent->d] = ent->dentry.is_used;  // logged sealed
+    }
+    if (hdr->quota_count != WAL_UNCHANGED) {
+        const quota_limit_t *limits = take(&pos, end, hdr->quota_count * sizeof(quota_limit_t));
+        memcpy(img->quotas, limits, hdr->quota_count * sizeof(quota_limit_t));
+        img->quota_count = hdr->quota_count;
+    }
+    if (hdr->volume_count != 0) {
+        memcpy(img->volumes, take(&pos, end, sizeof(img->volumes)), sizeof(img->volumes));
+    }
+    img->next_map_id = hdr->next_map_id;
+    img->alloc_end = hdr->alloc_end;
+    img->wal_seq = hdr->seq;
+    return 0;
+}
+
+int wal_replay(metadata_image_t *img) {
+    wal_seq = img->wal_seq;
+
+    FILE *f = fopen(wal_path(), "rb");
+    if (!f) {
+        return 0;
+    }
+    char *data = NULL;
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0 && (size = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0) {
+        data = malloc(size > 0 ? size : 1);
+        if (data && fread(data, 1, size, f) != (size_t)size) {
+            free(data);
+            data = NULL;
+        }
+    }
+    fclose(f);
+    if (!data) {
+        fprintf(stderr, "[WAL] Cannot read %s\n", wal_path());
+        return -EIO;
+    }
+
+    int applied = 0;
+    const char *pos = data;
+    const char *end = data + size;
+    while (pos < end) {
+        // A record counts only if it is whole, intact and the next in line
+        const wal_header_t *hdr = (const wal_header_t *)pos;
+        unsigned char sum[EVFS_CHECKSUM_LEN];
+        if ((size_t)(end - pos) < sizeof(*hdr) || hdr->magic != WAL_MAGIC ||
+            hdr->size < sizeof(*hdr) + EVFS_CHECKSUM_LEN || hdr->size > (uint64_t)(end - pos) ||
+            evfs_checksum(pos, hdr->size - EVFS_CHECKSUM_LEN, sum) != 0 ||
+            memcmp(sum, pos + hdr->size - EVFS_CHECKSUM_LEN, EVFS_CHECKSUM_LEN) != 0) {
+            break;
+        }
+        const char *body = pos + sizeof(*hdr);
+        const char *body_end = pos + hdr->size - EVFS_CHECKSUM_LEN;
+        pos += hdr->size;
+        if (hdr->seq <= img->wal_seq) {
+            continue;  // already in the metadata file
+        }
+        if (hdr->seq != img->wal_seq + 1 || !record_valid(hdr, body, body_end)) {
+            break;
+        }
+        int ret = apply_record(img, hdr, body, body_end);
+        if (ret < 0) {
+            free(data);
+            return ret;
+        }
+        applied++;
+    }
+    if (pos < end) {
+        printf("[WAL] Ignored %ld byte(s) after the last complete record\n", (long)(end - pos));
+    }
+    free(data);
+
+    wal_seq = img->wal_seq;
+    if (applied > 0) {
+        printf("[WAL] Replayed %d record(s) from %s (now at %llu)\n",
+               applied, wal_path(), (unsigned long long)wal_seq);
+    }
+    return applied;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Commits
+ * ----------------------------------------------------------------------------
+ */
+
+// Make the log empty and durable
+static int wal_reset(void) {
+    if (ftruncate(wal_fd, 0) != 0 || fsync(wal_fd) != 0) {
+        return -EIO;
+    }
+    wal_size = 0;
+    return 0;
+}
+
+// Inodes of absent pages keep what was logged before they were dropped
+static void remember(const metadata_image_t *img) {
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (!img->absent[INODE_PAGE(i)]) logged_files[i] = img->files[i];
+    }
+    memcpy(logged_dentries, img->dentries, sizeof(logged_dentries));
+    memcpy(logged_quotas, img->quotas, sizeof(logged_quotas));
+    logged_quota_count = img->quota_count;
+    memcpy(logged_volumes, img->volumes, sizeof(logged_volumes));
+}
+
+// Write the whole state as the metadata file and empty the log
+static int checkpoint(metadata_image_t *img) {
+    metadata_image_t *copy = malloc(sizeof(*copy));
+    if (!copy) {
+        return -ENOMEM;
+    }
+    img->quota_count = export_quotas(img->quotas, MAX_QUOTAS);
+    export_volumes(img->volumes);
+    memcpy(copy, img, sizeof(*copy));  // unsealed, to compare later commits with
+
+    int ret = storage_sync();
+    if (ret == 0) {
+        img->wal_seq = wal_seq;
+        ret = save_metadata_image(img);
+    }
+    if (ret == 0 && wal_reset() < 0) {
+        // Harmless: the metadata file now covers every record in the log
+        fprintf(stderr, "[WAL] Cannot empty %s\n", wal_path());
+    }
+    if (ret == 0) {
+        remember(copy);
+        checkpoint_count++;
+    }
+    free(copy);
+    return ret;
+}
+
+// Serialise what differs from the last commit. Returns the record size,
+// 0 if nothing changed, or -ENOMEM
+static ssize_t build_record(const metadata_image_t *img, const unsigned char *changed,
+                            char **out) {
+    size_t size = sizeof(wal_header_t) + EVFS_CHECKSUM_LEN;
+    uint32_t inode_count = 0, dentry_count = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        // An absent page's slots are empty here, not deleted
+        if (img->absent[INODE_PAGE(i)]) continue;
+        if (changed[i] || memcmp(&img->files[i], &logged_files[i], sizeof(file_metadata_t)) != 0) {
+            size += sizeof(wal_inode_t) + (changed[i] ? img->maps[i].count * sizeof(extent_t) : 0);
+            inode_count++;
+        }
+    }
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (memcmp(&img->dentries[d], &logged_dentries[d], sizeof(dentry_t)) != 0) {
+            size += sizeof(wal_dentry_t);
+            dentry_count++;
+        }
+    }
+    int quotas_changed = img->quota_count != logged_quota_count ||
+        memcmp(img->quotas, logged_quotas, img->quota_count * sizeof(quota_limit_t)) != 0;
+    int volumes_changed = memcmp(img->volumes, logged_volumes, sizeof(logged_volumes)) != 0;
+    if (inode_count == 0 && dentry_count == 0 && !quotas_changed && !volumes_changed) {
+        return 0;
+    }
+    if (quotas_changed) size += img->quota_count * sizeof(quota_limit_t);
+    if (volumes_changed) size += sizeof(img->volumes);
+
+    char *data = calloc(1, size);
+    if (!data) {
+        return -ENOMEM;
+    }
+    wal_header_t *hdr = (wal_header_t *)data;
+    hdr->magic = WAL_MAGIC;
+    hdr->seq = wal_seq + 1;
+    hdr->size = size;
+    hdr->next_map_id = img->next_map_id;
+    hdr->alloc_end = img->alloc_end;
+    hdr->inode_count = inode_count;
+    hdr->dentry_count = dentry_count;
+    hdr->quota_count = quotas_changed ? (uint32_t)img->quota_count : WAL_UNCHANGED;
+    hdr->volume_count = volumes_changed ? MAX_VOLUMES : 0;
+
+    char *pos = data + sizeof(*hdr);
+    for (int i = 0; i < MAX_FILES; i++) {
+        if (img->absent[INODE_PAGE(i)] ||
+            (!changed[i] && memcmp(&img->files[i], &logged_files[i], sizeof(file_metadata_t)) == 0)) {
+            continue;
+        }
+        wal_inode_t *ino = (wal_inode_t *)pos;
+        ino->idx = i;
+        ino->extent_count = changed[i] ? (uint32_t)img->maps[i].count : WAL_UNCHANGED;
+        ino->map_id = img->maps[i].id;
+        ino->old_engine = img->maps[i].old_engine;
+        ino->pad = 0;
+        ino->reencrypted = img->maps[i].reencrypted;
+        ino->changed = img->maps[i].changed;
+        ino->meta = img->files[i];
+        if (ino->meta.is_used && !img->sealed[i] &&
+            inode_seal(&ino->meta, ino->map_id, ino->old_engine, 1) != 0) {
+            free(data);
+            return -EIO;
+        }
+        pos += sizeof(*ino);
+        if (changed[i]) {
+            memcpy(pos, img->maps[i].extents, img->maps[i].count * sizeof(extent_t));
+            pos += img->maps[i].count * sizeof(extent_t);
+        }
+    }
+    for (int d = 0; d < MAX_DENTRIES; d++) {
+        if (memcmp(&img->dentries[d], &logged_dentries[d], sizeof(dentry_t)) == 0) continue;
+        wal_dentry_t *ent = (wal_dentry_t *)pos;
+        ent->d = d;
+        ent->dentry = img->dentries[d];
+        if (!img->names_sealed[d] && dentry_seal(&ent->dentry, d, 1) != 0) {
+            free(data);
+            return -EIO;
+        }
+        pos += sizeof(*ent);
+    }
+    if (quotas_changed) {
+        memcpy(pos, img->quotas, img->quota_count * sizeof(quota_limit_t));
+        pos += img->quota_count * sizeof(quota_limit_t);
+    }
+    if (volumes_changed) {
+        memcpy(pos, img->volumes, sizeof(img->volumes));
+        pos += sizeof(img->volumes);
+    }
+    if (evfs_checksum(data, pos - data, (unsigned char *)pos) != 0) {
+        free(data);
+        return -EIO;
+    }
+    *out = data;
+    return size;
+}
+
+// Append a record and make it durable
+static int append_record(const char *data, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = pwrite(wal_fd, data + done, size - done, wal_size + done);
+        if (n < 0) {
+            return -EIO;  // the torn tail is overwritten by the next record
+        }
+        done += n;
+    }
+    if (fdatasync(wal_fd) != 0) {
+        return -EIO;
+    }
+    wal_size += size;
+    return 0;
+}
+
+/*
+ * Leave timestamp-only changes out of this commit (--lazytime): give such
+ * inodes in the captured image their logged timestamps back, so the
+ * record skips them and remember() keeps them pending. Returns how many
+ */
+static int defer_times(metadata_image_t *img, const unsigned char *changed) {
+    int deferred = 0;
+    for (int i = 0; i < MAX_FILES; i++) {
+        file_metadata_t *meta = &img->files[i];
+        const file_metadata_t *logged = &logged_files[i];
+        if (img->absent[INODE_PAGE(i)] || changed[i] || !meta->is_used || !logged->is_used ||
+            (meta->atime == logged->atime && meta->mtime == logged->mtime &&
+             meta->ctime == logged->ctime)) {
+            continue;
+        }
+        file_metadata_t times = *meta;
+        times.atime = logged->atime;
+        times.mtime = logged->mtime;
+        times.ctime = logged->ctime;
+        if (memcmp(&times, logged, sizeof(times)) == 0) {
+            *meta = times;
+            deferred++;
+        }
+    }
+    return deferred;
+}
+
+/*
+ * One commit: capture the state, make the data it references durable,
+ * then the record describing it; only then may the blocks it no longer
+ * references be reused. full = write a checkpoint instead of a record;
+ * all_times = log timestamp-only changes even with --lazytime.
+ */
+static int commit(int full, int all_times) {
+    metadata_image_t *img = calloc(1, sizeof(*img));
+    if (!img) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&commit_lock);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long since_checkpoint = (now.tv_sec - last_checkpoint.tv_sec) * 1000 +
+                            (now.tv_nsec - last_checkpoint.tv_nsec) / 1000000;
+    full = full || wal_size >= WAL_CHECKPOINT_BYTES ||
+           (checkpoint_due && since_checkpoint >= WAL_CACHE_CHECKPOINT_MS);
+    unsigned char changed[MAX_FILES];
+    int ret = storage_capture(img, full ? NULL : changed);
+    if (ret < 0) {
+        pthread_mutex_unlock(&commit_lock);
+        free_metadata_image(img);
+        free(img);
+        return ret;
+    }
+
+    if (full) {
+        ret = checkpoint(img);
+        if (ret == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &times_logged);
+            last_checkpoint = times_logged;
+            checkpoint_due = 0;
+        }
+    } else {
+        img->quota_count = export_quotas(img->quotas, MAX_QUOTAS);
+        export_volumes(img->volumes);
+
+        long since = (now.tv_sec - times_logged.tv_sec) * 1000 +
+                     (now.tv_nsec - times_logged.tv_nsec) / 1000000;
+        int deferred = 0;
+        if (evfs_options.lazytime && !all_times && since < WAL_LAZYTIME_MS) {
+            deferred = defer_times(img, changed);
+        }
+
+        char *record = NULL;
+        ssize_t size = build_record(img, changed, &record);
+        if (size < 0) {
+            ret = size;
+        } else if (size > 0) {
+            ret = storage_sync();
+            if (ret == 0) ret = append_record(record, size);
+            if (ret == 0) {
+                wal_seq++;
+                commit_count++;
+                remember(img);
+            }
+        }
+        free(record);
+        if (ret == 0) {
+            deferred_count += deferred;
+            if (deferred == 0) times_logged = now;
+        }
+    }
+    storage_end_commit(ret == 0);
+    // What is now as saved and logged may leave memory
+    if (ret == 0 && inode_cache_trim(logged_files) > 0) {
+        checkpoint_due = 1;
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    if (ret < 0) {
+        fprintf(stderr, "[WAL] Commit failed: %s\n", strerror(-ret));
+    }
+    free_metadata_image(img);
+    free(img);
+    return ret;
+}
+
+// Take the tables as they are for what was last committed, without
+// writing anything (see wal_start())
+static int baseline(void) {
+    metadata_image_t *img = calloc(1, sizeof(*img));
+    if (!img) {
+        return -ENOMEM;
+    }
+
+    pthread_mutex_lock(&commit_lock);
+    int ret = storage_capture(img, NULL);
+    if (ret == 0) {
+        img->quota_count = export_quotas(img->quotas, MAX_QUOTAS);
+        export_volumes(img->volumes);
+        remember(img);
+        clock_gettime(CLOCK_MONOTONIC, &times_logged);
+        last_checkpoint = times_logged;
+        storage_end_commit(1);
+    }
+    pthread_mutex_unlock(&commit_lock);
+
+    free_metadata_image(img);
+    free(img);
+    return ret;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Background committer
+ * ----------------------------------------------------------------------------
+ */
+
+static void *committer_main(void *arg) {
+    (void)arg;
+
+    pthread_mutex_lock(&wal_lock);
+    while (wal_running) {
+        if (sync_requested == sync_done) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            long ms = evfs_options.commit_ms > 0 ? evfs_options.commit_ms : WAL_COMMIT_MS;
+            deadline.tv_sec += ms / 1000;
+            deadline.tv_nsec += (ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&wal_wake, &wal_lock, &deadline);
+            if (!wal_running) break;
+        }
+
+        // Only requests made before the capture are covered by it. fsync
+        // makes timestamps durable too
+        uint64_t target = sync_requested;
+        int waited = target != sync_done;
+        pthread_mutex_unlock(&wal_lock);
+        int ret = commit(0, waited);
+        pthread_mutex_lock(&wal_lock);
+
+        sync_result = ret;
+        sync_done = target;
+        pthread_cond_broadcast(&wal_done);
+    }
+    pthread_mutex_unlock(&wal_lock);
+    return NULL;
+}
+
+int wal_sync(void) {
+    pthread_mutex_lock(&wal_lock);
+    if (!wal_running) {
+        pthread_mutex_unlock(&wal_lock);
+        return 0;
+    }
+    uint64_t ticket = ++sync_requested;
+    pthread_cond_signal(&wal_wake);
+    while (wal_running && sync_done < ticket) {
+        pthread_cond_wait(&wal_done, &wal_lock);
+    }
+    int ret = sync_done >= ticket ? sync_result : 0;
+    pthread_mutex_unlock(&wal_lock);
+    return ret;
+}
+
+int wal_start(void) {
+    wal_fd = open(wal_path(), O_RDWR | O_CREAT, 0600);
+    if (wal_fd < 0) {
+        fprintf(stderr, "[WAL] Cannot open %s: %s\n", wal_path(), strerror(errno));
+        return -errno;
+    }
+
+    // From here on, blocks of committed state are kept intact. The first
+    // checkpoint folds in whatever was replayed and empties the log; a
+    // metadata file saved at a clean unmount already is the last commit
+    block_allocator_track(1);
+    commit_count = checkpoint_count = deferred_count = 0;
+    int ret = metadata_clean_mount() ? baseline() : commit(1, 1);
+    if (ret < 0) {
+        block_allocator_track(0);
+        close(wal_fd);
+        wal_fd = -1;
+        return ret;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    wal_running = 1;
+    sync_requested = sync_done = 0;
+    if (pthread_create(&committer, NULL, committer_main, NULL) != 0) {
+        perror("[WAL] Failed to start committer");
+        wal_running = 0;
+    }
+    pthread_mutex_unlock(&wal_lock);
+
+    printf("[WAL] Logging to %s, committing every %d ms\n", wal_path(),
+           evfs_options.commit_ms > 0 ? evfs_options.commit_ms : WAL_COMMIT_MS);
+    return 0;
+}
+
+void wal_stop(void) {
+    if (wal_fd < 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&wal_lock);
+    int was_running = wal_running;
+    wal_running = 0;
+    pthread_cond_signal(&wal_wake);
+    pthread_cond_broadcast(&wal_done);
+    pthread_mutex_unlock(&wal_lock);
+    if (was_running) {
+        pthread_join(committer, NULL);
+    }
+
+    // Last commit, in case the full save that follows does not happen
+    commit(0, 1);
+    block_allocator_track(0);
+    close(wal_fd);
+    wal_fd = -1;
+
+    printf("[WAL] %lu commit(s), %lu checkpoint(s); last record %llu\n",
+           commit_count, checkpoint_count, (unsigned long long)wal_seq);
+    if (evfs_options.lazytime) {
+        printf("[WAL] %lu timestamp-only inode record(s) held back\n", deferred_count);
+    }
+}
@@ -0,0 +1,415 @@
+#include "evfs.h"
+#include "evfs_crypto.h"
+#include <pthread.h>
+#include <sys/xattr.h>
+
+/*
+ * ============================================================================
+ * XATTR MODULE - Extended attributes
+ * ============================================================================
+ *
+ * Every entry has XATTR_INLINE_SIZE bytes for attributes in its metadata
+ * record. Small values live there; large ones, and whatever no longer
+ * fits, go to the entry's xattr stream (encrypted data blocks, see
+ * write_xattr_stream()). Both use the same layout:
+ *
+ *   inline area: u32 stream_len | u16 inline_used | entries...
+ *   stream:      entries...
+ *   entry:       u8 name_len | u32 value_len | name | value
+ *
+ * The inline area is plaintext in memory and sealed with the block cipher
+ * when the metadata file is written (the engine's nonce/tag, if any, takes
+ * its last bytes), or while the entry's volume is locked (see
+ * seal_volume_inodes()). Streams are cached once read, so lookups never do I/O
+ * after the first one on a file, up to --xattr-cache bytes: past that the
+ * least recently used streams are dropped and read again when needed.
+ */
+
+#define XATTR_HEADER 6              // stream_len + inline_used
+#define XATTR_ENTRY_HEADER 5        // name_len + value_len
+#define XATTR_INLINE_MAX_VALUE 64   // larger values always go to the stream
+#define XATTR_STREAM_MAX (256 * 1024)
+
+// Tweak block for sealing inline areas; never a data or stream block
+#define XATTR_SEAL_LBLK (XATTR_LBLK - 1)
+
+typedef struct {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} xattr_entry_t;
+
+// Decrypted xattr streams of live entries
+typedef struct {
+    char *data;
+    size_t len;
+    int loaded;
+    uint64_t last_used;  // use_clock at the last access
+} xattr_stream_t;
+
+static xattr_stream_t streams[MAX_FILES];
+static size_t cached_bytes = 0;
+static uint64_t use_clock = 0;
+static pthread_mutex_t xattr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * ----------------------------------------------------------------------------
+ * Encoding
+ * ----------------------------------------------------------------------------
+ */
+
+static size_t inline_capacity(void) {
+    return XATTR_INLINE_SIZE - evfs_crypto_block_overhead();
+}
+
+static uint32_t get_u32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint16_t get_u16(const unsigned char *p) {
+    uint16_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+size_t xattr_stream_size(const file_metadata_t *meta) {
+    return get_u32(meta->xattr);
+}
+
+static size_t inline_used(const file_metadata_t *meta) {
+    size_t used = get_u16(meta->xattr + 4);
+    return used > inline_capacity() - XATTR_HEADER ? 0 : used;
+}
+
+// Decode packed entries into out (room for max). Returns the count, or
+// -EIO if the buffer is malformed
+static int decode(const char *buf, size_t len, xattr_entry_t *out, int max) {
+    int n = 0;
+    size_t pos = 0;
+    while (pos < len) {
+        if (len - pos < XATTR_ENTRY_HEADER || n == max) return -EIO;
+        size_t name_len = (unsigned char)buf[pos];
+        size_t value_len = get_u32((const unsigned char *)buf + pos + 1);
+        pos += XATTR_ENTRY_HEADER;
+        if (name_len == 0 || value_len > len - pos || name_len > len - pos - value_len) {
+            return -EIO;
+        }
+        out[n].name = buf + pos;
+        out[n].name_len = name_len;
+        out[n].value = buf + pos + name_len;
+        out[n].value_len = value_len;
+        pos += name_len + value_len;
+        n++;
+    }
+    return n;
+}
+
+static size_t encode(char *buf, const xattr_entry_t *ent) {
+    buf[0] = (char)ent->name_len;
+    uint32_t value_len = ent->value_len;
+    memcpy(buf + 1, &value_len, sizeof(value_len));
+    memcpy(buf + XATTR_ENTRY_HEADER, ent->name, ent->name_len);
+    memcpy(buf + XATTR_ENTRY_HEADER + ent->name_len, ent->value, ent->value_len);
+    return XATTR_ENTRY_HEADER + ent->name_len + ent->value_len;
+}
+
+// All entries of an entry: inline ones first, then the stream's.
+// Returns the count (*out malloc'd), or a negative errno
+static int decode_all(const file_metadata_t *meta, const char *stream, xattr_entry_t **out) {
+    size_t used = inline_used(meta);
+    size_t stream_len = xattr_stream_size(meta);
+    int max = (used + stream_len) / XATTR_ENTRY_HEADER + 1;
+
+    *out = malloc(max * sizeof(xattr_entry_t));
+    if (!*out) return -ENOMEM;
+
+    int n = decode((const char *)meta->xattr + XATTR_HEADER, used, *out, max);
+    int m = n < 0 || stream_len == 0 ? 0 : decode(stream, stream_len, *out + n, max - n);
+    if (n < 0 || m < 0) {
+        free(*out);
+        return -EIO;
+    }
+    return n + m;
+}
+
+static int find_entry(const xattr_entry_t *ents, int count, const char *name) {
+    size_t len = strlen(name);
+    for (int i = 0; i < count; i++) {
+        if (ents[i].name_len == len && memcmp(ents[i].name, name, len) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int xattr_get_in(const file_metadata_t *meta, const char *stream, const char *name,
+                 char *value, size_t size) {
+    xattr_entry_t *ents;
+    int count = decode_all(meta, stream, &ents);
+    if (count < 0) return count;
+
+    int i = find_entry(ents, count, name);
+    int ret;
+    if (i < 0) {
+        ret = -ENODATA;
+    } else if (size == 0) {
+        ret = ents[i].value_len;  // caller asks how big a buffer to use
+    } else if (size < ents[i].value_len) {
+        ret = -ERANGE;
+    } else {
+        memcpy(value, ents[i].value, ents[i].value_len);
+        ret = ents[i].value_len;
+    }
+    free(ents);
+    return ret;
+}
+
+int xattr_list_in(const file_metadata_t *meta, const char *stream, char *list, size_t size) {
+    xattr_entry_t *ents;
+    int count = decode_all(meta, stream, &ents);
+    if (count < 0) return count;
+
+    size_t total = 0;
+    for (int i = 0; i < count; i++) {
+        total += ents[i].name_len + 1;
+    }
+    int ret = total;
+    if (size > 0 && size < total) {
+        ret = -ERANGE;
+    } else if (size > 0) {
+        char *p = list;
+        for (int i = 0; i < count; i++) {
+            memcpy(p, ents[i].name, ents[i].name_len);
+            p[ents[i].name_len] = '\0';
+            p += ents[i].name_len + 1;
+        }
+    }
+    free(ents);
+    return ret;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ * Live entries
+ * ----------------------------------------------------------------------------
+ */
+
+// Drop a cached stream. Caller holds xattr_lock
+static void uncache(int idx) {
+    cached_bytes -= streams[idx].len;
+    free(streams[idx].data);
+    memset(&streams[idx], 0, sizeof(xattr_stream_t));
+}
+
+// Drop the least recently used streams, other than keep's, until the
+// cache fits its limit. Caller holds xattr_lock
+static void trim_cache(int keep) {
+    while (cached_bytes > evfs_options.xattr_cache) {
+        int victim = -1;
+        for (int i = 0; i < MAX_FILES; i++) {
+            if (i != keep && streams[i].len > 0 &&
+                (victim == -1 || streams[i].last_used < streams[victim].last_used)) {
+                victim = i;
+            }
+        }
+        if (victim == -1) return;
+        EVFS_PROBE2(xattr__evict, victim, streams[victim].len);
+        uncache(victim);
+    }
+}
+
+// Make sure the entry's stream is in memory. Caller holds xattr_lock
+static int load_stream(int idx) {
+    xattr_stream_t *st = &streams[idx];
+    st->last_used = ++use_clock;
+    if (st->loaded) {
+        EVFS_PROBE2(xattr__hit, idx, st->len);
+        return 0;
+    }
+
+    size_t len = xattr_stream_size(&file_table[idx]);
+    EVFS_PROBE2(xattr__miss, idx, len);
+    char *data = NULL;
+    if (len > 0) {
+        if (len > XATTR_STREAM_MAX || !(data = malloc(len))) {
+            return len > XATTR_STREAM_MAX ? -EIO : -ENOMEM;
+        }
+        if (read_xattr_stream(idx, data, len) < 0) {
+            free(data);
+            return -EIO;
+        }
+    }
+    st->data = data;
+    st->len = len;
+    st->loaded = 1;
+    cached_bytes += len;
+    trim_cache(idx);
+    return 0;
+}
+
+int xattr_get(int idx, const char *name, char *value, size_t size) {
+    pthread_mutex_lock(&xattr_lock);
+    int ret = load_stream(idx);
+    if (ret == 0) {
+        ret = xattr_get_in(&file_table[idx], streams[idx].data, name, value, size);
+    }
+    pthread_mutex_unlock(&xattr_lock);
+    return ret;
+}
+
+int xattr_list(int idx, char *list, size_t size) {
+    pthread_mutex_lock(&xattr_lock);
+    int ret = load_stream(idx);
+    if (ret == 0) {
+        ret = xattr_list_in(&file_table[idx], streams[idx].data, list, size);
+    }
+    pthread_mutex_unlock(&xattr_lock);
+    return ret;
+}
+
+/*
+ * Re-pack all entries: small values inline while they fit, the rest into
+ * the stream. The stream is only rewritten if its contents changed.
+ * Caller holds xattr_lock.
+ */
+static int store(int idx, const xattr_entry_t *ents, int count) {
+    file_metadata_t *meta = &file_table[idx];
+    unsigned char area[XATTR_INLINE_SIZE] = { 0 };
+    size_t capacity = inline_capacity() - XATTR_HEADER;
+    size_t used = 0, stream_len = 0;
+
+    for (int i = 0; i < count; i++) {
+        stream_len += XATTR_ENTRY_HEADER + ents[i].name_len + ents[i].value_len;
+    }
+    char *stream = malloc(stream_len > 0 ? stream_len : 1);
+    if (!stream) return -ENOMEM;
+
+    stream_len = 0;
+    for (int i = 0; i < count; i++) {
+        size_t len = XATTR_ENTRY_HEADER + ents[i].name_len + ents[i].value_len;
+        if (ents[i].value_len <= XATTR_INLINE_MAX_VALUE && used + len <= capacity) {
+            used += encode((char *)area + XATTR_HEADER + used, &ents[i]);
+        } else {
+            stream_len += encode(stream + stream_len, &ents[i]);
+        }
+    }
+    if (stream_len > XATTR_STREAM_MAX) {
+        free(stream);
+        return -ENOSPC;
+    }
+
+    xattr_stream_t *st = &streams[idx];
+    if (stream_len != st->len || (stream_len > 0 && memcmp(stream, st->data, stream_len) != 0)) {
+        int ret = write_xattr_stream(idx, stream, stream_len);
+        if (ret < 0) {
+            free(stream);
+            return ret == -ENOSPC || ret == -EDQUOT ? ret : -EIO;
+        }
+    }
+
+    uint32_t len32 = stream_len;
+    uint16_t used16 = used;
+    memcpy(area, &len32, sizeof(len32));
+    memcpy(area + 4, &used16, sizeof(used16));
+    memcpy(meta->xattr, area, XATTR_INLINE_SIZE);
+
+    free(st->data);
+    cached_bytes += stream_len - st->len;
+    st->data = stream_len > 0 ? stream : NULL;
+    st->len = stream_len;
+    if (stream_len == 0) free(stream);
+    trim_cache(idx);
+
+    meta->ctime = time(NULL);
+    return 0;
+}
+
+int xattr_set(int idx, const char *name, const char *value, size_t size, int flags) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || name_len > 255) {
+        return name_len == 0 ? -EINVAL : -ERANGE;
+    }
+    if (size > XATTR_STREAM_MAX) {
+        return -E2BIG;
+    }
+
+    pthread_mutex_lock(&xattr_lock);
+    int ret = load_stream(idx);
+    xattr_entry_t *ents = NULL;
+    int count = ret == 0 ? decode_all(&file_table[idx], streams[idx].data, &ents) : ret;
+    if (count < 0) {
+        pthread_mutex_unlock(&xattr_lock);
+        return count;
+    }
+
+    int i = find_entry(ents, count, name);
+    if (i >= 0 && (flags & XATTR_CREATE)) {
+        ret = -EEXIST;
+    } else if (i < 0 && (flags & XATTR_REPLACE)) {
+        ret = -ENODATA;
+    } else {
+        // Room for one more entry was left by decode_all()
+        if (i < 0) i = count++;
+        ents[i] = (xattr_entry_t){ name, name_len, value, size };
+        ret = store(idx, ents, count);
+    }
+
+    free(ents);
+    pthread_mutex_unlock(&xattr_lock);
+    return ret;
+}
+
+int xattr_remove(int idx, const char *name) {
+    pthread_mutex_lock(&xattr_lock);
+    int ret = load_stream(idx);
+    xattr_entry_t *ents = NULL;
+    int count = ret == 0 ? decode_all(&file_table[idx], streams[idx].data, &ents) : ret;
+    if (count < 0) {
+        pthread_mutex_unlock(&xattr_lock);
+        return count;
+    }
+
+    int i = find_entry(ents, count, name);
+    if (i < 0) {
+        ret = -ENODATA;
+    } else {
+        ents[i] = ents[--count];
+        ret = store(idx, ents, count);
+    }
+
+    free(ents);
+    pthread_mutex_unlock(&xattr_lock);
+    return ret;
+}
+
+void init_xattrs(void) {
+    pthread_mutex_lock(&xattr_lock);
+    for (int i = 0; i < MAX_FILES; i++) {
+        free(streams[i].data);
+    }
+    memset(streams, 0, sizeof(streams));
+    cached_bytes = 0;
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+void xattr_forget(int idx) {
+    pthread_mutex_lock(&xattr_lock);
+    uncache(idx);
+    memset(file_table[idx].xattr, 0, XATTR_INLINE_SIZE);
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+void xattr_uncache(int idx) {
+    pthread_mutex_lock(&xattr_lock);
+    uncache(idx);
+    pthread_mutex_unlock(&xattr_lock);
+}
+
+int xattr_seal(unsigned char *area, uint64_t map_id, uint32_t engine, int enc) {
+    evfs_crypto_vec_t v = { (char *)area, (char *)area, XATTR_INLINE_SIZE, map_id,
+                            XATTR_SEAL_LBLK, engine };
+    return enc ? evfs_encrypt_blocks(&v, 1) : evfs_decrypt_blocks(&v, 1);
+}
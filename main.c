@@ -1,5 +1,106 @@
 #include "evfs.h"
 
+// Parse a size such as 4096, 512M or 2G
+static off_t parse_size(const char *arg) {
+    char *end;
+    off_t size = strtoll(arg, &end, 10);
+    switch (*end) {
+    case 'T': case 't': size <<= 10; // fall through
+    case 'G': case 'g': size <<= 10; // fall through
+    case 'M': case 'm': size <<= 10; // fall through
+    case 'K': case 'k': size <<= 10; end++; break;
+    }
+    if (end == arg || *end != '\0' || size <= 0) {
+        fprintf(stderr, "Invalid size: %s\n", arg);
+        exit(1);
+    }
+    return size;
+}
+
+/*
+ * Consume EVFS-specific options and leave the rest for FUSE.
+ */
+static void parse_evfs_options(int *argc, char *argv[]) {
+    int out = 1;
+    for (int i = 1; i < *argc; i++) {
+        if (strcmp(argv[i], "--direct-io") == 0) {
+            evfs_options.direct_io = 1;
+        } else if (strncmp(argv[i], "--cipher=", 9) == 0) {
+            evfs_options.cipher = argv[i] + 9;
+        } else if (strncmp(argv[i], "--compact-rate=", 15) == 0) {
+            evfs_options.compact_rate_mb = atoi(argv[i] + 15);
+        } else if (strncmp(argv[i], "--io-rate=", 10) == 0) {
+            // CLASS:MB, e.g. --io-rate=background:8 (MB/s, 0 = unlimited)
+            char *spec = argv[i] + 10;
+            char *colon = strchr(spec, ':');
+            int cls = -1;
+            if (colon) {
+                *colon = '\0';
+                cls = io_class_by_name(spec);
+            }
+            if (cls < 0 || atol(colon + 1) < 0) {
+                fprintf(stderr, "Invalid --io-rate (expected read|write|background:MB)\n");
+                exit(1);
+            }
+            evfs_options.io_rate[cls] = atol(colon + 1) * 1024 * 1024;
+        } else if (strncmp(argv[i], "--commit=", 9) == 0) {
+            evfs_options.commit_ms = atoi(argv[i] + 9);
+            if (evfs_options.commit_ms <= 0) {
+                fprintf(stderr, "Invalid commit interval: %s\n", argv[i] + 9);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--inline-max=", 13) == 0) {
+            evfs_options.inline_max = atoi(argv[i] + 13);
+            if (evfs_options.inline_max < 0) {
+                fprintf(stderr, "Invalid inline size: %s\n", argv[i] + 13);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--capacity=", 11) == 0) {
+            evfs_options.capacity = parse_size(argv[i] + 11);
+        } else if (strcmp(argv[i], "--strictatime") == 0) {
+            evfs_options.atime = ATIME_STRICT;
+        } else if (strcmp(argv[i], "--relatime") == 0) {
+            evfs_options.atime = ATIME_RELATIME;
+        } else if (strcmp(argv[i], "--noatime") == 0) {
+            evfs_options.atime = ATIME_NONE;
+        } else if (strcmp(argv[i], "--lazytime") == 0) {
+            evfs_options.lazytime = 1;
+        } else if (strncmp(argv[i], "--xattr-cache=", 14) == 0) {
+            evfs_options.xattr_cache = parse_size(argv[i] + 14);
+        } else if (strncmp(argv[i], "--inode-cache=", 14) == 0) {
+            evfs_options.inode_cache = atoi(argv[i] + 14);
+            if (evfs_options.inode_cache <= 0) {
+                fprintf(stderr, "Invalid inode cache size: %s\n", argv[i] + 14);
+                exit(1);
+            }
+        } else if (strncmp(argv[i], "--volume=", 9) == 0) {
+            if (evfs_options.volume_count == MAX_VOLUMES) {
+                fprintf(stderr, "Too many volumes (max %d)\n", MAX_VOLUMES);
+                exit(1);
+            }
+            evfs_options.volumes[evfs_options.volume_count++] = argv[i] + 9;
+        } else if (strncmp(argv[i], "--meta=", 7) == 0) {
+            evfs_options.metadata_file = argv[i] + 7;
+        } else if (strncmp(argv[i], "--record=", 9) == 0) {
+            evfs_options.record_file = argv[i] + 9;
+        } else if (strncmp(argv[i], "--backing=", 10) == 0) {
+            // Comma-separated list, e.g. --backing=/nvme0/d.bin,/nvme1/d.bin
+            char *list = argv[i] + 10;
+            for (char *path = strtok(list, ","); path; path = strtok(NULL, ",")) {
+                if (evfs_options.backing_count == MAX_BACKING_FILES) {
+                    fprintf(stderr, "Too many backing files (max %d)\n", MAX_BACKING_FILES);
+                    exit(1);
+                }
+                evfs_options.backing_files[evfs_options.backing_count++] = path;
+            }
+        } else {
+            argv[out++] = argv[i];
+        }
+    }
+    argv[out] = NULL;
+    *argc = out;
+}
+
 int main(int argc, char *argv[]) {
     printf("==============================================\n");
     printf("  Encrypted Virtual File System (EVFS)\n");
@@ -11,18 +112,44 @@ int main(int argc, char *argv[]) {
     printf("  - Metadata management\n");
     printf("==============================================\n");
     
+    parse_evfs_options(&argc, argv);
+
     if (argc < 2) {
         fprintf(stderr, "\nUsage: %s <mountpoint> [options]\n\n", argv[0]);
         fprintf(stderr, "Options:\n");
         fprintf(stderr, "  -f        Run in foreground (see debug output)\n");
         fprintf(stderr, "  -d        Run in debug mode (very verbose)\n");
         fprintf(stderr, "  -s        Run single-threaded\n");
+        fprintf(stderr, "  --direct-io  Open backing file with O_DIRECT (no page cache)\n");
+        fprintf(stderr, "  --backing=F1,F2,...  Stripe data across these backing files\n");
+        fprintf(stderr, "  --meta=FILE  Metadata file (default evfs_meta.bin)\n");
+        fprintf(stderr, "  --capacity=SIZE  Most the backing files may hold, e.g. 10G (default: host free space)\n");
+        fprintf(stderr, "  --volume=NAME:KEYFILE  Unlock (or create) volume /NAME with the passphrase in KEYFILE\n");
+        fprintf(stderr, "  --commit=MS  Commit changes to the write-ahead log every MS ms (default %d)\n",
+                WAL_COMMIT_MS);
+        fprintf(stderr, "  --inline-max=BYTES  Keep files up to BYTES in their inode (0 = off, default %d\n",
+                INLINE_DATA_SIZE);
+        fprintf(stderr, "                      less the cipher overhead)\n");
+        fprintf(stderr, "  --relatime | --strictatime | --noatime  When reads update atime (default relatime)\n");
+        fprintf(stderr, "  --lazytime  Log timestamp-only changes at most every %d s (and on fsync)\n",
+                WAL_LAZYTIME_MS / 1000);
+        fprintf(stderr, "  --xattr-cache=SIZE  Memory for decrypted xattr streams (default %dM)\n",
+                XATTR_CACHE_SIZE >> 20);
+        fprintf(stderr, "  --inode-cache=N  Inodes kept in memory, in pages of %d (default %d)\n",
+                META_PAGE_INODES, INODE_CACHE_SIZE);
+        fprintf(stderr, "  --compact-rate=MB  Background compaction rate (MB/s, 0 = off, default 16)\n");
+        fprintf(stderr, "  --io-rate=CLASS:MB  Rate limit for read, write or background I/O (MB/s)\n");
+        fprintf(stderr, "  --record=FILE  Record every operation to FILE (replay with evfs-replay)\n");
+        fprintf(stderr, "  --cipher=NAME  aes-256-xts | aes-256-cbc-essiv | aes-256-gcm |\n");
+        fprintf(stderr, "                 chacha20-poly1305 | auto (default)\n");
         fprintf(stderr, "\nExample:\n");
         fprintf(stderr, "  %s mnt -f    # Mount on 'mnt' directory in foreground\n\n", argv[0]);
         return 1;
     }
     
     printf("\nMount point: %s\n", argv[1]);
+    printf("Backing I/O: %s, %d file(s)\n", evfs_options.direct_io ? "direct" : "buffered",
+           evfs_options.backing_count ? evfs_options.backing_count : 1);
     printf("Starting FUSE filesystem...\n\n");
     
     // Start FUSE with our operations
@@ -0,0 +1,696 @@
+#!/bin/bash
+
+# EVFS feature tests: crash replay and the features built on the storage
+#
+# Each section runs on its own file system in a scratch directory, so
+# evfs_data.bin and evfs_meta.bin in the source tree are left alone.
+# The quota and volume sections need root (trusted.* xattrs) and setfattr.
+
+# Colors
+RED='\033[0;31m'
+GREEN='\033[0;32m'
+YELLOW='\033[1;33m'
+BLUE='\033[0;34m'
+NC='\033[0m'
+
+PASS=0
+FAIL=0
+SKIP=0
+
+ROOT=$(pwd)
+WORK=$(mktemp -d)
+EVFS_PID=""
+
+# Test result tracking
+test_result() {
+    if [ $1 -eq 0 ]; then
+        echo -e "${GREEN}✓ PASS${NC}: $2"
+        ((PASS++))
+    else
+        echo -e "${RED}✗ FAIL${NC}: $2"
+        ((FAIL++))
+    fi
+}
+
+skip() {
+    echo -e "${YELLOW}- SKIP${NC}: $1"
+    ((SKIP++))
+}
+
+# Mount a file system kept in $WORK; extra arguments go to evfs
+mount_evfs() {
+    ./evfs -f mnt --backing="$WORK/data.bin" --meta="$WORK/meta.bin" "$@" >> "$WORK/evfs.log" 2>&1 &
+    EVFS_PID=$!
+    for i in {1..50}; do
+        mountpoint -q mnt && return 0
+        kill -0 $EVFS_PID 2>/dev/null || return 1
+        sleep 0.1
+    done
+    return 1
+}
+
+unmount_evfs() {
+    fusermount -u mnt 2>/dev/null
+    wait $EVFS_PID 2>/dev/null || true
+    EVFS_PID=""
+}
+
+# Start the next section on an empty file system
+fresh_fs() {
+    rm -f "$WORK/data.bin" "$WORK/meta.bin" "$WORK/meta.bin.wal"
+}
+
+# Cleanup function
+cleanup() {
+    echo -e "\n${YELLOW}Cleaning up...${NC}"
+    if [ -n "$EVFS_PID" ]; then
+        fusermount -u mnt 2>/dev/null || fusermount -uz mnt 2>/dev/null || true
+        kill $EVFS_PID 2>/dev/null || true
+    fi
+    rm -rf "$WORK"
+}
+
+trap cleanup EXIT
+
+echo "========================================"
+echo "  EVFS Feature Tests"
+echo "========================================"
+
+# Build
+echo -e "\n${BLUE}Building EVFS...${NC}"
+make evfs evfs-fsck evfs-tool test_rename_flags test_crypto > /dev/null 2>&1
+test_result $? "Build system"
+[ $FAIL -eq 0 ] || exit 1
+
+mkdir -p mnt
+
+echo -e "\n${BLUE}=== Test 1: Crash and Log Replay ===${NC}"
+
+fresh_fs
+mount_evfs --commit=200
+test_result $? "Mount filesystem"
+
+mkdir mnt/crash
+dd if=/dev/urandom of=mnt/crash/data.bin bs=1K count=300 2>/dev/null
+DATA_SUM=$(md5sum < mnt/crash/data.bin)
+echo "small" > mnt/crash/small.txt
+echo "keep" > mnt/crash/kept.txt
+mv mnt/crash/kept.txt mnt/crash/renamed.txt
+echo "doomed" > mnt/crash/doomed.txt
+rm mnt/crash/doomed.txt
+
+# fsync commits every change made so far, not just this file's
+sync mnt/crash/data.bin
+test_result $? "fsync commits the changes"
+
+[ -s "$WORK/meta.bin.wal" ]
+test_result $? "Commit went to the write-ahead log"
+
+# Crash: no unmount, no final save
+kill -9 $EVFS_PID
+wait $EVFS_PID 2>/dev/null
+fusermount -uz mnt 2>/dev/null
+EVFS_PID=""
+
+./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems after replaying the log"
+
+mount_evfs
+test_result $? "Remount after crash"
+
+[ "$(md5sum < mnt/crash/data.bin)" = "$DATA_SUM" ]
+test_result $? "300KB file intact after replay"
+
+[ "$(cat mnt/crash/small.txt 2>/dev/null)" = "small" ]
+test_result $? "Small file intact after replay"
+
+[ "$(cat mnt/crash/renamed.txt 2>/dev/null)" = "keep" ] && [ ! -e mnt/crash/kept.txt ]
+test_result $? "Rename survives replay"
+
+[ ! -e mnt/crash/doomed.txt ]
+test_result $? "Unlink survives replay"
+
+unmount_evfs
+
+echo -e "\n${BLUE}=== Test 2: Snapshot Point-in-Time View ===${NC}"
+
+fresh_fs
+mount_evfs
+test_result $? "Mount filesystem"
+
+mkdir mnt/data
+echo "version 1" > mnt/data/a.txt
+dd if=/dev/urandom of=mnt/data/big.bin bs=1K count=64 2>/dev/null
+BIG_SUM=$(md5sum < mnt/data/big.bin)
+echo "removed later" > mnt/data/c.txt
+
+mkdir mnt/.snapshots/s1
+test_result $? "Take snapshot"
+
+# Change everything after the snapshot
+echo "version 2" > mnt/data/a.txt
+dd if=/dev/urandom of=mnt/data/big.bin bs=1K count=8 seek=4 conv=notrunc 2>/dev/null
+rm mnt/data/c.txt
+echo "created later" > mnt/data/b.txt
+
+[ "$(cat mnt/.snapshots/s1/data/a.txt 2>/dev/null)" = "version 1" ]
+test_result $? "Snapshot keeps overwritten contents"
+
+[ "$(md5sum < mnt/.snapshots/s1/data/big.bin)" = "$BIG_SUM" ]
+test_result $? "Snapshot keeps blocks overwritten in place"
+
+[ "$(cat mnt/.snapshots/s1/data/c.txt 2>/dev/null)" = "removed later" ]
+test_result $? "Snapshot keeps deleted files"
+
+[ ! -e mnt/.snapshots/s1/data/b.txt ]
+test_result $? "Snapshot does not show later files"
+
+[ "$(cat mnt/data/a.txt)" = "version 2" ] && [ "$(md5sum < mnt/data/big.bin)" != "$BIG_SUM" ]
+test_result $? "Live tree has the new contents"
+
+! (echo "x" > mnt/.snapshots/s1/data/a.txt) 2>/dev/null
+test_result $? "Snapshot is read-only"
+
+rmdir mnt/.snapshots/s1 && [ ! -e mnt/.snapshots/s1 ]
+test_result $? "Delete snapshot"
+
+unmount_evfs
+
+echo -e "\n${BLUE}=== Test 3: Quota EDQUOT ===${NC}"
+
+if [ "$(id -u)" -ne 0 ] || ! command -v setfattr > /dev/null; then
+    skip "Quota tests need root and setfattr"
+else
+    fresh_fs
+    mount_evfs
+    test_result $? "Mount filesystem"
+
+    QUOTA=trusted.evfs.quota.user.$(id -u)
+    # One 4 KiB block, no inode limit
+    setfattr -n $QUOTA -v "0 4096 0 0" mnt
+    test_result $? "Set a 4KB hard block limit"
+
+    dd if=/dev/urandom of=mnt/fill.bin bs=4096 count=1 2>/dev/null
+    test_result $? "Write up to the limit"
+
+    OUT=$(dd if=/dev/urandom of=mnt/over.bin bs=4096 count=1 2>&1)
+    [ $? -ne 0 ] && echo "$OUT" | grep -q "quota"
+    test_result $? "Write over the limit fails with EDQUOT"
+
+    echo -n "hello" > mnt/small.txt
+    OUT=$(truncate -s 100000 mnt/small.txt 2>&1)
+    [ $? -ne 0 ] && echo "$OUT" | grep -q "quota"
+    test_result $? "Truncate over the limit fails with EDQUOT"
+
+    [ "$(cat mnt/small.txt)" = "hello" ]
+    test_result $? "Failed truncate leaves the file alone"
+
+    setfattr -x $QUOTA mnt && truncate -s 100000 mnt/small.txt
+    test_result $? "Truncate succeeds once the limit is dropped"
+
+    unmount_evfs
+fi
+
+echo -e "\n${BLUE}=== Test 4: Rename Flags ===${NC}"
+
+# The mount cannot pass renameat2() flags (libfuse 2), so
+# test_rename_flags runs the file system in process
+mkdir -p "$WORK/rename"
+for PHASE in write check; do
+    (cd "$WORK/rename" && "$ROOT/test_rename_flags" $PHASE) > "$WORK/rename.log" 2>&1
+    STATUS=$?
+    grep -E "^(PASS|FAIL)" "$WORK/rename.log" | sed 's/^/  /'
+    test_result $STATUS "RENAME_NOREPLACE and RENAME_EXCHANGE ($PHASE)"
+done
+
+echo -e "\n${BLUE}=== Test 5: O_DIRECT Backing File ===${NC}"
+
+fresh_fs
+mount_evfs --direct-io
+test_result $? "Mount filesystem with --direct-io"
+
+# The backing file descriptor must really carry O_DIRECT (flags are octal)
+DIRECT=$(python3 -c 'import os; print(oct(os.O_DIRECT)[2:])' 2>/dev/null)
+if [ -z "$DIRECT" ]; then
+    skip "O_DIRECT flag check needs python3"
+else
+    FLAGS=""
+    for FD in /proc/$EVFS_PID/fd/*; do
+        if [ "$(readlink "$FD")" = "$WORK/data.bin" ]; then
+            FLAGS=$(awk '/^flags:/ { print $2 }' /proc/$EVFS_PID/fdinfo/${FD##*/})
+        fi
+    done
+    [ -n "$FLAGS" ] && [ $(( 0$FLAGS & 0$DIRECT )) -ne 0 ]
+    test_result $? "Backing file is open with O_DIRECT"
+fi
+
+# Writes that start and end off the 4 KiB boundaries, applied to a
+# reference copy as well
+dd if=/dev/urandom of="$WORK/src.bin" bs=1K count=64 2>/dev/null
+: > "$WORK/ref.bin"
+: > mnt/direct.bin
+for SPEC in "4097 3 0" "777 5 12345" "1 1 4095" "10000 2 30001" "4096 4 8192"; do
+    set -- $SPEC
+    for OUT in mnt/direct.bin "$WORK/ref.bin"; do
+        dd if="$WORK/src.bin" of="$OUT" bs=$1 count=$2 seek=$3 oflag=seek_bytes conv=notrunc 2>/dev/null
+    done
+done
+REF_SUM=$(md5sum < "$WORK/ref.bin")
+
+[ "$(md5sum < mnt/direct.bin)" = "$REF_SUM" ]
+test_result $? "Unaligned writes read back correctly"
+
+unmount_evfs
+mount_evfs
+[ "$(md5sum < mnt/direct.bin)" = "$REF_SUM" ]
+test_result $? "Buffered remount reads the same data"
+
+unmount_evfs
+
+echo -e "\n${BLUE}=== Test 6: Symlink Targets at Rest ===${NC}"
+
+fresh_fs
+mount_evfs --commit=200
+test_result $? "Mount filesystem"
+
+SHORT=../findme-short-target-7f3a
+LONG=../findme-long-target-$(printf 'x%.0s' {1..200})
+ln -s "$SHORT" mnt/short
+ln -s "$LONG" mnt/long
+[ "$(readlink mnt/short)" = "$SHORT" ] && [ "$(readlink mnt/long)" = "$LONG" ]
+test_result $? "Read back short and long symlink targets"
+
+# Commit to the log, then look for the targets in it
+echo "x" > mnt/anchor
+sync mnt/anchor
+[ -s "$WORK/meta.bin.wal" ] && ! grep -q "findme" "$WORK/meta.bin.wal"
+test_result $? "No symlink target in the write-ahead log"
+
+unmount_evfs
+! grep -q "findme" "$WORK/meta.bin" && ! grep -q "findme" "$WORK/data.bin"
+test_result $? "No symlink target in the metadata or backing file"
+
+mount_evfs
+[ "$(readlink mnt/short)" = "$SHORT" ] && [ "$(readlink mnt/long)" = "$LONG" ]
+test_result $? "Symlink targets survive a remount"
+
+unmount_evfs
+
+echo -e "\n${BLUE}=== Test 7: Sealed Names and the Name Index ===${NC}"
+
+fresh_fs
+mount_evfs --commit=200
+test_result $? "Mount filesystem"
+
+mkdir mnt/findme-dir-a mnt/findme-dir-b
+for i in 1 2 3; do echo "a$i" > mnt/findme-dir-a/findme-file-$i; done
+for i in $(seq 1 60); do : > mnt/findme-dir-b/findme-many-$i; done
+sync mnt/findme-dir-a/findme-file-1
+[ -s "$WORK/meta.bin.wal" ] && ! grep -q "findme" "$WORK/meta.bin.wal"
+test_result $? "No name in the write-ahead log"
+
+unmount_evfs
+! grep -q "findme" "$WORK/meta.bin"
+test_result $? "No name in the metadata file"
+
+# Only what is reached gets decrypted: the unmount prints the table, with
+# names never reached as "(sealed)"
+: > "$WORK/evfs.log"
+mount_evfs
+ls mnt/findme-dir-a > "$WORK/ls.txt"
+[ "$(cat mnt/findme-dir-b/findme-many-37)" = "" ] && [ "$(wc -l < "$WORK/ls.txt")" -eq 3 ]
+test_result $? "Lookup and listing after a remount"
+unmount_evfs
+SEALED=$(sed -n '/\[DESTROY\]/,$p' "$WORK/evfs.log" | grep -c "(sealed)")
+[ "$SEALED" -eq 59 ]
+test_result $? "Names not reached stay sealed ($SEALED of 65)"
+
+# Lookups go through the index, filed from the saved keys
+mount_evfs
+MISSING=0
+for i in $(seq 1 60); do
+    [ -e mnt/findme-dir-b/findme-many-$i ] || MISSING=$((MISSING + 1))
+done
+[ $MISSING -eq 0 ] && [ ! -e mnt/findme-dir-b/findme-many-61 ] &&
+    [ "$(ls mnt/findme-dir-b | wc -l)" -eq 60 ]
+test_result $? "Every name is found, and no other"
+
+! rmdir mnt/findme-dir-a 2>/dev/null
+test_result $? "A directory with sealed names is not empty"
+unmount_evfs
+
+# Moving a directory renames names below it that are still sealed
+mount_evfs
+mv mnt/findme-dir-a mnt/findme-dir-b/moved
+unmount_evfs
+mount_evfs
+[ "$(cat mnt/findme-dir-b/moved/findme-file-2 2>/dev/null)" = "a2" ] && [ ! -e mnt/findme-dir-a ]
+test_result $? "Directory move keeps the names below it"
+unmount_evfs
+
+./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems"
+
+echo -e "\n${BLUE}=== Test 8: Volumes ===${NC}"
+
+if [ "$(id -u)" -ne 0 ] || ! command -v setfattr > /dev/null; then
+    skip "Volume tests need root and setfattr"
+else
+    fresh_fs
+    mount_evfs --commit=200
+    test_result $? "Mount filesystem"
+
+    setfattr -n trusted.evfs.volume.acme -v "acme-passphrase" mnt &&
+        setfattr -n trusted.evfs.volume.zeta -v "zeta-passphrase" mnt
+    test_result $? "Create two volumes"
+
+    # Four busy writers in acme must not hold up one in zeta
+    dd if=/dev/urandom of="$WORK/acme.ref" bs=64k count=128 2>/dev/null
+    dd if=/dev/urandom of="$WORK/zeta.ref" bs=64k count=16 2>/dev/null
+    PIDS=""
+    for i in 1 2 3 4; do
+        cp "$WORK/acme.ref" mnt/acme/busy-$i &
+        PIDS="$PIDS $!"
+    done
+    cp "$WORK/zeta.ref" mnt/zeta/data
+    ZSTATUS=$?
+    RUNNING=0
+    for p in $PIDS; do kill -0 $p 2>/dev/null && RUNNING=$((RUNNING + 1)); done
+    wait $PIDS
+    [ $ZSTATUS -eq 0 ] && [ $RUNNING -gt 0 ]
+    test_result $? "A volume's writer finishes while another volume is busy ($RUNNING still writing)"
+
+    INTACT=1
+    for i in 1 2 3 4; do cmp -s "$WORK/acme.ref" mnt/acme/busy-$i || INTACT=0; done
+    cmp -s "$WORK/zeta.ref" mnt/zeta/data && [ $INTACT -eq 1 ]
+    test_result $? "Concurrent writes in both volumes are intact"
+
+    # Each volume only opens with its own key
+    echo "acme only" > mnt/acme/secret
+    setfattr -x trusted.evfs.volume.acme mnt
+    OUT=$(cat mnt/acme/secret 2>&1)
+    [ $? -ne 0 ] && echo "$OUT" | grep -q "key" && cmp -s "$WORK/zeta.ref" mnt/zeta/data
+    test_result $? "A locked volume refuses reads, the other stays readable"
+
+    ! touch mnt/acme/new 2>/dev/null && [ -e mnt/acme/secret ]
+    test_result $? "Nothing can be created in a locked volume, names stay visible"
+
+    OUT=$(setfattr -n trusted.evfs.volume.acme -v "zeta-passphrase" mnt 2>&1)
+    [ $? -ne 0 ] && echo "$OUT" | grep -qi "rejected" && ! cat mnt/acme/secret > /dev/null 2>&1
+    test_result $? "Another volume's passphrase is rejected"
+
+    setfattr -n trusted.evfs.volume.acme -v "acme-passphrase" mnt &&
+        [ "$(cat mnt/acme/secret)" = "acme only" ]
+    test_result $? "The right passphrase unlocks the volume again"
+    unmount_evfs
+
+    # After a mount every volume is locked until it is unlocked
+    echo "zeta-passphrase" > "$WORK/zeta.key"
+    mount_evfs --volume=zeta:"$WORK/zeta.key"
+    ! cat mnt/acme/secret > /dev/null 2>&1 && cmp -s "$WORK/zeta.ref" mnt/zeta/data
+    test_result $? "Only the volume unlocked at mount is readable after a remount"
+    unmount_evfs
+
+    ./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+    test_result $? "evfs-fsck finds no problems"
+fi
+
+echo -e "\n${BLUE}=== Test 9: Cipher Engines ===${NC}"
+
+# Round trip through every engine, tampering against the AEAD ones
+"$ROOT/test_crypto" > "$WORK/crypto.log" 2>&1
+STATUS=$?
+grep -c "^PASS" "$WORK/crypto.log" | sed 's/^/  checks passed: /'
+grep "^FAIL" "$WORK/crypto.log" | sed 's/^/  /'
+test_result $STATUS "Every engine round-trips; AEAD engines refuse altered blocks"
+
+echo -e "\n${BLUE}=== Test 10: Paged Inodes ===${NC}"
+
+fresh_fs
+mount_evfs --commit=200 --inode-cache=16
+test_result $? "Mount filesystem with --inode-cache=16"
+
+mkdir mnt/pages
+for i in $(seq 1 40); do echo "page file $i" > mnt/pages/file-$i; done
+dd if=/dev/urandom of="$WORK/paged.ref" bs=64k count=4 2>/dev/null
+cp "$WORK/paged.ref" mnt/pages/big
+DF_BEFORE=$(df --output=used,iused mnt | tail -1)
+unmount_evfs
+
+# A clean unmount saved free space and usage: the mount reads no inode page
+# but the root's, and df must not change. With --noatime reads leave the
+# inodes as saved, so their pages may go as soon as they are cold
+: > "$WORK/evfs.log"
+mount_evfs --commit=200 --inode-cache=16 --noatime
+[ "$(df --output=used,iused mnt | tail -1)" = "$DF_BEFORE" ]
+test_result $? "Free space and inodes in use are as before the unmount"
+
+# 42 inodes through a cache of 16: pages are dropped and read again
+BAD=0
+for i in $(seq 1 40); do
+    [ "$(cat mnt/pages/file-$i)" = "page file $i" ] || BAD=$((BAD + 1))
+done
+sleep 1
+for i in 1 20 40; do
+    [ "$(cat mnt/pages/file-$i)" = "page file $i" ] || BAD=$((BAD + 1))
+done
+cmp -s "$WORK/paged.ref" mnt/pages/big && [ $BAD -eq 0 ] && [ "$(ls mnt/pages | wc -l)" -eq 41 ]
+test_result $? "Every file reads back through a small inode cache"
+
+echo "changed" > mnt/pages/file-7
+rm mnt/pages/file-8
+unmount_evfs
+grep -q "superblock only" "$WORK/evfs.log"
+test_result $? "Remount after a clean unmount reads the superblock only"
+DROPS=$(grep -o "[0-9]* drop(s)" "$WORK/evfs.log" | tail -1 | cut -d' ' -f1)
+[ "${DROPS:-0}" -gt 0 ]
+test_result $? "Cold inode pages leave memory (${DROPS:-0} dropped)"
+
+mount_evfs
+[ "$(cat mnt/pages/file-7)" = "changed" ] && [ ! -e mnt/pages/file-8 ] &&
+    [ "$(cat mnt/pages/file-9)" = "page file 9" ]
+test_result $? "Changes next to dropped pages survive a remount"
+unmount_evfs
+
+./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems, saved free space included"
+
+echo -e "\n${BLUE}=== Test 11: Small Files ===${NC}"
+
+# With --capacity, df's used space is exactly the blocks allocated
+fresh_fs
+mount_evfs --commit=200 --capacity=64M --inline-max=256
+test_result $? "Mount filesystem with --inline-max=256"
+
+used_blocks() {
+    sleep 0.5  # freed blocks return after the next commit
+    df --output=used mnt | tail -1
+}
+
+BASE=$(used_blocks)
+head -c 200 /dev/urandom > "$WORK/small.ref"
+cp "$WORK/small.ref" mnt/small
+cmp -s "$WORK/small.ref" mnt/small && [ "$(used_blocks)" -eq "$BASE" ]
+test_result $? "A file under --inline-max uses no data block"
+
+# Appending past the limit moves the contents to a data block
+head -c 3000 /dev/urandom >> "$WORK/small.ref"
+tail -c 3000 "$WORK/small.ref" >> mnt/small
+cmp -s "$WORK/small.ref" mnt/small && [ "$(used_blocks)" -gt "$BASE" ]
+test_result $? "Growing past the limit spills to a data block"
+
+truncate -s 100 mnt/small
+head -c 100 "$WORK/small.ref" | cmp -s - mnt/small && [ "$(stat -c %s mnt/small)" -eq 100 ]
+test_result $? "Truncating a spilled file keeps its first bytes"
+
+# Without data blocks the file may be inline again
+truncate -s 0 mnt/small
+echo "inline again" > mnt/small
+[ "$(cat mnt/small)" = "inline again" ] && [ "$(used_blocks)" -eq "$BASE" ]
+test_result $? "Truncated to 0, the file goes back inline"
+unmount_evfs
+
+mount_evfs
+[ "$(cat mnt/small)" = "inline again" ]
+test_result $? "Inline contents survive a remount"
+unmount_evfs
+
+./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems"
+
+echo -e "\n${BLUE}=== Test 12: Extended Attributes ===${NC}"
+
+if ! command -v setfattr > /dev/null || ! command -v getfattr > /dev/null; then
+    skip "Extended attribute tests need setfattr and getfattr"
+else
+    fresh_fs
+    mount_evfs --commit=200
+    test_result $? "Mount filesystem"
+
+    # Short values stay in the inode; a long one and the overflow go to
+    # data blocks
+    LONG=$(head -c 3000 /dev/zero | tr '\0' 'L')
+    touch mnt/attrs && mkdir mnt/attrdir
+    setfattr -n user.short -v "small value" mnt/attrs &&
+        setfattr -n user.long -v "$LONG" mnt/attrs &&
+        setfattr -n user.dir -v "on a directory" mnt/attrdir
+    STATUS=$?
+    for i in $(seq 1 8); do
+        setfattr -n user.many-$i -v "value number $i of eight, past the inline area" mnt/attrs ||
+            STATUS=1
+    done
+    test_result $STATUS "Set short, long and many attributes"
+
+    [ "$(getfattr --only-values -n user.short mnt/attrs)" = "small value" ] &&
+        [ "$(getfattr --only-values -n user.long mnt/attrs)" = "$LONG" ] &&
+        [ "$(getfattr -d mnt/attrs | grep -c '^user\.')" -eq 10 ]
+    test_result $? "Get and list them"
+
+    setfattr -x user.many-3 mnt/attrs && ! getfattr -n user.many-3 mnt/attrs > /dev/null 2>&1 &&
+        ! setfattr -x user.missing mnt/attrs 2>/dev/null
+    test_result $? "Remove one; removing a missing one fails"
+    unmount_evfs
+
+    mount_evfs
+    BAD=0
+    for i in 1 2 4 5 6 7 8; do
+        [ "$(getfattr --only-values -n user.many-$i mnt/attrs)" = "value number $i of eight, past the inline area" ] ||
+            BAD=$((BAD + 1))
+    done
+    [ $BAD -eq 0 ] && [ "$(getfattr --only-values -n user.short mnt/attrs)" = "small value" ] &&
+        [ "$(getfattr --only-values -n user.long mnt/attrs)" = "$LONG" ] &&
+        [ "$(getfattr --only-values -n user.dir mnt/attrdir)" = "on a directory" ] &&
+        [ "$(getfattr -d mnt/attrs | grep -c '^user\.')" -eq 9 ] &&
+        ! getfattr -n user.many-3 mnt/attrs > /dev/null 2>&1
+    test_result $? "Attributes and the removal survive a remount"
+
+    setfattr -x user.long mnt/attrs && setfattr -n user.short -v "changed" mnt/attrs
+    unmount_evfs
+    mount_evfs
+    [ "$(getfattr --only-values -n user.short mnt/attrs)" = "changed" ] &&
+        ! getfattr -n user.long mnt/attrs > /dev/null 2>&1
+    test_result $? "Replaced and removed values survive a remount"
+    unmount_evfs
+
+    ./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+    test_result $? "evfs-fsck finds no problems"
+fi
+
+echo -e "\n${BLUE}=== Test 13: Re-encryption After a Crash ===${NC}"
+
+fresh_fs
+mount_evfs --cipher=aes-256-xts
+test_result $? "Mount filesystem with aes-256-xts"
+dd if=/dev/urandom of=mnt/reenc.bin bs=64k count=64 2>/dev/null
+REENC_SUM=$(md5sum < mnt/reenc.bin)
+echo "inline contents" > mnt/reenc-small
+unmount_evfs
+
+# Slow enough to crash half way: 4 MB read and written at 1 MB/s
+mount_evfs --cipher=aes-256-cbc-essiv --commit=200 --io-rate=background:1
+test_result $? "Mount with aes-256-cbc-essiv starts re-encryption"
+sleep 2
+[ "$(md5sum < mnt/reenc.bin)" = "$REENC_SUM" ]
+test_result $? "Contents read back half way through"
+kill -9 $EVFS_PID
+wait $EVFS_PID 2>/dev/null
+fusermount -uz mnt 2>/dev/null
+EVFS_PID=""
+
+# The mount stays up, but nothing is readable
+: > "$WORK/evfs.log"
+mount_evfs --cipher=aes-256-xts
+! cat mnt/reenc.bin > /dev/null 2>&1
+STATUS=$?
+unmount_evfs
+[ $STATUS -eq 0 ] && grep -q "has not finished" "$WORK/evfs.log"
+test_result $? "Going back to aes-256-xts is refused while files use both"
+
+# The next mount continues from each file's saved watermark, not from the
+# start: less than the whole file is re-encrypted again
+: > "$WORK/evfs.log"
+mount_evfs --cipher=aes-256-cbc-essiv --commit=200
+sleep 1
+[ "$(md5sum < mnt/reenc.bin)" = "$REENC_SUM" ] && [ "$(cat mnt/reenc-small)" = "inline contents" ]
+test_result $? "Contents intact after the crash"
+unmount_evfs
+STATS=$(grep "^Re-encryption:" "$WORK/evfs.log" | tail -1)
+BYTES=$(echo "$STATS" | sed -n 's/.*, \([0-9]*\) bytes,.*/\1/p')
+echo "$STATS" | grep -q " 0 left" && [ "${BYTES:-0}" -gt 0 ] && [ "${BYTES:-0}" -lt $((64 * 65536)) ]
+test_result $? "Re-encryption resumed where it stopped (${BYTES:-0} of $((64 * 65536)) bytes redone)"
+
+mount_evfs --cipher=aes-256-cbc-essiv
+[ "$(md5sum < mnt/reenc.bin)" = "$REENC_SUM" ]
+test_result $? "Re-encrypted file reads back after a remount"
+unmount_evfs
+
+./evfs-fsck -n --backing="$WORK/data.bin" --meta="$WORK/meta.bin" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems"
+
+echo -e "\n${BLUE}=== Test 14: Incremental Backup ===${NC}"
+
+SRC=(--backing="$WORK/data.bin" --meta="$WORK/meta.bin")
+REPLICA=(--backing="$WORK/replica.bin" --meta="$WORK/replica-meta.bin")
+rm -f "$WORK/replica.bin" "$WORK/replica-meta.bin"
+
+fresh_fs
+mount_evfs
+test_result $? "Mount filesystem"
+mkdir mnt/backup
+dd if=/dev/urandom of=mnt/backup/a.bin bs=4096 count=256 2>/dev/null
+dd if=/dev/urandom of=mnt/backup/b.bin bs=4096 count=256 2>/dev/null
+echo "gone next time" > mnt/backup/c.txt
+unmount_evfs
+
+./evfs-tool backup 0 "$WORK/full.bak" "${SRC[@]}" > "$WORK/tool.log" 2>&1
+test_result $? "Full backup"
+SINCE=$(sed -n 's/.*Pass \([0-9]*\) as SINCE.*/\1/p' "$WORK/tool.log")
+
+# One block overwritten, one file added, one removed
+mount_evfs
+dd if=/dev/urandom of=mnt/backup/a.bin bs=4096 seek=100 count=1 conv=notrunc 2>/dev/null
+echo "new" > mnt/backup/d.txt
+rm mnt/backup/c.txt
+unmount_evfs
+
+./evfs-tool backup "$SINCE" "$WORK/incr.bak" "${SRC[@]}" > "$WORK/tool.log" 2>&1
+STATUS=$?
+BLOCKS=$(sed -n 's/.*files, \([0-9]*\) blocks,.*/\1/p' "$WORK/tool.log")
+[ $STATUS -eq 0 ] && [ "$BLOCKS" = "1" ]
+test_result $? "Incremental backup after generation $SINCE sends only the changed block (${BLOCKS:-?})"
+NEXT=$(sed -n 's/.*Pass \([0-9]*\) as SINCE.*/\1/p' "$WORK/tool.log")
+
+./evfs-tool backup "$NEXT" "$WORK/none.bak" "${SRC[@]}" > "$WORK/tool.log" 2>&1 &&
+    grep -q "files, 0 blocks" "$WORK/tool.log"
+test_result $? "Nothing changed since generation $NEXT: no blocks"
+
+./evfs-tool apply "$WORK/full.bak" "${REPLICA[@]}" > "$WORK/tool.log" 2>&1 &&
+    ./evfs-tool apply "$WORK/incr.bak" "${REPLICA[@]}" >> "$WORK/tool.log" 2>&1
+test_result $? "Apply the full and the incremental backup to a replica"
+
+! ./evfs-tool apply "$WORK/incr.bak" "${REPLICA[@]}" >> "$WORK/tool.log" 2>&1
+test_result $? "The same backup is refused a second time"
+
+./evfs-tool export "$WORK/src-out" "${SRC[@]}" > /dev/null 2>&1 &&
+    ./evfs-tool export "$WORK/replica-out" "${REPLICA[@]}" > /dev/null 2>&1 &&
+    diff -r "$WORK/src-out" "$WORK/replica-out" > /dev/null && [ -f "$WORK/replica-out/backup/d.txt" ] &&
+    [ ! -e "$WORK/replica-out/backup/c.txt" ]
+test_result $? "The replica has the same files as the source"
+
+./evfs-fsck -n "${REPLICA[@]}" > "$WORK/fsck.log" 2>&1
+test_result $? "evfs-fsck finds no problems on the replica"
+
+# Summary
+echo -e "\n========================================"
+echo -e "${GREEN}Tests Passed: $PASS${NC}"
+echo -e "${RED}Tests Failed: $FAIL${NC}"
+echo -e "${YELLOW}Tests Skipped: $SKIP${NC}"
+echo "========================================"
+
+if [ $FAIL -eq 0 ]; then
+    echo -e "${GREEN}All tests passed! ✓${NC}"
+    exit 0
+else
+    echo -e "${RED}Some tests failed!${NC}"
+    exit 1
+fi
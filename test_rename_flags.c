@@ -0,0 +1,106 @@
+/*
+ * test_rename_flags.c - RENAME_NOREPLACE and RENAME_EXCHANGE checks
+ *
+ * The libfuse 2 high-level API drops the renameat2() flags, so a mount
+ * cannot reach evfs_rename_flags() with them. This program drives the file
+ * system in process instead, on evfs_data.bin and evfs_meta.bin in the
+ * current directory. It is built and run by test_features.sh:
+ *
+ *   ./test_rename_flags write   # rename with flags, check, unmount
+ *   ./test_rename_flags check   # mount again, check the result was saved
+ */
+
+#include "evfs.h"
+
+static int failed = 0;
+
+static void check(int ok, const char *what) {
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok) failed = 1;
+}
+
+// Not running under fuse_main(): files belong to the caller
+struct fuse_context *fuse_get_context(void) {
+    static struct fuse_context ctx;
+    ctx.uid = getuid();
+    ctx.gid = getgid();
+    return &ctx;
+}
+
+static int put(const char *path, const char *data) {
+    int ret = evfs_oper.create(path, 0644, NULL);
+    if (ret < 0) return ret;
+    ret = evfs_oper.write(path, data, strlen(data), 0, NULL);
+    return ret < 0 ? ret : 0;
+}
+
+// 1 if path holds exactly data
+static int holds(const char *path, const char *data) {
+    char buf[256];
+    int n = evfs_oper.read(path, buf, sizeof(buf), 0, NULL);
+    return n == (int)strlen(data) && memcmp(buf, data, n) == 0;
+}
+
+static ino_t inode_of(const char *path) {
+    struct stat st;
+    return evfs_oper.getattr(path, &st) == 0 ? st.st_ino : 0;
+}
+
+static void write_phase(void) {
+    struct stat st;
+
+    check(put("/a", "AAA") == 0 && put("/b", "BBBB") == 0, "create /a and /b");
+
+    // NOREPLACE: refuses an existing target, leaves both alone
+    check(evfs_rename_flags("/a", "/b", RENAME_NOREPLACE) == -EEXIST,
+          "NOREPLACE onto an existing name fails with EEXIST");
+    check(holds("/a", "AAA") && holds("/b", "BBBB"), "NOREPLACE failure changes nothing");
+    check(evfs_rename_flags("/a", "/c", RENAME_NOREPLACE) == 0, "NOREPLACE to a free name");
+    check(evfs_oper.getattr("/a", &st) == -ENOENT && holds("/c", "AAA"),
+          "NOREPLACE moved /a to /c");
+
+    // EXCHANGE: both names stay, pointing at each other's inode
+    ino_t b = inode_of("/b"), c = inode_of("/c");
+    check(evfs_rename_flags("/b", "/c", RENAME_EXCHANGE) == 0, "EXCHANGE two files");
+    check(holds("/b", "AAA") && holds("/c", "BBBB"), "EXCHANGE swapped the contents");
+    check(inode_of("/b") == c && inode_of("/c") == b, "EXCHANGE swapped the inodes");
+    check(evfs_rename_flags("/b", "/missing", RENAME_EXCHANGE) == -ENOENT,
+          "EXCHANGE with a missing target fails with ENOENT");
+    check(evfs_rename_flags("/b", "/c", RENAME_NOREPLACE | RENAME_EXCHANGE) == -EINVAL,
+          "NOREPLACE together with EXCHANGE fails with EINVAL");
+
+    // EXCHANGE a directory with a file: its children move with it
+    check(evfs_oper.mkdir("/d", 0755) == 0 && put("/d/x", "inside") == 0,
+          "create /d/x");
+    check(evfs_rename_flags("/d", "/b", RENAME_EXCHANGE) == 0, "EXCHANGE a directory and a file");
+    check(evfs_oper.getattr("/b", &st) == 0 && S_ISDIR(st.st_mode) && holds("/b/x", "inside"),
+          "the directory and its child are under the new name");
+    check(evfs_oper.getattr("/d", &st) == 0 && S_ISREG(st.st_mode) && holds("/d", "AAA"),
+          "the file is under the directory's old name");
+}
+
+static void check_phase(void) {
+    struct stat st;
+
+    check(holds("/c", "BBBB"), "/c kept its contents across the remount");
+    check(holds("/d", "AAA"), "/d kept its contents across the remount");
+    check(evfs_oper.getattr("/b", &st) == 0 && S_ISDIR(st.st_mode) && holds("/b/x", "inside"),
+          "/b is still the directory holding x");
+    check(evfs_oper.getattr("/a", &st) == -ENOENT, "/a is still gone");
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 || (strcmp(argv[1], "write") != 0 && strcmp(argv[1], "check") != 0)) {
+        fprintf(stderr, "Usage: %s write|check\n", argv[0]);
+        return 2;
+    }
+
+    evfs_oper.init(NULL);
+    if (strcmp(argv[1], "write") == 0) {
+        write_phase();
+    } else {
+        check_phase();
+    }
+    evfs_oper.destroy(NULL);
+    return failed;
+}